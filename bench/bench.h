@@ -0,0 +1,158 @@
+#ifndef JB_BENCH_H
+#define JB_BENCH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Allocation counters.  Every benchmark executable is a single translation
+// unit, so the replacement global operator new below is defined once.
+
+namespace jb {
+
+namespace bench {
+
+atomic<long> allocations(0);
+atomic<long> allocated_bytes(0);
+
+}  // namespace bench
+
+}  // namespace jb
+
+void * operator new(size_t size) {
+  jb::bench::allocations++;
+  jb::bench::allocated_bytes += size;
+  void * p = malloc(size ? size : 1);
+  if (!p)
+    throw bad_alloc();
+  return p;
+}
+
+void operator delete(void * p) noexcept { free(p); }
+
+void operator delete(void * p, size_t) noexcept { free(p); }
+
+namespace jb {
+
+namespace bench {
+
+// Times benchmark bodies and reports one record per benchmark as CSV
+// (default) or JSON.
+//
+//   --format=csv|json   output format
+//   --filter=TEXT       only run benchmarks whose name contains TEXT
+//   --min-time=SECONDS  minimum measured time per benchmark (default 0.2)
+
+struct Result {
+  string name;
+  long iterations;
+  double ns_per_op;
+  double gb_per_s;
+  double gflop_per_s;
+  double allocs_per_op;
+  double alloc_bytes_per_op;
+};
+
+class Runner {
+public:
+  Runner(int argc, char ** argv);
+  ~Runner() { Report(); };
+  // Times f, which moves `bytes` bytes and performs `flops` flops per call.
+  void Run(const string & name, double bytes, double flops,
+           function<void()> f);
+private:
+  void Report();
+  vector<Result> results;
+  string format = "csv";
+  string filter;
+  double min_time = 0.2;
+};
+
+Runner::Runner(int argc, char ** argv) {
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.find("--format=") == 0)
+      format = arg.substr(9);
+    else if (arg.find("--filter=") == 0)
+      filter = arg.substr(9);
+    else if (arg.find("--min-time=") == 0)
+      min_time = atof(arg.substr(11).c_str());
+  }
+}
+
+void Runner::Run(const string & name, double bytes, double flops,
+                 function<void()> f) {
+  if (name.find(filter) == string::npos)
+    return;
+  typedef chrono::steady_clock Clock;
+  f();  // warm up caches and lazily built state
+  long iterations = 1;
+  double elapsed = 0;
+  long allocs = 0, alloc_bytes = 0;
+  while (true) {
+    long allocs_start = allocations, bytes_start = allocated_bytes;
+    auto start = Clock::now();
+    for (long i = 0; i < iterations; i++)
+      f();
+    elapsed = chrono::duration<double>(Clock::now() - start).count();
+    allocs = allocations - allocs_start;
+    alloc_bytes = allocated_bytes - bytes_start;
+    if (elapsed >= min_time || iterations >= (1L << 30))
+      break;
+    iterations = elapsed > 0
+        ? max(iterations * 2, (long) (iterations * 1.2 * min_time / elapsed))
+        : iterations * 10;
+  }
+  Result r;
+  r.name = name;
+  r.iterations = iterations;
+  r.ns_per_op = elapsed * 1e9 / iterations;
+  r.gb_per_s = bytes / r.ns_per_op;
+  r.gflop_per_s = flops / r.ns_per_op;
+  r.allocs_per_op = (double) allocs / iterations;
+  r.alloc_bytes_per_op = (double) alloc_bytes / iterations;
+  results.push_back(r);
+  fprintf(stderr, "%-48s %12.1f ns/op\n", name.c_str(), r.ns_per_op);
+}
+
+void Runner::Report() {
+  if (format == "json") {
+    printf("[\n");
+    for (int i = 0; i < results.size(); i++) {
+      const Result & r = results[i];
+      printf("  {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.3f, "
+             "\"gb_per_s\": %.3f, \"gflop_per_s\": %.3f, "
+             "\"allocs_per_op\": %.3f, \"alloc_bytes_per_op\": %.1f}%s\n",
+             r.name.c_str(), r.iterations, r.ns_per_op, r.gb_per_s,
+             r.gflop_per_s, r.allocs_per_op, r.alloc_bytes_per_op,
+             i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+  } else {
+    printf("name,iterations,ns_per_op,gb_per_s,gflop_per_s,allocs_per_op,"
+           "alloc_bytes_per_op\n");
+    for (auto & r : results)
+      printf("%s,%ld,%.3f,%.3f,%.3f,%.3f,%.1f\n", r.name.c_str(),
+             r.iterations, r.ns_per_op, r.gb_per_s, r.gflop_per_s,
+             r.allocs_per_op, r.alloc_bytes_per_op);
+  }
+}
+
+// Keeps the optimizer from discarding a benchmark's result.
+template<typename T>
+void DoNotOptimize(const T & value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+}  // namespace bench
+
+}  // namespace jb
+
+#endif  // JB_BENCH_H
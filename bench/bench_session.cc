@@ -0,0 +1,302 @@
+#include <future>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "src/tensor.h"
+#include "src/op.h"
+#include "src/session.h"
+#include "src/graph_file.h"
+#include "bench/bench.h"
+
+using namespace std;
+using namespace jb;
+using namespace jb::tensor;
+using namespace jb::op;
+using namespace jb::session;
+using namespace jb::profiler;
+using namespace jb::bench;
+
+Float32 Relu(Float32 x) { return x > 0 ? x : 0; }
+Float32 ReluGrad(Float32 x) { return x > 0 ? 1 : 0; }
+
+// Chain of `depth` elementwise ops on small tensors: dominated by per-op
+// overhead.
+void BenchDeep(Runner & runner, int depth, int size) {
+  Variable<Float32> x, w;
+  vector<unique_ptr<Op<Float32>>> ops;
+  Op<Float32> * y = &x;
+  for (int d = 0; d < depth; d++) {
+    if (d % 3 == 0)
+      ops.emplace_back(new op::Add<Float32>({y, &w}));
+    else if (d % 3 == 1)
+      ops.emplace_back(new op::Multiply<Float32>({y, &w}));
+    else
+      ops.emplace_back(new op::Apply<Float32>(y, Relu));
+    y = ops.back().get();
+  }
+  string suffix = "/depth" + to_string(depth) + "_size" + to_string(size);
+  double bytes = 3.0 * depth * size * sizeof(Float32);
+
+  Session<Float32> s;
+  s.SetIncremental(false);  // measure evaluation, not the cache
+  s.Assign(&x, Ones<Float32>({size}));
+  s.Assign(&w, Ones<Float32>({size}));
+  runner.Run("session/deep/run_outputs" + suffix, bytes, depth * size, [&] {
+    s.Run({y});
+  });
+  Plan<Float32> plan = s.Compile({y});
+  runner.Run("session/deep/run_plan" + suffix, bytes, depth * size, [&] {
+    s.Run(plan);
+  });
+  Profiler profiler;
+  s.SetProfiler(&profiler);
+  runner.Run("session/deep/run_plan_profiled" + suffix, bytes, depth * size,
+             [&] {
+    s.Run(plan);
+    profiler.Clear();
+  });
+  s.SetProfiler(nullptr);
+  s.PlanMemory(plan);
+  runner.Run("session/deep/run_plan_memory" + suffix, bytes, depth * size,
+             [&] { s.Run(plan); });
+  Plan<Float32> fused = s.Compile({y});
+  s.Fuse(fused);
+  runner.Run("session/deep/run_plan_fused" + suffix, bytes, depth * size,
+             [&] { s.Run(fused); });
+}
+
+// `width` independent towers of matrix multiplies joined by an Add: measures
+// scaling of the parallel executor with the worker count.
+void BenchWide(Runner & runner, int width, int depth, int n) {
+  Variable<Float32> x, w;
+  vector<unique_ptr<Op<Float32>>> ops;
+  vector<Op<Float32> *> towers;
+  for (int t = 0; t < width; t++) {
+    Op<Float32> * y = &x;
+    for (int d = 0; d < depth; d++) {
+      ops.emplace_back(new op::MatrixMultiply<Float32>(y, &w));
+      y = ops.back().get();
+    }
+    towers.push_back(y);
+  }
+  op::Add<Float32> out(towers);
+  double flops = 2.0 * n * n * n * width * depth;
+  double bytes = 3.0 * n * n * sizeof(Float32) * width * depth;
+
+  int max_threads = max(4, (int) thread::hardware_concurrency());
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    Session<Float32> s(threads);
+    s.SetIncremental(false);
+    s.Assign(&x, Ones<Float32>({n, n}));
+    s.Assign(&w, Ones<Float32>({n, n}));
+    Plan<Float32> plan = s.Compile({&out});
+    runner.Run("session/wide/width" + to_string(width) + "_n" + to_string(n) +
+               "/threads" + to_string(threads), bytes, flops,
+               [&] { s.Run(plan); });
+  }
+}
+
+// Serving loop: a deep subgraph that depends on constant weights only,
+// followed by one op on a per request input that is reassigned every run.
+void BenchIncremental(Runner & runner, int depth, int size, bool incremental) {
+  Variable<Float32> w, x;
+  vector<unique_ptr<Op<Float32>>> ops;
+  Op<Float32> * y = &w;
+  for (int d = 0; d < depth; d++) {
+    if (d % 2 == 0)
+      ops.emplace_back(new op::Multiply<Float32>({y, &w}));
+    else
+      ops.emplace_back(new op::Apply<Float32>(y, Relu));
+    y = ops.back().get();
+  }
+  op::Add<Float32> out({y, &x});
+  Session<Float32> s;
+  s.SetIncremental(incremental);
+  s.Assign(&w, Ones<Float32>({size}));
+  Tensor<Float32> input = Ones<Float32>({size});
+  Plan<Float32> plan = s.Compile({&out});
+  string name = "session/serving/depth" + to_string(depth) + "_size" +
+                to_string(size) + (incremental ? "/incremental" : "/full");
+  runner.Run(name, 3.0 * size * sizeof(Float32), size, [&] {
+    s.Assign(&x, input);
+    s.Run(plan);
+  });
+}
+
+// `requests` single samples through a dense layer, one Run per sample
+// against one RunBatch for all of them.
+void BenchBatch(Runner & runner, int requests, int n) {
+  Variable<Float32> x, w, bias;
+  op::MatrixMultiply<Float32> h(&x, &w);
+  op::Add<Float32> z({&h, &bias});
+  op::Apply<Float32> out(&z, Relu);
+  Session<Float32> s;
+  s.Assign(&w, Ones<Float32>({n, n}));
+  s.Assign(&bias, Ones<Float32>({n}));
+  vector<Feed<Float32>> feeds;
+  for (int r = 0; r < requests; r++)
+    feeds.push_back({{&x, Ones<Float32>({n})}});
+  double flops = 2.0 * n * n * requests;
+  double bytes = (double) n * n * sizeof(Float32);
+  string suffix = "/requests" + to_string(requests) + "_n" + to_string(n);
+  runner.Run("session/batch/per_request" + suffix, bytes, flops, [&] {
+    for (auto & feed : feeds) {
+      s.Assign(&x, View(feed[&x], {1, n}));
+      s.Run({&out});
+      DoNotOptimize(s.Values().at(&out));
+    }
+  });
+  runner.Run("session/batch/run_batch" + suffix, bytes, flops, [&] {
+    DoNotOptimize(s.RunBatch({&out}, feeds));
+  });
+}
+
+// The same serving graph with every op computed twice, run in full with and
+// without Optimize(): the weight subgraph folds away and the duplicates
+// merge.
+void BenchOptimize(Runner & runner, int depth, int size, bool optimize) {
+  Variable<Float32> w, x;
+  vector<unique_ptr<Op<Float32>>> ops;
+  Op<Float32> * y = &w;
+  for (int d = 0; d < depth; d++) {
+    Op<Float32> * copies[2];
+    for (auto & copy : copies) {
+      if (d % 2 == 0)
+        ops.emplace_back(new op::Multiply<Float32>({y, &w}));
+      else
+        ops.emplace_back(new op::Apply<Float32>(y, Relu));
+      copy = ops.back().get();
+    }
+    ops.emplace_back(new op::Add<Float32>({copies[0], copies[1]}));
+    y = ops.back().get();
+  }
+  op::Multiply<Float32> a({y, &x});
+  op::Multiply<Float32> b({y, &x});
+  op::Add<Float32> out({&a, &b});
+  Session<Float32> s;
+  s.SetIncremental(false);
+  s.Assign(&w, Ones<Float32>({size}));
+  Tensor<Float32> input = Ones<Float32>({size});
+  Plan<Float32> plan = s.Compile({&out});
+  if (optimize)
+    s.Optimize(plan, {&w});
+  string name = "session/optimize/depth" + to_string(depth) + "_size" +
+                to_string(size) + (optimize ? "/optimized" : "/full");
+  runner.Run(name, 3.0 * size * sizeof(Float32), size, [&] {
+    s.Assign(&x, input);
+    s.Run(plan);
+  });
+}
+
+// `requests` independent requests from concurrent clients sharing the
+// weights of one session: throughput as the number of clients grows.
+void BenchAsync(Runner & runner, int clients, int requests, int n) {
+  Variable<Float32> x, w, bias;
+  op::MatrixMultiply<Float32> h(&x, &w);
+  op::Add<Float32> z({&h, &bias});
+  op::Apply<Float32> out(&z, Relu);
+  Session<Float32> s(clients);
+  s.Assign(&w, Ones<Float32>({n, n}));
+  s.Assign(&bias, Ones<Float32>({1, n}));
+  Feed<Float32> feed = {{&x, Ones<Float32>({1, n})}};
+  double flops = 2.0 * n * n * requests;
+  double bytes = (double) n * n * sizeof(Float32);
+  string name = "session/async/clients" + to_string(clients) + "_requests" +
+                to_string(requests) + "_n" + to_string(n);
+  runner.Run(name, bytes, flops, [&] {
+    vector<future<vector<Tensor<Float32>>>> results;
+    for (int r = 0; r < requests; r++)
+      results.push_back(s.RunAsync({&out}, feed));
+    for (auto & result : results)
+      DoNotOptimize(result.get());
+  });
+}
+
+// Forward and backward through `depth` dense layers, keeping every
+// activation or only every `every`-th one.
+void BenchGradients(Runner & runner, int depth, int n, int every) {
+  Variable<Float32> x;
+  vector<unique_ptr<Variable<Float32>>> weights;
+  vector<unique_ptr<Op<Float32>>> ops;
+  list<Variable<Float32> *> wrt;
+  list<Op<Float32> *> checkpoints;
+  Op<Float32> * y = &x;
+  for (int d = 0; d < depth; d++) {
+    weights.emplace_back(new Variable<Float32>());
+    wrt.push_back(weights.back().get());
+    ops.emplace_back(new op::MatrixMultiply<Float32>(y, weights.back().get()));
+    ops.emplace_back(new op::Apply<Float32>(ops.back().get(), Relu, ReluGrad));
+    y = ops.back().get();
+    if (every > 0 && d % every == every - 1)
+      checkpoints.push_back(y);
+  }
+  Session<Float32> s;
+  s.Assign(&x, Ones<Float32>({n, n}));
+  for (auto & w : weights)
+    s.Assign(w.get(), Ones<Float32>({n, n}));
+  Gradients<Float32> g = s.CompileGradients(y, wrt, checkpoints);
+  double flops = 3 * 2.0 * n * n * n * depth;
+  double bytes = 3.0 * n * n * sizeof(Float32) * depth;
+  string name = "session/gradients/depth" + to_string(depth) + "_n" +
+                to_string(n) + (every > 0 ? "/checkpoint" + to_string(every)
+                                          : string("/keep_all"));
+  runner.Run(name, bytes, flops, [&] { s.RunGradients(g); });
+}
+
+// Loading a saved graph of `count` ops, alternating elementwise ops with
+// constant operands: dominated by per-op decoding and construction.
+void BenchLoad(Runner & runner, int count) {
+  string path = "bench_session_load.jbg";
+  string constants_path = "bench_session_load.jbt";
+  graph_file::RegisterFunction<Float32>("relu", Relu);
+  graph_file::RegisterFunction<Float32>("relu_grad", ReluGrad);
+  {
+    Variable<Float32> x, c;
+    vector<unique_ptr<Op<Float32>>> ops;
+    Op<Float32> * y = &x;
+    for (int i = 2; i < count; i++) {
+      if (i % 3 == 0)
+        ops.emplace_back(new op::Add<Float32>({y, &c}));
+      else if (i % 3 == 1)
+        ops.emplace_back(new op::Multiply<Float32>({y, &c}));
+      else
+        ops.emplace_back(new op::Apply<Float32>(y, Relu, ReluGrad));
+      y = ops.back().get();
+    }
+    graph_file::Writer<Float32> writer;
+    writer.Input(&x, "x");
+    writer.Constant(&c, "c", Ones<Float32>({256}));
+    writer.Write(path, constants_path, {y});
+  }
+  storage::MappedFile file(path);
+  runner.Run("session/load/ops" + to_string(count), file.Size(), 0, [&] {
+    Session<Float32> s;
+    graph_file::Graph<Float32> graph(path, constants_path, s);
+    DoNotOptimize(graph.NumOps());
+  });
+  remove(path.c_str());
+  remove(constants_path.c_str());
+}
+
+int main(int argc, char ** argv) {
+  Runner runner(argc, argv);
+  BenchDeep(runner, 64, 16);
+  BenchDeep(runner, 64, 4096);
+  BenchDeep(runner, 512, 16);
+  BenchWide(runner, 8, 4, 128);
+  BenchWide(runner, 16, 2, 256);
+  BenchIncremental(runner, 64, 4096, false);
+  BenchIncremental(runner, 64, 4096, true);
+  BenchOptimize(runner, 64, 4096, false);
+  BenchOptimize(runner, 64, 4096, true);
+  BenchBatch(runner, 64, 256);
+  BenchAsync(runner, 1, 64, 256);
+  BenchAsync(runner, 4, 64, 256);
+  BenchGradients(runner, 16, 128, 0);
+  BenchGradients(runner, 16, 128, 4);
+  BenchLoad(runner, 100000);
+  return 0;
+}
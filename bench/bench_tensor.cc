@@ -0,0 +1,434 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "src/activation.h"
+#include "src/quantize.h"
+#include "src/sparse.h"
+#include "src/tensor.h"
+#include "src/static_tensor.h"
+#include "src/tensor_file.h"
+#include "bench/bench.h"
+
+using namespace std;
+using namespace jb;
+using namespace jb::tensor;
+using namespace jb::bench;
+
+template<typename T>
+Tensor<T> Filled(vector<int> shape) {
+  Tensor<T> t = Zeros<T>(shape);
+  int i = 0;
+  for (auto & d : t.DataMutable())
+    d = (T) ((i++ % 17) - 8) / 4;
+  return t;
+}
+
+template<typename T>
+T Relu(T x) { return x > 0 ? x : 0; }
+
+template<typename T>
+void BenchElementwise(Runner & runner, const string & type) {
+  const int n = 1 << 20;
+  double bytes = 3.0 * n * sizeof(T);
+  auto a = Filled<T>({1024, 1024});
+  auto b = Filled<T>({1024, 1024});
+  auto bias = Filled<T>({1024});
+  auto wide = Filled<T>({1024, 2048});
+  auto strided = Slice<T>(wide, {0, 0}, {1024, 2048}, {1, 2});
+
+  runner.Run("add/contiguous/" + type, bytes, n, [&] {
+    DoNotOptimize(Add(a, b));
+  });
+  runner.Run("add/bias_broadcast/" + type, 2.0 * n * sizeof(T), n, [&] {
+    DoNotOptimize(Add(a, bias));
+  });
+  runner.Run("multiply/contiguous/" + type, bytes, n, [&] {
+    DoNotOptimize(Multiply(a, b));
+  });
+  runner.Run("multiply/strided/" + type, bytes, n, [&] {
+    DoNotOptimize(Multiply(a, strided));
+  });
+  runner.Run("subtract/contiguous/" + type, bytes, n, [&] {
+    DoNotOptimize(Subtract(a, b));
+  });
+  runner.Run("negate/contiguous/" + type, 2.0 * n * sizeof(T), n, [&] {
+    DoNotOptimize(Negate(a));
+  });
+  runner.Run("apply/relu/" + type, 2.0 * n * sizeof(T), n, [&] {
+    DoNotOptimize(Apply(a, Relu<T>));
+  });
+  runner.Run("apply/relu_functor/" + type, 2.0 * n * sizeof(T), n, [&] {
+    DoNotOptimize(Apply(a, [](T x) { return x > 0 ? x : (T) 0; }));
+  });
+}
+
+// libm versions of the activation kernels, applied through function pointers
+template<typename T> T LibmExp(T x) { return exp(x); }
+template<typename T> T LibmLog(T x) { return log(x); }
+template<typename T> T LibmTanh(T x) { return tanh(x); }
+template<typename T> T LibmSigmoid(T x) { return 1 / (1 + exp(-x)); }
+template<typename T> T LibmGelu(T x) {
+  return (T) 0.5 * x * (1 + tanh((T) 0.797884560802865355880 *
+                                 (x + (T) 0.044715 * x * x * x)));
+}
+
+template<typename T, typename F>
+void BenchActivation(Runner & runner, const string & name, const string & type,
+                     const Tensor<T> & a, T (*libm)(T), F f) {
+  double bytes = 2.0 * a.Size() * sizeof(T);
+  runner.Run("activation/" + name + "/libm/" + type, bytes, a.Size(), [&] {
+    DoNotOptimize(Apply(a, libm));
+  });
+  runner.Run("activation/" + name + "/" + type, bytes, a.Size(), [&] {
+    DoNotOptimize(Apply(a, f));
+  });
+}
+
+template<typename T>
+void BenchActivations(Runner & runner, const string & type) {
+  auto a = Filled<T>({1024, 1024});
+  auto positive = Apply(a, [](T x) { return x * x + (T) 0.5; });
+  BenchActivation(runner, "exp", type, a, LibmExp<T>,
+                  activation::ExpFunctor());
+  BenchActivation(runner, "log", type, positive, LibmLog<T>,
+                  activation::LogFunctor());
+  BenchActivation(runner, "tanh", type, a, LibmTanh<T>,
+                  activation::TanhFunctor());
+  BenchActivation(runner, "sigmoid", type, a, LibmSigmoid<T>,
+                  activation::SigmoidFunctor());
+  BenchActivation(runner, "gelu", type, a, LibmGelu<T>,
+                  activation::GeluFunctor());
+}
+
+template<typename T>
+void BenchMatrixMultiply(Runner & runner, const string & type) {
+  vector<vector<int>> shapes = {{32, 32, 32}, {128, 128, 128},
+                                {256, 256, 256}, {512, 512, 512},
+                                {1024, 64, 1024}, {64, 1024, 64},
+                                {1, 1024, 1024}};
+  for (auto & s : shapes) {
+    int m = s[0], k = s[1], n = s[2];
+    auto a = Filled<T>({m, k});
+    auto b = Filled<T>({k, n});
+    string name = "matmul/" + to_string(m) + "x" + to_string(k) + "x" +
+                  to_string(n) + "/" + type;
+    double bytes = (double) (m * k + k * n + m * n) * sizeof(T);
+    runner.Run(name, bytes, 2.0 * m * n * k, [&] {
+      DoNotOptimize(MatrixMultiply(a, b));
+    });
+  }
+  // strided views are consumed without a copy
+  {
+    int m = 256, k = 256, n = 256;
+    auto a = Filled<T>({2 * m, 2 * k});
+    auto b = Filled<T>({k, 3 * n});
+    auto as = Slice<T>(a, {0, 0}, {2 * m, 2 * k}, {2, 2});
+    auto bs = Slice<T>(b, {0, 0}, {k, 3 * n}, {1, 3});
+    double bytes = (double) (m * k + k * n + m * n) * sizeof(T);
+    runner.Run("matmul/256x256x256_strided/" + type, bytes,
+               2.0 * m * n * k, [&] {
+      DoNotOptimize(MatrixMultiply(as, bs));
+    });
+  }
+}
+
+template<typename T>
+void BenchCopy(Runner & runner, const string & type) {
+  auto a = Filled<T>({1024, 1024});
+  auto rows = Slice<T>(a, {0, 0}, {1024, 512}, {1, 1});
+  auto every_other = Slice<T>(a, {0, 0}, {1024, 1024}, {2, 2});
+  auto dst = Zeros<T>({1024, 512});
+  double full = 2.0 * 1024 * 1024 * sizeof(T);
+  runner.Run("copy/contiguous/" + type, full, 0, [&] {
+    DoNotOptimize(Copy(a));
+  });
+  runner.Run("copy/row_slice/" + type, full / 2, 0, [&] {
+    DoNotOptimize(Copy(rows));
+  });
+  runner.Run("copy/strided_slice/" + type, full / 4, 0, [&] {
+    DoNotOptimize(Copy(every_other));
+  });
+  runner.Run("move/row_slice/" + type, full / 2, 0, [&] {
+    Move(rows, dst);
+  });
+  auto cube = Filled<T>({64, 128, 128});
+  runner.Run("copy/transpose/" + type, full, 0, [&] {
+    DoNotOptimize(Contiguous(Transpose(a)));
+  });
+  runner.Run("copy/permute/" + type, full, 0, [&] {
+    DoNotOptimize(Contiguous(Permute(cube, {2, 0, 1})));
+  });
+}
+
+template<typename T>
+void BenchReduce(Runner & runner, const string & type) {
+  auto a = Filled<T>({1024, 1024});
+  auto strided = Slice<T>(Filled<T>({1024, 2048}), {0, 0}, {1024, 2048},
+                          {1, 2});
+  double bytes = 1024.0 * 1024 * sizeof(T);
+  runner.Run("reduce/sum_all/" + type, bytes, 1 << 20, [&] {
+    DoNotOptimize(Sum(a));
+  });
+  runner.Run("reduce/sum_rows/" + type, bytes, 1 << 20, [&] {
+    DoNotOptimize(Sum(a, {1}));
+  });
+  runner.Run("reduce/sum_columns/" + type, bytes, 1 << 20, [&] {
+    DoNotOptimize(Sum(a, {0}));
+  });
+  runner.Run("reduce/sum_strided/" + type, bytes, 1 << 20, [&] {
+    DoNotOptimize(Sum(strided, {1}));
+  });
+  runner.Run("reduce/max_rows/" + type, bytes, 1 << 20, [&] {
+    DoNotOptimize(Max(a, {1}));
+  });
+  runner.Run("reduce/argmax_rows/" + type, bytes, 1 << 20, [&] {
+    DoNotOptimize(ArgMax(a, 1));
+  });
+}
+
+// Small fixed shapes: dynamic tensors against compile-time shaped ones.
+template<int N>
+void BenchStatic(Runner & runner) {
+  string shape = to_string(N) + "x" + to_string(N);
+  auto a = Filled<Float32>({N, N});
+  auto b = Filled<Float32>({N, N});
+  auto sa = FromTensor<StaticTensor<Float32, N, N>>(a);
+  auto sb = FromTensor<StaticTensor<Float32, N, N>>(b);
+  double bytes = 3.0 * N * N * sizeof(Float32);
+  runner.Run("small/matmul/" + shape + "/tensor", bytes, 2.0 * N * N * N, [&] {
+    DoNotOptimize(MatrixMultiply(a, b));
+  });
+  runner.Run("small/matmul/" + shape + "/static", bytes, 2.0 * N * N * N, [&] {
+    sa = MatrixMultiply(sa, sb);
+    DoNotOptimize(sa);
+  });
+  runner.Run("small/add/" + shape + "/tensor", bytes, N * N, [&] {
+    DoNotOptimize(Add(a, b));
+  });
+  runner.Run("small/add/" + shape + "/static", bytes, N * N, [&] {
+    sa = Add(sa, sb);
+    DoNotOptimize(sa);
+  });
+}
+
+// Loading a 64 MB weight file: mapping it against reading it into a fresh
+// tensor.
+void BenchQuantize(Runner & runner) {
+  auto a = Filled<Float32>({1024, 1024});
+  auto h = Cast<Float16>(a);
+  double elements = a.Size();
+  runner.Run("cast/float32_float16", elements * 6, 0, [&] {
+    DoNotOptimize(Cast<Float16>(a));
+  });
+  runner.Run("cast/float16_float32", elements * 6, 0, [&] {
+    DoNotOptimize(Cast<Float32>(h));
+  });
+  runner.Run("cast/float32_bfloat16", elements * 6, 0, [&] {
+    DoNotOptimize(Cast<BFloat16>(a));
+  });
+  runner.Run("quantized/quantize/1024x1024", elements * 5, 0, [&] {
+    DoNotOptimize(quantize::Quantize(a, quantize::ChooseParams(a)));
+  });
+  // weights quantized ahead of time, activations per call
+  vector<vector<int>> shapes = {{1, 1024, 1024}, {256, 256, 256},
+                                {256, 1024, 1024}};
+  for (auto & s : shapes) {
+    int m = s[0], k = s[1], n = s[2];
+    auto x = Filled<Float32>({m, k});
+    auto w = Filled<Float32>({k, n});
+    quantize::Params pw = quantize::ChooseParams(w, 1, true);
+    auto qw = quantize::Quantize(w, pw);
+    auto sums = quantize::ColumnSums(qw);
+    string shape = to_string(m) + "x" + to_string(k) + "x" + to_string(n);
+    runner.Run("quantized/matmul/" + shape + "/float32",
+               (double) (m * k + k * n + m * n) * 4, 2.0 * m * n * k, [&] {
+      DoNotOptimize(MatrixMultiply(x, w));
+    });
+    runner.Run("quantized/matmul/" + shape + "/int8",
+               (double) (m * k + k * n) + m * n * 4, 2.0 * m * n * k, [&] {
+      quantize::Params px = quantize::ChooseParams(x);
+      DoNotOptimize(quantize::MatrixMultiply(quantize::Quantize(x, px), px,
+                                             qw, pw, &sums));
+    });
+  }
+}
+
+// The textbook loop nest, as the baseline for the convolution kernels.
+void NaiveConv2D(const Tensor<Float32> & x, const Tensor<Float32> & w,
+                 const conv::Params & p, Tensor<Float32> & c) {
+  const vector<int> & xs = x.Shape();
+  const vector<int> & cs = c.Shape();
+  int cg = w.Shape()[1], kh = w.Shape()[2], kw = w.Shape()[3];
+  int og = cs[1] / p.groups;
+  const Float32 * xd = x.Data().data();
+  const Float32 * wd = w.Data().data();
+  Float32 * cd = c.DataMutable().data();
+  for (int b = 0; b < cs[0]; b++)
+    for (int f = 0; f < cs[1]; f++)
+      for (int y = 0; y < cs[2]; y++)
+        for (int z = 0; z < cs[3]; z++) {
+          Float32 acc = 0;
+          for (int ch = 0; ch < cg; ch++)
+            for (int i = 0; i < kh; i++)
+              for (int j = 0; j < kw; j++) {
+                int iy = y * p.stride_h - p.pad_h + i * p.dilation_h;
+                int ix = z * p.stride_w - p.pad_w + j * p.dilation_w;
+                if (iy < 0 || iy >= xs[2] || ix < 0 || ix >= xs[3])
+                  continue;
+                int channel = f / og * cg + ch;
+                acc += wd[((f * cg + ch) * kh + i) * kw + j] *
+                       xd[((b * xs[1] + channel) * xs[2] + iy) * xs[3] + ix];
+              }
+          cd[((b * cs[1] + f) * cs[2] + y) * cs[3] + z] = acc;
+        }
+}
+
+void BenchConv2D(Runner & runner) {
+  // {c, h, w, o, k, stride, groups}, one image, padding k / 2
+  vector<vector<int>> shapes = {
+      {3, 112, 112, 32, 3, 2, 1},    // stem
+      {1, 128, 128, 16, 3, 1, 1},    // single channel
+      {64, 56, 56, 64, 3, 1, 1},     // residual block
+      {256, 14, 14, 256, 3, 1, 1},   // deep block
+      {64, 56, 56, 128, 1, 1, 1},    // pointwise
+      {128, 56, 56, 128, 3, 1, 128}, // depthwise
+      {128, 28, 28, 128, 3, 1, 4},   // grouped
+  };
+  for (auto & s : shapes) {
+    int c = s[0], h = s[1], w = s[2], o = s[3], k = s[4];
+    conv::Params p;
+    p.stride_h = p.stride_w = s[5];
+    p.pad_h = p.pad_w = k / 2;
+    p.groups = s[6];
+    auto x = Filled<Float32>({1, c, h, w});
+    auto filters = Filled<Float32>({o, c / p.groups, k, k});
+    auto out = Conv2D(x, filters, p);
+    double flops = 2.0 * out.Size() * filters.Size() / o;
+    double bytes = (double) (x.Size() + filters.Size() + out.Size()) * 4;
+    string name = "conv2d/" + to_string(c) + "x" + to_string(h) + "x" +
+                  to_string(w) + "/" + to_string(o) + "x" + to_string(k) +
+                  "x" + to_string(k) + "_s" + to_string(s[5]) + "_g" +
+                  to_string(s[6]) + "/";
+    runner.Run(name + "naive", bytes, flops, [&] {
+      NaiveConv2D(x, filters, p, out);
+      DoNotOptimize(out);
+    });
+    for (auto algorithm : {conv::kIm2col, conv::kDirect, conv::kAuto}) {
+      p.algorithm = algorithm;
+      string kernel = algorithm == conv::kIm2col
+                          ? "im2col"
+                          : (algorithm == conv::kDirect ? "direct" : "auto");
+      runner.Run(name + kernel, bytes, flops, [&] {
+        DoNotOptimize(Conv2D(x, filters, p));
+      });
+    }
+  }
+}
+
+void BenchLoad(Runner & runner) {
+  string path = "bench_tensor_load.jbt";
+  auto w = Filled<Float32>({4096, 4096});
+  double bytes = (double) w.Size() * sizeof(Float32);
+  {
+    tensor_file::Writer writer;
+    writer.Add("w", w);
+    writer.Write(path);
+  }
+  runner.Run("load/mmap/64MB", bytes, 0, [&] {
+    tensor_file::File file(path);
+    DoNotOptimize(file.Get<Float32>("w"));
+  });
+  runner.Run("load/read/64MB", bytes, 0, [&] {
+    tensor_file::File file(path);
+    DoNotOptimize(Copy(file.Get<Float32>("w")));
+  });
+  remove(path.c_str());
+}
+
+// Feature matrices at several sparsities times dense weights, dense against
+// CSR: the sparse product should scale with the nonzeros.
+void BenchSparse(Runner & runner) {
+  int m = 1024, k = 1024, n = 256;
+  auto w = Filled<Float32>({k, n});
+  for (int percent : {50, 90, 95, 99}) {
+    Tensor<Float32> x = Zeros<Float32>({m, k});
+    int i = 0;
+    for (auto & d : x.DataMutable()) {
+      if ((i++ * 7919) % 100 >= percent)
+        d = (Float32) (i % 17 - 8) / 4;
+    }
+    sparse::Csr<Float32> xs = sparse::FromDense(x);
+    string name = "sparse/matmul/" + to_string(m) + "x" + to_string(k) + "x" +
+                  to_string(n) + "_" + to_string(percent) + "pct";
+    double bytes = (double) (m * k + k * n + m * n) * sizeof(Float32);
+    double sparse_bytes = (double) (xs.NonZeros() * (sizeof(Float32) +
+        sizeof(int)) + k * n * sizeof(Float32) + m * n * sizeof(Float32));
+    runner.Run(name + "/dense", bytes, 2.0 * m * n * k, [&] {
+      DoNotOptimize(MatrixMultiply(x, w));
+    });
+    runner.Run(name + "/csr", sparse_bytes, 2.0 * xs.NonZeros() * n, [&] {
+      DoNotOptimize(sparse::MatrixMultiply(xs, w));
+    });
+  }
+}
+
+// Large kernels on 1, 2 and 4 threads of the shared pool: elementwise
+// kernels are bound by memory bandwidth, the product by arithmetic.
+void BenchParallel(Runner & runner) {
+  const int n = 1 << 22;
+  auto a = Filled<Float32>({n});
+  auto b = Filled<Float32>({n});
+  auto c = Filled<Float32>({n});
+  auto square = Filled<Float32>({2048, 2048});
+  auto x = Filled<Float32>({1024, 1024});
+  auto w = Filled<Float32>({1024, 1024});
+  for (int threads : {1, 2, 4}) {
+    parallel::SetNumThreads(threads);
+    string suffix = "/float32/threads" + to_string(threads);
+    double bytes = 3.0 * n * sizeof(Float32);
+    runner.Run("parallel/add/" + to_string(n) + suffix, bytes, n, [&] {
+      Add(a, b, c);
+    });
+    runner.Run("parallel/multiply/" + to_string(n) + suffix, bytes, n, [&] {
+      Multiply(a, b, c);
+    });
+    runner.Run("parallel/apply_gelu/" + to_string(n) + suffix,
+               2.0 * n * sizeof(Float32), n, [&] {
+      Apply(a, activation::GeluFunctor(), c);
+    });
+    runner.Run("parallel/copy_transpose/2048x2048" + suffix,
+               2.0 * square.Size() * sizeof(Float32), square.Size(), [&] {
+      DoNotOptimize(Copy(Transpose(square)));
+    });
+    runner.Run("parallel/matmul/1024x1024x1024" + suffix,
+               3.0 * 1024 * 1024 * sizeof(Float32), 2.0 * 1024 * 1024 * 1024,
+               [&] {
+      DoNotOptimize(MatrixMultiply(x, w));
+    });
+  }
+  parallel::SetNumThreads(0);
+}
+
+int main(int argc, char ** argv) {
+  Runner runner(argc, argv);
+  BenchElementwise<Float32>(runner, "float32");
+  BenchElementwise<Float64>(runner, "float64");
+  BenchElementwise<Int32>(runner, "int32");
+  BenchActivations<Float32>(runner, "float32");
+  BenchActivations<Float64>(runner, "float64");
+  BenchMatrixMultiply<Float32>(runner, "float32");
+  BenchMatrixMultiply<Float64>(runner, "float64");
+  BenchCopy<Float32>(runner, "float32");
+  BenchReduce<Float32>(runner, "float32");
+  BenchReduce<Float64>(runner, "float64");
+  BenchStatic<3>(runner);
+  BenchStatic<4>(runner);
+  BenchQuantize(runner);
+  BenchConv2D(runner);
+  BenchSparse(runner);
+  BenchLoad(runner);
+  BenchParallel(runner);
+  return 0;
+}
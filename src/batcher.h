@@ -0,0 +1,131 @@
+#ifndef JB_BATCHER_H
+#define JB_BATCHER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "src/session.h"
+
+using namespace std;
+using namespace jb::session;
+
+namespace jb {
+
+namespace batcher {
+
+// Dynamic micro-batching: concurrent callers of Run() each submit one
+// request and block until it is done.  A background thread coalesces the
+// waiting requests into a single Session::RunBatch() as soon as max_batch of
+// them are waiting, or when the oldest has waited max_delay, whichever comes
+// first.  The batcher's thread is the only user of the session while the
+// batcher exists.  If a batch fails, every request in it gets the error.
+
+template<typename T>
+class Batcher {
+public:
+  typedef chrono::steady_clock Clock;
+  Batcher(Session<T> * session, list<Op<T> *> outputs, int max_batch,
+          chrono::microseconds max_delay);
+  ~Batcher();
+  vector<Tensor<T>> Run(Feed<T> feed);
+  long Batches() const { return batches; };
+  long Requests() const { return requests; };
+private:
+  struct Request {
+    Feed<T> feed;
+    promise<vector<Tensor<T>>> result;
+    Clock::time_point arrival;
+  };
+  void Loop();
+  Session<T> * session;
+  list<Op<T> *> outputs;
+  int max_batch;
+  chrono::microseconds max_delay;
+  mutex lock;
+  condition_variable ready;
+  deque<unique_ptr<Request>> queue;
+  bool stopping = false;
+  atomic<long> batches;
+  atomic<long> requests;
+  thread worker;
+};
+
+template<typename T>
+Batcher<T>::Batcher(Session<T> * session, list<Op<T> *> outputs,
+                    int max_batch, chrono::microseconds max_delay)
+    : session(session), outputs(outputs), max_batch(max(1, max_batch)),
+      max_delay(max_delay), batches(0), requests(0) {
+  worker = thread(&Batcher<T>::Loop, this);
+}
+
+template<typename T>
+Batcher<T>::~Batcher() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  ready.notify_all();
+  worker.join();
+}
+
+template<typename T>
+vector<Tensor<T>> Batcher<T>::Run(Feed<T> feed) {
+  unique_ptr<Request> request(new Request());
+  request->feed = move(feed);
+  request->arrival = Clock::now();
+  future<vector<Tensor<T>>> result = request->result.get_future();
+  {
+    lock_guard<mutex> guard(lock);
+    queue.push_back(move(request));
+  }
+  ready.notify_all();
+  return result.get();
+}
+
+template<typename T>
+void Batcher<T>::Loop() {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    ready.wait(guard, [&] { return stopping || !queue.empty(); });
+    if (queue.empty())
+      return;  // stopping, and drained
+    Clock::time_point deadline = queue.front()->arrival + max_delay;
+    ready.wait_until(guard, deadline, [&] {
+      return stopping || (int) queue.size() >= max_batch;
+    });
+    vector<unique_ptr<Request>> batch;
+    while (!queue.empty() && (int) batch.size() < max_batch) {
+      batch.push_back(move(queue.front()));
+      queue.pop_front();
+    }
+    guard.unlock();
+    vector<Feed<T>> feeds;
+    for (auto & request : batch)
+      feeds.push_back(request->feed);
+    batches++;
+    requests += batch.size();
+    try {
+      vector<vector<Tensor<T>>> results = session->RunBatch(outputs, feeds);
+      for (int i = 0; i < (int) batch.size(); i++)
+        batch[i]->result.set_value(results[i]);
+    } catch (...) {
+      for (auto & request : batch)
+        request->result.set_exception(current_exception());
+    }
+    guard.lock();
+  }
+}
+
+}  // namespace batcher
+
+}  // namespace jb
+
+#endif  // JB_BATCHER_H
@@ -0,0 +1,346 @@
+#ifndef JB_CONV_H
+#define JB_CONV_H
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "src/gemm.h"
+#include "src/parallel.h"
+#include "src/reduce.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace conv {
+
+// 2-D convolution (cross-correlation, as in the deep learning frameworks)
+// of contiguous NCHW images x (n, c, h, w) with filters w (o, c / groups,
+// kh, kw) into an output (n, o, oh, ow):
+//
+//   out[b][f][y][x] = sum over the filter's group of input channels ch,
+//                     and i, j of w[f][ch][i][j] *
+//                     x[b][ch][y * stride_h - pad_h + i * dilation_h]
+//                         [x * stride_w - pad_w + j * dilation_w]
+//
+// with zeros outside the image.  Two kernels:
+//
+//   im2col   the receptive fields of a block of output rows are laid out as
+//            the columns of a (c / groups * kh * kw) x (rows * ow) matrix
+//            and multiplied by the group's filters with gemm::Gemm.  1 x 1
+//            filters with unit stride and no padding multiply the image in
+//            place.  Wins when the filter depth c / groups * kh * kw and the
+//            filters per group are large enough to feed the micro-kernel.
+//   direct   output rows are accumulated kBlock outputs at a time, for
+//            kFilterBlock filters at once so that every input loaded feeds
+//            several filters, with the padded borders done separately.  No
+//            copies: wins for depthwise filters (one input channel each)
+//            and shallow ones.
+//
+// Work is split across threads by image, group (or output channel) and
+// block of output rows.
+
+enum Algorithm { kAuto, kIm2col, kDirect };
+
+struct Params {
+  int stride_h = 1, stride_w = 1;
+  int pad_h = 0, pad_w = 0;
+  int dilation_h = 1, dilation_w = 1;
+  int groups = 1;
+  Algorithm algorithm = kAuto;  // kAuto picks by shape, see Choose()
+};
+
+// Sizes of one convolution, derived from the operand shapes.
+struct Geometry {
+  int n, c, h, w;  // images
+  int o, kh, kw;   // filters
+  int oh, ow;      // output
+  int groups;
+  int GroupChannels() const { return c / groups; }
+  int GroupFilters() const { return o / groups; }
+  int Depth() const { return c / groups * kh * kw; }  // per output
+};
+
+const int kBlock = 64;             // outputs per block, direct
+const int kFilterBlock = 4;        // filters per block, direct
+const int kColumnBlock = 1024;     // output columns per im2col task
+const int kDirectMaxDepth = 32;    // deeper filters use im2col, ...
+const int kDirectMaxFilters = 4;   // ... unless groups are this thin
+
+// UTILITY FUNCTIONS
+
+Geometry MakeGeometry(const vector<int> & x_shape, const vector<int> & w_shape,
+                      const Params & p) {
+  if (x_shape.size() != 4)
+    throw runtime_error("Conv2D: input is not (n, c, h, w)");
+  if (w_shape.size() != 4)
+    throw runtime_error("Conv2D: filters are not (o, c / groups, kh, kw)");
+  if (p.stride_h < 1 || p.stride_w < 1 || p.dilation_h < 1 ||
+      p.dilation_w < 1 || p.pad_h < 0 || p.pad_w < 0 || p.groups < 1)
+    throw runtime_error("Conv2D: invalid stride, padding or dilation");
+  Geometry g;
+  g.n = x_shape[0], g.c = x_shape[1], g.h = x_shape[2], g.w = x_shape[3];
+  g.o = w_shape[0], g.kh = w_shape[2], g.kw = w_shape[3];
+  g.groups = p.groups;
+  if (g.c % g.groups != 0 || g.o % g.groups != 0)
+    throw runtime_error("Conv2D: channels are not divisible by the groups");
+  if (w_shape[1] != g.c / g.groups)
+    throw runtime_error("Conv2D: filters do not match the input channels");
+  long span_h = (long) p.dilation_h * (g.kh - 1) + 1;
+  long span_w = (long) p.dilation_w * (g.kw - 1) + 1;
+  if (g.kh < 1 || g.kw < 1 || span_h > g.h + 2L * p.pad_h ||
+      span_w > g.w + 2L * p.pad_w)
+    throw runtime_error("Conv2D: filter exceeds the padded input");
+  g.oh = (int) ((g.h + 2L * p.pad_h - span_h) / p.stride_h + 1);
+  g.ow = (int) ((g.w + 2L * p.pad_w - span_w) / p.stride_w + 1);
+  return g;
+}
+
+vector<int> OutputShape(const vector<int> & x_shape,
+                        const vector<int> & w_shape, const Params & p) {
+  Geometry g = MakeGeometry(x_shape, w_shape, p);
+  return {g.n, g.o, g.oh, g.ow};
+}
+
+Algorithm Choose(const Geometry & g, const Params & p) {
+  if (p.algorithm != kAuto)
+    return p.algorithm;
+  if (g.GroupFilters() <= kDirectMaxFilters || g.Depth() <= kDirectMaxDepth)
+    return kDirect;
+  return kIm2col;
+}
+
+// Output positions [lo, hi) along one axis whose whole receptive field lies
+// inside the input, so that they need no bounds checks.
+void Interior(int size, int out, int k, int stride, int pad, int dilation,
+              int & lo, int & hi) {
+  lo = min(out, (pad + stride - 1) / stride);
+  long last = size - 1 + pad - (long) (k - 1) * dilation;  // hi * stride <=
+  hi = last < 0 ? 0 : (int) min((long) out, last / stride + 1);
+  hi = max(hi, lo);
+}
+
+// IM2COL
+
+// Receptive fields of output rows [y0, y1) of one group of input channels
+// (x points to its first channel) as the columns of col, which is
+// (c / groups * kh * kw) x ((y1 - y0) * ow).
+template<typename T>
+void Im2col(const Geometry & g, const Params & p, const T * x, int y0, int y1,
+            T * col) {
+  int columns = (y1 - y0) * g.ow;
+  for (int ch = 0; ch < g.GroupChannels(); ch++) {
+    const T * plane = x + (long) ch * g.h * g.w;
+    for (int i = 0; i < g.kh; i++) {
+      for (int j = 0; j < g.kw; j++) {
+        T * row = col + ((long) (ch * g.kh + i) * g.kw + j) * columns;
+        int shift = j * p.dilation_w - p.pad_w;
+        // outputs whose tap j lands inside the row: lo <= x < hi
+        int x_lo = shift >= 0 ? 0 : (-shift + p.stride_w - 1) / p.stride_w;
+        long last = g.w - 1 - (long) shift;
+        int x_hi = last < 0 ? 0 : (int) min((long) g.ow,
+                                            last / p.stride_w + 1);
+        x_lo = min(x_lo, g.ow);
+        x_hi = max(x_hi, x_lo);
+        for (int y = y0; y < y1; y++, row += g.ow) {
+          int iy = y * p.stride_h - p.pad_h + i * p.dilation_h;
+          if (iy < 0 || iy >= g.h) {
+            fill(row, row + g.ow, T(0));
+            continue;
+          }
+          const T * in = plane + (long) iy * g.w + shift;
+          fill(row, row + x_lo, T(0));
+          if (p.stride_w == 1) {
+            memcpy(row + x_lo, in + x_lo, (x_hi - x_lo) * sizeof(T));
+          } else {
+            for (int k = x_lo; k < x_hi; k++)
+              row[k] = in[(long) k * p.stride_w];
+          }
+          fill(row + x_hi, row + g.ow, T(0));
+        }
+      }
+    }
+  }
+}
+
+template<typename T>
+void ConvIm2col(const Geometry & g, const Params & p, const T * x,
+                const T * w, T * out) {
+  long plane = (long) g.oh * g.ow;
+  int rows = max(1, min(g.oh, kColumnBlock / g.ow));
+  int blocks = (g.oh + rows - 1) / rows;
+  long tasks = (long) g.n * g.groups * blocks;
+  int depth = g.Depth();
+  bool pointwise = g.kh == 1 && g.kw == 1 && p.stride_h == 1 &&
+                   p.stride_w == 1 && p.pad_h == 0 && p.pad_w == 0;
+  long work = tasks * g.GroupFilters() * depth * rows * g.ow;
+  parallel::ParallelFor(tasks, work, [&](long begin, long end) {
+    vector<T> col(pointwise ? 0 : (long) depth * rows * g.ow);
+    for (long t = begin; t < end; t++) {
+      int b = t / (g.groups * blocks);
+      int group = t / blocks % g.groups;
+      int y0 = t % blocks * rows;
+      int y1 = min(g.oh, y0 + rows);
+      int columns = (y1 - y0) * g.ow;
+      const T * image = x + ((long) b * g.c + group * g.GroupChannels()) *
+                                g.h * g.w;
+      const T * filters = w + (long) group * g.GroupFilters() * depth;
+      T * o = out + ((long) b * g.o + group * g.GroupFilters()) * plane +
+              (long) y0 * g.ow;
+      for (int f = 0; f < g.GroupFilters(); f++)
+        fill(o + f * plane, o + f * plane + columns, T(0));
+      // image rows are output rows when pointwise, read in place
+      const T * b_matrix = image + (long) y0 * g.ow;
+      long rs_b = (long) g.h * g.w;
+      if (!pointwise) {
+        Im2col(g, p, image, y0, y1, col.data());
+        b_matrix = col.data();
+        rs_b = columns;
+      }
+      gemm::Gemm<T>(g.GroupFilters(), columns, depth, filters, depth, 1,
+                    b_matrix, rs_b, 1, o, plane, 1);
+    }
+  });
+}
+
+// DIRECT
+
+// out[f][x] for F filters f (w points to the first, out to its output row)
+// and x in [x0, x0 + n), n <= kBlock, with every tap inside the input rows
+// that exist.  Each input is loaded once for the F filters.  UnitStride lets
+// the inner loop run over contiguous inputs.
+template<typename T, bool UnitStride, int F>
+void DirectBlock(const Geometry & g, const Params & p, const T * x,
+                 const T * w, int y, int x0, int n, T * out, long plane) {
+  T acc[F][kBlock];
+  for (int f = 0; f < F; f++)
+    fill(acc[f], acc[f] + kBlock, T(0));
+  long depth = g.Depth();
+  for (int ch = 0; ch < g.GroupChannels(); ch++) {
+    for (int i = 0; i < g.kh; i++) {
+      int iy = y * p.stride_h - p.pad_h + i * p.dilation_h;
+      if (iy < 0 || iy >= g.h)
+        continue;
+      const T * in = x + ((long) ch * g.h + iy) * g.w +
+                     (long) x0 * p.stride_w - p.pad_w;
+      const T * taps = w + ((long) ch * g.kh + i) * g.kw;
+      for (int j = 0; j < g.kw; j++) {
+        const T * s = in + j * p.dilation_w;
+        T weight[F];
+        for (int f = 0; f < F; f++)
+          weight[f] = taps[f * depth + j];
+        for (int k = 0; k < n; k++) {
+          T v = s[UnitStride ? k : (long) k * p.stride_w];
+          for (int f = 0; f < F; f++)
+            acc[f][k] += weight[f] * v;
+        }
+      }
+    }
+  }
+  for (int f = 0; f < F; f++)
+    copy(acc[f], acc[f] + n, out + f * plane);
+}
+
+// One output, checking every tap: for the padded borders.
+template<typename T>
+T DirectPoint(const Geometry & g, const Params & p, const T * x, const T * w,
+              int y, int x_out) {
+  T acc = 0;
+  for (int ch = 0; ch < g.GroupChannels(); ch++) {
+    for (int i = 0; i < g.kh; i++) {
+      int iy = y * p.stride_h - p.pad_h + i * p.dilation_h;
+      if (iy < 0 || iy >= g.h)
+        continue;
+      for (int j = 0; j < g.kw; j++) {
+        int ix = x_out * p.stride_w - p.pad_w + j * p.dilation_w;
+        if (ix >= 0 && ix < g.w)
+          acc += w[((long) ch * g.kh + i) * g.kw + j] *
+                 x[((long) ch * g.h + iy) * g.w + ix];
+      }
+    }
+  }
+  return acc;
+}
+
+// The output planes of F consecutive filters w of one group, over its input
+// channels x.
+template<typename T, bool UnitStride, int F>
+void DirectPlanes(const Geometry & g, const Params & p, const T * x,
+                  const T * w, T * out) {
+  long plane = (long) g.oh * g.ow;
+  int lo, hi;
+  Interior(g.w, g.ow, g.kw, p.stride_w, p.pad_w, p.dilation_w, lo, hi);
+  for (int y = 0; y < g.oh; y++) {
+    T * row = out + (long) y * g.ow;
+    for (int f = 0; f < F; f++) {
+      for (int k = 0; k < lo; k++)
+        row[f * plane + k] = DirectPoint(g, p, x, w + f * g.Depth(), y, k);
+      for (int k = hi; k < g.ow; k++)
+        row[f * plane + k] = DirectPoint(g, p, x, w + f * g.Depth(), y, k);
+    }
+    for (int k = lo; k < hi; k += kBlock)
+      DirectBlock<T, UnitStride, F>(g, p, x, w, y, k, min(kBlock, hi - k),
+                                    row + k, plane);
+  }
+}
+
+template<typename T, int F>
+void DirectPlanes(const Geometry & g, const Params & p, const T * x,
+                  const T * w, T * out) {
+  if (p.stride_w == 1)
+    DirectPlanes<T, true, F>(g, p, x, w, out);
+  else
+    DirectPlanes<T, false, F>(g, p, x, w, out);
+}
+
+template<typename T>
+void ConvDirect(const Geometry & g, const Params & p, const T * x,
+                const T * w, T * out) {
+  long plane = (long) g.oh * g.ow;
+  int blocks = (g.GroupFilters() + kFilterBlock - 1) / kFilterBlock;
+  long tasks = (long) g.n * g.groups * blocks;
+  long work = (long) g.n * g.o * plane * g.Depth();
+  parallel::ParallelFor(tasks, work, [&](long begin, long end) {
+    for (long t = begin; t < end; t++) {
+      int b = t / (g.groups * blocks);
+      int group = t / blocks % g.groups;
+      int f0 = t % blocks * kFilterBlock;
+      int f1 = min(g.GroupFilters(), f0 + kFilterBlock);
+      const T * image = x + ((long) b * g.c + group * g.GroupChannels()) *
+                                g.h * g.w;
+      long f = (long) group * g.GroupFilters() + f0;
+      const T * filters = w + f * g.Depth();
+      T * o = out + ((long) b * g.o + f) * plane;
+      if (f1 - f0 == kFilterBlock) {
+        DirectPlanes<T, kFilterBlock>(g, p, image, filters, o);
+      } else {
+        for (int k = 0; k < f1 - f0; k++)
+          DirectPlanes<T, 1>(g, p, image, filters + k * g.Depth(),
+                             o + k * plane);
+      }
+    }
+  });
+}
+
+// DRIVER
+
+// out = x conv w for contiguous operands of the shapes in g; out is
+// overwritten.
+template<typename T>
+void Conv2D(const Geometry & g, const Params & p, const T * x, const T * w,
+            T * out) {
+  if (g.n == 0 || g.o == 0 || g.oh == 0 || g.ow == 0)
+    return;
+  if (Choose(g, p) == kDirect)
+    ConvDirect(g, p, x, w, out);
+  else
+    ConvIm2col(g, p, x, w, out);
+}
+
+}  // namespace conv
+
+}  // namespace jb
+
+#endif  // JB_CONV_H
@@ -0,0 +1,348 @@
+#ifndef JB_ELEMENTWISE_H
+#define JB_ELEMENTWISE_H
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+#include <stdexcept>
+
+#include "src/parallel.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace elementwise {
+
+// Shared engine for elementwise kernels.  Operands (output first) are
+// described by their strides over a common, broadcast loop shape; broadcast
+// dimensions have stride 0.  Dimensions that are contiguous across every
+// operand are collapsed so the innermost loop is as long as possible, and
+// each row is dispatched to an inner loop specialized for contiguous,
+// broadcast (stride 0) or generally strided operands.
+//
+// Offsets and strides are 64-bit, so operands may span more than 2^31
+// elements.  Rows are kept under 2^31 elements and strided rows index with
+// 32-bit arithmetic whenever their extent allows it.
+//
+// The drivers spread large loops over the shared thread pool
+// (src/parallel.h): whole rows when there are several, pieces of
+// kRowPiece elements when everything collapsed into a single row.  Only
+// dimensions along which the output (operand 0) moves are split, so no two
+// threads update the same element; accumulations into a broadcast output
+// (stride 0, e.g. bias gradients) keep their serial order.  Every output
+// element is therefore computed the same way on any thread, and results do
+// not depend on the thread count.
+
+const int kRowPiece = 4096;  // elements per task when splitting one row
+
+// A loop nest over `shape` with one stride vector per operand.
+struct Loop {
+  vector<int> shape;
+  vector<vector<long>> strides;
+};
+
+// UTILITY FUNCTIONS
+
+// Numpy-style broadcast of two shapes (trailing dimensions aligned).
+vector<int> BroadcastShape(const vector<int> & a, const vector<int> & b) {
+  int ndim = max(a.size(), b.size());
+  vector<int> shape(ndim);
+  for (int i = 0; i < ndim; i++) {
+    int da = i < ndim - (int) a.size() ? 1 : a[i - (ndim - a.size())];
+    int db = i < ndim - (int) b.size() ? 1 : b[i - (ndim - b.size())];
+    if (da != db && da != 1 && db != 1)
+      throw runtime_error("Broadcast: incompatible shapes");
+    shape[i] = da == 1 ? db : da;
+  }
+  return shape;
+}
+
+// Strides of an operand read over `out_shape`; broadcast dimensions get
+// stride 0.
+vector<long> BroadcastStrides(const vector<int> & shape,
+                              const vector<long> & stride,
+                              const vector<int> & out_shape) {
+  int lead = out_shape.size() - shape.size();
+  if (lead < 0)
+    throw runtime_error("Broadcast: operand has too many dimensions");
+  vector<long> strides(out_shape.size(), 0);
+  for (int i = 0; i < (int) shape.size(); i++) {
+    if (shape[i] == out_shape[lead + i])
+      strides[lead + i] = stride[i];
+    else if (shape[i] != 1)
+      throw runtime_error("Broadcast: incompatible shapes");
+  }
+  return strides;
+}
+
+// Drops unit dimensions and merges neighbours that are contiguous for every
+// operand, e.g. a dense 3 x 4 x 5 loop becomes a single loop of 60.  Merged
+// extents stay below 2^31.
+void Collapse(Loop & loop) {
+  Loop out;
+  out.strides.resize(loop.strides.size());
+  for (int d = 0; d < (int) loop.shape.size(); d++) {
+    if (loop.shape[d] == 1)
+      continue;
+    bool merge = !out.shape.empty() &&
+                 (long) out.shape.back() * loop.shape[d] <= INT_MAX;
+    for (int k = 0; merge && k < (int) loop.strides.size(); k++)
+      merge = out.strides[k].back() == loop.strides[k][d] * loop.shape[d];
+    if (merge) {
+      out.shape.back() *= loop.shape[d];
+      for (int k = 0; k < (int) loop.strides.size(); k++)
+        out.strides[k].back() = loop.strides[k][d];
+    } else {
+      out.shape.push_back(loop.shape[d]);
+      for (int k = 0; k < (int) loop.strides.size(); k++)
+        out.strides[k].push_back(loop.strides[k][d]);
+    }
+  }
+  if (out.shape.empty()) {
+    out.shape.push_back(1);
+    for (auto & s : out.strides)
+      s.push_back(0);
+  }
+  loop = out;
+}
+
+// Number of innermost rows of a loop.
+long Rows(const Loop & loop) {
+  long rows = 1;
+  for (int d = 0; d + 1 < (int) loop.shape.size(); d++)
+    rows *= loop.shape[d];
+  return rows;
+}
+
+// Calls body(offsets) once per innermost row in [begin, end) (rows counted
+// in row-major order), where offsets[k] is the element offset of operand k
+// at the start of the row.
+template<typename Body>
+void ForEachRow(const Loop & loop, long begin, long end, Body body) {
+  if (begin >= end)
+    return;
+  int ndim = loop.shape.size();
+  int nops = loop.strides.size();
+  vector<int> index(ndim, 0);
+  vector<long> offsets(nops, 0);
+  long rest = begin;
+  for (int d = ndim - 2; d >= 0; d--) {
+    index[d] = rest % loop.shape[d];
+    rest /= loop.shape[d];
+    for (int k = 0; k < nops; k++)
+      offsets[k] += loop.strides[k][d] * index[d];
+  }
+  for (long row = begin; row < end; row++) {
+    body(offsets.data());
+    for (int d = ndim - 2; d >= 0; d--) {
+      index[d]++;
+      for (int k = 0; k < nops; k++)
+        offsets[k] += loop.strides[k][d];
+      if (index[d] < loop.shape[d])
+        break;
+      for (int k = 0; k < nops; k++)
+        offsets[k] -= loop.strides[k][d] * loop.shape[d];
+      index[d] = 0;
+    }
+  }
+}
+
+template<typename Body>
+void ForEachRow(const Loop & loop, Body body) {
+  ForEachRow(loop, 0, Rows(loop), body);
+}
+
+// Calls body(n, offsets) over a collapsed loop, on several threads when it
+// is large and the output has no broadcast (stride 0) dimension: once per
+// row with n its length, or, for a single row, once per piece of it.
+// Bodies must be safe to run concurrently.
+template<typename Body>
+void ParallelForEachRow(const Loop & loop, Body body) {
+  int n = loop.shape.back();
+  long rows = Rows(loop);
+  long work = rows * n;
+  if (work == 0)
+    return;
+  // threads must write disjoint output elements
+  const vector<long> & out = loop.strides[0];
+  bool split = find(out.begin(), out.end(), 0L) == out.end();
+  if (!split) {
+    ForEachRow(loop, [&](const long * offsets) { body(n, offsets); });
+    return;
+  }
+  if (rows > 1) {
+    parallel::ParallelFor(rows, work, [&](long begin, long end) {
+      ForEachRow(loop, begin, end, [&](const long * offsets) {
+        body(n, offsets);
+      });
+    });
+    return;
+  }
+  int nops = loop.strides.size();
+  long pieces = (n + kRowPiece - 1) / kRowPiece;
+  parallel::ParallelFor(pieces, work, [&](long begin, long end) {
+    long first = begin * kRowPiece;
+    long last = min(end * kRowPiece, (long) n);
+    vector<long> offsets(nops);
+    for (int k = 0; k < nops; k++)
+      offsets[k] = first * loop.strides[k].back();
+    body((int) (last - first), offsets.data());
+  });
+}
+
+// INNER LOOPS
+
+// Whether the offsets i * stride of a row of n elements fit in an int, so
+// the row can be indexed with 32-bit arithmetic (cheaper address math, and
+// 32-bit gather indices when vectorized).
+inline bool FitsInt(int n, long stride) {
+  return (long) n * (stride < 0 ? -stride : stride) <= INT_MAX;
+}
+
+template<typename I, typename T, typename U, typename F>
+void StridedUnaryRow(int n, U * o, I so, const T * a, I sa, F f) {
+  for (I i = 0; i < n; i++)
+    o[i * so] = f(a[i * sa]);
+}
+
+template<typename I, typename T, typename F>
+void StridedBinaryRow(int n, T * o, I so, const T * a, I sa, const T * b, I sb,
+                      F f) {
+  for (I i = 0; i < n; i++)
+    o[i * so] = f(a[i * sa], b[i * sb]);
+}
+
+template<typename I, typename T, typename F>
+void StridedTernaryRow(int n, T * o, I so, const T * a, I sa, const T * b,
+                       I sb, const T * c, I sc, F f) {
+  for (I i = 0; i < n; i++)
+    o[i * so] = f(a[i * sa], b[i * sb], c[i * sc]);
+}
+
+// The output type may differ from the input's (conversions).
+template<typename T, typename U, typename F>
+void UnaryRow(int n, U * o, long so, const T * a, long sa, F f) {
+  if (so == 1 && sa == 1) {
+    for (int i = 0; i < n; i++)
+      o[i] = f(a[i]);
+  } else if (so == 1 && sa == 0) {
+    U v = f(*a);
+    for (int i = 0; i < n; i++)
+      o[i] = v;
+  } else if (FitsInt(n, so) && FitsInt(n, sa)) {
+    StridedUnaryRow<int>(n, o, (int) so, a, (int) sa, f);
+  } else {
+    StridedUnaryRow<long>(n, o, so, a, sa, f);
+  }
+}
+
+template<typename T, typename F>
+void BinaryRow(int n, T * o, long so, const T * a, long sa, const T * b,
+               long sb, F f) {
+  if (so == 1 && sa == 1 && sb == 1) {
+    for (int i = 0; i < n; i++)
+      o[i] = f(a[i], b[i]);
+  } else if (so == 1 && sa == 1 && sb == 0) {
+    T bv = *b;
+    for (int i = 0; i < n; i++)
+      o[i] = f(a[i], bv);
+  } else if (so == 1 && sa == 0 && sb == 1) {
+    T av = *a;
+    for (int i = 0; i < n; i++)
+      o[i] = f(av, b[i]);
+  } else if (FitsInt(n, so) && FitsInt(n, sa) && FitsInt(n, sb)) {
+    StridedBinaryRow<int>(n, o, (int) so, a, (int) sa, b, (int) sb, f);
+  } else {
+    StridedBinaryRow<long>(n, o, so, a, sa, b, sb, f);
+  }
+}
+
+template<typename T, typename F>
+void TernaryRow(int n, T * o, long so, const T * a, long sa, const T * b,
+                long sb, const T * c, long sc, F f) {
+  if (so == 1 && sa == 1 && sb == 1 && sc == 1) {
+    for (int i = 0; i < n; i++)
+      o[i] = f(a[i], b[i], c[i]);
+  } else if (FitsInt(n, so) && FitsInt(n, sa) && FitsInt(n, sb) &&
+             FitsInt(n, sc)) {
+    StridedTernaryRow<int>(n, o, (int) so, a, (int) sa, b, (int) sb, c,
+                           (int) sc, f);
+  } else {
+    StridedTernaryRow<long>(n, o, so, a, sa, b, sb, c, sc, f);
+  }
+}
+
+// DRIVERS
+
+template<typename T, typename U, typename F>
+void Unary(Loop loop, U * o, const T * a, F f) {
+  Collapse(loop);
+  long so = loop.strides[0].back();
+  long sa = loop.strides[1].back();
+  ParallelForEachRow(loop, [&](int n, const long * offsets) {
+    UnaryRow(n, o + offsets[0], so, a + offsets[1], sa, f);
+  });
+}
+
+template<typename T, typename F>
+void Binary(Loop loop, T * o, const T * a, const T * b, F f) {
+  Collapse(loop);
+  long so = loop.strides[0].back();
+  long sa = loop.strides[1].back();
+  long sb = loop.strides[2].back();
+  ParallelForEachRow(loop, [&](int n, const long * offsets) {
+    BinaryRow(n, o + offsets[0], so, a + offsets[1], sa, b + offsets[2], sb, f);
+  });
+}
+
+template<typename T, typename F>
+void Ternary(Loop loop, T * o, const T * a, const T * b, const T * c, F f) {
+  Collapse(loop);
+  long so = loop.strides[0].back();
+  long sa = loop.strides[1].back();
+  long sb = loop.strides[2].back();
+  long sc = loop.strides[3].back();
+  ParallelForEachRow(loop, [&](int n, const long * offsets) {
+    TernaryRow(n, o + offsets[0], so, a + offsets[1], sa, b + offsets[2], sb,
+               c + offsets[3], sc, f);
+  });
+}
+
+// FUNCTORS
+
+struct AddFunctor {
+  template<typename T> T operator()(T a, T b) const { return a + b; }
+};
+
+struct MultiplyFunctor {
+  template<typename T> T operator()(T a, T b) const { return a * b; }
+};
+
+struct SubtractFunctor {
+  template<typename T> T operator()(T a, T b) const { return a - b; }
+};
+
+struct MultiplyAddFunctor {
+  template<typename T> T operator()(T a, T b, T c) const { return a + b * c; }
+};
+
+struct IdentityFunctor {
+  template<typename T> T operator()(T a) const { return a; }
+};
+
+struct NegateFunctor {
+  template<typename T> T operator()(T a) const { return -a; }
+};
+
+template<typename T>
+struct ConstantFunctor {
+  T value;
+  T operator()(T) const { return value; }
+};
+
+}  // namespace elementwise
+
+}  // namespace jb
+
+#endif  // JB_ELEMENTWISE_H
@@ -0,0 +1,582 @@
+#ifndef JB_GEMM_H
+#define JB_GEMM_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "src/parallel.h"
+#include "src/pool.h"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace jb {
+
+namespace gemm {
+
+// Blocked general matrix multiply, C += A * B, over arbitrarily strided
+// operands.  A and B are packed into contiguous panels sized for the caches
+// and fed to a register-blocked micro-kernel.  The micro-kernel is picked at
+// compile time (AVX-512, AVX2 + FMA, or portable scalar code).
+//
+// Large products split C into blocks of kBlockM rows or kTaskN columns,
+// whichever makes more blocks, and run them on the shared thread pool
+// (src/parallel.h), each packing its own panels.  Blocks start on micro-tile
+// boundaries and every element is accumulated in the same order as in a
+// serial run, so results do not depend on the thread count.
+
+// ACCUMULATOR TYPES
+
+template<typename T>
+struct Accumulator { typedef T Type; };
+
+template<>
+struct Accumulator<int8_t> { typedef int32_t Type; };
+
+template<>
+struct Accumulator<int16_t> { typedef int32_t Type; };
+
+// BLOCKING PARAMETERS
+
+const int kBlockK = 256;   // depth of a packed panel (micro-panels stay in L1)
+const int kBlockM = 96;    // rows of a packed A block (stays in L2)
+const int kBlockN = 2048;  // columns of a packed B panel (stays in L3)
+const long kSmallProblem = 32 * 32 * 32;  // m * n * k below which packing
+                                          // costs more than it saves
+const int kTaskN = 128;            // columns of C per task, split by column
+const long kTaskGrain = 1L << 21;  // multiply-adds per task, at least
+const int kPackPadding = 16;  // elements a kernel may read past packed A
+
+// MICRO-KERNELS
+
+// Computes an MR x NR tile of C += A * B.  `a` holds kc columns of MR packed
+// rows, `b` holds kc rows of NR packed columns.  C may be wider than the
+// operands (Int8 x Int8 -> Int32).
+template<typename T>
+struct MicroKernel {
+  static const int MR = 4;
+  static const int NR = 4;
+  template<typename TC>
+  static void Run(int kc, const T * a, const T * b, TC * c, long rs_c,
+                  long cs_c) {
+    typedef typename Accumulator<T>::Type Acc;
+    Acc acc[MR][NR] = {};
+    for (int p = 0; p < kc; p++) {
+      for (int i = 0; i < MR; i++) {
+        Acc ai = a[i];
+        for (int j = 0; j < NR; j++)
+          acc[i][j] += ai * b[j];
+      }
+      a += MR;
+      b += NR;
+    }
+    for (int i = 0; i < MR; i++)
+      for (int j = 0; j < NR; j++)
+        c[i * rs_c + j * cs_c] += (TC) acc[i][j];
+  }
+};
+
+#if defined(__AVX512F__)
+
+template<>
+struct MicroKernel<float> {
+  static const int MR = 6;
+  static const int NR = 32;
+  static void Run(int kc, const float * a, const float * b, float * c,
+                  long rs_c, long cs_c) {
+    __m512 acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm512_setzero_ps();
+    for (int p = 0; p < kc; p++) {
+      __m512 b0 = _mm512_loadu_ps(b);
+      __m512 b1 = _mm512_loadu_ps(b + 16);
+      for (int i = 0; i < MR; i++) {
+        __m512 ai = _mm512_set1_ps(a[i]);
+        acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+        acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+      }
+      a += MR;
+      b += NR;
+    }
+    if (cs_c == 1) {
+      for (int i = 0; i < MR; i++) {
+        float * ci = c + i * rs_c;
+        _mm512_storeu_ps(ci, _mm512_add_ps(_mm512_loadu_ps(ci), acc[i][0]));
+        _mm512_storeu_ps(ci + 16,
+                         _mm512_add_ps(_mm512_loadu_ps(ci + 16), acc[i][1]));
+      }
+    } else {
+      float tile[MR][NR];
+      for (int i = 0; i < MR; i++) {
+        _mm512_storeu_ps(tile[i], acc[i][0]);
+        _mm512_storeu_ps(tile[i] + 16, acc[i][1]);
+      }
+      for (int i = 0; i < MR; i++)
+        for (int j = 0; j < NR; j++)
+          c[i * rs_c + j * cs_c] += tile[i][j];
+    }
+  }
+};
+
+template<>
+struct MicroKernel<double> {
+  static const int MR = 6;
+  static const int NR = 16;
+  static void Run(int kc, const double * a, const double * b, double * c,
+                  long rs_c, long cs_c) {
+    __m512d acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm512_setzero_pd();
+    for (int p = 0; p < kc; p++) {
+      __m512d b0 = _mm512_loadu_pd(b);
+      __m512d b1 = _mm512_loadu_pd(b + 8);
+      for (int i = 0; i < MR; i++) {
+        __m512d ai = _mm512_set1_pd(a[i]);
+        acc[i][0] = _mm512_fmadd_pd(ai, b0, acc[i][0]);
+        acc[i][1] = _mm512_fmadd_pd(ai, b1, acc[i][1]);
+      }
+      a += MR;
+      b += NR;
+    }
+    if (cs_c == 1) {
+      for (int i = 0; i < MR; i++) {
+        double * ci = c + i * rs_c;
+        _mm512_storeu_pd(ci, _mm512_add_pd(_mm512_loadu_pd(ci), acc[i][0]));
+        _mm512_storeu_pd(ci + 8,
+                         _mm512_add_pd(_mm512_loadu_pd(ci + 8), acc[i][1]));
+      }
+    } else {
+      double tile[MR][NR];
+      for (int i = 0; i < MR; i++) {
+        _mm512_storeu_pd(tile[i], acc[i][0]);
+        _mm512_storeu_pd(tile[i] + 8, acc[i][1]);
+      }
+      for (int i = 0; i < MR; i++)
+        for (int j = 0; j < NR; j++)
+          c[i * rs_c + j * cs_c] += tile[i][j];
+    }
+  }
+};
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+template<>
+struct MicroKernel<float> {
+  static const int MR = 6;
+  static const int NR = 16;
+  static void Run(int kc, const float * a, const float * b, float * c,
+                  long rs_c, long cs_c) {
+    __m256 acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm256_setzero_ps();
+    for (int p = 0; p < kc; p++) {
+      __m256 b0 = _mm256_loadu_ps(b);
+      __m256 b1 = _mm256_loadu_ps(b + 8);
+      for (int i = 0; i < MR; i++) {
+        __m256 ai = _mm256_broadcast_ss(a + i);
+        acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+        acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+      }
+      a += MR;
+      b += NR;
+    }
+    if (cs_c == 1) {
+      for (int i = 0; i < MR; i++) {
+        float * ci = c + i * rs_c;
+        _mm256_storeu_ps(ci, _mm256_add_ps(_mm256_loadu_ps(ci), acc[i][0]));
+        _mm256_storeu_ps(ci + 8,
+                         _mm256_add_ps(_mm256_loadu_ps(ci + 8), acc[i][1]));
+      }
+    } else {
+      float tile[MR][NR];
+      for (int i = 0; i < MR; i++) {
+        _mm256_storeu_ps(tile[i], acc[i][0]);
+        _mm256_storeu_ps(tile[i] + 8, acc[i][1]);
+      }
+      for (int i = 0; i < MR; i++)
+        for (int j = 0; j < NR; j++)
+          c[i * rs_c + j * cs_c] += tile[i][j];
+    }
+  }
+};
+
+template<>
+struct MicroKernel<double> {
+  static const int MR = 6;
+  static const int NR = 8;
+  static void Run(int kc, const double * a, const double * b, double * c,
+                  long rs_c, long cs_c) {
+    __m256d acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm256_setzero_pd();
+    for (int p = 0; p < kc; p++) {
+      __m256d b0 = _mm256_loadu_pd(b);
+      __m256d b1 = _mm256_loadu_pd(b + 4);
+      for (int i = 0; i < MR; i++) {
+        __m256d ai = _mm256_broadcast_sd(a + i);
+        acc[i][0] = _mm256_fmadd_pd(ai, b0, acc[i][0]);
+        acc[i][1] = _mm256_fmadd_pd(ai, b1, acc[i][1]);
+      }
+      a += MR;
+      b += NR;
+    }
+    if (cs_c == 1) {
+      for (int i = 0; i < MR; i++) {
+        double * ci = c + i * rs_c;
+        _mm256_storeu_pd(ci, _mm256_add_pd(_mm256_loadu_pd(ci), acc[i][0]));
+        _mm256_storeu_pd(ci + 4,
+                         _mm256_add_pd(_mm256_loadu_pd(ci + 4), acc[i][1]));
+      }
+    } else {
+      double tile[MR][NR];
+      for (int i = 0; i < MR; i++) {
+        _mm256_storeu_pd(tile[i], acc[i][0]);
+        _mm256_storeu_pd(tile[i] + 4, acc[i][1]);
+      }
+      for (int i = 0; i < MR; i++)
+        for (int j = 0; j < NR; j++)
+          c[i * rs_c + j * cs_c] += tile[i][j];
+    }
+  }
+};
+
+#endif
+
+// Int8 kernels take k two steps at a time: rows p and p + 1 of B are
+// interleaved and widened to 16 bits, so that madd_epi16 against the pair
+// (a[p], a[p + 1]) broadcast from A adds both products into each Int32
+// lane.  A pair of Int8 products cannot overflow.
+
+#if defined(__AVX2__)
+
+// Widens a packed A panel of 6 rows into (a[p], a[p + 1]) pairs of 16-bit
+// lanes, 8 words apart per step, so the kernels broadcast them straight from
+// memory.  Reads 16 bytes at a time, see kPackPadding.  Returns the steps.
+inline int WidenPairs(int kc, const int8_t * a, int32_t * pairs) {
+  const int MR = 6;
+  int steps = (kc + 1) / 2;
+  for (int s = 0; s < steps; s++) {
+    __m128i a01 = _mm_loadu_si128((const __m128i *) (a + 2 * s * MR));
+    __m128i a1 = 2 * s + 1 < kc ? _mm_srli_si128(a01, MR)
+                                : _mm_setzero_si128();
+    _mm256_storeu_si256((__m256i *) (pairs + 8 * s),
+                        _mm256_cvtepi8_epi16(_mm_unpacklo_epi8(a01, a1)));
+  }
+  return steps;
+}
+
+#endif
+
+#if defined(__AVX512BW__)
+
+template<>
+struct MicroKernel<int8_t> {
+  static const int MR = 6;
+  static const int NR = 32;
+  template<typename TC>
+  static void Run(int kc, const int8_t * a, const int8_t * b, TC * c,
+                  long rs_c, long cs_c) {
+    int32_t pairs[(kBlockK + 1) / 2 * 8];
+    int steps = WidenPairs(kc, a, pairs);
+    __m512i acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm512_setzero_si512();
+    for (int s = 0; s < steps; s++, b += 2 * NR) {
+      __m256i b0 = _mm256_loadu_si256((const __m256i *) b);
+      __m256i b1 = 2 * s + 1 < kc
+                       ? _mm256_loadu_si256((const __m256i *) (b + NR))
+                       : _mm256_setzero_si256();
+      // unpacking works within 128-bit lanes: lo holds columns 0-7 and
+      // 16-23, hi columns 8-15 and 24-31
+      __m512i lo = _mm512_cvtepi8_epi16(_mm256_unpacklo_epi8(b0, b1));
+      __m512i hi = _mm512_cvtepi8_epi16(_mm256_unpackhi_epi8(b0, b1));
+      for (int i = 0; i < MR; i++) {
+        __m512i ai = _mm512_set1_epi32(pairs[8 * s + i]);
+        acc[i][0] = _mm512_add_epi32(acc[i][0], _mm512_madd_epi16(ai, lo));
+        acc[i][1] = _mm512_add_epi32(acc[i][1], _mm512_madd_epi16(ai, hi));
+      }
+    }
+    int32_t tile[MR][NR];
+    for (int i = 0; i < MR; i++) {
+      for (int h = 0; h < 2; h++) {
+        _mm256_storeu_si256((__m256i *) (tile[i] + 8 * h),
+                            _mm512_castsi512_si256(acc[i][h]));
+        _mm256_storeu_si256((__m256i *) (tile[i] + 16 + 8 * h),
+                            _mm512_extracti64x4_epi64(acc[i][h], 1));
+      }
+    }
+    for (int i = 0; i < MR; i++)
+      for (int j = 0; j < NR; j++)
+        c[i * rs_c + j * cs_c] += (TC) tile[i][j];
+  }
+};
+
+#elif defined(__AVX2__)
+
+template<>
+struct MicroKernel<int8_t> {
+  static const int MR = 6;
+  static const int NR = 16;
+  template<typename TC>
+  static void Run(int kc, const int8_t * a, const int8_t * b, TC * c,
+                  long rs_c, long cs_c) {
+    int32_t pairs[(kBlockK + 1) / 2 * 8];
+    int steps = WidenPairs(kc, a, pairs);
+    __m256i acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm256_setzero_si256();
+    for (int s = 0; s < steps; s++, b += 2 * NR) {
+      __m128i b0 = _mm_loadu_si128((const __m128i *) b);
+      __m128i b1 = 2 * s + 1 < kc
+                       ? _mm_loadu_si128((const __m128i *) (b + NR))
+                       : _mm_setzero_si128();
+      __m256i lo = _mm256_cvtepi8_epi16(_mm_unpacklo_epi8(b0, b1));
+      __m256i hi = _mm256_cvtepi8_epi16(_mm_unpackhi_epi8(b0, b1));
+      for (int i = 0; i < MR; i++) {
+        __m256i ai = _mm256_set1_epi32(pairs[8 * s + i]);
+        acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(ai, lo));
+        acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(ai, hi));
+      }
+    }
+    int32_t tile[MR][NR];
+    for (int i = 0; i < MR; i++) {
+      _mm256_storeu_si256((__m256i *) tile[i], acc[i][0]);
+      _mm256_storeu_si256((__m256i *) (tile[i] + 8), acc[i][1]);
+    }
+    for (int i = 0; i < MR; i++)
+      for (int j = 0; j < NR; j++)
+        c[i * rs_c + j * cs_c] += (TC) tile[i][j];
+  }
+};
+
+#elif defined(__SSE2__)
+
+template<>
+struct MicroKernel<int8_t> {
+  static const int MR = 4;
+  static const int NR = 8;
+  // SSE2 has no sign extension: pairing each byte with itself and shifting
+  // right arithmetically widens it
+  static __m128i WidenLow(__m128i x) {
+    return _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+  }
+  static __m128i WidenHigh(__m128i x) {
+    return _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+  }
+  static void Step(const int8_t * a, const int8_t * b, bool last,
+                   __m128i acc[MR][2]) {
+    __m128i a01 = _mm_loadl_epi64((const __m128i *) a);
+    __m128i a1 = last ? _mm_setzero_si128() : _mm_srli_si128(a01, MR);
+    __m128i pairs = WidenLow(_mm_unpacklo_epi8(a01, a1));
+    __m128i b0 = _mm_loadl_epi64((const __m128i *) b);
+    __m128i b1 = last ? _mm_setzero_si128()
+                      : _mm_loadl_epi64((const __m128i *) (b + NR));
+    __m128i bb = _mm_unpacklo_epi8(b0, b1);
+    __m128i lo = WidenLow(bb);
+    __m128i hi = WidenHigh(bb);
+    __m128i ai[MR] = {_mm_shuffle_epi32(pairs, 0x00),
+                      _mm_shuffle_epi32(pairs, 0x55),
+                      _mm_shuffle_epi32(pairs, 0xaa),
+                      _mm_shuffle_epi32(pairs, 0xff)};
+    for (int i = 0; i < MR; i++) {
+      acc[i][0] = _mm_add_epi32(acc[i][0], _mm_madd_epi16(ai[i], lo));
+      acc[i][1] = _mm_add_epi32(acc[i][1], _mm_madd_epi16(ai[i], hi));
+    }
+  }
+  template<typename TC>
+  static void Run(int kc, const int8_t * a, const int8_t * b, TC * c,
+                  long rs_c, long cs_c) {
+    __m128i acc[MR][2];
+    for (int i = 0; i < MR; i++)
+      acc[i][0] = acc[i][1] = _mm_setzero_si128();
+    int p = 0;
+    for (; p + 1 < kc; p += 2, a += 2 * MR, b += 2 * NR)
+      Step(a, b, false, acc);
+    if (p < kc)
+      Step(a, b, true, acc);
+    int32_t tile[MR][NR];
+    for (int i = 0; i < MR; i++) {
+      _mm_storeu_si128((__m128i *) tile[i], acc[i][0]);
+      _mm_storeu_si128((__m128i *) (tile[i] + 4), acc[i][1]);
+    }
+    for (int i = 0; i < MR; i++)
+      for (int j = 0; j < NR; j++)
+        c[i * rs_c + j * cs_c] += (TC) tile[i][j];
+  }
+};
+
+#endif
+
+// PACKING
+
+// Packing buffer of n elements from the tensor pool, so repeated products
+// reuse their panels instead of reaching the heap.
+template<typename T>
+struct Panel {
+  explicit Panel(long n)
+      : bytes(n * sizeof(T)), data((T *) pool::Allocate(bytes)) {}
+  ~Panel() { pool::Free(data, bytes); }
+  Panel(const Panel &) = delete;
+  Panel & operator=(const Panel &) = delete;
+  long bytes;
+  T * data;
+};
+
+// Packs an mc x kc block of A into row micro-panels of height MR, padding
+// the last panel with zeros.
+template<typename T, int MR>
+void PackA(int mc, int kc, const T * a, long rs_a, long cs_a, T * packed) {
+  for (int ir = 0; ir < mc; ir += MR) {
+    int mr = min(MR, mc - ir);
+    for (int p = 0; p < kc; p++) {
+      const T * ap = a + ir * rs_a + p * cs_a;
+      for (int i = 0; i < mr; i++)
+        packed[i] = ap[i * rs_a];
+      for (int i = mr; i < MR; i++)
+        packed[i] = 0;
+      packed += MR;
+    }
+  }
+}
+
+// Packs a kc x nc panel of B into column micro-panels of width NR, padding
+// the last panel with zeros.
+template<typename T, int NR>
+void PackB(int kc, int nc, const T * b, long rs_b, long cs_b, T * packed) {
+  for (int jr = 0; jr < nc; jr += NR) {
+    int nr = min(NR, nc - jr);
+    for (int p = 0; p < kc; p++) {
+      const T * bp = b + p * rs_b + jr * cs_b;
+      if (cs_b == 1) {
+        copy(bp, bp + nr, packed);
+      } else {
+        for (int j = 0; j < nr; j++)
+          packed[j] = bp[j * cs_b];
+      }
+      for (int j = nr; j < NR; j++)
+        packed[j] = 0;
+      packed += NR;
+    }
+  }
+}
+
+// DRIVERS
+
+// Unblocked C += A * B for problems too small to amortize packing.
+template<typename T, typename TC>
+void GemmSmall(int m, int n, int k,
+               const T * a, long rs_a, long cs_a,
+               const T * b, long rs_b, long cs_b,
+               TC * c, long rs_c, long cs_c) {
+  typedef typename Accumulator<T>::Type Acc;
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      Acc acc = 0;
+      const T * ai = a + i * rs_a;
+      const T * bj = b + j * cs_b;
+      for (int p = 0; p < k; p++)
+        acc += (Acc) ai[p * cs_a] * (Acc) bj[p * rs_b];
+      c[i * rs_c + j * cs_c] += (TC) acc;
+    }
+  }
+}
+
+// Packed C += A * B on the calling thread.
+template<typename T, typename TC>
+void GemmBlocked(int m, int n, int k,
+                 const T * a, long rs_a, long cs_a,
+                 const T * b, long rs_b, long cs_b,
+                 TC * c, long rs_c, long cs_c) {
+  typedef MicroKernel<T> Kernel;
+  const int MR = Kernel::MR;
+  const int NR = Kernel::NR;
+
+  int kc_max = min(k, kBlockK);
+  int mc_max = min(m, kBlockM);
+  int nc_max = min(n, kBlockN);
+  long size_a = kc_max * ((mc_max + MR - 1) / MR) * MR;
+  Panel<T> packed_a(size_a + kPackPadding);
+  Panel<T> packed_b(kc_max * ((nc_max + NR - 1) / NR) * NR);
+  fill(packed_a.data + size_a, packed_a.data + size_a + kPackPadding, T(0));
+  TC tile[MR * NR];
+
+  for (int jc = 0; jc < n; jc += kBlockN) {
+    int nc = min(kBlockN, n - jc);
+    for (int pc = 0; pc < k; pc += kBlockK) {
+      int kc = min(kBlockK, k - pc);
+      PackB<T, NR>(kc, nc, b + pc * rs_b + jc * cs_b, rs_b, cs_b,
+                   packed_b.data);
+      for (int ic = 0; ic < m; ic += kBlockM) {
+        int mc = min(kBlockM, m - ic);
+        PackA<T, MR>(mc, kc, a + ic * rs_a + pc * cs_a, rs_a, cs_a,
+                     packed_a.data);
+        for (int jr = 0; jr < nc; jr += NR) {
+          int nr = min(NR, nc - jr);
+          const T * bp = packed_b.data + jr * kc;
+          for (int ir = 0; ir < mc; ir += MR) {
+            int mr = min(MR, mc - ir);
+            const T * ap = packed_a.data + ir * kc;
+            TC * cp = c + (ic + ir) * rs_c + (jc + jr) * cs_c;
+            if (mr == MR && nr == NR) {
+              Kernel::Run(kc, ap, bp, cp, rs_c, cs_c);
+            } else {
+              // edge tile: compute the full tile aside, keep the valid part
+              fill(tile, tile + MR * NR, TC(0));
+              Kernel::Run(kc, ap, bp, tile, NR, 1);
+              for (int i = 0; i < mr; i++)
+                for (int j = 0; j < nr; j++)
+                  cp[i * rs_c + j * cs_c] += tile[i * NR + j];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// C (m x n) += A (m x k) * B (k x n).  Each operand is addressed as
+// base[row * row_stride + col * col_stride], so transposed and sliced views
+// are consumed in place.  C is of type T, or of T's accumulator type to
+// keep full precision products of narrow integers.
+template<typename T, typename TC = T>
+void Gemm(int m, int n, int k,
+          const T * a, long rs_a, long cs_a,
+          const T * b, long rs_b, long cs_b,
+          TC * c, long rs_c, long cs_c) {
+  if (m == 0 || n == 0 || k == 0)
+    return;
+  long work = (long) m * n * k;
+  if (work <= kSmallProblem) {
+    GemmSmall(m, n, k, a, rs_a, cs_a, b, rs_b, cs_b, c, rs_c, cs_c);
+    return;
+  }
+  long row_blocks = (m + kBlockM - 1) / kBlockM;
+  long col_blocks = (n + kTaskN - 1) / kTaskN;
+  if (row_blocks >= col_blocks) {
+    parallel::ParallelFor(row_blocks, work, [&](long begin, long end) {
+      long i0 = begin * kBlockM;
+      long i1 = min(end * kBlockM, (long) m);
+      GemmBlocked((int) (i1 - i0), n, k, a + i0 * rs_a, rs_a, cs_a,
+                  b, rs_b, cs_b, c + i0 * rs_c, rs_c, cs_c);
+    }, kTaskGrain);
+  } else {
+    parallel::ParallelFor(col_blocks, work, [&](long begin, long end) {
+      long j0 = begin * kTaskN;
+      long j1 = min(end * kTaskN, (long) n);
+      GemmBlocked(m, (int) (j1 - j0), k, a, rs_a, cs_a,
+                  b + j0 * cs_b, rs_b, cs_b, c + j0 * cs_c, rs_c, cs_c);
+    }, kTaskGrain);
+  }
+}
+
+}  // namespace gemm
+
+}  // namespace jb
+
+#endif  // JB_GEMM_H
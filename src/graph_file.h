@@ -0,0 +1,542 @@
+#ifndef JB_GRAPH_FILE_H
+#define JB_GRAPH_FILE_H
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "src/op.h"
+#include "src/session.h"
+#include "src/storage.h"
+#include "src/tensor_file.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace graph_file {
+
+using op::Op;
+using op::Variable;
+using session::Session;
+using tensor::Tensor;
+
+// Op graphs saved as a compact binary file, so a process can load a model
+// instead of rebuilding it in code.  Variables are saved by name: inputs are
+// fed at run time, constants are stored in a tensor file (src/tensor_file.h)
+// written alongside and are bound to the session by mapping it, so loading
+// never copies the weights.  Apply and Fused ops call plain functions, which
+// are saved by the name they were registered under with RegisterFunction().
+//
+// Layout (little endian):
+//
+//   char     magic[8]        "JBGRAPH1"
+//   uint32   version         1
+//   uint32   dtype           element type of the graph, see tensor_file
+//   uint32   count
+//   count ops, each after its inputs
+//     uint32 code
+//     uint32 input_count,     uint32 inputs[input_count]   (op indices)
+//     uint32 attribute_count, int64 attributes[attribute_count]
+//     uint32 string_count
+//     string_count strings of
+//       uint32 length, char string[length]
+//   uint32   output_count,    uint32 outputs[output_count]   (op indices)
+//
+// Attributes and strings by op:
+//
+//   Variable                 kind (kInput or kConstant); name
+//   Apply                    ; f, df (empty when not differentiable)
+//   Conv2D                   stride_h, stride_w, pad_h, pad_w, dilation_h,
+//                            dilation_w, groups, algorithm
+//   QuantizedMatrixMultiply  axis, then float bits of each scale followed by
+//                            its zero point; name of the Int8 weights
+//   Sum, Mean, Max           keep_dims, axes...
+//   ArgMax                   keep_dims, axis
+//   Fused                    code, a, b of each instruction; f of each
+//                            kApply instruction
+
+const char kMagic[8] = {'J', 'B', 'G', 'R', 'A', 'P', 'H', '1'};
+const uint32_t kVersion = 1;
+
+enum Code : uint32_t {
+  kVariable = 1,
+  kAdd = 2,
+  kMultiply = 3,
+  kApply = 4,
+  kExp = 5,
+  kLog = 6,
+  kTanh = 7,
+  kSigmoid = 8,
+  kGelu = 9,
+  kMatrixMultiply = 10,
+  kConv2D = 11,
+  kQuantizedMatrixMultiply = 12,
+  kSum = 13,
+  kMean = 14,
+  kMax = 15,
+  kArgMax = 16,
+  kFused = 17,
+};
+
+enum VariableKind : int64_t {
+  kInput = 0,
+  kConstant = 1,
+};
+
+// FUNCTIONS
+
+// Functions Apply and Fused ops may call, by name.  Register them before
+// saving or loading graphs that use them; registration is not thread safe.
+template<typename T>
+struct Functions {
+  map<string, T (*)(T)> by_name;
+  map<T (*)(T), string> names;
+};
+
+template<typename T>
+Functions<T> & Registry() {
+  static Functions<T> functions;
+  return functions;
+}
+
+template<typename T>
+void RegisterFunction(const string & name, T (*f)(T)) {
+  Functions<T> & functions = Registry<T>();
+  auto it = functions.by_name.find(name);
+  if (it != functions.by_name.end() && it->second != f)
+    throw runtime_error("RegisterFunction: " + name + " is taken");
+  functions.by_name[name] = f;
+  functions.names[f] = name;
+}
+
+template<typename T>
+string FunctionName(T (*f)(T)) {
+  if (!f)
+    return "";
+  auto it = Registry<T>().names.find(f);
+  if (it == Registry<T>().names.end())
+    throw runtime_error("Writer: function is not registered");
+  return it->second;
+}
+
+template<typename T>
+T (*FindFunction(const string & name))(T) {
+  if (name.empty())
+    return nullptr;
+  auto it = Registry<T>().by_name.find(name);
+  if (it == Registry<T>().by_name.end())
+    throw runtime_error("Graph: function " + name + " is not registered");
+  return it->second;
+}
+
+// One op as stored in the file.
+struct Record {
+  Code code;
+  vector<uint32_t> inputs;
+  vector<int64_t> attributes;
+  vector<string> strings;
+};
+
+int64_t FloatBits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+float BitsFloat(int64_t value) {
+  uint32_t bits = (uint32_t) value;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// WRITER
+
+// Saves the graph of a set of outputs with the constants it reads.  Every
+// variable the outputs depend on must be named, as an input or a constant.
+template<typename T>
+class Writer {
+public:
+  void Input(Variable<T> * variable, const string & name);
+  void Constant(Variable<T> * variable, const string & name,
+                const Tensor<T> & value);
+  void Write(const string & path, const string & constants_path,
+             const list<Op<T> *> & outputs) const;
+private:
+  void Name(Variable<T> * variable, const string & name, VariableKind kind);
+  Record Describe(Op<T> * op, int index, tensor_file::Writer & tensors) const;
+  map<Variable<T> *, pair<string, VariableKind>> variables;
+  map<string, Variable<T> *> taken;
+  tensor_file::Writer constants;
+};
+
+template<typename T>
+void Writer<T>::Input(Variable<T> * variable, const string & name) {
+  Name(variable, name, kInput);
+}
+
+template<typename T>
+void Writer<T>::Constant(Variable<T> * variable, const string & name,
+                         const Tensor<T> & value) {
+  Name(variable, name, kConstant);
+  constants.Add(name, value);
+}
+
+template<typename T>
+void Writer<T>::Name(Variable<T> * variable, const string & name,
+                     VariableKind kind) {
+  if (name.empty())
+    throw runtime_error("Writer: variable names can not be empty");
+  if (variables.count(variable))
+    throw runtime_error("Writer: variable " + name + " is named already");
+  if (!taken.insert({name, variable}).second)
+    throw runtime_error("Writer: duplicate variable " + name);
+  variables[variable] = {name, kind};
+}
+
+template<typename T>
+Record Writer<T>::Describe(Op<T> * op, int index,
+                           tensor_file::Writer & tensors) const {
+  Record r;
+  if (auto v = dynamic_cast<Variable<T> *>(op)) {
+    auto it = variables.find(v);
+    if (it == variables.end())
+      throw runtime_error("Writer: variable has no name");
+    r.code = kVariable;
+    r.attributes = {it->second.second};
+    r.strings = {it->second.first};
+  } else if (dynamic_cast<op::Add<T> *>(op)) {
+    r.code = kAdd;
+  } else if (dynamic_cast<op::Multiply<T> *>(op)) {
+    r.code = kMultiply;
+  } else if (auto apply = dynamic_cast<op::Apply<T> *>(op)) {
+    r.code = kApply;
+    r.strings = {FunctionName(apply->Function()),
+                 FunctionName(apply->Derivative())};
+  } else if (dynamic_cast<op::Exp<T> *>(op)) {
+    r.code = kExp;
+  } else if (dynamic_cast<op::Log<T> *>(op)) {
+    r.code = kLog;
+  } else if (dynamic_cast<op::Tanh<T> *>(op)) {
+    r.code = kTanh;
+  } else if (dynamic_cast<op::Sigmoid<T> *>(op)) {
+    r.code = kSigmoid;
+  } else if (dynamic_cast<op::Gelu<T> *>(op)) {
+    r.code = kGelu;
+  } else if (dynamic_cast<op::MatrixMultiply<T> *>(op)) {
+    r.code = kMatrixMultiply;
+  } else if (auto conv2d = dynamic_cast<op::Conv2D<T> *>(op)) {
+    const conv::Params & p = conv2d->Parameters();
+    r.code = kConv2D;
+    r.attributes = {p.stride_h, p.stride_w, p.pad_h, p.pad_w,
+                    p.dilation_h, p.dilation_w, p.groups, p.algorithm};
+  } else if (auto qmm = dynamic_cast<op::QuantizedMatrixMultiply<T> *>(op)) {
+    const quantize::Params & p = qmm->WeightParams();
+    r.code = kQuantizedMatrixMultiply;
+    r.attributes = {p.axis};
+    for (int c = 0; c < p.scale.size(); c++) {
+      r.attributes.push_back(FloatBits(p.scale[c]));
+      r.attributes.push_back(p.zero_point[c]);
+    }
+    r.strings = {"op" + to_string(index) + "/weights"};
+    tensors.Add(r.strings[0], qmm->Weights());
+  } else if (auto sum = dynamic_cast<op::Sum<T> *>(op)) {
+    r.code = kSum;
+    r.attributes = {sum->KeepDims()};
+    r.attributes.insert(r.attributes.end(), sum->Axes().begin(),
+                        sum->Axes().end());
+  } else if (auto mean = dynamic_cast<op::Mean<T> *>(op)) {
+    r.code = kMean;
+    r.attributes = {mean->KeepDims()};
+    r.attributes.insert(r.attributes.end(), mean->Axes().begin(),
+                        mean->Axes().end());
+  } else if (auto maximum = dynamic_cast<op::Max<T> *>(op)) {
+    r.code = kMax;
+    r.attributes = {maximum->KeepDims()};
+    r.attributes.insert(r.attributes.end(), maximum->Axes().begin(),
+                        maximum->Axes().end());
+  } else if (auto argmax = dynamic_cast<op::ArgMax<T> *>(op)) {
+    r.code = kArgMax;
+    r.attributes = {argmax->KeepDims(), argmax->Axis()};
+  } else if (auto fused = dynamic_cast<op::Fused<T> *>(op)) {
+    r.code = kFused;
+    for (auto & ins : fused->Program()) {
+      r.attributes.insert(r.attributes.end(), {ins.code, ins.a, ins.b});
+      if (ins.code == op::Fused<T>::kApply)
+        r.strings.push_back(FunctionName(ins.f));
+    }
+  } else {
+    throw runtime_error(string("Writer: can not save ") + op->Type() +
+                        " ops");
+  }
+  return r;
+}
+
+void WriteString(ofstream & out, const string & s) {
+  tensor_file::WriteValue<uint32_t>(out, s.size());
+  out.write(s.data(), s.size());
+}
+
+template<typename T>
+void Writer<T>::Write(const string & path, const string & constants_path,
+                      const list<Op<T> *> & outputs) const {
+  using tensor_file::WriteValue;
+  // the session's compiler orders the ops, inputs first
+  session::Plan<T> plan = Session<T>().Compile(outputs);
+  tensor_file::Writer tensors = constants;
+  ofstream out(path, ios::binary | ios::trunc);
+  if (!out)
+    throw runtime_error("Writer: cannot open " + path);
+  out.write(kMagic, sizeof(kMagic));
+  WriteValue<uint32_t>(out, kVersion);
+  WriteValue<uint32_t>(out, tensor_file::DTypeOf<T>());
+  WriteValue<uint32_t>(out, plan.ops.size());
+  for (int i = 0; i < plan.ops.size(); i++) {
+    Record r = Describe(plan.ops[i], i, tensors);
+    WriteValue<uint32_t>(out, r.code);
+    WriteValue<uint32_t>(out, plan.inputs[i].size());
+    for (auto input : plan.inputs[i])
+      WriteValue<uint32_t>(out, input);
+    WriteValue<uint32_t>(out, r.attributes.size());
+    for (auto a : r.attributes)
+      WriteValue<int64_t>(out, a);
+    WriteValue<uint32_t>(out, r.strings.size());
+    for (auto & s : r.strings)
+      WriteString(out, s);
+  }
+  WriteValue<uint32_t>(out, plan.outputs.size());
+  for (auto o : plan.outputs)
+    WriteValue<uint32_t>(out, o);
+  if (!out)
+    throw runtime_error("Writer: failed writing " + path);
+  tensors.Write(constants_path);
+}
+
+// READER
+
+// A graph loaded from a file, owning its ops.  Loading reads the file once,
+// in order, and assigns the constants to `session`, which is then ready to
+// run Outputs() given the inputs; the graph must outlive the session's use
+// of its ops.
+template<typename T>
+class Graph {
+public:
+  Graph(const string & path, const string & constants_path,
+        Session<T> & session);
+  Variable<T> * Input(const string & name) const;
+  const list<Op<T> *> & Outputs() const { return outputs; };
+  int NumOps() const { return ops.size(); };
+private:
+  Op<T> * Build(const Record & r, const tensor_file::File & constants,
+                Session<T> & session);
+  Op<T> * At(uint32_t index) const;
+  vector<unique_ptr<Op<T>>> ops;
+  map<string, Variable<T> *> inputs;
+  list<Op<T> *> outputs;
+};
+
+template<typename T>
+Graph<T>::Graph(const string & path, const string & constants_path,
+                Session<T> & session) {
+  storage::MappedFile file(path);
+  tensor_file::File constants(constants_path);
+  tensor_file::HeaderReader in(file.Data(), file.Size());
+  if (memcmp(in.Take(sizeof(kMagic)), kMagic, sizeof(kMagic)) != 0)
+    throw runtime_error("Graph: not a graph file " + path);
+  if (in.Read<uint32_t>() != kVersion)
+    throw runtime_error("Graph: unsupported version in " + path);
+  if (in.Read<uint32_t>() != tensor_file::DTypeOf<T>())
+    throw runtime_error("Graph: " + path + " has a different type");
+  uint32_t count = in.Read<uint32_t>();
+  ops.reserve(count);
+  Record r;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t code = in.Read<uint32_t>();
+    if (code < kVariable || code > kFused)
+      throw runtime_error("Graph: unknown op code " + to_string(code));
+    r.code = (Code) code;
+    r.inputs.resize(in.Read<uint32_t>());
+    for (auto & input : r.inputs) {
+      input = in.Read<uint32_t>();
+      if (input >= i)
+        throw runtime_error("Graph: op reads a later op in " + path);
+    }
+    r.attributes.resize(in.Read<uint32_t>());
+    for (auto & a : r.attributes)
+      a = in.Read<int64_t>();
+    r.strings.resize(in.Read<uint32_t>());
+    for (auto & s : r.strings) {
+      uint32_t length = in.Read<uint32_t>();
+      s.assign(in.Take(length), length);
+    }
+    ops.emplace_back(Build(r, constants, session));
+  }
+  uint32_t output_count = in.Read<uint32_t>();
+  for (uint32_t i = 0; i < output_count; i++)
+    outputs.push_back(At(in.Read<uint32_t>()));
+}
+
+template<typename T>
+Op<T> * Graph<T>::At(uint32_t index) const {
+  if (index >= ops.size())
+    throw runtime_error("Graph: op index out of range");
+  return ops[index].get();
+}
+
+// Checks the number of inputs, attributes and strings of a record.
+void Expect(const Record & r, int inputs, int attributes, int strings) {
+  if ((inputs >= 0 && (int) r.inputs.size() != inputs) ||
+      (attributes >= 0 && (int) r.attributes.size() != attributes) ||
+      (strings >= 0 && (int) r.strings.size() != strings))
+    throw runtime_error("Graph: malformed op " + to_string(r.code));
+}
+
+// Attribute j of a record, checked to lie in [lo, hi] before it is narrowed
+// or cast to an enum.
+int Attribute(const Record & r, int j, int64_t lo = INT_MIN,
+              int64_t hi = INT_MAX) {
+  if (r.attributes[j] < lo || r.attributes[j] > hi)
+    throw runtime_error("Graph: malformed op " + to_string(r.code));
+  return (int) r.attributes[j];
+}
+
+template<typename T>
+Op<T> * Graph<T>::Build(const Record & r, const tensor_file::File & constants,
+                        Session<T> & session) {
+  vector<Op<T> *> in;
+  for (auto input : r.inputs)
+    in.push_back(ops[input].get());
+  switch (r.code) {
+    case kVariable: {
+      Expect(r, 0, 1, 1);
+      Variable<T> * v = new Variable<T>();
+      if (r.attributes[0] == kConstant)
+        session.Assign(v, constants.Get<T>(r.strings[0]));
+      else if (!inputs.insert({r.strings[0], v}).second)
+        throw runtime_error("Graph: duplicate input " + r.strings[0]);
+      return v;
+    }
+    case kAdd:
+      Expect(r, -1, 0, 0);
+      return new op::Add<T>(in);
+    case kMultiply:
+      Expect(r, -1, 0, 0);
+      return new op::Multiply<T>(in);
+    case kApply:
+      Expect(r, 1, 0, 2);
+      if (r.strings[0].empty())
+        throw runtime_error("Graph: malformed op " + to_string(r.code));
+      return new op::Apply<T>(in[0], FindFunction<T>(r.strings[0]),
+                              FindFunction<T>(r.strings[1]));
+    case kExp:
+      Expect(r, 1, 0, 0);
+      return new op::Exp<T>(in[0]);
+    case kLog:
+      Expect(r, 1, 0, 0);
+      return new op::Log<T>(in[0]);
+    case kTanh:
+      Expect(r, 1, 0, 0);
+      return new op::Tanh<T>(in[0]);
+    case kSigmoid:
+      Expect(r, 1, 0, 0);
+      return new op::Sigmoid<T>(in[0]);
+    case kGelu:
+      Expect(r, 1, 0, 0);
+      return new op::Gelu<T>(in[0]);
+    case kMatrixMultiply:
+      Expect(r, 2, 0, 0);
+      return new op::MatrixMultiply<T>(in[0], in[1]);
+    case kConv2D: {
+      Expect(r, 2, 8, 0);
+      conv::Params p;
+      p.stride_h = Attribute(r, 0);
+      p.stride_w = Attribute(r, 1);
+      p.pad_h = Attribute(r, 2);
+      p.pad_w = Attribute(r, 3);
+      p.dilation_h = Attribute(r, 4);
+      p.dilation_w = Attribute(r, 5);
+      p.groups = Attribute(r, 6);
+      p.algorithm = (conv::Algorithm) Attribute(r, 7, conv::kAuto,
+                                                conv::kDirect);
+      return new op::Conv2D<T>(in[0], in[1], p);
+    }
+    case kQuantizedMatrixMultiply: {
+      Expect(r, 1, -1, 1);
+      if (r.attributes.size() % 2 != 1)
+        throw runtime_error("Graph: malformed op " + to_string(r.code));
+      quantize::Params p;
+      p.axis = r.attributes[0];
+      for (int c = 1; c < r.attributes.size(); c += 2) {
+        p.scale.push_back(BitsFloat(r.attributes[c]));
+        p.zero_point.push_back(r.attributes[c + 1]);
+      }
+      return new op::QuantizedMatrixMultiply<T>(
+          in[0], constants.Get<Int8>(r.strings[0]), p);
+    }
+    case kSum:
+    case kMean:
+    case kMax: {
+      Expect(r, 1, -1, 0);
+      if (r.attributes.empty())
+        throw runtime_error("Graph: malformed op " + to_string(r.code));
+      bool keep_dims = r.attributes[0];
+      vector<int> axes(r.attributes.begin() + 1, r.attributes.end());
+      if (r.code == kSum)
+        return new op::Sum<T>(in[0], axes, keep_dims);
+      if (r.code == kMean)
+        return new op::Mean<T>(in[0], axes, keep_dims);
+      return new op::Max<T>(in[0], axes, keep_dims);
+    }
+    case kArgMax:
+      Expect(r, 1, 2, 0);
+      return new op::ArgMax<T>(in[0], r.attributes[1], r.attributes[0]);
+    case kFused: {
+      Expect(r, -1, -1, -1);
+      if (in.empty() || r.attributes.size() % 3 != 0)
+        throw runtime_error("Graph: malformed op " + to_string(r.code));
+      vector<typename op::Fused<T>::Instruction> program;
+      int apply = 0;
+      for (int j = 0; j < r.attributes.size(); j += 3) {
+        typename op::Fused<T>::Instruction ins;
+        int registers = in.size() + program.size();
+        ins.code = (typename op::Fused<T>::Code) Attribute(
+            r, j, op::Fused<T>::kAdd, op::Fused<T>::kApply);
+        ins.a = Attribute(r, j + 1, 0, registers - 1);
+        ins.b = Attribute(r, j + 2, 0, registers - 1);
+        ins.f = nullptr;
+        if (ins.code == op::Fused<T>::kApply) {
+          if (apply >= r.strings.size() || r.strings[apply].empty())
+            throw runtime_error("Graph: malformed op " + to_string(r.code));
+          ins.f = FindFunction<T>(r.strings[apply++]);
+        }
+        program.push_back(ins);
+      }
+      if (apply != r.strings.size())
+        throw runtime_error("Graph: malformed op " + to_string(r.code));
+      return new op::Fused<T>(in, program);
+    }
+  }
+  throw runtime_error("Graph: unknown op code " + to_string(r.code));
+}
+
+template<typename T>
+Variable<T> * Graph<T>::Input(const string & name) const {
+  auto it = inputs.find(name);
+  if (it == inputs.end())
+    throw runtime_error("Graph: no input named " + name);
+  return it->second;
+}
+
+}  // namespace graph_file
+
+}  // namespace jb
+
+#endif  // JB_GRAPH_FILE_H
@@ -0,0 +1,112 @@
+#ifndef JB_HALF_H
+#define JB_HALF_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace jb {
+
+namespace half {
+
+// 16-bit floating point storage types.  Values convert to and from float
+// (rounding to nearest even), and arithmetic happens in float: these halve
+// the memory and bandwidth of Float32 tensors, they do not compute faster.
+//
+//   Float16   IEEE binary16: 5 exponent bits, 10 mantissa bits, relative
+//             rounding error <= 2^-11, finite range +-65504
+//   BFloat16  the top half of a float: 8 exponent bits, 7 mantissa bits,
+//             relative rounding error <= 2^-8, Float32's range
+
+// UTILITY FUNCTIONS
+
+inline uint32_t FloatBits(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+inline float BitsFloat(uint32_t u) {
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+// CONVERSIONS
+
+inline uint16_t FloatToHalf(float f) {
+#if defined(__F16C__)
+  return _cvtss_sh(f, 0);
+#else
+  uint32_t u = FloatBits(f);
+  uint32_t sign = (u >> 16) & 0x8000;
+  u &= 0x7fffffff;
+  if (u >= 0x47800000)  // 2^16 and up: inf or NaN (quieted)
+    return sign | (u > 0x7f800000 ? 0x7e00 : 0x7c00);
+  if (u < 0x38800000) {
+    // subnormal half: adding 0.5 aligns the mantissa so the float adder
+    // does the rounding
+    return sign | (FloatBits(BitsFloat(u) + 0.5f) - 0x3f000000);
+  }
+  uint32_t odd = (u >> 13) & 1;
+  u += ((uint32_t) (15 - 127) << 23) + 0xfff + odd;  // rebias, round
+  return sign | (u >> 13);
+#endif
+}
+
+inline float HalfToFloat(uint16_t h) {
+#if defined(__F16C__)
+  return _cvtsh_ss(h);
+#else
+  const uint32_t kExponent = 0x7c00 << 13;
+  uint32_t u = (uint32_t) (h & 0x7fff) << 13;
+  uint32_t exponent = u & kExponent;
+  u += (uint32_t) (127 - 15) << 23;
+  if (exponent == kExponent) {
+    u += (uint32_t) (128 - 16) << 23;  // inf or NaN
+  } else if (exponent == 0) {
+    u += 1 << 23;  // subnormal: renormalize through the float unit
+    u = FloatBits(BitsFloat(u) - BitsFloat(113 << 23));
+  }
+  return BitsFloat(u | (uint32_t) (h & 0x8000) << 16);
+#endif
+}
+
+inline uint16_t FloatToBFloat16(float f) {
+  uint32_t u = FloatBits(f);
+  if ((u & 0x7fffffff) > 0x7f800000)
+    return (u >> 16) | 0x40;  // NaN stays NaN
+  u += 0x7fff + ((u >> 16) & 1);
+  return u >> 16;
+}
+
+inline float BFloat16ToFloat(uint16_t b) {
+  return BitsFloat((uint32_t) b << 16);
+}
+
+// TYPES
+
+struct Float16 {
+  uint16_t bits;
+  Float16() : bits(0) {};
+  Float16(float f) : bits(FloatToHalf(f)) {};
+  operator float() const { return HalfToFloat(bits); }
+};
+
+struct BFloat16 {
+  uint16_t bits;
+  BFloat16() : bits(0) {};
+  BFloat16(float f) : bits(FloatToBFloat16(f)) {};
+  operator float() const { return BFloat16ToFloat(bits); }
+};
+
+}  // namespace half
+
+}  // namespace jb
+
+#endif  // JB_HALF_H
@@ -2,8 +2,13 @@
 #define JB_OP_H
 
 #include <vector>
+#include <string>
 #include <unordered_map>
+#include <stdexcept>
 
+#include "src/activation.h"
+#include "src/quantize.h"
+#include "src/sparse.h"
 #include "src/tensor.h"
 
 using namespace std;
@@ -13,14 +18,62 @@ namespace jb {
 
 namespace op {
 
+// Ops compute their value in Compute() from the values of their inputs only,
+// without touching shared state, so independent ops may run concurrently.
+// Evaluate() is the map based entry point built on top of it.
+//
+// Ops that can report their output shape up front (OutputShape() returns a
+// non-empty shape) may have their output preallocated by the session's
+// memory planner and written through ComputeInto().  InPlace() ops may be
+// handed an output that shares the buffer of their first input.
+//
+// Backward() is the reverse mode counterpart of Compute(): given the
+// gradient of the loss with respect to the op's output, it adds the gradient
+// with respect to input k into *input_grads[k] (null when that input needs
+// none).  Gradients have their input's shape, so broadcast dimensions are
+// summed out, and are accumulated rather than assigned so that values with
+// several consumers collect every contribution in one preallocated buffer.
+
 template<typename T>
 class Op {
 public:
   Op() {};
-  virtual const Tensor<T> & Evaluate(unordered_map<Op<T> *, Tensor<T>> &) = 0;
+  virtual ~Op() {};
+  virtual const Tensor<T> & Evaluate(unordered_map<Op<T> *, Tensor<T>> &);
+  virtual Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) = 0;
+  virtual void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                           Tensor<T> & output) {
+    output = Compute(inputs);
+  }
+  virtual vector<int> OutputShape(const vector<vector<int>> & input_shapes) {
+    return {};  // unknown
+  }
+  virtual bool InPlace() { return false; }
+  virtual void Backward(const vector<const Tensor<T> *> & inputs,
+                        const Tensor<T> & output, const Tensor<T> & output_grad,
+                        const vector<Tensor<T> *> & input_grads) {
+    throw runtime_error(string(Type()) + ": backward is not implemented");
+  }
+  // Name of the op type and estimated floating point operations, for
+  // profiling.
+  virtual const char * Type() { return "Op"; }
+  virtual double Flops(const vector<const Tensor<T> *> & inputs,
+                       const Tensor<T> & output) {
+    return 0;
+  }
   virtual vector<Op<T> *> Inputs() = 0;
 };
 
+template<typename T>
+const Tensor<T> & Op<T>::Evaluate(unordered_map<Op<T> *, Tensor<T>> & values) {
+  vector<const Tensor<T> *> inputs;
+  for (auto input : Inputs())
+    inputs.push_back(&values[input]);
+  Tensor<T> value = Compute(inputs);
+  values[this] = value;
+  return values[this];
+}
+
 // OP SUBCLASSES
 
 template<typename T>
@@ -35,18 +88,69 @@ public:
     values[this] = value;
     return values[this];
   }
+  Tensor<T> Compute(const vector<const Tensor<T> *> &) override {
+    throw runtime_error("Variable: value must be assigned, not computed");
+  }
+  const char * Type() override { return "Variable"; }
+  vector<Op<T> *> Inputs() { return {}; }
+};
+
+// A precomputed value, such as a constant folded subgraph.
+template<typename T>
+class Constant : public Op<T> {
+public:
+  Constant(const Tensor<T> & value) : value(value) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> &) override {
+    return value;
+  }
+  const char * Type() override { return "Constant"; }
+  vector<int> OutputShape(const vector<vector<int>> &) override {
+    return value.Shape();
+  }
   vector<Op<T> *> Inputs() { return {}; }
+  const Tensor<T> & Value() { return value; };
+private:
+  Tensor<T> value;
 };
 
 template<typename T>
 class Add : public Op<T> {
 public:
   Add(vector<Op<T> *> inputs) : inputs(inputs) {};
-  const Tensor<T> & Evaluate(unordered_map<Op<T> *, Tensor<T>> & values) override {
-    values[this] = values[Inputs()[0]];
-    for (int i = 1; i < Inputs().size(); i++)
-      values[this] = tensor::Add(values[this], values[Inputs()[i]]);
-    return values[this];
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    Tensor<T> value = *inputs[0];
+    for (int i = 1; i < inputs.size(); i++)
+      value = tensor::Add(value, *inputs[i]);
+    return value;
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    if (inputs.size() == 1)
+      Move(*inputs[0], output);
+    else
+      tensor::Add(*inputs[0], *inputs[1], output);
+    for (int i = 2; i < inputs.size(); i++)
+      tensor::Add(output, *inputs[i], output);
+  }
+  const char * Type() override { return "Add"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return (double) output.Size() * (inputs.size() - 1);
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    vector<int> shape = input_shapes[0];
+    for (int i = 1; i < input_shapes.size(); i++)
+      shape = elementwise::BroadcastShape(shape, input_shapes[i]);
+    return shape;
+  }
+  bool InPlace() override { return true; }
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    for (auto grad : input_grads) {
+      if (grad)
+        Accumulate(output_grad, *grad);
+    }
   }
   vector<Op<T> *> Inputs() { return inputs; };
 private:
@@ -57,17 +161,656 @@ template<typename T>
 class Multiply : public Op<T> {
 public:
   Multiply(vector<Op<T> *> inputs) : inputs(inputs) {};
-  const Tensor<T> & Evaluate(unordered_map<Op<T> *, Tensor<T>> & values) override {
-    values[this] = values[Inputs()[0]];
-    for (int i = 1; i < Inputs().size(); i++)
-      values[this] = tensor::Multiply(values[this], values[Inputs()[i]]);
-    return values[this];
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    Tensor<T> value = *inputs[0];
+    for (int i = 1; i < inputs.size(); i++)
+      value = tensor::Multiply(value, *inputs[i]);
+    return value;
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    if (inputs.size() == 1)
+      Move(*inputs[0], output);
+    else
+      tensor::Multiply(*inputs[0], *inputs[1], output);
+    for (int i = 2; i < inputs.size(); i++)
+      tensor::Multiply(output, *inputs[i], output);
+  }
+  const char * Type() override { return "Multiply"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return (double) output.Size() * (inputs.size() - 1);
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    vector<int> shape = input_shapes[0];
+    for (int i = 1; i < input_shapes.size(); i++)
+      shape = elementwise::BroadcastShape(shape, input_shapes[i]);
+    return shape;
+  }
+  bool InPlace() override { return true; }
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    for (int k = 0; k < inputs.size(); k++) {
+      if (!input_grads[k])
+        continue;
+      if (inputs.size() == 2) {
+        MultiplyAccumulate(output_grad, *inputs[1 - k], *input_grads[k]);
+        continue;
+      }
+      // product of the other inputs; only n-ary products allocate
+      Tensor<T> others = output_grad;
+      for (int j = 0; j < inputs.size(); j++) {
+        if (j != k)
+          others = tensor::Multiply(others, *inputs[j]);
+      }
+      Accumulate(others, *input_grads[k]);
+    }
   }
   vector<Op<T> *> Inputs() { return inputs; };
 private:
   vector<Op<T> *> inputs;
 };
 
+// f applied to every element.  Differentiable when the derivative df is
+// given.
+template<typename T>
+class Apply : public Op<T> {
+public:
+  Apply(Op<T> * input, T (*f)(T), T (*df)(T) = nullptr)
+      : input(input), f(f), df(df) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::Apply(*inputs[0], f);
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    tensor::Apply(*inputs[0], f, output);
+  }
+  const char * Type() override { return "Apply"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return output.Size();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return input_shapes[0];
+  }
+  bool InPlace() override { return true; }
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (!df)
+      throw runtime_error("Apply: no derivative given");
+    if (input_grads[0])
+      AccumulateHelper(output_grad, *inputs[0], *input_grads[0],
+                       GradientFunctor{df});
+  }
+  vector<Op<T> *> Inputs() { return {input}; };
+  T (*Function())(T) { return f; };
+  T (*Derivative())(T) { return df; };
+private:
+  struct GradientFunctor {
+    T (*df)(T);
+    T operator()(T grad, T g, T x) const { return grad + g * df(x); }
+  };
+  Op<T> * input;
+  T (*f)(T);
+  T (*df)(T);
+};
+
+// An activation::*Functor applied to every element, inlined and vectorized
+// (see src/activation.h for accuracy).  Use through the aliases below:
+// op::Exp<Float32> e(&x).
+template<typename T, typename F>
+class Activation : public Op<T> {
+public:
+  Activation(Op<T> * input) : input(input) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::Apply(*inputs[0], F());
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    tensor::Apply(*inputs[0], F(), output);
+  }
+  const char * Type() override { return F::Name(); }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return output.Size();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return input_shapes[0];
+  }
+  bool InPlace() override { return true; }
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (!input_grads[0])
+      return;
+    // grad += output_grad * f'(x, y) in one pass, without a temporary
+    Tensor<T> & grad = *input_grads[0];
+    NaryHelper({&output_grad, inputs[0], &output}, grad,
+               [](int n, T * o, long so, const T * const * rows,
+                  const long * strides) {
+      const T * g = rows[0];
+      const T * x = rows[1];
+      const T * y = rows[2];
+      if (so == 1 && strides[0] == 1 && strides[1] == 1 && strides[2] == 1) {
+        for (int i = 0; i < n; i++)
+          o[i] += g[i] * F::Derivative(x[i], y[i]);
+      } else {
+        for (long i = 0; i < n; i++)
+          o[i * so] += g[i * strides[0]] *
+                       F::Derivative(x[i * strides[1]], y[i * strides[2]]);
+      }
+    });
+  }
+  vector<Op<T> *> Inputs() { return {input}; };
+private:
+  Op<T> * input;
+};
+
+template<typename T>
+using Exp = Activation<T, activation::ExpFunctor>;
+template<typename T>
+using Log = Activation<T, activation::LogFunctor>;
+template<typename T>
+using Tanh = Activation<T, activation::TanhFunctor>;
+template<typename T>
+using Sigmoid = Activation<T, activation::SigmoidFunctor>;
+template<typename T>
+using Gelu = Activation<T, activation::GeluFunctor>;
+
+template<typename T>
+class MatrixMultiply : public Op<T> {
+public:
+  MatrixMultiply(Op<T> * a, Op<T> * b) : a(a), b(b) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::MatrixMultiply(*inputs[0], *inputs[1]);
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    Fill(output, (T) 0);
+    MatrixMultiplyAccumulate(*inputs[0], *inputs[1], output);
+  }
+  const char * Type() override { return "MatrixMultiply"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return 2.0 * output.Size() * inputs[0]->Shape()[1];
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    if (input_shapes[0].size() != 2 || input_shapes[1].size() != 2)
+      throw runtime_error("MatrixMultiply: inputs are not matrices");
+    return {input_shapes[0][0], input_shapes[1][1]};
+  }
+  // dA += dC B^T and dB += A^T dC, with the transposes as strided views
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (input_grads[0])
+      MatrixMultiplyAccumulate(output_grad, Transpose(*inputs[1]),
+                               *input_grads[0]);
+    if (input_grads[1])
+      MatrixMultiplyAccumulate(Transpose(*inputs[0]), output_grad,
+                               *input_grads[1]);
+  }
+  vector<Op<T> *> Inputs() { return {a, b}; };
+private:
+  Op<T> * a;
+  Op<T> * b;
+};
+
+// Convolution of NCHW images x with filters w (o, c / groups, kh, kw), see
+// src/conv.h.  Inference only: there is no Backward.
+template<typename T>
+class Conv2D : public Op<T> {
+public:
+  Conv2D(Op<T> * x, Op<T> * w, const conv::Params & params = conv::Params())
+      : x(x), w(w), params(params) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::Conv2D(*inputs[0], *inputs[1], params);
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    tensor::Conv2D(*inputs[0], *inputs[1], output, params);
+  }
+  const char * Type() override { return "Conv2D"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    const Tensor<T> & filters = *inputs[1];
+    if (filters.Size() == 0)
+      return 0;
+    return 2.0 * output.Size() * (filters.Size() / filters.Shape()[0]);
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return conv::OutputShape(input_shapes[0], input_shapes[1], params);
+  }
+  vector<Op<T> *> Inputs() { return {x, w}; };
+  const conv::Params & Parameters() { return params; };
+private:
+  Op<T> * x;
+  Op<T> * w;
+  conv::Params params;
+};
+
+// x w with w stored as Int8, quantized symmetric per output column when the
+// op is built; x is quantized per tensor on each run.  Reads a quarter of the
+// weight memory of MatrixMultiply.  Inference only: there is no Backward.
+template<typename T>
+class QuantizedMatrixMultiply : public Op<T> {
+public:
+  QuantizedMatrixMultiply(Op<T> * x, const Tensor<T> & w)
+      : x(x), weight_params(quantize::ChooseParams(w, 1, true)),
+        weights(quantize::Quantize(w, weight_params)),
+        column_sums(quantize::ColumnSums(weights)) {};
+  // Weights quantized already, e.g. loaded from a file.
+  QuantizedMatrixMultiply(Op<T> * x, const Tensor<Int8> & weights,
+                          const quantize::Params & weight_params)
+      : x(x), weight_params(weight_params), weights(weights),
+        column_sums(quantize::ColumnSums(weights)) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    quantize::Params params = quantize::ChooseParams(*inputs[0]);
+    return quantize::MatrixMultiply<T>(quantize::Quantize(*inputs[0], params),
+                                       params, weights, weight_params,
+                                       &column_sums);
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    Move(Compute(inputs), output);
+  }
+  const char * Type() override { return "QuantizedMatrixMultiply"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return 2.0 * output.Size() * weights.Shape()[0];
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    if (input_shapes[0].size() != 2)
+      throw runtime_error("QuantizedMatrixMultiply: input is not a matrix");
+    return {input_shapes[0][0], weights.Shape()[1]};
+  }
+  const Tensor<Int8> & Weights() const { return weights; }
+  const quantize::Params & WeightParams() const { return weight_params; }
+  vector<Op<T> *> Inputs() { return {x}; };
+private:
+  Op<T> * x;
+  quantize::Params weight_params;
+  Tensor<Int8> weights;
+  Tensor<Int32> column_sums;
+};
+
+// Product of a sparse matrix held by the op (pruned weights, adjacency or
+// feature matrices) with a dense input, on either side: a x, or x a when
+// built with the input first.  Costs scale with a's nonzeros.
+template<typename T>
+class SparseMatrixMultiply : public Op<T> {
+public:
+  SparseMatrixMultiply(const sparse::Csr<T> & a, Op<T> * x)
+      : x(x), a(a), transposed(sparse::Transpose(a)), left(true) {
+    sparse::Check(a);
+  };
+  SparseMatrixMultiply(Op<T> * x, const sparse::Csr<T> & a)
+      : x(x), a(a), transposed(sparse::Transpose(a)), left(false) {
+    sparse::Check(a);
+  };
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return left ? sparse::MatrixMultiply(a, *inputs[0])
+                : sparse::MatrixMultiply(*inputs[0], a);
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    Fill(output, (T) 0);
+    if (left)
+      sparse::MatrixMultiplyAccumulate(a, *inputs[0], output);
+    else
+      sparse::MatrixMultiplyAccumulate(*inputs[0], a, output);
+  }
+  const char * Type() override { return "SparseMatrixMultiply"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    int other = output.NumDimension() == 2 ? output.Shape()[left ? 1 : 0] : 0;
+    return 2.0 * a.NonZeros() * other;
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    if (input_shapes[0].size() != 2)
+      throw runtime_error("SparseMatrixMultiply: input is not a matrix");
+    return left ? vector<int>({a.rows, input_shapes[0][1]})
+                : vector<int>({input_shapes[0][0], a.cols});
+  }
+  // dx += a^T dC, or dC a^T
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (!input_grads[0])
+      return;
+    if (left)
+      sparse::MatrixMultiplyAccumulate(transposed, output_grad,
+                                       *input_grads[0]);
+    else
+      sparse::MatrixMultiplyAccumulate(output_grad, transposed,
+                                       *input_grads[0]);
+  }
+  vector<Op<T> *> Inputs() { return {x}; };
+  const sparse::Csr<T> & Matrix() const { return a; }
+private:
+  Op<T> * x;
+  sparse::Csr<T> a;
+  sparse::Csr<T> transposed;
+  bool left;
+};
+
+// x + a for a sparse a held by the op.  In place, only a's nonzeros are
+// touched.
+template<typename T>
+class SparseAdd : public Op<T> {
+public:
+  SparseAdd(Op<T> * x, const sparse::Csr<T> & a) : x(x), a(a) {
+    sparse::Check(a);
+  };
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return sparse::Add(*inputs[0], a);
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    const Tensor<T> & input = *inputs[0];
+    if (&input.Data() != &output.Data() ||
+        input.DataIndex({}) != output.DataIndex({}))
+      Move(input, output);
+    sparse::Accumulate(a, output);
+  }
+  const char * Type() override { return "SparseAdd"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return a.NonZeros();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    if (input_shapes[0] != a.Shape())
+      throw runtime_error("SparseAdd: input does not match the shape");
+    return input_shapes[0];
+  }
+  bool InPlace() override { return true; }
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (input_grads[0])
+      Accumulate(output_grad, *input_grads[0]);
+  }
+  vector<Op<T> *> Inputs() { return {x}; };
+  const sparse::Csr<T> & Matrix() const { return a; }
+private:
+  Op<T> * x;
+  sparse::Csr<T> a;
+};
+
+// x * a for a sparse a held by the op: zero outside a's nonzeros, so the
+// output is filled and then written at the nonzeros only.
+template<typename T>
+class SparseMultiply : public Op<T> {
+public:
+  SparseMultiply(Op<T> * x, const sparse::Csr<T> & a) : x(x), a(a) {
+    sparse::Check(a);
+  };
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return sparse::ToDense(sparse::Multiply(*inputs[0], a));
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override {
+    sparse::Csr<T> product = sparse::Multiply(*inputs[0], a);
+    Fill(output, (T) 0);
+    sparse::Accumulate(product, output);
+  }
+  const char * Type() override { return "SparseMultiply"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return a.NonZeros();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    if (input_shapes[0] != a.Shape())
+      throw runtime_error("SparseMultiply: input does not match the shape");
+    return input_shapes[0];
+  }
+  // dx += dC * a, at a's nonzeros
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (input_grads[0])
+      sparse::Accumulate(sparse::Multiply(output_grad, a), *input_grads[0]);
+  }
+  vector<Op<T> *> Inputs() { return {x}; };
+  const sparse::Csr<T> & Matrix() const { return a; }
+private:
+  Op<T> * x;
+  sparse::Csr<T> a;
+};
+
+// Reductions over `axes` (every axis when empty), see tensor::Sum.
+template<typename T>
+class Sum : public Op<T> {
+public:
+  Sum(Op<T> * input, vector<int> axes = {}, bool keep_dims = false)
+      : input(input), axes(axes), keep_dims(keep_dims) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::Sum(*inputs[0], axes, keep_dims);
+  }
+  const char * Type() override { return "Sum"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return inputs[0]->Size();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return reduce::ReducedShape(input_shapes[0], axes, keep_dims);
+  }
+  // every input element receives the gradient of its output
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (!input_grads[0])
+      return;
+    Tensor<T> grad = View(output_grad, reduce::ReducedShape(
+        inputs[0]->Shape(), axes, true));
+    AccumulateHelper(grad, *inputs[0], *input_grads[0], ScaledAddFunctor{1});
+  }
+  vector<Op<T> *> Inputs() { return {input}; };
+  const vector<int> & Axes() { return axes; };
+  bool KeepDims() { return keep_dims; };
+private:
+  struct ScaledAddFunctor {
+    T scale;
+    T operator()(T grad, T g, T) const { return grad + g * scale; }
+  };
+  Op<T> * input;
+  vector<int> axes;
+  bool keep_dims;
+};
+
+template<typename T>
+class Mean : public Op<T> {
+public:
+  Mean(Op<T> * input, vector<int> axes = {}, bool keep_dims = false)
+      : input(input), axes(axes), keep_dims(keep_dims) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::Mean(*inputs[0], axes, keep_dims);
+  }
+  const char * Type() override { return "Mean"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return inputs[0]->Size();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return reduce::ReducedShape(input_shapes[0], axes, keep_dims);
+  }
+  void Backward(const vector<const Tensor<T> *> & inputs,
+                const Tensor<T> & output, const Tensor<T> & output_grad,
+                const vector<Tensor<T> *> & input_grads) override {
+    if (!input_grads[0])
+      return;
+    Tensor<T> grad = View(output_grad, reduce::ReducedShape(
+        inputs[0]->Shape(), axes, true));
+    T scale = (T) 1 / (T) reduce::ReducedCount(inputs[0]->Shape(), axes);
+    AccumulateHelper(grad, *inputs[0], *input_grads[0],
+                     ScaledAddFunctor{scale});
+  }
+  vector<Op<T> *> Inputs() { return {input}; };
+  const vector<int> & Axes() { return axes; };
+  bool KeepDims() { return keep_dims; };
+private:
+  struct ScaledAddFunctor {
+    T scale;
+    T operator()(T grad, T g, T) const { return grad + g * scale; }
+  };
+  Op<T> * input;
+  vector<int> axes;
+  bool keep_dims;
+};
+
+template<typename T>
+class Max : public Op<T> {
+public:
+  Max(Op<T> * input, vector<int> axes = {}, bool keep_dims = false)
+      : input(input), axes(axes), keep_dims(keep_dims) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::Max(*inputs[0], axes, keep_dims);
+  }
+  const char * Type() override { return "Max"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return inputs[0]->Size();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return reduce::ReducedShape(input_shapes[0], axes, keep_dims);
+  }
+  vector<Op<T> *> Inputs() { return {input}; };
+  const vector<int> & Axes() { return axes; };
+  bool KeepDims() { return keep_dims; };
+private:
+  Op<T> * input;
+  vector<int> axes;
+  bool keep_dims;
+};
+
+// Graphs carry a single element type, so indices are stored as T.
+template<typename T>
+class ArgMax : public Op<T> {
+public:
+  ArgMax(Op<T> * input, int axis, bool keep_dims = false)
+      : input(input), axis(axis), keep_dims(keep_dims) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    return tensor::ArgMax<T, T>(*inputs[0], axis, keep_dims);
+  }
+  const char * Type() override { return "ArgMax"; }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    return reduce::ReducedShape(input_shapes[0], {axis}, keep_dims);
+  }
+  vector<Op<T> *> Inputs() { return {input}; };
+  int Axis() { return axis; };
+  bool KeepDims() { return keep_dims; };
+private:
+  Op<T> * input;
+  int axis;
+  bool keep_dims;
+};
+
+// Elementwise expression over several inputs, evaluated in a single pass.
+// The program is in SSA form: registers 0 .. inputs - 1 hold the inputs and
+// instruction i writes register inputs + i; the last register is the value.
+// Rows are processed in blocks small enough for every register to stay in
+// L1, so memory is touched once per input and once for the output.
+template<typename T>
+class Fused : public Op<T> {
+public:
+  enum Code { kAdd, kMultiply, kApply };
+  struct Instruction {
+    Code code;
+    int a;
+    int b;
+    T (*f)(T);
+  };
+  static const int kBlock = 256;
+
+  Fused(vector<Op<T> *> inputs, vector<Instruction> program)
+      : inputs(inputs), program(program) {};
+  Tensor<T> Compute(const vector<const Tensor<T> *> & inputs) override {
+    vector<vector<int>> input_shapes;
+    for (auto input : inputs)
+      input_shapes.push_back(input->Shape());
+    Tensor<T> output = Empty<T>(OutputShape(input_shapes));
+    ComputeInto(inputs, output);
+    return output;
+  }
+  void ComputeInto(const vector<const Tensor<T> *> & inputs,
+                   Tensor<T> & output) override;
+  const char * Type() override { return "Fused"; }
+  double Flops(const vector<const Tensor<T> *> & inputs,
+               const Tensor<T> & output) override {
+    return (double) output.Size() * program.size();
+  }
+  vector<int> OutputShape(const vector<vector<int>> & input_shapes) override {
+    vector<int> shape = input_shapes[0];
+    for (int i = 1; i < input_shapes.size(); i++)
+      shape = elementwise::BroadcastShape(shape, input_shapes[i]);
+    return shape;
+  }
+  // every block is read before it is written
+  bool InPlace() override { return true; }
+  vector<Op<T> *> Inputs() { return inputs; };
+  const vector<Instruction> & Program() { return program; };
+private:
+  vector<Op<T> *> inputs;
+  vector<Instruction> program;
+};
+
+template<typename T>
+const int Fused<T>::kBlock;
+
+template<typename T>
+void Fused<T>::ComputeInto(const vector<const Tensor<T> *> & inputs,
+                           Tensor<T> & output) {
+  int nin = inputs.size();
+  int nreg = nin + program.size();
+  vector<T> scratch(nreg * kBlock);
+  vector<const T *> reg(nreg);
+  NaryHelper(inputs, output, [&](int n, T * o, long so,
+                                 const T * const * rows, const long * strides) {
+    for (int start = 0; start < n; start += kBlock) {
+      int m = min(kBlock, n - start);
+      // contiguous inputs are read in place, others gathered
+      for (int k = 0; k < nin; k++) {
+        const T * row = rows[k] + start * strides[k];
+        if (strides[k] == 1) {
+          reg[k] = row;
+        } else {
+          T * r = scratch.data() + k * kBlock;
+          for (int i = 0; i < m; i++)
+            r[i] = row[i * strides[k]];
+          reg[k] = r;
+        }
+      }
+      for (int j = 0; j < program.size(); j++) {
+        const Instruction & ins = program[j];
+        T * r = scratch.data() + (nin + j) * kBlock;
+        const T * a = reg[ins.a];
+        const T * b = reg[ins.b];
+        switch (ins.code) {
+          case kAdd:
+            for (int i = 0; i < m; i++)
+              r[i] = a[i] + b[i];
+            break;
+          case kMultiply:
+            for (int i = 0; i < m; i++)
+              r[i] = a[i] * b[i];
+            break;
+          case kApply:
+            for (int i = 0; i < m; i++)
+              r[i] = ins.f(a[i]);
+            break;
+        }
+        reg[nin + j] = r;
+      }
+      const T * result = reg[nreg - 1];
+      T * out = o + start * so;
+      for (int i = 0; i < m; i++)
+        out[i * so] = result[i];
+    }
+  });
+}
+
 }  // namespace op
 
 }  // namespace jb
@@ -0,0 +1,124 @@
+#ifndef JB_PARALLEL_H
+#define JB_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "src/thread_pool.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace parallel {
+
+// Intra-op parallelism.  Large kernels split their loops into chunks that
+// run on one process wide work-stealing pool (src/thread_pool.h), created on
+// first use with a thread per hardware thread; SetNumThreads() resizes it.
+// The calling thread works on the chunks as well and then waits only for
+// the chunks other threads have already started, so loops nest (a chunk may
+// run a parallel loop of its own) and never deadlock on a busy pool.  Loops
+// touching fewer than two grains of elements run on the caller alone, as
+// waking other threads would cost more than it saves.
+
+const long kGrain = 1 << 17;     // elements touched per chunk, at least
+const int kChunksPerThread = 4;  // chunks are claimed dynamically
+
+struct Pool {
+  int threads = 0;  // 0: one per hardware thread
+  unique_ptr<thread_pool::ThreadPool> workers;
+  mutex lock;
+};
+
+Pool & GlobalPool() {
+  static Pool pool;
+  return pool;
+}
+
+// Threads running parallel loops, the caller included; 0 for one per
+// hardware thread.  Not to be called while loops run.
+void SetNumThreads(int n) {
+  Pool & pool = GlobalPool();
+  lock_guard<mutex> guard(pool.lock);
+  pool.threads = max(n, 0);
+  pool.workers.reset();
+}
+
+int NumThreads() {
+  int n = GlobalPool().threads;
+  return n > 0 ? n : max(1, (int) thread::hardware_concurrency());
+}
+
+// The pool's workers, NumThreads() - 1 of them.
+thread_pool::ThreadPool & Workers() {
+  Pool & pool = GlobalPool();
+  lock_guard<mutex> guard(pool.lock);
+  if (!pool.workers)
+    pool.workers.reset(new thread_pool::ThreadPool(NumThreads() - 1));
+  return *pool.workers;
+}
+
+// A parallel loop, shared with the tasks helping with it.  Tasks may start
+// after the loop is over: they then find no chunk left and never touch the
+// loop body.
+struct Job {
+  long chunks = 0;
+  atomic<long> next{0};
+  atomic<long> done{0};
+  mutex lock;
+  condition_variable finished;
+  exception_ptr error;
+};
+
+// Calls f(begin, end) on contiguous ranges covering [0, n), spread over the
+// pool in chunks of at least `grain` of the `work` (elements touched) the
+// whole loop does.  Exceptions thrown by f reach the caller.
+template<typename F>
+void ParallelFor(long n, long work, F f, long grain = kGrain) {
+  int threads = NumThreads();
+  long chunks = min(min(n, work / max(grain, 1L)),
+                    (long) threads * kChunksPerThread);
+  if (threads <= 1 || chunks <= 1) {
+    f(0L, n);
+    return;
+  }
+  auto job = make_shared<Job>();
+  job->chunks = chunks;
+  F * body = &f;
+  auto run = [job, body, n] {
+    long c;
+    while ((c = job->next++) < job->chunks) {
+      try {
+        (*body)(n * c / job->chunks, n * (c + 1) / job->chunks);
+      } catch (...) {
+        lock_guard<mutex> guard(job->lock);
+        if (!job->error)
+          job->error = current_exception();
+      }
+      if (++job->done == job->chunks) {
+        lock_guard<mutex> guard(job->lock);
+        job->finished.notify_all();
+      }
+    }
+  };
+  thread_pool::ThreadPool & workers = Workers();
+  long helpers = min((long) workers.NumWorkers(), chunks - 1);
+  for (long h = 0; h < helpers; h++)
+    workers.Submit(run);
+  run();
+  unique_lock<mutex> guard(job->lock);
+  job->finished.wait(guard, [&] { return job->done == job->chunks; });
+  if (job->error)
+    rethrow_exception(job->error);
+}
+
+}  // namespace parallel
+
+}  // namespace jb
+
+#endif  // JB_PARALLEL_H
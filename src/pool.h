@@ -0,0 +1,260 @@
+#ifndef JB_POOL_H
+#define JB_POOL_H
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace jb {
+
+namespace pool {
+
+// Pooled, aligned buffers for tensor storage.  A graph run over and over
+// allocates and frees the same handful of sizes, so freed buffers are kept
+// for reuse instead of going back to the system.  Sizes are rounded up to
+// classes four per power of two (at most 25% waste), and every buffer is
+// 64-byte aligned, a cache line and a full AVX-512 vector.
+//
+// Buffers up to kThreadCacheBytes are cached per thread first, so that the
+// common small allocation takes no lock; a thread's cache overflows into,
+// and on exit drains into, the shared pool.  The shared pool keeps at most
+// SetCacheLimit() bytes and frees anything beyond.  With SetHugePages(true)
+// buffers of kHugePage or more are aligned to huge pages and advised as
+// such (transparent huge pages: the kernel may or may not comply).
+//
+// GetStats() counts the buffers taken from and returned to the system,
+// which stop growing once a steady workload has populated the pool.
+
+const long kAlignment = 64;
+const long kHugePage = 2 << 20;
+const long kThreadCacheBytes = 256 << 10;
+const int kThreadCacheEntries = 8;  // per size class
+const int kClasses = 4 + 4 * 54;    // 64, 128, 192, 256, then up to 2^62
+
+struct Stats {
+  long allocations = 0;         // Allocate() calls
+  long pool_hits = 0;           // ... served from a cached buffer
+  long system_allocations = 0;  // buffers obtained from the system
+  long system_frees = 0;        // buffers returned to the system
+  long huge_page_allocations = 0;
+  long bytes_in_use = 0;        // by live buffers, rounded to their class
+  long bytes_cached = 0;        // in the shared pool
+};
+
+// UTILITY FUNCTIONS
+
+// Size class of a request of `bytes`; sets `size` to the class's size.
+int SizeClass(long bytes, long & size) {
+  long b = bytes <= 0 ? kAlignment
+                      : (bytes + kAlignment - 1) / kAlignment * kAlignment;
+  if (b <= 4 * kAlignment) {
+    size = b;
+    return b / kAlignment - 1;
+  }
+  int p = 63 - __builtin_clzl(b - 1);  // 2^p < b <= 2^(p + 1), p >= 8
+  long step = 1L << (p - 2);
+  long k = (b - (1L << p) + step - 1) / step;
+  size = (1L << p) + k * step;
+  return 4 + (p - 8) * 4 + (k - 1);
+}
+
+// Inverse of SizeClass: the largest request in class c.
+long ClassSize(int c) {
+  if (c < 4)
+    return (c + 1) * kAlignment;
+  long base = 1L << ((c - 4) / 4 + 8);
+  return base + ((c - 4) % 4 + 1) * (base / 4);
+}
+
+// POOL
+
+class Pool {
+public:
+  void * Allocate(long bytes);
+  void Free(void * p, long bytes);
+  void Trim();
+  Stats GetStats();
+  void SetCacheLimit(long bytes) { cache_limit = bytes; Trim(); }
+  void SetHugePages(bool enable) { huge_pages = enable; }
+
+  static Pool & Default();
+
+private:
+  struct ThreadCache {
+    ~ThreadCache();
+    vector<void *> buffers[kClasses];
+  };
+  Pool() {}
+  ThreadCache * LocalCache();
+  void * SystemAllocate(long size);
+  void SystemFree(void * p);
+  void Release(void * p, int c);
+
+  mutex lock;
+  vector<void *> buffers[kClasses];
+  long cached = 0;  // guarded by lock
+  atomic<long> cache_limit{1L << 30};
+  atomic<bool> huge_pages{false};
+  atomic<long> allocations{0}, pool_hits{0}, system_allocations{0},
+      system_frees{0}, huge_page_allocations{0}, in_use{0};
+};
+
+// Never destroyed: tensors in static storage may be freed after any other
+// static object.
+Pool & Pool::Default() {
+  static Pool * pool = new Pool();
+  return *pool;
+}
+
+// Set while the calling thread's cache is being or has been destroyed, so
+// that tensors freed later in thread exit go straight to the shared pool.
+thread_local bool thread_cache_gone = false;
+
+Pool::ThreadCache * Pool::LocalCache() {
+  if (thread_cache_gone)
+    return nullptr;
+  static thread_local ThreadCache cache;
+  return &cache;
+}
+
+Pool::ThreadCache::~ThreadCache() {
+  thread_cache_gone = true;
+  for (int c = 0; c < kClasses; c++) {
+    for (auto p : buffers[c])
+      Default().Release(p, c);
+  }
+}
+
+void * Pool::SystemAllocate(long size) {
+  bool huge = huge_pages && size >= kHugePage;
+  void * p = nullptr;
+  if (posix_memalign(&p, huge ? kHugePage : kAlignment, size) != 0)
+    throw bad_alloc();
+  if (huge) {
+    madvise(p, size, MADV_HUGEPAGE);  // advisory, failure is harmless
+    huge_page_allocations++;
+  }
+  system_allocations++;
+  return p;
+}
+
+void Pool::SystemFree(void * p) {
+  free(p);
+  system_frees++;
+}
+
+void * Pool::Allocate(long bytes) {
+  if (bytes > ClassSize(kClasses - 1))
+    throw bad_alloc();
+  long size;
+  int c = SizeClass(bytes, size);
+  allocations++;
+  in_use += size;
+  ThreadCache * local = size <= kThreadCacheBytes ? LocalCache() : nullptr;
+  if (local && !local->buffers[c].empty()) {
+    void * p = local->buffers[c].back();
+    local->buffers[c].pop_back();
+    pool_hits++;
+    return p;
+  }
+  {
+    lock_guard<mutex> guard(lock);
+    if (!buffers[c].empty()) {
+      void * p = buffers[c].back();
+      buffers[c].pop_back();
+      cached -= size;
+      pool_hits++;
+      return p;
+    }
+  }
+  return SystemAllocate(size);
+}
+
+void Pool::Free(void * p, long bytes) {
+  long size;
+  int c = SizeClass(bytes, size);
+  in_use -= size;
+  ThreadCache * local = size <= kThreadCacheBytes ? LocalCache() : nullptr;
+  if (local && (int) local->buffers[c].size() < kThreadCacheEntries) {
+    local->buffers[c].push_back(p);
+    return;
+  }
+  Release(p, c);
+}
+
+// Caches a buffer of class c in the shared pool, or frees it when the pool
+// is full.
+void Pool::Release(void * p, int c) {
+  long size = ClassSize(c);
+  {
+    lock_guard<mutex> guard(lock);
+    if (cached + size <= cache_limit) {
+      buffers[c].push_back(p);
+      cached += size;
+      return;
+    }
+  }
+  SystemFree(p);
+}
+
+// Returns the shared pool's and the calling thread's cached buffers to the
+// system.
+void Pool::Trim() {
+  ThreadCache * local = LocalCache();
+  vector<void *> freed;
+  {
+    lock_guard<mutex> guard(lock);
+    for (int c = 0; c < kClasses; c++) {
+      freed.insert(freed.end(), buffers[c].begin(), buffers[c].end());
+      buffers[c].clear();
+      if (local) {
+        freed.insert(freed.end(), local->buffers[c].begin(),
+                     local->buffers[c].end());
+        local->buffers[c].clear();
+      }
+    }
+    cached = 0;
+  }
+  for (auto p : freed)
+    SystemFree(p);
+}
+
+Stats Pool::GetStats() {
+  Stats s;
+  s.allocations = allocations;
+  s.pool_hits = pool_hits;
+  s.system_allocations = system_allocations;
+  s.system_frees = system_frees;
+  s.huge_page_allocations = huge_page_allocations;
+  s.bytes_in_use = in_use;
+  lock_guard<mutex> guard(lock);
+  s.bytes_cached = cached;
+  return s;
+}
+
+// DEFAULT POOL
+
+void * Allocate(long bytes) { return Pool::Default().Allocate(bytes); }
+
+// `bytes` must be the size the buffer was allocated with.
+void Free(void * p, long bytes) { Pool::Default().Free(p, bytes); }
+
+void Trim() { Pool::Default().Trim(); }
+
+Stats GetStats() { return Pool::Default().GetStats(); }
+
+void SetCacheLimit(long bytes) { Pool::Default().SetCacheLimit(bytes); }
+
+void SetHugePages(bool enable) { Pool::Default().SetHugePages(enable); }
+
+}  // namespace pool
+
+}  // namespace jb
+
+#endif  // JB_POOL_H
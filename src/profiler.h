@@ -0,0 +1,142 @@
+#ifndef JB_PROFILER_H
+#define JB_PROFILER_H
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace jb {
+
+namespace profiler {
+
+// Collects one event per op evaluation when attached to a session
+// (Session::SetProfiler).  Sessions without a profiler only pay a null
+// pointer check per op.  Recording is thread safe, so parallel runs can be
+// profiled; export the events as a Chrome trace (chrome://tracing, Perfetto)
+// or aggregate them per op type.
+
+struct OpEvent {
+  string type;
+  int slot;
+  long start_ns;
+  long duration_ns;
+  int thread;
+  vector<int> shape;
+  long bytes;  // allocated for the output, 0 when written into a buffer
+  double flops;
+};
+
+struct OpSummary {
+  string type;
+  long count = 0;
+  long total_ns = 0;
+  long bytes = 0;
+  double flops = 0;
+};
+
+class Profiler {
+public:
+  typedef chrono::steady_clock Clock;
+  Profiler() : origin(Clock::now()) {};
+  long Now() const;
+  void Record(OpEvent event);
+  vector<OpEvent> Events() const;
+  vector<OpSummary> Summary() const;
+  void WriteChromeTrace(ostream & out) const;
+  void WriteChromeTrace(const string & path) const;
+  void Clear();
+private:
+  Clock::time_point origin;
+  mutable mutex lock;
+  vector<OpEvent> events;
+  map<thread::id, int> threads;
+};
+
+long Profiler::Now() const {
+  return chrono::duration_cast<chrono::nanoseconds>(Clock::now() - origin)
+      .count();
+}
+
+// A copy, safe to take while sessions are still recording.
+vector<OpEvent> Profiler::Events() const {
+  lock_guard<mutex> guard(lock);
+  return events;
+}
+
+void Profiler::Record(OpEvent event) {
+  lock_guard<mutex> guard(lock);
+  auto it = threads.find(this_thread::get_id());
+  if (it == threads.end())
+    it = threads.insert({this_thread::get_id(), (int) threads.size()}).first;
+  event.thread = it->second;
+  events.push_back(move(event));
+}
+
+// Per op type totals, slowest first.
+vector<OpSummary> Profiler::Summary() const {
+  lock_guard<mutex> guard(lock);
+  map<string, OpSummary> by_type;
+  for (auto & e : events) {
+    OpSummary & s = by_type[e.type];
+    s.type = e.type;
+    s.count++;
+    s.total_ns += e.duration_ns;
+    s.bytes += e.bytes;
+    s.flops += e.flops;
+  }
+  vector<OpSummary> summary;
+  for (auto & it : by_type)
+    summary.push_back(it.second);
+  sort(summary.begin(), summary.end(),
+       [](const OpSummary & a, const OpSummary & b) {
+    return a.total_ns > b.total_ns;
+  });
+  return summary;
+}
+
+// Trace event format: one complete ("X") event per op evaluation, times in
+// microseconds.
+void Profiler::WriteChromeTrace(ostream & out) const {
+  lock_guard<mutex> guard(lock);
+  out << "{\"traceEvents\": [";
+  for (int i = 0; i < events.size(); i++) {
+    const OpEvent & e = events[i];
+    out << (i ? ",\n" : "\n")
+        << "  {\"name\": \"" << e.type << "\", \"cat\": \"op\", \"ph\": \"X\", "
+        << "\"ts\": " << e.start_ns / 1e3 << ", \"dur\": "
+        << e.duration_ns / 1e3 << ", \"pid\": 0, \"tid\": " << e.thread
+        << ", \"args\": {\"slot\": " << e.slot << ", \"shape\": \"[";
+    for (int d = 0; d < e.shape.size(); d++)
+      out << (d ? ", " : "") << e.shape[d];
+    out << "]\", \"bytes\": " << e.bytes << ", \"flops\": " << e.flops
+        << "}}";
+  }
+  out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+}
+
+void Profiler::WriteChromeTrace(const string & path) const {
+  ofstream out(path);
+  if (!out)
+    throw runtime_error("Profiler: cannot open " + path);
+  WriteChromeTrace(out);
+}
+
+void Profiler::Clear() {
+  lock_guard<mutex> guard(lock);
+  events.clear();
+}
+
+}  // namespace profiler
+
+}  // namespace jb
+
+#endif  // JB_PROFILER_H
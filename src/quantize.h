@@ -0,0 +1,252 @@
+#ifndef JB_QUANTIZE_H
+#define JB_QUANTIZE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "src/tensor.h"
+
+using namespace std;
+using namespace jb::tensor;
+
+namespace jb {
+
+namespace quantize {
+
+// Affine Int8 quantization.  A real value x is stored as
+//
+//   q = clamp(round(x / scale) + zero_point, -128, 127)
+//
+// and read back as scale * (q - zero_point).  A tensor has one scale and
+// zero point, or one per channel (index along `axis`), which keeps the
+// error of weights whose output columns differ in range small.  The range
+// chosen always includes 0, so that 0 is stored exactly; the rounding error
+// is at most scale / 2 inside the range.
+//
+// MatrixMultiply() multiplies Int8 matrices with Int32 accumulators
+// (gemm::Gemm with a wide output), corrects for the zero points, and then
+// dequantizes to floating point or requantizes to Int8.  The usual split is
+// weights symmetric per output column (zero point 0, which also skips a
+// correction) and activations asymmetric per tensor.
+
+struct Params {
+  vector<float> scale;
+  vector<int32_t> zero_point;
+  int axis = -1;  // channel axis, or -1 for one scale for the whole tensor
+};
+
+const int kMin = -128;
+const int kMax = 127;
+
+// UTILITY FUNCTIONS
+
+// Number of channels params must have for a tensor of this shape.
+int Channels(const vector<int> & shape, int axis) {
+  if (axis == -1)
+    return 1;
+  if (axis < 0 || axis >= (int) shape.size())
+    throw runtime_error("Quantize: channel axis out of range");
+  return shape[axis];
+}
+
+void CheckParams(const vector<int> & shape, const Params & p) {
+  int channels = Channels(shape, p.axis);
+  if ((int) p.scale.size() != channels ||
+      (int) p.zero_point.size() != channels)
+    throw runtime_error("Quantize: params do not match the channels");
+}
+
+// Params covering [lo[c], hi[c]] (widened to include 0) for each channel c.
+Params FromRange(const vector<float> & lo, const vector<float> & hi, int axis,
+                 bool symmetric) {
+  Params p;
+  p.axis = axis;
+  for (int c = 0; c < (int) lo.size(); c++) {
+    float l = min(lo[c], 0.0f);
+    float h = max(hi[c], 0.0f);
+    float scale;
+    int32_t zero_point = 0;
+    if (symmetric) {
+      scale = max(-l, h) / kMax;
+    } else {
+      scale = (h - l) / (kMax - kMin);
+      if (scale > 0)
+        zero_point = (int32_t) lround(kMin - l / scale);
+    }
+    p.scale.push_back(scale > 0 ? scale : 1);  // all zeros: any scale works
+    p.zero_point.push_back(max(kMin, min(kMax, (int) zero_point)));
+  }
+  return p;
+}
+
+// Calls f(a_view, c_view, channel) for each channel's slice of a and c, or
+// once with the whole tensors.
+template<typename T, typename U, typename F>
+void ForEachChannel(const Tensor<T> & a, Tensor<U> & c, int axis, F f) {
+  if (axis == -1) {
+    f(a, c, 0);
+    return;
+  }
+  vector<int> start(a.NumDimension(), 0);
+  vector<int> stop = a.Shape();
+  vector<int> step(a.NumDimension(), 1);
+  for (int channel = 0; channel < a.Shape()[axis]; channel++) {
+    start[axis] = channel;
+    stop[axis] = channel + 1;
+    Tensor<U> c_view = Slice<U>(c, start, stop, step);
+    f(Slice<T>(a, start, stop, step), c_view, channel);
+  }
+}
+
+// Clamps, then rounds to nearest even by adding and subtracting 1.5 * 2^23
+// (where floats are integers), which vectorizes unlike nearbyint.
+template<typename T>
+struct QuantizeFunctor {
+  float inverse_scale;
+  float zero_point;
+  Int8 operator()(T x) const {
+    const float kShifter = 12582912.0f;
+    float q = (float) x * inverse_scale + zero_point;
+    q = q < kMin ? kMin : (q > kMax ? kMax : q);
+    return (Int8) (int) (q + kShifter - kShifter);
+  }
+};
+
+template<typename T>
+struct DequantizeFunctor {
+  float scale;
+  int32_t zero_point;
+  T operator()(Int8 q) const { return (T) (scale * (q - zero_point)); }
+};
+
+// QUANTIZATION
+
+// Params from the range of a's values, per tensor (axis -1) or per channel.
+// Symmetric params have zero point 0 and use [-127, 127].
+template<typename T>
+Params ChooseParams(const Tensor<T> & a, int axis = -1,
+                    bool symmetric = false) {
+  int channels = Channels(a.Shape(), axis);
+  vector<int> axes;
+  for (int d = 0; d < a.NumDimension() && axis != -1; d++) {
+    if (d != axis)
+      axes.push_back(d);
+  }
+  vector<float> lo(channels, 0), hi(channels, 0);
+  if (a.Size() > 0) {
+    // a 1-D tensor quantized per element reduces nothing
+    bool whole = axes.empty() && axis != -1;
+    Tensor<T> max = whole ? Copy(a) : Max(a, axes);
+    Tensor<T> min = whole ? Negate(a) : Max(Negate(a), axes);
+    for (int c = 0; c < channels; c++) {
+      hi[c] = (float) max.Data()[c];
+      lo[c] = -(float) min.Data()[c];
+    }
+  }
+  return FromRange(lo, hi, axis, symmetric);
+}
+
+template<typename T>
+Tensor<Int8> Quantize(const Tensor<T> & a, const Params & p) {
+  CheckParams(a.Shape(), p);
+  Tensor<Int8> q = Empty<Int8>(a.Shape());
+  ForEachChannel(a, q, p.axis, [&](const Tensor<T> & a_view,
+                                   Tensor<Int8> & q_view, int c) {
+    ConvertHelper(a_view, q_view,
+                  QuantizeFunctor<T>{1 / p.scale[c], (float) p.zero_point[c]});
+  });
+  return q;
+}
+
+template<typename T = Float32>
+Tensor<T> Dequantize(const Tensor<Int8> & q, const Params & p) {
+  CheckParams(q.Shape(), p);
+  Tensor<T> a = Empty<T>(q.Shape());
+  ForEachChannel(q, a, p.axis, [&](const Tensor<Int8> & q_view,
+                                   Tensor<T> & a_view, int c) {
+    ConvertHelper(q_view, a_view,
+                  DequantizeFunctor<T>{p.scale[c], p.zero_point[c]});
+  });
+  return a;
+}
+
+// MATRIX MULTIPLY
+
+// Sums of b's columns, which the zero point correction needs: constant
+// weights can compute them once.
+Tensor<Int32> ColumnSums(const Tensor<Int8> & b) {
+  return Sum(Cast<Int32>(b), {0});
+}
+
+// Int32 sums of (a - a's zero point) (b - b's zero point) for a quantized
+// per tensor and b per tensor or per column (axis 1).
+Tensor<Int32> Accumulate(const Tensor<Int8> & a, const Params & pa,
+                         const Tensor<Int8> & b, const Params & pb,
+                         const Tensor<Int32> * b_column_sums = nullptr) {
+  if (a.NumDimension() != 2 || b.NumDimension() != 2)
+    throw runtime_error("MatrixMultiply: operands are not matrices");
+  if (a.Shape()[1] != b.Shape()[0])
+    throw runtime_error("MatrixMultiply: inner dimensions do not match");
+  if (pa.axis != -1 || (pb.axis != -1 && pb.axis != 1))
+    throw runtime_error("MatrixMultiply: a must be quantized per tensor and "
+                        "b per tensor or per column");
+  CheckParams(a.Shape(), pa);
+  CheckParams(b.Shape(), pb);
+  int k = a.Shape()[1];
+  int n = b.Shape()[1];
+  Tensor<Int32> acc = Zeros<Int32>({a.Shape()[0], n});
+  MatrixMultiplyAccumulate(a, b, acc);
+
+  // sum (a - za)(b - zb) = sum a b - zb sum a - za (sum b - k zb)
+  int32_t za = pa.zero_point[0];
+  Tensor<Int32> zb = Zeros<Int32>({n});
+  bool has_zb = false;
+  for (int j = 0; j < n; j++) {
+    zb.DataMutable()[j] = pb.zero_point[pb.axis == -1 ? 0 : j];
+    has_zb = has_zb || zb.Data()[j] != 0;
+  }
+  if (has_zb) {
+    Tensor<Int32> row_sums = Sum(Cast<Int32>(a), {1}, true);
+    Subtract(acc, Multiply(row_sums, zb), acc);
+  }
+  if (za != 0) {
+    Tensor<Int32> column_sums =
+        b_column_sums ? Copy(*b_column_sums) : ColumnSums(b);
+    for (int j = 0; j < n; j++)
+      column_sums.DataMutable()[j] =
+          za * (column_sums.Data()[j] - k * zb.Data()[j]);
+    Subtract(acc, column_sums, acc);
+  }
+  return acc;
+}
+
+// a b, dequantized.
+template<typename T = Float32>
+Tensor<T> MatrixMultiply(const Tensor<Int8> & a, const Params & pa,
+                         const Tensor<Int8> & b, const Params & pb,
+                         const Tensor<Int32> * b_column_sums = nullptr) {
+  Tensor<Int32> acc = Accumulate(a, pa, b, pb, b_column_sums);
+  int n = b.Shape()[1];
+  Tensor<T> scale = Zeros<T>({n});
+  for (int j = 0; j < n; j++)
+    scale.DataMutable()[j] = pa.scale[0] * pb.scale[pb.axis == -1 ? 0 : j];
+  Tensor<T> c = Cast<T>(acc);
+  Multiply(c, scale, c);
+  return c;
+}
+
+// a b, requantized to Int8 with the per tensor params pc.
+Tensor<Int8> MatrixMultiply(const Tensor<Int8> & a, const Params & pa,
+                            const Tensor<Int8> & b, const Params & pb,
+                            const Params & pc) {
+  return Quantize(MatrixMultiply<Float32>(a, pa, b, pb), pc);
+}
+
+}  // namespace quantize
+
+}  // namespace jb
+
+#endif  // JB_QUANTIZE_H
@@ -0,0 +1,352 @@
+#ifndef JB_REDUCE_H
+#define JB_REDUCE_H
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "src/elementwise.h"
+#include "src/gemm.h"
+#include "src/parallel.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace reduce {
+
+// Shared engine for axis reductions over strided tensors.  The input is
+// described by two loops: `kept` over the output elements (operands: output
+// then input) and `reduced` over the elements folded into each output.
+//
+// When the reduced dimensions are innermost in memory every output is
+// reduced on its own: rows are summed pairwise with independent
+// accumulators (vectorizable), long rows are cut into fixed kChunk pieces
+// and the partial results combined in a fixed binary tree.  When a kept
+// dimension is innermost, whole rows of outputs are accumulated at once,
+// with Kahan compensation per output for floating point sums.
+//
+// Work is split across threads only along boundaries that do not depend on
+// the thread count, so results are bit identical however many threads run.
+
+const int kPairwiseBlock = 128;  // elements summed directly
+const int kChunk = 4096;         // elements per partial result
+
+// UTILITY FUNCTIONS
+
+// Reduced axes as flags; an empty axis list reduces every axis.  Negative
+// axes count from the end.
+vector<bool> AxisFlags(int ndim, const vector<int> & axes) {
+  vector<bool> flags(ndim, axes.empty());
+  for (auto axis : axes) {
+    int a = axis < 0 ? axis + ndim : axis;
+    if (a < 0 || a >= ndim)
+      throw runtime_error("Reduce: axis out of range");
+    if (flags[a])
+      throw runtime_error("Reduce: repeated axis");
+    flags[a] = true;
+  }
+  return flags;
+}
+
+vector<int> ReducedShape(const vector<int> & shape, const vector<int> & axes,
+                         bool keep_dims) {
+  vector<bool> flags = AxisFlags(shape.size(), axes);
+  vector<int> out;
+  for (int d = 0; d < (int) shape.size(); d++) {
+    if (!flags[d])
+      out.push_back(shape[d]);
+    else if (keep_dims)
+      out.push_back(1);
+  }
+  return out;
+}
+
+// Number of input elements folded into each output.
+long ReducedCount(const vector<int> & shape, const vector<int> & axes) {
+  vector<bool> flags = AxisFlags(shape.size(), axes);
+  long count = 1;
+  for (int d = 0; d < (int) shape.size(); d++) {
+    if (flags[d])
+      count *= shape[d];
+  }
+  return count;
+}
+
+// Splits a strided input into the kept and reduced loops; `out_stride`
+// holds the output strides of the kept dimensions, in order.
+void SplitLoops(const vector<int> & shape, const vector<long> & stride,
+                const vector<bool> & flags, const vector<long> & out_stride,
+                elementwise::Loop & kept, elementwise::Loop & reduced) {
+  kept.strides.assign(2, {});
+  reduced.strides.assign(1, {});
+  int k = 0;
+  for (int d = 0; d < (int) shape.size(); d++) {
+    if (flags[d]) {
+      reduced.shape.push_back(shape[d]);
+      reduced.strides[0].push_back(stride[d]);
+    } else {
+      kept.shape.push_back(shape[d]);
+      kept.strides[0].push_back(out_stride[k++]);
+      kept.strides[1].push_back(stride[d]);
+    }
+  }
+}
+
+// Sum of n elements, pairwise: blocks are summed with eight independent
+// accumulators and halves combined recursively, so the rounding error grows
+// with log n rather than n.
+template<typename A, typename T>
+A PairwiseSum(const T * p, int n, long stride) {
+  if (n > kPairwiseBlock) {
+    int half = n / 2 / 8 * 8;
+    return PairwiseSum<A>(p, half, stride) +
+           PairwiseSum<A>(p + half * stride, n - half, stride);
+  }
+  A acc[8] = {};
+  int i = 0;
+  if (stride == 1) {
+    for (; i + 8 <= n; i += 8) {
+      for (int k = 0; k < 8; k++)
+        acc[k] += p[i + k];
+    }
+  }
+  for (; i < n; i++)
+    acc[i % 8] += p[i * stride];
+  return ((acc[0] + acc[1]) + (acc[2] + acc[3])) +
+         ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+// REDUCERS
+
+// A reducer folds elements into a State: Row() folds a strided row,
+// Column() folds one element into each of n states, Merge() combines
+// partial states and Finish() produces the output element.
+
+template<typename T>
+struct SumReducer {
+  typedef typename gemm::Accumulator<T>::Type A;
+  static const bool kCompensated = is_floating_point<T>::value;
+  struct State {
+    A sum;
+    A carry;  // Kahan compensation
+  };
+  A divisor;  // 1 for sums, the element count for means
+
+  State Init() const { return {0, 0}; }
+  static void Add(State & s, A x) {
+    if (kCompensated) {
+      A y = x - s.carry;
+      A t = s.sum + y;
+      s.carry = (t - s.sum) - y;
+      s.sum = t;
+    } else {
+      s.sum += x;
+    }
+  }
+  void Row(State & s, const T * p, int n, long stride) const {
+    Add(s, PairwiseSum<A>(p, n, stride));
+  }
+  void Column(State * s, const T * p, int n) const {
+    for (int j = 0; j < n; j++)
+      Add(s[j], p[j]);
+  }
+  void Merge(State & a, const State & b) const {
+    a.sum += b.sum;
+    a.carry += b.carry;
+  }
+  T Finish(const State & s) const { return (T) ((s.sum - s.carry) / divisor); }
+};
+
+template<typename T>
+struct MaxReducer {
+  struct State {
+    T value;
+    bool empty;
+  };
+  State Init() const { return {T(), true}; }
+  void Row(State & s, const T * p, int n, long stride) const {
+    if (n == 0)
+      return;
+    T best = s.empty ? p[0] : s.value;
+    if (stride == 1) {
+      // independent lanes, merged at the end
+      T lanes[8];
+      fill(lanes, lanes + 8, best);
+      int i = 0;
+      for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 8; k++)
+          lanes[k] = p[i + k] > lanes[k] ? p[i + k] : lanes[k];
+      }
+      for (; i < n; i++)
+        best = p[i] > best ? p[i] : best;
+      for (int k = 0; k < 8; k++)
+        best = lanes[k] > best ? lanes[k] : best;
+    } else {
+      for (int i = 0; i < n; i++)
+        best = p[i * stride] > best ? p[i * stride] : best;
+    }
+    s = {best, false};
+  }
+  void Column(State * s, const T * p, int n) const {
+    for (int j = 0; j < n; j++) {
+      if (s[j].empty || p[j] > s[j].value)
+        s[j] = {p[j], false};
+    }
+  }
+  void Merge(State & a, const State & b) const {
+    if (!b.empty && (a.empty || b.value > a.value))
+      a = b;
+  }
+  T Finish(const State & s) const { return s.value; }
+};
+
+// DRIVERS
+
+template<typename T, typename R>
+void Reduce(elementwise::Loop kept, elementwise::Loop reduced, T * out,
+            const T * in, R reducer) {
+  typedef typename R::State State;
+  for (auto d : kept.shape) {
+    if (d == 0)
+      return;  // no outputs
+  }
+  bool empty = false;
+  for (auto d : reduced.shape)
+    empty = empty || d == 0;
+  elementwise::Collapse(kept);
+  elementwise::Collapse(reduced);
+  int kn = kept.shape.back();
+  long kso = kept.strides[0].back();
+  long ksi = kept.strides[1].back();
+  int rn = reduced.shape.back();
+  long rs = reduced.strides[0].back();
+
+  // start of every kept row (output, input) and every reduced row (input)
+  vector<pair<long, long>> kept_rows;
+  elementwise::ForEachRow(kept, [&](const long * o) {
+    kept_rows.push_back({o[0], o[1]});
+  });
+  vector<long> reduced_rows;
+  if (empty)
+    rn = 0;
+  else
+    elementwise::ForEachRow(reduced, [&](const long * o) {
+      reduced_rows.push_back(o[0]);
+    });
+  long outputs = (long) kept_rows.size() * kn;
+  long work = outputs * rn * reduced_rows.size();
+
+  if (ksi == 1 && rs != 1 && kn > 1) {
+    // outer reduction: accumulate whole output rows, split into column
+    // blocks across threads
+    vector<long> offsets;
+    for (auto r : reduced_rows) {
+      for (int i = 0; i < rn; i++)
+        offsets.push_back(r + i * rs);
+    }
+    int blocks = (kn + kChunk - 1) / kChunk;
+    long tasks = (long) kept_rows.size() * blocks;
+    parallel::ParallelFor(tasks, work, [&](long begin, long end) {
+      vector<State> states(min(kn, kChunk));
+      for (long t = begin; t < end; t++) {
+        const pair<long, long> & row = kept_rows[t / blocks];
+        int j0 = t % blocks * kChunk;
+        int n = min(kChunk, kn - j0);
+        fill(states.begin(), states.begin() + n, reducer.Init());
+        const T * base = in + row.second + j0;
+        for (auto o : offsets)
+          reducer.Column(states.data(), base + o, n);
+        T * o = out + row.first + j0 * kso;
+        for (int j = 0; j < n; j++)
+          o[j * kso] = reducer.Finish(states[j]);
+      }
+    });
+    return;
+  }
+
+  // inner reduction: every output folds fixed chunks of its reduced rows,
+  // then merges the partial states pairwise
+  int pieces = (rn + kChunk - 1) / kChunk;
+  int parts = max(1, (int) reduced_rows.size() * pieces);
+  auto partial = [&](const T * base, int part, State & s) {
+    if (rn == 0)
+      return;
+    int start = part % pieces * kChunk;
+    reducer.Row(s, base + reduced_rows[part / pieces] + start * rs,
+                min(kChunk, rn - start), rs);
+  };
+  auto merge = [&](vector<State> & states) {
+    for (int step = 1; step < (int) states.size(); step *= 2) {
+      for (int i = 0; i + step < (int) states.size(); i += 2 * step)
+        reducer.Merge(states[i], states[i + step]);
+    }
+    return reducer.Finish(states[0]);
+  };
+  auto element = [&](long e, T *& o, const T *& base) {
+    const pair<long, long> & row = kept_rows[e / kn];
+    o = out + row.first + (e % kn) * kso;
+    base = in + row.second + (e % kn) * ksi;
+  };
+  if (outputs >= 16 || parts == 1) {
+    parallel::ParallelFor(outputs, work, [&](long begin, long end) {
+      vector<State> states(parts);
+      for (long e = begin; e < end; e++) {
+        T * o;
+        const T * base;
+        element(e, o, base);
+        for (int part = 0; part < parts; part++) {
+          states[part] = reducer.Init();
+          partial(base, part, states[part]);
+        }
+        *o = merge(states);
+      }
+    });
+  } else {
+    // few outputs: split each one's parts across threads
+    vector<State> states(parts);
+    for (long e = 0; e < outputs; e++) {
+      T * o;
+      const T * base;
+      element(e, o, base);
+      parallel::ParallelFor(parts, work / outputs, [&](long begin, long end) {
+        for (long part = begin; part < end; part++) {
+          states[part] = reducer.Init();
+          partial(base, part, states[part]);
+        }
+      });
+      *o = merge(states);
+    }
+  }
+}
+
+// Index of the first maximum along a single reduced dimension of n
+// elements with stride `stride`, for every element of `kept`.
+template<typename T, typename I>
+void ArgMax(elementwise::Loop kept, int n, long stride, I * out,
+            const T * in) {
+  if (n == 0)
+    throw runtime_error("ArgMax: empty axis");
+  elementwise::Collapse(kept);
+  int kn = kept.shape.back();
+  long kso = kept.strides[0].back();
+  long ksi = kept.strides[1].back();
+  elementwise::ForEachRow(kept, [&](const long * offsets) {
+    for (int j = 0; j < kn; j++) {
+      const T * p = in + offsets[1] + j * ksi;
+      int best = 0;
+      for (int i = 1; i < n; i++) {
+        if (p[i * stride] > p[best * stride])
+          best = i;
+      }
+      out[offsets[0] + j * kso] = best;
+    }
+  });
+}
+
+}  // namespace reduce
+
+}  // namespace jb
+
+#endif  // JB_REDUCE_H
@@ -1,14 +1,26 @@
 #ifndef JB_SESSION_H
 #define JB_SESSION_H
 
+#include <cstring>
 #include <list>
+#include <map>
 #include <unordered_map>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <climits>
+#include <future>
+#include <mutex>
 #include "src/op.h"
 #include "src/tensor.h"
+#include "src/thread_pool.h"
+#include "src/profiler.h"
 
 using namespace std;
 using namespace jb::op;
 using namespace jb::tensor;
+using namespace jb::thread_pool;
+using namespace jb::profiler;
 
 namespace jb {
 
@@ -16,48 +28,1153 @@ namespace session {
 
 // Running operations and cache results.  Only necessary computations are
 // performed.
+//
+// Compile() orders the ops needed by a set of outputs topologically into a
+// reusable Plan: every op gets an integer slot in a flat tensor vector and
+// its inputs are resolved to slots up front, so running a plan involves no
+// hashing and no recursion.  Run(outputs) compiles on first use and reuses
+// the plan while the outputs stay the same.
+//
+// With one thread a plan is executed in order on the calling thread.  With
+// more, every op whose inputs are done is handed to a work-stealing pool, so
+// independent branches overlap.  Each op is computed by exactly one task from
+// the same inputs, so the outcome does not depend on the schedule.
+//
+// Runs are incremental: Assign() stamps a variable's value with a new
+// version, and every slot of a plan remembers the version of the newest
+// value it was computed from.  Before a run the stamps are propagated along
+// the plan's edges in order, and only the ops downstream of a reassigned
+// variable are evaluated again; the others keep their cached value.  Values
+// are therefore treated as immutable once assigned: modify a variable by
+// assigning it again, or turn caching off with SetIncremental(false).  Plans
+// with memory planned always run in full, as their buffers are recycled.
+// LastRunStats() and TotalStats() count the ops served from the cache (hits)
+// and evaluated (misses).
+//
+// RunBatch() runs many requests at once: each request feeds its own values
+// for the same variables, which are stacked along a new leading dimension,
+// the graph is run once on the stacked values, in an execution context of
+// its own as for RunAsync() (below), and every output is handed back as one
+// view per request (Unstack, no copy).  The session's assigned values and
+// cached results are left untouched.  Variables no request
+// feeds keep their assigned value and are shared by the whole batch, so ops
+// must accept the extra leading dimension (elementwise ops broadcast;
+// MatrixMultiply takes per request vectors as the rows of a matrix).
+//
+// SetProfiler() attaches a Profiler that records every op evaluation.
+//
+// Fuse() rewrites a plan so that every tree of elementwise ops (Add,
+// Multiply, Apply) whose intermediate values have a single consumer is
+// computed by one Fused kernel, which evaluates the whole expression per
+// element block instead of materializing each intermediate.
+//
+// Optimize() rewrites a plan for a set of variables whose values are fixed
+// (e.g. weights).  Ops of the same kind with the same attributes over the
+// same inputs are merged into one (common subexpression elimination), then
+// every op computed from fixed variables only is evaluated once, from their
+// current values, and the values the rest of the plan reads are kept as
+// Constant kernels (constant folding).  Outputs keep their positions, and
+// results are the same as the unoptimized plan's as long as the fixed
+// variables are not reassigned.
+//
+// PlanMemory() computes the lifetime of every intermediate from the plan
+// order and assigns buffers so that values whose lifetimes do not overlap
+// share one; InPlace() ops write straight into their first input when it
+// dies with them.  Planned buffers follow the serial order, so a plan with
+// memory planned always runs on the calling thread.
+//
+// RunAsync() serves concurrent requests from one session.  The compiled
+// plan of a set of outputs is shared read only: every request runs it in an
+// execution context of its own, a copy of the plan's structure with private
+// slots, which goes back to a per plan pool afterwards.  Variables a request
+// does not feed read the session's assigned values through an immutable
+// snapshot that Assign() replaces (copy on write), so in-flight requests
+// share the weights without locking them and keep the values they started
+// with.  Each request is one task on the session's thread pool, or runs on
+// the calling thread when the session has one thread.  Requests are not
+// incremental, and their intermediates come from the tensor pool rather
+// than planned buffers.  RunAsync() may be called from any number of
+// threads, also while Assign() runs, but the other members are not thread
+// safe.
+//
+// CompileGradients() prepares reverse mode differentiation of one output
+// with respect to a set of variables; RunGradients() then runs the forward
+// pass and the ops' Backward() in reverse order, accumulating into gradient
+// buffers that are allocated once and reused by every run.  When
+// checkpoints are given only they (and the variables) are kept after the
+// forward pass; every other activation is released as soon as the forward
+// pass is done with it and recomputed from the nearest kept values when the
+// backward pass needs it.
+
+// Peak memory of a plan's values with and without memory planning.
+struct MemoryReport {
+  long naive_peak_bytes = 0;    // every value kept for the whole run
+  long planned_peak_bytes = 0;  // variables, outputs and shared buffers
+  int buffers = 0;
+  int in_place = 0;
+};
+
+// Buffer assignment for the intermediates of a plan.  buffer[i] is the
+// buffer backing slot i, or -1 if the value is allocated by its op
+// (variables, outputs and ops of unknown shape).
+template<typename T>
+struct MemoryPlan {
+  vector<vector<int>> shapes;   // per slot, empty if unknown
+  vector<int> buffer;
+  vector<vector<int>> release;  // per step, unplanned slots it last uses
+  vector<Tensor<T>> buffers;
+  MemoryReport report;
+};
+
+// Ops needed by a set of outputs, in topological order.  Slot i holds the
+// value of ops[i], computed by kernels[i]: the op itself unless a pass
+// rewrote it (kernels created by passes are owned by the plan).  Edges are
+// slot indices.
+template<typename T>
+struct Plan {
+  Plan() = default;
+  Plan(Plan &&) = default;
+  Plan & operator=(Plan &&) = default;
+  Plan(const Plan &) = delete;  // arguments point into slots
+  const Tensor<T> & Output(int i) const { return slots[outputs[i]]; };
+
+  vector<Op<T> *> ops;
+  vector<Op<T> *> kernels;
+  vector<shared_ptr<Op<T>>> owned;
+  vector<vector<int>> inputs;
+  vector<vector<int>> consumers;
+  vector<vector<const Tensor<T> *>> arguments;
+  vector<int> steps;      // slots that are computed, in order
+  vector<int> variables;  // slots that are assigned
+  vector<int> outputs;
+  vector<Tensor<T>> slots;
+  vector<long> versions;  // per slot, version it was computed from, -1 stale
+  vector<long> pending;   // versions after the current run
+  vector<bool> dirty;     // per slot, evaluated by the current run
+  MemoryPlan<T> memory;  // empty unless memory was planned
+};
+
+// Values fed to the variables of one request.
+template<typename T>
+using Feed = unordered_map<Variable<T> *, Tensor<T>>;
+
+// Ops served from a plan's cached values and ops evaluated.
+struct CacheStats {
+  long hits = 0;
+  long misses = 0;
+};
+
+// Activation memory of a gradient run.
+struct GradientReport {
+  long peak_activation_bytes = 0;  // forward values alive at the same time
+  int recomputed = 0;              // forward ops recomputed for backward
+};
+
+// Ops an Optimize() pass removed from a plan.
+struct OptimizationReport {
+  int merged = 0;   // duplicates of an earlier op
+  int folded = 0;   // ops evaluated once, from fixed variables
+  int removed = 0;  // slots the plan lost, including unread variables
+};
+
+// A plan for the gradients of plan.Output(0) (seeded with ones, so a
+// non-scalar output is differentiated as the sum of its elements) with
+// respect to the slots in wrt.
+template<typename T>
+struct Gradients {
+  const Tensor<T> & Value() const { return plan.Output(0); };
+  const Tensor<T> & Gradient(int i) const { return grads[wrt[i]]; };
+
+  Plan<T> plan;
+  vector<int> wrt;
+  vector<bool> keep;      // per slot, survives the forward pass
+  vector<bool> required;  // per slot, a gradient flows through it
+  vector<vector<int>> forward_release;   // per step, values released after
+  vector<vector<int>> backward_release;  // per step, in the backward pass
+  vector<vector<Tensor<T> *>> input_grads;
+  vector<vector<int>> shapes;  // per slot, from the last forward pass
+  vector<Tensor<T>> grads;
+  bool allocated = false;
+  vector<bool> live;
+  GradientReport report;
+};
+
+// Derives consumers, slots and arguments from the plan's ops and inputs.
+template<typename T>
+void Link(Plan<T> & plan) {
+  int n = plan.ops.size();
+  plan.consumers.assign(n, {});
+  plan.slots.assign(n, Tensor<T>());
+  plan.arguments.assign(n, {});
+  plan.versions.assign(n, -1);
+  plan.pending.assign(n, -1);
+  plan.dirty.assign(n, true);
+  for (int i = 0; i < n; i++) {
+    for (auto input : plan.inputs[i]) {
+      plan.consumers[input].push_back(i);
+      plan.arguments[i].push_back(&plan.slots[input]);
+    }
+  }
+  plan.memory = MemoryPlan<T>();
+}
+
+// Whether two kernels of the same type compute the same function of their
+// inputs.  Kernels whose attributes are unknown here only match themselves.
+template<typename T>
+bool Equivalent(Op<T> * a, Op<T> * b) {
+  if (a == b)
+    return true;
+  if (strcmp(a->Type(), b->Type()) != 0)
+    return false;
+  if (dynamic_cast<op::Add<T> *>(a) || dynamic_cast<op::Multiply<T> *>(a) ||
+      dynamic_cast<op::MatrixMultiply<T> *>(a) ||
+      dynamic_cast<op::Exp<T> *>(a) || dynamic_cast<op::Log<T> *>(a) ||
+      dynamic_cast<op::Tanh<T> *>(a) || dynamic_cast<op::Sigmoid<T> *>(a) ||
+      dynamic_cast<op::Gelu<T> *>(a))
+    return true;
+  if (auto apply = dynamic_cast<op::Apply<T> *>(a)) {
+    auto other = static_cast<op::Apply<T> *>(b);
+    return apply->Function() == other->Function() &&
+           apply->Derivative() == other->Derivative();
+  }
+  if (auto sum = dynamic_cast<op::Sum<T> *>(a)) {
+    auto other = static_cast<op::Sum<T> *>(b);
+    return sum->Axes() == other->Axes() &&
+           sum->KeepDims() == other->KeepDims();
+  }
+  if (auto mean = dynamic_cast<op::Mean<T> *>(a)) {
+    auto other = static_cast<op::Mean<T> *>(b);
+    return mean->Axes() == other->Axes() &&
+           mean->KeepDims() == other->KeepDims();
+  }
+  if (auto maximum = dynamic_cast<op::Max<T> *>(a)) {
+    auto other = static_cast<op::Max<T> *>(b);
+    return maximum->Axes() == other->Axes() &&
+           maximum->KeepDims() == other->KeepDims();
+  }
+  if (auto argmax = dynamic_cast<op::ArgMax<T> *>(a)) {
+    auto other = static_cast<op::ArgMax<T> *>(b);
+    return argmax->Axis() == other->Axis() &&
+           argmax->KeepDims() == other->KeepDims();
+  }
+  if (auto conv2d = dynamic_cast<op::Conv2D<T> *>(a)) {
+    const conv::Params & p = conv2d->Parameters();
+    const conv::Params & q = static_cast<op::Conv2D<T> *>(b)->Parameters();
+    return p.stride_h == q.stride_h && p.stride_w == q.stride_w &&
+           p.pad_h == q.pad_h && p.pad_w == q.pad_w &&
+           p.dilation_h == q.dilation_h && p.dilation_w == q.dilation_w &&
+           p.groups == q.groups && p.algorithm == q.algorithm;
+  }
+  return false;
+}
+
+// A copy of plan's structure with fresh slots: an execution context.
+template<typename T>
+unique_ptr<Plan<T>> Instantiate(const Plan<T> & plan) {
+  unique_ptr<Plan<T>> context(new Plan<T>());
+  context->ops = plan.ops;
+  context->kernels = plan.kernels;
+  context->owned = plan.owned;
+  context->inputs = plan.inputs;
+  context->steps = plan.steps;
+  context->variables = plan.variables;
+  context->outputs = plan.outputs;
+  Link(*context);
+  return context;
+}
 
 template<typename T>
 class Session {
 public:
+  Session(int num_threads = 1) { SetNumThreads(num_threads); };
+  ~Session() { pool.reset(); }  // finishes the requests in flight
+  Plan<T> Compile(const list<Op<T> *> & outputs);
   void Run(list<Op<T> *> outputs);
+  void Run(Plan<T> & plan);
+  future<vector<Tensor<T>>> RunAsync(const list<Op<T> *> & outputs,
+                                     const Feed<T> & feed = {});
+  vector<vector<Tensor<T>>> RunBatch(const list<Op<T> *> & outputs,
+                                     const vector<Feed<T>> & feeds);
+  MemoryReport PlanMemory(Plan<T> & plan);
+  int Fuse(Plan<T> & plan);
+  OptimizationReport Optimize(Plan<T> & plan,
+                              const list<Variable<T> *> & fixed);
+  Gradients<T> CompileGradients(Op<T> * output,
+                                const list<Variable<T> *> & wrt,
+                                const list<Op<T> *> & checkpoints = {});
+  void RunGradients(Gradients<T> & gradients);
   void Assign(Variable<T> *, Tensor<T>);
+  void SetNumThreads(int num_threads);
+  int NumThreads() const { return pool ? pool->NumWorkers() : 1; };
+  void SetMemoryPlanning(bool enabled) { memory_planning = enabled; };
+  void SetFusion(bool enabled) { fusion = enabled; };
+  void SetProfiler(Profiler * p) { profiler = p; };
+  void SetIncremental(bool enabled) { incremental = enabled; };
+  const CacheStats & LastRunStats() const { return last_run; };
+  const CacheStats & TotalStats() const { return total; };
   const unordered_map<Op<T> *, Tensor<T>> & Values() { return values; };
 private:
-  void Evaluate(Op<T> *, long run);
+  typedef unordered_map<Op<T> *, Tensor<T>> Constants;
+  // A plan shared by RunAsync() requests and its idle contexts.
+  struct SharedPlan {
+    Plan<T> plan;  // never run itself
+    mutex lock;
+    vector<unique_ptr<Plan<T>>> idle;
+  };
+  shared_ptr<SharedPlan> Share(const list<Op<T> *> & outputs);
+  vector<Tensor<T>> Execute(SharedPlan & shared, const Feed<T> & feed,
+                            const Constants & constants);
+  void RunSerial(Plan<T> &);
+  void RunParallel(Plan<T> &);
+  void RunPlanned(Plan<T> &);
+  void Step(Plan<T> &, int i, bool into);
+  int Invalidate(Plan<T> &);
+  void Recompute(Gradients<T> &, int i, long & live_bytes);
   unordered_map<Op<T> *, Tensor<T>> values;
-  unordered_map<Op<T> *, long> runs;
-  long run = 0;
+  unordered_map<Op<T> *, long> runs;  // version of each assigned value
+  long run = 0;                        // last version handed out
+  shared_ptr<const Constants> constants = make_shared<Constants>();
+  mutex shared_lock;
+  map<list<Op<T> *>, shared_ptr<SharedPlan>> shared_plans;
+  unique_ptr<ThreadPool> pool;
+  list<Op<T> *> cached_outputs;
+  Plan<T> cached_plan;
+  bool memory_planning = false;
+  bool fusion = false;
+  bool incremental = true;
+  CacheStats last_run;
+  CacheStats total;
+  Profiler * profiler = nullptr;
 };
 
 template<typename T>
 void Session<T>::Assign(Variable<T> * variable, Tensor<T> value) {
   variable->Assign(values, value);
+  runs[variable] = ++run;
+  shared_ptr<Constants> snapshot = make_shared<Constants>(*constants);
+  (*snapshot)[variable] = value;
+  atomic_store(&constants, shared_ptr<const Constants>(snapshot));
+}
+
+template<typename T>
+void Session<T>::SetNumThreads(int num_threads) {
+  if (num_threads > 1)
+    pool.reset(new ThreadPool(num_threads));
+  else
+    pool.reset();
 }
 
 template<typename T>
 void Session<T>::Run(list<Op<T> *> outputs) {
-  run++;
-  for (auto o : outputs)
-    Evaluate(o, run);
+  if (outputs != cached_outputs || cached_plan.ops.empty()) {
+    cached_plan = Compile(outputs);
+    cached_outputs = outputs;
+    if (fusion)
+      Fuse(cached_plan);
+  }
+  if (memory_planning && cached_plan.memory.buffer.empty())
+    PlanMemory(cached_plan);
+  Run(cached_plan);
+  // keep intermediates visible through Values(), unless their memory is
+  // recycled
+  if (cached_plan.memory.buffer.empty()) {
+    for (int i = 0; i < cached_plan.ops.size(); i++)
+      values[cached_plan.ops[i]] = cached_plan.slots[i];
+  }
 }
 
 template<typename T>
-void Session<T>::Evaluate(Op<T> * op, long run) {
-  if (runs[op] == run) {
-    return;  // result cached for this run
+void Session<T>::Run(Plan<T> & plan) {
+  for (auto v : plan.variables)
+    plan.slots[v] = values[plan.ops[v]];
+  int dirty = Invalidate(plan);
+  last_run.hits = plan.steps.size() - dirty;
+  last_run.misses = dirty;
+  total.hits += last_run.hits;
+  total.misses += last_run.misses;
+  if (!plan.memory.buffer.empty()) {
+    for (auto v : plan.variables) {
+      if (plan.slots[v].Shape() != plan.memory.shapes[v]) {
+        PlanMemory(plan);  // shapes changed, replan
+        break;
+      }
+    }
+    RunPlanned(plan);
+  } else if (pool) {
+    RunParallel(plan);
   } else {
-    // run dependents
-    for (auto input : op->Inputs()) {
-      Evaluate(input, run);
+    RunSerial(plan);
+  }
+  plan.versions = plan.pending;
+  for (auto o : plan.outputs)
+    values[plan.ops[o]] = plan.slots[o];
+}
+
+template<typename T>
+vector<vector<Tensor<T>>> Session<T>::RunBatch(const list<Op<T> *> & outputs,
+                                               const vector<Feed<T>> & feeds) {
+  if (feeds.empty())
+    return {};
+  for (auto & feed : feeds) {
+    if (feed.size() != feeds[0].size())
+      throw runtime_error("Session: batched requests feed different variables");
+  }
+  Feed<T> stacked;
+  for (auto & it : feeds[0]) {
+    vector<Tensor<T>> column;
+    for (auto & feed : feeds) {
+      auto value = feed.find(it.first);
+      if (value == feed.end())
+        throw runtime_error("Session: batched requests feed different "
+                            "variables");
+      column.push_back(value->second);
+    }
+    stacked[it.first] = Stack(column);
+  }
+  vector<Tensor<T>> batch = Execute(*Share(outputs), stacked,
+                                    *atomic_load(&constants));
+  vector<vector<Tensor<T>>> results(feeds.size());
+  for (auto & value : batch) {
+    if (value.NumDimension() == 0 || value.Shape()[0] != (int) feeds.size())
+      throw runtime_error("Session: output is not batched");
+    vector<Tensor<T>> slices = Unstack(value);
+    for (int i = 0; i < (int) feeds.size(); i++)
+      results[i].push_back(slices[i]);
+  }
+  return results;
+}
+
+template<typename T>
+future<vector<Tensor<T>>> Session<T>::RunAsync(const list<Op<T> *> & outputs,
+                                               const Feed<T> & feed) {
+  shared_ptr<SharedPlan> shared = Share(outputs);
+  shared_ptr<const Constants> snapshot = atomic_load(&constants);
+  auto result = make_shared<promise<vector<Tensor<T>>>>();
+  auto request = [this, shared, snapshot, feed, result] {
+    try {
+      result->set_value(Execute(*shared, feed, *snapshot));
+    } catch (...) {
+      result->set_exception(current_exception());
+    }
+  };
+  if (pool)
+    pool->Submit(request);
+  else
+    request();
+  return result->get_future();
+}
+
+// The shared plan of a set of outputs, compiled on first use.
+template<typename T>
+shared_ptr<typename Session<T>::SharedPlan> Session<T>::Share(
+    const list<Op<T> *> & outputs) {
+  lock_guard<mutex> guard(shared_lock);
+  shared_ptr<SharedPlan> & shared = shared_plans[outputs];
+  if (!shared) {
+    shared = make_shared<SharedPlan>();
+    shared->plan = Compile(outputs);
+    if (fusion)
+      Fuse(shared->plan);
+  }
+  return shared;
+}
+
+// Runs one request in an idle context of the shared plan.
+template<typename T>
+vector<Tensor<T>> Session<T>::Execute(SharedPlan & shared,
+                                      const Feed<T> & feed,
+                                      const Constants & constants) {
+  unique_ptr<Plan<T>> context;
+  {
+    lock_guard<mutex> guard(shared.lock);
+    if (!shared.idle.empty()) {
+      context = move(shared.idle.back());
+      shared.idle.pop_back();
+    }
+  }
+  if (!context)
+    context = Instantiate(shared.plan);
+  Plan<T> & plan = *context;
+  for (auto v : plan.variables) {
+    auto fed = feed.find(static_cast<Variable<T> *>(plan.ops[v]));
+    if (fed != feed.end()) {
+      plan.slots[v] = fed->second;
+      continue;
+    }
+    auto assigned = constants.find(plan.ops[v]);
+    if (assigned == constants.end())
+      throw runtime_error("Session: variable is neither fed nor assigned");
+    plan.slots[v] = assigned->second;
+  }
+  for (auto i : plan.steps)
+    Step(plan, i, false);
+  vector<Tensor<T>> outputs;
+  for (auto o : plan.outputs)
+    outputs.push_back(plan.slots[o]);
+  fill(plan.slots.begin(), plan.slots.end(), Tensor<T>());
+  lock_guard<mutex> guard(shared.lock);
+  shared.idle.push_back(move(context));
+  return outputs;
+}
+
+// Propagates value versions through the plan and marks the steps that must
+// be evaluated; their cached versions are cleared until the run succeeds.
+template<typename T>
+int Session<T>::Invalidate(Plan<T> & plan) {
+  bool all = !incremental || !plan.memory.buffer.empty();
+  for (auto v : plan.variables) {
+    auto it = runs.find(plan.ops[v]);
+    plan.pending[v] = it == runs.end() ? 0 : it->second;
+  }
+  int dirty = 0;
+  for (auto i : plan.steps) {
+    long version = 0;
+    for (auto input : plan.inputs[i])
+      version = max(version, plan.pending[input]);
+    plan.pending[i] = version;
+    plan.dirty[i] = all || version != plan.versions[i];
+    if (plan.dirty[i]) {
+      plan.versions[i] = -1;
+      dirty++;
+    }
+  }
+  return dirty;
+}
+
+template<typename T>
+Plan<T> Session<T>::Compile(const list<Op<T> *> & outputs) {
+  // iterative post-order depth first search
+  Plan<T> plan;
+  unordered_map<Op<T> *, int> index;
+  vector<pair<Op<T> *, bool>> stack;
+  for (auto it = outputs.rbegin(); it != outputs.rend(); it++)
+    stack.push_back({*it, false});
+  while (!stack.empty()) {
+    Op<T> * op = stack.back().first;
+    bool expanded = stack.back().second;
+    stack.pop_back();
+    if (index.count(op))
+      continue;
+    vector<Op<T> *> inputs = op->Inputs();
+    if (!expanded) {
+      stack.push_back({op, true});
+      for (auto it = inputs.rbegin(); it != inputs.rend(); it++) {
+        if (!index.count(*it))
+          stack.push_back({*it, false});
+      }
+      continue;
+    }
+    int i = plan.ops.size();
+    index[op] = i;
+    plan.ops.push_back(op);
+    plan.inputs.push_back({});
+    for (auto input : inputs) {
+      if (!index.count(input))
+        throw runtime_error("Session: graph contains a cycle");
+      plan.inputs[i].push_back(index[input]);
+    }
+    if (inputs.empty() && dynamic_cast<Variable<T> *>(op))
+      plan.variables.push_back(i);
+    else
+      plan.steps.push_back(i);
+  }
+  for (auto o : outputs)
+    plan.outputs.push_back(index[o]);
+
+  plan.kernels = plan.ops;
+  Link(plan);
+  return plan;
+}
+
+template<typename T>
+int Session<T>::Fuse(Plan<T> & plan) {
+  int n = plan.ops.size();
+  vector<bool> output(n, false);
+  for (auto o : plan.outputs)
+    output[o] = true;
+
+  // group every fusable op with its consumer when it is that consumer's
+  // private input; group[i] is the root of i's group
+  vector<int> group(n, -1);
+  for (int pos = plan.steps.size() - 1; pos >= 0; pos--) {
+    int i = plan.steps[pos];
+    Op<T> * kernel = plan.kernels[i];
+    if (!dynamic_cast<op::Add<T> *>(kernel) &&
+        !dynamic_cast<op::Multiply<T> *>(kernel) &&
+        !dynamic_cast<op::Apply<T> *>(kernel))
+      continue;
+    group[i] = i;
+    if (!output[i] && plan.consumers[i].size() == 1 &&
+        group[plan.consumers[i][0]] >= 0)
+      group[i] = group[plan.consumers[i][0]];
+  }
+
+  // express each group as one fused program
+  typedef typename Fused<T>::Instruction Instruction;
+  vector<shared_ptr<Op<T>>> fused(n);
+  vector<vector<int>> fused_inputs(n);
+  int removed = 0;
+  for (int root = 0; root < n; root++) {
+    if (group[root] != root)
+      continue;
+    vector<int> externals;
+    vector<Instruction> program;
+    // registers: external k is encoded as -1 - k until the inputs are known
+    function<int(int)> emit = [&](int i) -> int {
+      if (group[i] != root) {
+        auto it = find(externals.begin(), externals.end(), i);
+        if (it == externals.end())
+          it = externals.insert(it, i);
+        return -1 - (int) (it - externals.begin());
+      }
+      const vector<int> & inputs = plan.inputs[i];
+      if (auto apply = dynamic_cast<op::Apply<T> *>(plan.kernels[i])) {
+        int a = emit(inputs[0]);
+        program.push_back({Fused<T>::kApply, a, a, apply->Function()});
+        return program.size() - 1;
+      }
+      auto code = dynamic_cast<op::Add<T> *>(plan.kernels[i])
+                      ? Fused<T>::kAdd : Fused<T>::kMultiply;
+      int r = emit(inputs[0]);
+      for (int k = 1; k < inputs.size(); k++) {
+        int b = emit(inputs[k]);
+        program.push_back({code, r, b, nullptr});
+        r = program.size() - 1;
+      }
+      return r;
+    };
+    int result = emit(root);
+    if (program.empty() || result != (int) program.size() - 1)
+      continue;  // nothing to fuse
+    int nin = externals.size();
+    auto reg = [nin](int r) { return r < 0 ? -1 - r : nin + r; };
+    vector<Op<T> *> inputs;
+    for (auto & ins : program) {
+      ins.a = reg(ins.a);
+      ins.b = reg(ins.b);
+    }
+    for (auto e : externals)
+      inputs.push_back(plan.ops[e]);
+    fused[root] = make_shared<Fused<T>>(inputs, program);
+    fused_inputs[root] = externals;
+  }
+
+  // rebuild the plan without the ops folded into a fused root
+  Plan<T> rewritten;
+  vector<int> remap(n, -1);
+  rewritten.owned = plan.owned;
+  for (int i = 0; i < n; i++) {
+    if (group[i] >= 0 && group[i] != i && fused[group[i]]) {
+      removed++;
+      continue;
+    }
+    int ni = rewritten.ops.size();
+    remap[i] = ni;
+    rewritten.ops.push_back(plan.ops[i]);
+    const vector<int> & inputs = fused[i] ? fused_inputs[i] : plan.inputs[i];
+    rewritten.inputs.push_back({});
+    for (auto input : inputs)
+      rewritten.inputs[ni].push_back(remap[input]);
+    if (fused[i]) {
+      rewritten.kernels.push_back(fused[i].get());
+      rewritten.owned.push_back(fused[i]);
+    } else {
+      rewritten.kernels.push_back(plan.kernels[i]);
+    }
+    if (find(plan.variables.begin(), plan.variables.end(), i) !=
+        plan.variables.end())
+      rewritten.variables.push_back(ni);
+    else
+      rewritten.steps.push_back(ni);
+  }
+  for (auto o : plan.outputs)
+    rewritten.outputs.push_back(remap[o]);
+  Link(rewritten);
+  plan = move(rewritten);
+  return removed;
+}
+
+template<typename T>
+OptimizationReport Session<T>::Optimize(Plan<T> & plan,
+                                        const list<Variable<T> *> & fixed) {
+  int n = plan.ops.size();
+  OptimizationReport report;
+  vector<bool> output(n, false);
+  for (auto o : plan.outputs)
+    output[o] = true;
+
+  // common subexpressions: steps are in order, so the inputs of a step are
+  // merged before the step is compared
+  vector<int> same(n);
+  for (int i = 0; i < n; i++)
+    same[i] = i;
+  vector<vector<int>> inputs(n);
+  map<pair<string, vector<int>>, vector<int>> seen;
+  for (auto i : plan.steps) {
+    for (auto input : plan.inputs[i])
+      inputs[i].push_back(same[input]);
+    vector<int> & candidates = seen[{plan.kernels[i]->Type(), inputs[i]}];
+    for (auto c : candidates) {
+      if (Equivalent(plan.kernels[c], plan.kernels[i])) {
+        same[i] = c;
+        report.merged++;
+        break;
+      }
+    }
+    if (same[i] == i)
+      candidates.push_back(i);
+  }
+  for (auto o : plan.outputs)
+    output[same[o]] = true;
+
+  // constant folding: a step is constant when all its inputs are, and only
+  // the constants read by the rest of the plan (or output) are kept
+  vector<bool> constant(n, false);
+  for (auto v : plan.variables) {
+    Variable<T> * variable = static_cast<Variable<T> *>(plan.ops[v]);
+    constant[v] = find(fixed.begin(), fixed.end(), variable) != fixed.end();
+  }
+  vector<int> uses(n, 0);  // by constant steps
+  for (auto i : plan.steps) {
+    if (same[i] != i)
+      continue;
+    constant[i] = true;
+    for (auto input : inputs[i])
+      constant[i] = constant[i] && constant[input];
+    for (auto input : inputs[i])
+      uses[input] += constant[i];
+  }
+  vector<bool> keep(n, false);
+  for (int i = 0; i < n; i++) {
+    if (same[i] != i)
+      continue;
+    keep[i] = !constant[i] || output[i];
+    if (!constant[i]) {
+      for (auto input : inputs[i])
+        keep[input] = true;
+    }
+  }
+  vector<Tensor<T>> value(n);
+  for (int i = 0; i < n; i++) {
+    if (!constant[i] || (!keep[i] && uses[i] == 0))
+      continue;
+    if (dynamic_cast<Variable<T> *>(plan.kernels[i])) {
+      auto it = values.find(plan.ops[i]);
+      if (it == values.end())
+        throw runtime_error("Session: fixed variable is not assigned");
+      value[i] = it->second;
+      continue;
+    }
+    vector<const Tensor<T> *> arguments;
+    for (auto input : inputs[i])
+      arguments.push_back(&value[input]);
+    value[i] = plan.kernels[i]->Compute(arguments);
+    report.folded += !inputs[i].empty();
+    for (auto input : inputs[i]) {
+      if (--uses[input] == 0 && !keep[input])
+        value[input] = Tensor<T>();
+    }
+  }
+
+  Plan<T> rewritten;
+  vector<int> remap(n, -1);
+  rewritten.owned = plan.owned;
+  for (int i = 0; i < n; i++) {
+    if (same[i] != i) {
+      remap[i] = remap[same[i]];
+      continue;
     }
-    // evaluate op (assumes dependents exist)
-    op->Evaluate(values);
+    if (!keep[i])
+      continue;
+    int ni = rewritten.ops.size();
+    remap[i] = ni;
+    rewritten.ops.push_back(plan.ops[i]);
+    rewritten.inputs.push_back({});
+    if (inputs[i].empty()) {
+      rewritten.kernels.push_back(plan.kernels[i]);
+      if (find(plan.variables.begin(), plan.variables.end(), i) !=
+          plan.variables.end())
+        rewritten.variables.push_back(ni);
+      else
+        rewritten.steps.push_back(ni);
+    } else if (constant[i]) {
+      auto folded = make_shared<op::Constant<T>>(value[i]);
+      rewritten.kernels.push_back(folded.get());
+      rewritten.owned.push_back(folded);
+      rewritten.steps.push_back(ni);
+    } else {
+      for (auto input : inputs[i])
+        rewritten.inputs[ni].push_back(remap[input]);
+      rewritten.kernels.push_back(plan.kernels[i]);
+      rewritten.steps.push_back(ni);
+    }
+  }
+  for (auto o : plan.outputs)
+    rewritten.outputs.push_back(remap[o]);
+  report.removed = n - rewritten.ops.size();
+  Link(rewritten);
+  plan = move(rewritten);
+  return report;
+}
+
+template<typename T>
+Gradients<T> Session<T>::CompileGradients(Op<T> * output,
+                                          const list<Variable<T> *> & wrt,
+                                          const list<Op<T> *> & checkpoints) {
+  Gradients<T> g;
+  g.plan = Compile({output});
+  Plan<T> & plan = g.plan;
+  int n = plan.ops.size();
+  unordered_map<Op<T> *, int> index;
+  for (int i = 0; i < n; i++)
+    index[plan.ops[i]] = i;
+
+  g.required.assign(n, false);
+  for (auto v : wrt) {
+    if (!index.count(v))
+      throw runtime_error("Session: output does not depend on a variable");
+    g.wrt.push_back(index[v]);
+    g.required[index[v]] = true;
+  }
+  for (auto i : plan.steps) {
+    for (auto input : plan.inputs[i])
+      g.required[i] = g.required[i] || g.required[input];
+  }
+
+  g.keep.assign(n, checkpoints.empty());
+  for (auto c : checkpoints) {
+    if (index.count(c))
+      g.keep[index[c]] = true;
+  }
+  for (auto v : plan.variables)
+    g.keep[v] = true;
+  for (auto o : plan.outputs)
+    g.keep[o] = true;
+
+  // a value is released once its last forward consumer has run, and again
+  // (if recomputed) once the backward pass is past its own step, as every
+  // user of a value comes after it
+  int steps = plan.steps.size();
+  g.forward_release.resize(steps);
+  g.backward_release.resize(steps);
+  vector<int> last_forward(n, -1);
+  for (int pos = 0; pos < steps; pos++) {
+    for (auto input : plan.inputs[plan.steps[pos]])
+      last_forward[input] = pos;
+  }
+  for (int pos = 0; pos < steps; pos++) {
+    int i = plan.steps[pos];
+    if (!g.keep[i]) {
+      g.forward_release[last_forward[i]].push_back(i);
+      g.backward_release[pos].push_back(i);
+    }
+  }
+
+  g.shapes.resize(n);
+  g.grads.resize(n);
+  g.input_grads.resize(n);
+  for (int i = 0; i < n; i++) {
+    for (auto input : plan.inputs[i])
+      g.input_grads[i].push_back(g.required[input] ? &g.grads[input]
+                                                   : nullptr);
+  }
+  return g;
+}
+
+template<typename T>
+void Session<T>::RunGradients(Gradients<T> & g) {
+  Plan<T> & plan = g.plan;
+  int n = plan.ops.size();
+  auto bytes = [](const Tensor<T> & t) { return (long) t.Size() * sizeof(T); };
+  g.report = GradientReport();
+  g.live.assign(n, false);
+  long live_bytes = 0;
+  for (auto v : plan.variables) {
+    plan.slots[v] = values[plan.ops[v]];
+    g.shapes[v] = plan.slots[v].Shape();
+    g.live[v] = true;
+    live_bytes += bytes(plan.slots[v]);
+  }
+  auto release = [&](int i) {
+    if (!g.live[i])
+      return;
+    live_bytes -= bytes(plan.slots[i]);
+    plan.slots[i] = Tensor<T>();
+    g.live[i] = false;
+  };
+
+  // forward, releasing activations that are not kept
+  for (int pos = 0; pos < plan.steps.size(); pos++) {
+    int i = plan.steps[pos];
+    Step(plan, i, false);
+    g.shapes[i] = plan.slots[i].Shape();
+    g.live[i] = true;
+    live_bytes += bytes(plan.slots[i]);
+    g.report.peak_activation_bytes = max(g.report.peak_activation_bytes,
+                                         live_bytes);
+    for (auto dead : g.forward_release[pos])
+      release(dead);
+  }
+
+  // gradient buffers are reallocated only when shapes change
+  for (int i = 0; i < n; i++) {
+    if (!g.required[i])
+      continue;
+    if (!g.allocated || g.grads[i].Shape() != g.shapes[i])
+      g.grads[i] = Zeros<T>(g.shapes[i]);
+    else
+      Fill(g.grads[i], (T) 0);
+  }
+  g.allocated = true;
+  Fill(g.grads[plan.outputs[0]], (T) 1);
+
+  // backward, in reverse plan order
+  for (int pos = plan.steps.size() - 1; pos >= 0; pos--) {
+    int i = plan.steps[pos];
+    if (g.required[i]) {
+      for (auto input : plan.inputs[i])
+        Recompute(g, input, live_bytes);
+      Recompute(g, i, live_bytes);
+      g.report.peak_activation_bytes = max(g.report.peak_activation_bytes,
+                                           live_bytes);
+      plan.kernels[i]->Backward(plan.arguments[i], plan.slots[i], g.grads[i],
+                                g.input_grads[i]);
+    }
+    for (auto dead : g.backward_release[pos])
+      release(dead);
+  }
+  for (int i = 0; i < n; i++) {
+    if (!g.keep[i])
+      release(i);
+  }
+  values[plan.ops[plan.outputs[0]]] = plan.slots[plan.outputs[0]];
+}
+
+// Makes slot i's value available again, recomputing released inputs first.
+template<typename T>
+void Session<T>::Recompute(Gradients<T> & g, int i, long & live_bytes) {
+  if (g.live[i])
+    return;
+  for (auto input : g.plan.inputs[i])
+    Recompute(g, input, live_bytes);
+  Step(g.plan, i, false);
+  g.live[i] = true;
+  live_bytes += (long) g.plan.slots[i].Size() * sizeof(T);
+  g.report.recomputed++;
+}
+
+template<typename T>
+void Session<T>::RunSerial(Plan<T> & plan) {
+  for (auto i : plan.steps) {
+    if (plan.dirty[i])
+      Step(plan, i, false);
+  }
+}
+
+// Computes slot i, into its planned buffer if `into`.
+template<typename T>
+void Session<T>::Step(Plan<T> & plan, int i, bool into) {
+  if (!profiler) {
+    if (into)
+      plan.kernels[i]->ComputeInto(plan.arguments[i], plan.slots[i]);
+    else
+      plan.slots[i] = plan.kernels[i]->Compute(plan.arguments[i]);
+    return;
+  }
+  long start = profiler->Now();
+  if (into)
+    plan.kernels[i]->ComputeInto(plan.arguments[i], plan.slots[i]);
+  else
+    plan.slots[i] = plan.kernels[i]->Compute(plan.arguments[i]);
+  long end = profiler->Now();
+  const Tensor<T> & output = plan.slots[i];
+  OpEvent event;
+  event.type = plan.kernels[i]->Type();
+  event.slot = i;
+  event.start_ns = start;
+  event.duration_ns = end - start;
+  event.shape = output.Shape();
+  event.bytes = into ? 0 : output.Size() * sizeof(T);
+  event.flops = plan.kernels[i]->Flops(plan.arguments[i], output);
+  profiler->Record(event);
+}
+
+template<typename T>
+MemoryReport Session<T>::PlanMemory(Plan<T> & plan) {
+  int n = plan.ops.size();
+  MemoryPlan<T> memory;
+  memory.shapes.resize(n);
+  memory.buffer.assign(n, -1);
+  memory.release.resize(plan.steps.size());
+  vector<bool> output(n, false);
+  vector<bool> pinned(n, false);  // buffer may be aliased, never recycle
+  vector<int> last_use(n, -1);
+  for (auto o : plan.outputs)
+    output[o] = true;
+  for (auto v : plan.variables)
+    memory.shapes[v] = values[plan.ops[v]].Shape();
+  for (int pos = 0; pos < plan.steps.size(); pos++) {
+    int i = plan.steps[pos];
+    vector<vector<int>> input_shapes;
+    for (auto input : plan.inputs[i]) {
+      last_use[input] = pos;
+      input_shapes.push_back(memory.shapes[input]);
+    }
+    bool known = true;
+    for (auto & shape : input_shapes)
+      known = known && !shape.empty();
+    if (known)
+      memory.shapes[i] = plan.kernels[i]->OutputShape(input_shapes);
+    // values computed through Compute() may alias their inputs
+    if (memory.shapes[i].empty() || output[i]) {
+      for (auto input : plan.inputs[i])
+        pinned[input] = true;
+    }
+  }
+
+  auto elements = [](const vector<int> & shape) {
+    return accumulate(shape.begin(), shape.end(), 1L, multiplies<long>());
+  };
+  MemoryReport & report = memory.report;
+  for (int i = 0; i < n; i++) {
+    if (!memory.shapes[i].empty()) {
+      long bytes = elements(memory.shapes[i]) * sizeof(T);
+      report.naive_peak_bytes += bytes;
+      if (output[i] || plan.inputs[i].empty())
+        report.planned_peak_bytes += bytes;
+    }
+  }
+
+  vector<long> sizes;
+  vector<int> free_buffers;
+  for (int pos = 0; pos < plan.steps.size(); pos++) {
+    int i = plan.steps[pos];
+    const vector<int> & inputs = plan.inputs[i];
+    int in_place = -1;
+    // kernels without inputs (Constant) hand out their own value
+    if (!memory.shapes[i].empty() && !output[i] && !inputs.empty()) {
+      long need = elements(memory.shapes[i]);
+      int first = inputs.empty() ? -1 : inputs[0];
+      if (plan.kernels[i]->InPlace() && first >= 0 &&
+          memory.buffer[first] >= 0 && !pinned[first] && last_use[first] == pos &&
+          memory.shapes[first] == memory.shapes[i] &&
+          count(inputs.begin(), inputs.end(), first) == 1) {
+        in_place = first;
+        memory.buffer[i] = memory.buffer[first];
+        report.in_place++;
+      } else if (!free_buffers.empty()) {
+        // best fit, else grow the largest free buffer
+        int best = 0;
+        for (int f = 1; f < free_buffers.size(); f++) {
+          long size = sizes[free_buffers[f]];
+          long best_size = sizes[free_buffers[best]];
+          if (size >= need ? (best_size < need || size < best_size)
+                           : (best_size < need && size > best_size))
+            best = f;
+        }
+        memory.buffer[i] = free_buffers[best];
+        sizes[memory.buffer[i]] = max(sizes[memory.buffer[i]], need);
+        free_buffers.erase(free_buffers.begin() + best);
+      } else {
+        memory.buffer[i] = sizes.size();
+        sizes.push_back(need);
+      }
+    }
+    // recycle the values whose last use is this step
+    vector<int> dead;
+    for (auto input : inputs) {
+      if (last_use[input] == pos && !output[input] &&
+          !plan.inputs[input].empty() &&
+          find(dead.begin(), dead.end(), input) == dead.end())
+        dead.push_back(input);
+    }
+    for (auto input : dead) {
+      if (memory.buffer[input] < 0)
+        memory.release[pos].push_back(input);
+      else if (!pinned[input] && input != in_place)
+        free_buffers.push_back(memory.buffer[input]);
+    }
+  }
+
+  for (auto size : sizes) {
+    // slots are views of the storage, so a buffer past 2^31 elements (too
+    // long for one dimension) is simply shaped as rows
+    const long kRow = 1 << 20;
+    vector<int> shape = {(int) size};
+    if (size > INT_MAX)
+      shape = {(int) ((size + kRow - 1) / kRow), (int) kRow};
+    memory.buffers.push_back(Zeros<T>(shape));
+    report.planned_peak_bytes += size * sizeof(T);
+  }
+  report.buffers = sizes.size();
+  for (int i = 0; i < n; i++) {
+    if (memory.buffer[i] >= 0)
+      plan.slots[i] = View(memory.buffers[memory.buffer[i]], memory.shapes[i]);
+  }
+  plan.memory = memory;
+  return report;
+}
+
+template<typename T>
+void Session<T>::RunPlanned(Plan<T> & plan) {
+  const MemoryPlan<T> & memory = plan.memory;
+  for (int pos = 0; pos < plan.steps.size(); pos++) {
+    int i = plan.steps[pos];
+    Step(plan, i, memory.buffer[i] >= 0);
+    for (auto dead : memory.release[pos])
+      plan.slots[dead] = Tensor<T>();
+  }
+}
+
+template<typename T>
+void Session<T>::RunParallel(Plan<T> & plan) {
+  int n = plan.ops.size();
+  vector<atomic<int>> remaining(n);
+  vector<bool> computed(n, false);
+  for (int i = 0; i < n; i++)
+    remaining[i] = plan.inputs[i].size();
+  for (auto i : plan.steps)
+    computed[i] = plan.dirty[i];
+  mutex done_lock;
+  condition_variable done;
+  int finished = 0;
+  exception_ptr error;
+  atomic<bool> failed(false);
+
+  function<void(int)> submit = [&](int i) {
+    pool->Submit([&, i] {
+      try {
+        // after a failure the remaining ops are drained, not computed
+        if (computed[i] && !failed)
+          Step(plan, i, false);
+      } catch (...) {
+        lock_guard<mutex> guard(done_lock);
+        if (!error)
+          error = current_exception();
+        failed = true;
+      }
+      for (auto consumer : plan.consumers[i]) {
+        if (--remaining[consumer] == 0)
+          submit(consumer);
+      }
+      lock_guard<mutex> guard(done_lock);
+      finished++;
+      done.notify_one();
+    });
+  };
+
+  for (int i = 0; i < n; i++) {
+    if (plan.inputs[i].empty())
+      submit(i);
   }
+  unique_lock<mutex> guard(done_lock);
+  done.wait(guard, [&] { return finished == n; });
+  if (error)
+    rethrow_exception(error);
 }
 
 }  // namespace session
 
 }  // namespace jb
 
-#endif  // JB_SESSION_H
\ No newline at end of file
+#endif  // JB_SESSION_H
@@ -0,0 +1,400 @@
+#ifndef JB_SPARSE_H
+#define JB_SPARSE_H
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "src/parallel.h"
+#include "src/reduce.h"
+#include "src/tensor.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace sparse {
+
+using tensor::Tensor;
+
+// Sparse matrices in compressed sparse row form (CSR): the nonzeros of row i
+// are values[offsets[i] .. offsets[i + 1]), at columns[...] sorted within
+// the row.  Storage and the cost of every operation grow with the number of
+// nonzeros (nnz) rather than with rows * cols, except where the result is
+// dense.  Coordinate lists (COO) convert to and from CSR, and dense tensors
+// convert both ways.
+//
+// Products with dense matrices split the rows into ranges holding about the
+// same number of nonzeros, which run on the shared thread pool (parallel::
+// ParallelFor), so skewed rows do not leave threads idle.
+
+template<typename T>
+struct Csr {
+  int rows = 0;
+  int cols = 0;
+  vector<long> offsets = {0};  // rows + 1 entries
+  vector<int> columns;
+  vector<T> values;
+  long NonZeros() const { return values.size(); }
+  vector<int> Shape() const { return {rows, cols}; }
+};
+
+// Nonzero k is value[k] at (row[k], column[k]), in any order.  Duplicates
+// are summed by FromCoo().
+template<typename T>
+struct Coo {
+  int rows = 0;
+  int cols = 0;
+  vector<int> row;
+  vector<int> column;
+  vector<T> value;
+};
+
+const int kChunks = 64;  // row ranges of a product, balanced by nonzeros
+
+// UTILITY FUNCTIONS
+
+template<typename T>
+void Check(const Csr<T> & a) {
+  long nnz = a.values.size();
+  bool valid = a.rows >= 0 && a.cols >= 0 &&
+               (long) a.offsets.size() == a.rows + 1L &&
+               (long) a.columns.size() == nnz && a.offsets[0] == 0 &&
+               a.offsets[a.rows] == nnz;
+  for (int i = 0; valid && i < a.rows; i++) {
+    valid = a.offsets[i] <= a.offsets[i + 1];
+    for (long k = a.offsets[i]; valid && k < a.offsets[i + 1]; k++)
+      valid = a.columns[k] >= 0 && a.columns[k] < a.cols &&
+              (k == a.offsets[i] || a.columns[k - 1] < a.columns[k]);
+  }
+  if (!valid)
+    throw runtime_error("Sparse: malformed matrix");
+}
+
+template<typename T>
+void CheckDense(const Tensor<T> & b, int rows, int cols) {
+  if (b.Shape() != vector<int>({rows, cols}))
+    throw runtime_error("Sparse: dense operand does not match the shape");
+}
+
+// First element of a tensor's view.
+template<typename T>
+const T * Base(const Tensor<T> & a) {
+  return a.Data().data() + a.DataIndex({});
+}
+
+template<typename T>
+T * Base(Tensor<T> & a) {
+  return a.DataMutable().data() + a.DataIndex({});
+}
+
+// Boundaries of `chunks` row ranges holding about the same number of
+// nonzeros.
+template<typename T>
+vector<int> Partition(const Csr<T> & a, int chunks) {
+  vector<int> bounds(chunks + 1, a.rows);
+  for (int c = 0; c < chunks; c++) {
+    long target = a.NonZeros() * c / chunks;
+    bounds[c] = lower_bound(a.offsets.begin(), a.offsets.end(), target) -
+                a.offsets.begin();
+    bounds[c] = min(bounds[c], a.rows);
+  }
+  bounds[0] = 0;
+  return bounds;
+}
+
+// CONVERSIONS
+
+template<typename T>
+Csr<T> FromCoo(const Coo<T> & a) {
+  long nnz = a.value.size();
+  if (a.rows < 0 || a.cols < 0 || (long) a.row.size() != nnz ||
+      (long) a.column.size() != nnz)
+    throw runtime_error("Sparse: malformed coordinate list");
+  Csr<T> c;
+  c.rows = a.rows;
+  c.cols = a.cols;
+  c.offsets.assign(a.rows + 1, 0);
+  for (long k = 0; k < nnz; k++) {
+    if (a.row[k] < 0 || a.row[k] >= a.rows || a.column[k] < 0 ||
+        a.column[k] >= a.cols)
+      throw runtime_error("Sparse: coordinate out of range");
+    c.offsets[a.row[k] + 1]++;
+  }
+  partial_sum(c.offsets.begin(), c.offsets.end(), c.offsets.begin());
+  // counting sort by row, then by column within each row; duplicates are
+  // summed in input order
+  vector<long> order(nnz);
+  vector<long> next(c.offsets.begin(), c.offsets.end() - 1);
+  for (long k = 0; k < nnz; k++)
+    order[next[a.row[k]]++] = k;
+  c.columns.reserve(nnz);
+  c.values.reserve(nnz);
+  for (int i = 0; i < a.rows; i++) {
+    long begin = c.offsets[i];
+    long end = c.offsets[i + 1];
+    stable_sort(order.begin() + begin, order.begin() + end,
+                [&](long x, long y) { return a.column[x] < a.column[y]; });
+    c.offsets[i] = c.values.size();
+    for (long p = begin; p < end; p++) {
+      long k = order[p];
+      if ((long) c.values.size() > c.offsets[i] &&
+          c.columns.back() == a.column[k]) {
+        c.values.back() += a.value[k];
+      } else {
+        c.columns.push_back(a.column[k]);
+        c.values.push_back(a.value[k]);
+      }
+    }
+  }
+  c.offsets[a.rows] = c.values.size();
+  return c;
+}
+
+template<typename T>
+Coo<T> ToCoo(const Csr<T> & a) {
+  Coo<T> c;
+  c.rows = a.rows;
+  c.cols = a.cols;
+  c.column = a.columns;
+  c.value = a.values;
+  c.row.reserve(a.NonZeros());
+  for (int i = 0; i < a.rows; i++)
+    c.row.insert(c.row.end(), a.offsets[i + 1] - a.offsets[i], i);
+  return c;
+}
+
+// The nonzero elements of a matrix.
+template<typename T>
+Csr<T> FromDense(const Tensor<T> & a) {
+  if (a.NumDimension() != 2)
+    throw runtime_error("Sparse: tensor is not a matrix");
+  Csr<T> c;
+  c.rows = a.Shape()[0];
+  c.cols = a.Shape()[1];
+  c.offsets.assign(c.rows + 1, 0);
+  const T * pa = Base(a);
+  long s0 = a.Stride()[0];
+  long s1 = a.Stride()[1];
+  for (int i = 0; i < c.rows; i++) {
+    for (int j = 0; j < c.cols; j++) {
+      T v = pa[i * s0 + j * s1];
+      if (v != (T) 0) {
+        c.columns.push_back(j);
+        c.values.push_back(v);
+      }
+    }
+    c.offsets[i + 1] = c.values.size();
+  }
+  return c;
+}
+
+template<typename T>
+Tensor<T> ToDense(const Csr<T> & a) {
+  Tensor<T> c = tensor::Zeros<T>(a.Shape());
+  T * pc = Base(c);
+  for (int i = 0; i < a.rows; i++) {
+    for (long k = a.offsets[i]; k < a.offsets[i + 1]; k++)
+      pc[(long) i * a.cols + a.columns[k]] = a.values[k];
+  }
+  return c;
+}
+
+template<typename T>
+Csr<T> Transpose(const Csr<T> & a) {
+  Csr<T> c;
+  c.rows = a.cols;
+  c.cols = a.rows;
+  c.offsets.assign(c.rows + 1, 0);
+  for (auto j : a.columns)
+    c.offsets[j + 1]++;
+  partial_sum(c.offsets.begin(), c.offsets.end(), c.offsets.begin());
+  c.columns.resize(a.NonZeros());
+  c.values.resize(a.NonZeros());
+  // rows of a are visited in order, so columns of c come out sorted
+  vector<long> next(c.offsets.begin(), c.offsets.end() - 1);
+  for (int i = 0; i < a.rows; i++) {
+    for (long k = a.offsets[i]; k < a.offsets[i + 1]; k++) {
+      long p = next[a.columns[k]]++;
+      c.columns[p] = i;
+      c.values[p] = a.values[k];
+    }
+  }
+  return c;
+}
+
+// MATRIX MULTIPLY
+
+// c += a b for sparse a: every nonzero a(i, k) adds a scaled row of b to row
+// i of c.
+template<typename T>
+void MatrixMultiplyAccumulate(const Csr<T> & a, const Tensor<T> & b,
+                              Tensor<T> & c) {
+  if (b.NumDimension() != 2)
+    throw runtime_error("MatrixMultiply: operands are not matrices");
+  if (a.cols != b.Shape()[0])
+    throw runtime_error("MatrixMultiply: inner dimensions do not match");
+  int n = b.Shape()[1];
+  CheckDense(c, a.rows, n);
+  const T * pb = Base(b);
+  T * pc = Base(c);
+  long sb0 = b.Stride()[0], sb1 = b.Stride()[1];
+  long sc0 = c.Stride()[0], sc1 = c.Stride()[1];
+  vector<int> bounds = Partition(a, kChunks);
+  parallel::ParallelFor(kChunks, a.NonZeros() * n, [&](long begin, long end) {
+    for (int i = bounds[begin]; i < bounds[end]; i++) {
+      T * row = pc + i * sc0;
+      for (long k = a.offsets[i]; k < a.offsets[i + 1]; k++) {
+        const T * b_row = pb + a.columns[k] * sb0;
+        T v = a.values[k];
+        if (sb1 == 1 && sc1 == 1) {
+          for (int j = 0; j < n; j++)
+            row[j] += v * b_row[j];
+        } else {
+          for (int j = 0; j < n; j++)
+            row[j * sc1] += v * b_row[j * sb1];
+        }
+      }
+    }
+  });
+}
+
+// c += a b for sparse b: every element a(i, k) scatters row k of b into row
+// i of c.
+template<typename T>
+void MatrixMultiplyAccumulate(const Tensor<T> & a, const Csr<T> & b,
+                              Tensor<T> & c) {
+  if (a.NumDimension() != 2)
+    throw runtime_error("MatrixMultiply: operands are not matrices");
+  if (a.Shape()[1] != b.rows)
+    throw runtime_error("MatrixMultiply: inner dimensions do not match");
+  int m = a.Shape()[0];
+  CheckDense(c, m, b.cols);
+  const T * pa = Base(a);
+  T * pc = Base(c);
+  long sa0 = a.Stride()[0], sa1 = a.Stride()[1];
+  long sc0 = c.Stride()[0], sc1 = c.Stride()[1];
+  parallel::ParallelFor(m, m * b.NonZeros(), [&](long begin, long end) {
+    for (long i = begin; i < end; i++) {
+      const T * a_row = pa + i * sa0;
+      T * row = pc + i * sc0;
+      for (int k = 0; k < b.rows; k++) {
+        T x = a_row[k * sa1];
+        for (long p = b.offsets[k]; p < b.offsets[k + 1]; p++)
+          row[b.columns[p] * sc1] += x * b.values[p];
+      }
+    }
+  });
+}
+
+template<typename T>
+Tensor<T> MatrixMultiply(const Csr<T> & a, const Tensor<T> & b) {
+  if (b.NumDimension() != 2)
+    throw runtime_error("MatrixMultiply: operands are not matrices");
+  Tensor<T> c = tensor::Zeros<T>({a.rows, b.Shape()[1]});
+  MatrixMultiplyAccumulate(a, b, c);
+  return c;
+}
+
+template<typename T>
+Tensor<T> MatrixMultiply(const Tensor<T> & a, const Csr<T> & b) {
+  if (a.NumDimension() != 2)
+    throw runtime_error("MatrixMultiply: operands are not matrices");
+  Tensor<T> c = tensor::Zeros<T>({a.Shape()[0], b.cols});
+  MatrixMultiplyAccumulate(a, b, c);
+  return c;
+}
+
+// ELEMENTWISE
+
+// c += a, touching the nonzeros only.
+template<typename T>
+void Accumulate(const Csr<T> & a, Tensor<T> & c) {
+  CheckDense(c, a.rows, a.cols);
+  T * pc = Base(c);
+  long s0 = c.Stride()[0], s1 = c.Stride()[1];
+  for (int i = 0; i < a.rows; i++) {
+    for (long k = a.offsets[i]; k < a.offsets[i + 1]; k++)
+      pc[i * s0 + a.columns[k] * s1] += a.values[k];
+  }
+}
+
+// a and b merged row by row: f(x, y) at every position either holds (add)
+// or both hold, with 0 for the missing side.
+template<typename T, typename F>
+Csr<T> MergeHelper(const Csr<T> & a, const Csr<T> & b, bool add, F f) {
+  if (a.rows != b.rows || a.cols != b.cols)
+    throw runtime_error("Sparse: shapes do not match");
+  Csr<T> c;
+  c.rows = a.rows;
+  c.cols = a.cols;
+  c.offsets.assign(c.rows + 1, 0);
+  for (int i = 0; i < a.rows; i++) {
+    long p = a.offsets[i], p_end = a.offsets[i + 1];
+    long q = b.offsets[i], q_end = b.offsets[i + 1];
+    while (p < p_end || q < q_end) {
+      int ja = p < p_end ? a.columns[p] : a.cols;
+      int jb = q < q_end ? b.columns[q] : b.cols;
+      int j = min(ja, jb);
+      if (add || ja == jb) {
+        c.columns.push_back(j);
+        c.values.push_back(f(ja == j ? a.values[p] : (T) 0,
+                             jb == j ? b.values[q] : (T) 0));
+      }
+      p += ja == j;
+      q += jb == j;
+    }
+    c.offsets[i + 1] = c.values.size();
+  }
+  return c;
+}
+
+template<typename T>
+Csr<T> Add(const Csr<T> & a, const Csr<T> & b) {
+  return MergeHelper(a, b, true, [](T x, T y) { return x + y; });
+}
+
+template<typename T>
+Csr<T> Multiply(const Csr<T> & a, const Csr<T> & b) {
+  return MergeHelper(a, b, false, [](T x, T y) { return x * y; });
+}
+
+// Dense, since every element of b is kept.
+template<typename T>
+Tensor<T> Add(const Csr<T> & a, const Tensor<T> & b) {
+  CheckDense(b, a.rows, a.cols);
+  Tensor<T> c = tensor::Copy(b);
+  Accumulate(a, c);
+  return c;
+}
+
+template<typename T>
+Tensor<T> Add(const Tensor<T> & a, const Csr<T> & b) {
+  return Add(b, a);
+}
+
+// Sparse, with a's nonzeros scaled by the elements of b at their positions.
+template<typename T>
+Csr<T> Multiply(const Csr<T> & a, const Tensor<T> & b) {
+  CheckDense(b, a.rows, a.cols);
+  Csr<T> c = a;
+  const T * pb = Base(b);
+  long s0 = b.Stride()[0], s1 = b.Stride()[1];
+  for (int i = 0; i < a.rows; i++) {
+    for (long k = a.offsets[i]; k < a.offsets[i + 1]; k++)
+      c.values[k] *= pb[i * s0 + a.columns[k] * s1];
+  }
+  return c;
+}
+
+template<typename T>
+Csr<T> Multiply(const Tensor<T> & a, const Csr<T> & b) {
+  return Multiply(b, a);
+}
+
+}  // namespace sparse
+
+}  // namespace jb
+
+#endif  // JB_SPARSE_H
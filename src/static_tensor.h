@@ -0,0 +1,192 @@
+#ifndef JB_STATIC_TENSOR_H
+#define JB_STATIC_TENSOR_H
+
+#include <vector>
+#include <stdexcept>
+
+#include "src/tensor.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace tensor {
+
+// Tensors whose shape is part of the type.  Strides and sizes are computed
+// at compile time, elements are stored inline (no heap allocation, no
+// reference counting), and kernels over small shapes are fully unrolled.
+// Meant for small fixed-size math (3x3 rotations, 4x4 transforms, tiny
+// MLP layers); convert to and from Tensor<T> at the boundaries.
+
+// UTILITY TYPES
+
+template<int... Dims>
+struct StaticShape {
+  static constexpr int kNumDimension = sizeof...(Dims);
+  static constexpr int kDims[sizeof...(Dims)] = {Dims...};
+  static constexpr int Dim(int i) { return kDims[i]; }
+  static constexpr int Stride(int i) {
+    return i + 1 >= kNumDimension ? 1 : Dim(i + 1) * Stride(i + 1);
+  }
+  static constexpr int Size() { return Dim(0) * Stride(0); }
+};
+
+template<int... Dims>
+constexpr int StaticShape<Dims...>::kDims[sizeof...(Dims)];
+
+// Calls f(0), f(1), ..., f(N - 1).  Unrolled at compile time for small N.
+const int kUnrollLimit = 64;
+
+template<int N, bool Unrolled = (N <= kUnrollLimit)>
+struct For {
+  template<typename F>
+  static void Run(F & f) {
+    For<N - 1>::Run(f);
+    f(N - 1);
+  }
+};
+
+template<bool Unrolled>
+struct For<0, Unrolled> {
+  template<typename F>
+  static void Run(F &) {}
+};
+
+template<int N>
+struct For<N, false> {
+  template<typename F>
+  static void Run(F & f) {
+    for (int i = 0; i < N; i++)
+      f(i);
+  }
+};
+
+// STATIC TENSOR CLASS
+
+template<typename T, int... Dims>
+class StaticTensor {
+public:
+  typedef StaticShape<Dims...> Shape;
+  static constexpr int kSize = Shape::Size();
+
+  StaticTensor() : data() {};  // zeros
+
+  static vector<int> ShapeVector() { return {Dims...}; };
+  static constexpr int Size() { return kSize; };
+  static constexpr int NumDimension() { return Shape::kNumDimension; };
+
+  T & operator[](int i) { return data[i]; };
+  const T & operator[](int i) const { return data[i]; };
+  template<typename... Index>
+  T & At(Index... index) { return data[DataIndex(index...)]; };
+  template<typename... Index>
+  T Get(Index... index) const { return data[DataIndex(index...)]; };
+  T * Data() { return data; };
+  const T * Data() const { return data; };
+
+  template<typename... Index>
+  static constexpr int DataIndex(Index... index) {
+    static_assert(sizeof...(Index) == sizeof...(Dims),
+                  "StaticTensor: wrong number of indices");
+    return Offset(0, index...);
+  }
+
+private:
+  static constexpr int Offset(int) { return 0; }
+  template<typename... Rest>
+  static constexpr int Offset(int dim, int i, Rest... rest) {
+    return i * Shape::Stride(dim) + Offset(dim + 1, rest...);
+  }
+  T data[kSize];
+};
+
+template<typename T, int... Dims>
+constexpr int StaticTensor<T, Dims...>::kSize;
+
+// CONVERSIONS
+
+template<typename T, int... Dims>
+Tensor<T> ToTensor(const StaticTensor<T, Dims...> & a) {
+  Tensor<T> t = Empty<T>(a.ShapeVector());
+  Import(a.Data(), t);
+  return t;
+}
+
+template<typename S, typename T>
+S FromTensor(const Tensor<T> & a) {
+  if (a.Shape() != S::ShapeVector())
+    throw runtime_error("FromTensor: shape does not match");
+  S s;
+  Export(a, s.Data());
+  return s;
+}
+
+// STATIC TENSOR FRIENDS
+
+template<typename T, int... Dims, typename F>
+StaticTensor<T, Dims...> Apply(const StaticTensor<T, Dims...> & a, F f) {
+  StaticTensor<T, Dims...> c;
+  auto body = [&](int i) { c[i] = f(a[i]); };
+  For<StaticTensor<T, Dims...>::kSize>::Run(body);
+  return c;
+}
+
+template<typename T, int... Dims>
+StaticTensor<T, Dims...> Add(const StaticTensor<T, Dims...> & a,
+                             const StaticTensor<T, Dims...> & b) {
+  StaticTensor<T, Dims...> c;
+  auto body = [&](int i) { c[i] = a[i] + b[i]; };
+  For<StaticTensor<T, Dims...>::kSize>::Run(body);
+  return c;
+}
+
+template<typename T, int... Dims>
+StaticTensor<T, Dims...> Multiply(const StaticTensor<T, Dims...> & a,
+                                  const StaticTensor<T, Dims...> & b) {
+  StaticTensor<T, Dims...> c;
+  auto body = [&](int i) { c[i] = a[i] * b[i]; };
+  For<StaticTensor<T, Dims...>::kSize>::Run(body);
+  return c;
+}
+
+template<typename T, int... Dims>
+StaticTensor<T, Dims...> Subtract(const StaticTensor<T, Dims...> & a,
+                                  const StaticTensor<T, Dims...> & b) {
+  StaticTensor<T, Dims...> c;
+  auto body = [&](int i) { c[i] = a[i] - b[i]; };
+  For<StaticTensor<T, Dims...>::kSize>::Run(body);
+  return c;
+}
+
+template<typename T, int... Dims>
+StaticTensor<T, Dims...> Negate(const StaticTensor<T, Dims...> & a) {
+  StaticTensor<T, Dims...> c;
+  auto body = [&](int i) { c[i] = -a[i]; };
+  For<StaticTensor<T, Dims...>::kSize>::Run(body);
+  return c;
+}
+
+// Fully unrolled for small shapes: every (i, j, k) is a compile-time
+// constant, so the products become straight-line multiply-adds.
+template<typename T, int M, int K, int N>
+StaticTensor<T, M, N> MatrixMultiply(const StaticTensor<T, M, K> & a,
+                                     const StaticTensor<T, K, N> & b) {
+  StaticTensor<T, M, N> c;
+  auto row = [&](int i) {
+    auto col = [&](int j) {
+      T val = 0;
+      auto inner = [&](int k) { val += a[i * K + k] * b[k * N + j]; };
+      For<K>::Run(inner);
+      c[i * N + j] = val;
+    };
+    For<N>::Run(col);
+  };
+  For<M>::Run(row);
+  return c;
+}
+
+}  // namespace tensor
+
+}  // namespace jb
+
+#endif  // JB_STATIC_TENSOR_H
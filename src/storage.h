@@ -0,0 +1,159 @@
+#ifndef JB_STORAGE_H
+#define JB_STORAGE_H
+
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/pool.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace storage {
+
+// Backing memory for tensors.  A storage is a flat array of elements shared
+// (through shared_ptr) by every view onto it.  HeapStorage owns a pooled
+// buffer (src/pool.h); MappedStorage points into a memory mapped file and
+// keeps the mapping alive, so tensors loaded from disk cost no copy and share
+// the page cache with every other process mapping the same file.  Mapped
+// storage stays writable: a write does not fail, it silently gives the
+// process a private copy of each page it touches (see MappedFile), which
+// forfeits the sharing for those pages.  Reading through the mutable
+// accessors copies nothing; IsMapped() tells mapped storage apart.
+//
+// The element accessors keep std::vector's names, so code written against
+// the old vector backed Tensor::Data() keeps working.
+
+template<typename T>
+class Storage {
+public:
+  virtual ~Storage() {};
+
+  T * data() { return elements; };
+  const T * data() const { return elements; };
+  long size() const { return count; };
+  T & operator[](long i) { return elements[i]; };
+  const T & operator[](long i) const { return elements[i]; };
+  T * begin() { return elements; };
+  T * end() { return elements + count; };
+  const T * begin() const { return elements; };
+  const T * end() const { return elements + count; };
+
+  // Overwrites the elements in order; the size can not change.
+  Storage & operator=(initializer_list<T> values);
+
+  virtual bool IsMapped() const { return false; };
+
+protected:
+  Storage() : elements(nullptr), count(0) {};
+  T * elements;
+  long count;
+
+private:
+  Storage(const Storage &);
+  Storage & operator=(const Storage &);
+};
+
+template<typename T>
+Storage<T> & Storage<T>::operator=(initializer_list<T> values) {
+  if ((long) values.size() != count)
+    throw runtime_error("Storage: assigned values do not match the size");
+  copy(values.begin(), values.end(), elements);
+  return *this;
+}
+
+// A buffer from the tensor pool, zeroed unless the caller is about to
+// overwrite every element.
+template<typename T>
+class HeapStorage : public Storage<T> {
+  static_assert(is_trivially_copyable<T>::value,
+                "HeapStorage: elements are never constructed");
+public:
+  HeapStorage(long size, bool zero = true) {
+    this->elements = (T *) pool::Allocate(size * sizeof(T));
+    this->count = size;
+    if (zero)
+      memset(this->elements, 0, size * sizeof(T));
+  };
+  ~HeapStorage() { pool::Free(this->elements, this->count * sizeof(T)); }
+};
+
+// A whole file mapped copy-on-write (PROT_WRITE, MAP_PRIVATE): the pages are
+// shared with the page cache until written.  A write never fails; the
+// kernel copies the touched page into private, process-only memory, so the
+// file is never modified and other processes never see the change.
+class MappedFile {
+public:
+  MappedFile(const string & path);
+  ~MappedFile();
+  const char * Data() const { return (const char *) address; };
+  char * DataMutable() { return (char *) address; };
+  long Size() const { return length; };
+private:
+  MappedFile(const MappedFile &);
+  MappedFile & operator=(const MappedFile &);
+  void * address;
+  long length;
+};
+
+MappedFile::MappedFile(const string & path) : address(nullptr), length(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("MappedFile: cannot open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error("MappedFile: cannot stat " + path);
+  }
+  length = st.st_size;
+  if (length > 0) {
+    address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   0);
+    if (address == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("MappedFile: cannot map " + path);
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (address)
+    munmap(address, length);
+}
+
+template<typename T>
+class MappedStorage : public Storage<T> {
+public:
+  // `size` elements starting `byte_offset` bytes into the file.
+  MappedStorage(shared_ptr<MappedFile> file, long byte_offset, long size)
+      : file(file) {
+    if (byte_offset < 0 || size < 0 ||
+        byte_offset + size * (long) sizeof(T) > file->Size())
+      throw runtime_error("MappedStorage: region exceeds the file");
+    if (byte_offset % alignof(T) != 0)
+      throw runtime_error("MappedStorage: region is misaligned");
+    this->elements = (T *) (file->DataMutable() + byte_offset);
+    this->count = size;
+  };
+  bool IsMapped() const override { return true; };
+private:
+  shared_ptr<MappedFile> file;
+};
+
+}  // namespace storage
+
+}  // namespace jb
+
+#endif  // JB_STORAGE_H
@@ -0,0 +1,156 @@
+#ifndef JB_STRIDED_H
+#define JB_STRIDED_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include "src/elementwise.h"
+#include "src/parallel.h"
+#include "src/reduce.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace strided {
+
+// Copies between two strided layouts of the same shape: the engine behind
+// tensor::Copy, Move, Export and Import.  A copy may visit elements in any
+// order, so the loop is first reordered to walk the destination front to
+// back and then collapsed (elementwise::Collapse).  What is left picks the
+// inner kernel:
+//
+//   both innermost strides 1       memcpy per row
+//   destination innermost stride   tiled transpose between the destination's
+//   1, source stride 1 elsewhere   and the source's contiguous dimensions
+//   otherwise                      a strided loop per row
+//
+// Large copies split their outermost dimension across threads.
+
+using elementwise::Loop;
+
+const int kTile = 32;  // edge of a transpose tile, in elements
+
+// UTILITY FUNCTIONS
+
+// Orders the dimensions by decreasing destination stride (operand 0).
+void SortByOutput(Loop & loop) {
+  int ndim = loop.shape.size();
+  vector<int> order(ndim);
+  iota(order.begin(), order.end(), 0);
+  const vector<long> & out = loop.strides[0];
+  stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return abs(out[a]) > abs(out[b]);
+  });
+  Loop sorted;
+  sorted.strides.resize(loop.strides.size());
+  for (int d : order) {
+    sorted.shape.push_back(loop.shape[d]);
+    for (int k = 0; k < (int) loop.strides.size(); k++)
+      sorted.strides[k].push_back(loop.strides[k][d]);
+  }
+  loop = sorted;
+}
+
+// INNER KERNELS
+
+// dst[i * dst_row + j] = src[i + j * src_column] for a rows x columns
+// block, in kTile x kTile tiles so that the lines read from the source
+// stay in cache until all of their elements are used.
+template<typename T>
+void TransposeBlock(int rows, int columns, T * dst, long dst_row,
+                    const T * src, long src_column) {
+  for (int i0 = 0; i0 < rows; i0 += kTile) {
+    int i1 = min(rows, i0 + kTile);
+    for (int j0 = 0; j0 < columns; j0 += kTile) {
+      int j1 = min(columns, j0 + kTile);
+      for (int i = i0; i < i1; i++) {
+        T * d = dst + i * dst_row;
+        const T * s = src + i;
+        for (int j = j0; j < j1; j++)
+          d[j] = s[j * src_column];
+      }
+    }
+  }
+}
+
+// One thread's share of a sorted and collapsed loop.
+template<typename T>
+void CopyLoop(const Loop & loop, T * dst, const T * src) {
+  int ndim = loop.shape.size();
+  int n = loop.shape.back();
+  const vector<long> & ds = loop.strides[0];
+  const vector<long> & ss = loop.strides[1];
+  if (ds.back() == 1 && ss.back() == 1) {
+    elementwise::ForEachRow(loop, [&](const long * offsets) {
+      memcpy(dst + offsets[0], src + offsets[1], n * sizeof(T));
+    });
+    return;
+  }
+  int k = -1;
+  for (int d = 0; d < ndim - 1 && ds.back() == 1; d++) {
+    if (ss[d] == 1)
+      k = d;
+  }
+  if (k >= 0) {
+    // the other dimensions, with a unit row so ForEachRow visits each block
+    Loop outer;
+    outer.strides.resize(2);
+    for (int d = 0; d < ndim - 1; d++) {
+      if (d == k)
+        continue;
+      outer.shape.push_back(loop.shape[d]);
+      outer.strides[0].push_back(ds[d]);
+      outer.strides[1].push_back(ss[d]);
+    }
+    outer.shape.push_back(1);
+    outer.strides[0].push_back(0);
+    outer.strides[1].push_back(0);
+    elementwise::ForEachRow(outer, [&](const long * offsets) {
+      TransposeBlock(loop.shape[k], n, dst + offsets[0], ds[k],
+                     src + offsets[1], ss.back());
+    });
+    return;
+  }
+  elementwise::ForEachRow(loop, [&](const long * offsets) {
+    elementwise::UnaryRow(n, dst + offsets[0], ds.back(), src + offsets[1],
+                          ss.back(), elementwise::IdentityFunctor());
+  });
+}
+
+// ENGINE
+
+// dst = src, elementwise over `shape`.  The two may not overlap, unless they
+// are the same elements in the same layout.
+template<typename T>
+void Copy(const vector<int> & shape, T * dst, const vector<long> & dst_stride,
+          const T * src, const vector<long> & src_stride) {
+  if (dst == src && dst_stride == src_stride)
+    return;
+  Loop loop;
+  loop.shape = shape;
+  loop.strides = {dst_stride, src_stride};
+  long size = 1;
+  for (int s : shape)
+    size *= s;
+  if (size == 0)
+    return;
+  SortByOutput(loop);
+  elementwise::Collapse(loop);
+  long ds = loop.strides[0][0];
+  long ss = loop.strides[1][0];
+  parallel::ParallelFor(loop.shape[0], size, [&](long begin, long end) {
+    Loop part = loop;
+    part.shape[0] = end - begin;
+    CopyLoop(part, dst + begin * ds, src + begin * ss);
+  });
+}
+
+}  // namespace strided
+
+}  // namespace jb
+
+#endif  // JB_STRIDED_H
@@ -7,6 +7,14 @@
 #include <memory>
 #include <algorithm>
 
+#include "src/conv.h"
+#include "src/gemm.h"
+#include "src/half.h"
+#include "src/storage.h"
+#include "src/elementwise.h"
+#include "src/reduce.h"
+#include "src/strided.h"
+
 #define TENSOR_TYPE(type, name) typedef type name;
 
 using namespace std;
@@ -21,18 +29,24 @@ TENSOR_TYPE(int8_t, Int8)
 TENSOR_TYPE(int16_t, Int16)
 TENSOR_TYPE(int32_t, Int32)
 TENSOR_TYPE(int64_t, Int64)
+TENSOR_TYPE(half::Float16, Float16)
+TENSOR_TYPE(half::BFloat16, BFloat16)
 
 template<typename T>
 class Tensor;
 
 // UTILITY FUNCTIONS
 
-vector<int> ShapeToStrides(const vector<int> &shape) {
+// Row-major strides, 64-bit: a tensor may hold more than 2^31 elements (each
+// dimension's extent is an int).
+vector<long> ShapeToStrides(const vector<int> &shape) {
   int ndim = (int)shape.size();
-  vector<int> strides(ndim);
+  vector<long> strides(ndim);
+  if (ndim == 0)
+    return strides;
   strides[ndim - 1] = 1;
   for (int i = ndim - 2; i >= 0; i--) {
-    strides[i] = shape[i + 1] * strides[i + 1];
+    strides[i] = (long) shape[i + 1] * strides[i + 1];
   }
   return strides;
 }
@@ -44,7 +58,18 @@ Tensor<T> Zeros(vector<int> shape) {
   t.shape = shape;
   t.stride = ShapeToStrides(shape);
   t.offset = 0;
-  t.data = make_shared<vector<T>>(t.Size());
+  t.data = make_shared<storage::HeapStorage<T>>(t.Size());
+  return t;
+}
+
+// Uninitialized: for outputs whose every element is about to be written.
+template<typename T>
+Tensor<T> Empty(vector<int> shape) {
+  Tensor<T> t;
+  t.shape = shape;
+  t.stride = ShapeToStrides(shape);
+  t.offset = 0;
+  t.data = make_shared<storage::HeapStorage<T>>(t.Size(), false);
   return t;
 }
 
@@ -54,7 +79,7 @@ Tensor<T> Ones(vector<int> shape) {
   t.shape = shape;
   t.stride = ShapeToStrides(shape);
   t.offset = 0;
-  t.data = make_shared<vector<T>>(t.Size());
+  t.data = make_shared<storage::HeapStorage<T>>(t.Size(), false);
   for (auto &d : t.DataMutable())
     d = 1;
   return t;
@@ -103,74 +128,387 @@ Tensor<T> Slice(const Tensor<T> & other, vector<int> start, vector<int>
   return t;
 }
 
+// Contiguous view of the given shape over the leading elements of a
+// contiguous tensor's data.  Used to carve outputs out of reusable buffers.
+template<typename T>
+Tensor<T> View(const Tensor<T> & other, vector<int> shape) {
+  if (!other.IsContiguous())
+    throw runtime_error("View: tensor is not contiguous");
+  Tensor<T> t;
+  t.data = other.data;
+  t.offset = other.offset;
+  t.shape = shape;
+  t.stride = ShapeToStrides(shape);
+  if (t.offset + t.Size() > other.data->size())
+    throw runtime_error("View: shape exceeds tensor data");
+  return t;
+}
+
+// Matrix transpose as a view: the strides are swapped, no data is moved.
+template<typename T>
+Tensor<T> Transpose(const Tensor<T> & other) {
+  if (other.NumDimension() != 2)
+    throw runtime_error("Transpose: tensor is not a matrix");
+  Tensor<T> t = other;
+  swap(t.shape[0], t.shape[1]);
+  swap(t.stride[0], t.stride[1]);
+  return t;
+}
+
+// Views of a tensor's slices along its leading dimension, which is
+// dropped: the inverse of Stack(), without a copy.
+template<typename T>
+vector<Tensor<T>> Unstack(const Tensor<T> & other) {
+  if (other.NumDimension() == 0)
+    throw runtime_error("Unstack: tensor is a scalar");
+  vector<Tensor<T>> slices(other.shape[0]);
+  for (int i = 0; i < other.shape[0]; i++) {
+    Tensor<T> & t = slices[i];
+    t.data = other.data;
+    t.offset = other.offset + i * other.stride[0];
+    t.shape.assign(other.shape.begin() + 1, other.shape.end());
+    t.stride.assign(other.stride.begin() + 1, other.stride.end());
+  }
+  return slices;
+}
+
+// Tensor over existing storage, e.g. a region of a mapped file.  Every
+// element the shape and strides can reach must lie inside the storage.
+template<typename T>
+Tensor<T> FromStorage(shared_ptr<storage::Storage<T>> data, vector<int> shape,
+                      vector<long> stride, long offset) {
+  if (shape.size() != stride.size())
+    throw runtime_error("FromStorage: shape and stride do not match");
+  long lo = offset, hi = offset;
+  bool empty = false;
+  for (int i = 0; i < (int) shape.size(); i++) {
+    if (shape[i] <= 0)
+      empty = true;
+    else if (stride[i] < 0)
+      lo += stride[i] * (shape[i] - 1);
+    else
+      hi += stride[i] * (shape[i] - 1);
+  }
+  if (!empty && (lo < 0 || hi >= data->size()))
+    throw runtime_error("FromStorage: tensor exceeds storage");
+  Tensor<T> t;
+  t.data = data;
+  t.shape = shape;
+  t.stride = stride;
+  t.offset = offset;
+  return t;
+}
+
+// Copies go through the copy engine (src/strided.h): contiguous runs become
+// memcpy, transposed layouts are copied in cache sized tiles, and large
+// copies are split across threads.
 template<typename T>
 Tensor<T> Copy(const Tensor<T> & src) {
-  Tensor<T> dst = Zeros<T>(src.shape);
-  MoveHelper(src, dst, src.offset, dst.offset, 0);
+  Tensor<T> dst = Empty<T>(src.shape);
+  Move(src, dst);
   return dst;
 }
 
 template<typename T>
 void Move(const Tensor<T> & src, Tensor<T> & dst) {
-  MoveHelper(src, dst, src.offset, dst.offset, 0);
+  if (src.shape != dst.shape)
+    throw runtime_error("Move: tensors have different shapes");
+  strided::Copy(src.shape, dst.data->data() + dst.offset, dst.stride,
+                src.data->data() + src.offset, src.stride);
 }
 
+// The dimensions reordered, as a view: dimension i of the result is
+// dimension axes[i] of other.
 template<typename T>
-void MoveHelper(const Tensor<T> & a, Tensor<T> & b, int da, int db, int dim) {
-  if (dim < a.NumDimension()) {
-    int stride_a = a.stride[dim];
-    int stride_b = b.stride[dim];
-    int shape = a.shape[dim];
-    for (int i = 0; i < shape; i++) {
-      MoveHelper<T>(a, b, da + i * stride_a, db + i * stride_b, dim + 1);
-    }
-  } else {
-    b.data->at(db) = a.data->at(da);
+Tensor<T> Permute(const Tensor<T> & other, const vector<int> & axes) {
+  int ndim = other.NumDimension();
+  if ((int) axes.size() != ndim)
+    throw runtime_error("Permute: wrong number of axes");
+  vector<bool> seen(ndim, false);
+  Tensor<T> t = other;
+  for (int i = 0; i < ndim; i++) {
+    if (axes[i] < 0 || axes[i] >= ndim || seen[axes[i]])
+      throw runtime_error("Permute: axes are not a permutation");
+    seen[axes[i]] = true;
+    t.shape[i] = other.shape[axes[i]];
+    t.stride[i] = other.stride[axes[i]];
   }
+  return t;
+}
+
+// Dimensions a and b swapped, as a view.
+template<typename T>
+Tensor<T> Transpose(const Tensor<T> & other, int a, int b) {
+  vector<int> axes(other.NumDimension());
+  iota(axes.begin(), axes.end(), 0);
+  if (a < 0 || a >= (int) axes.size() || b < 0 || b >= (int) axes.size())
+    throw runtime_error("Transpose: axis out of range");
+  swap(axes[a], axes[b]);
+  return Permute(other, axes);
+}
+
+// other itself when it is contiguous, else a contiguous copy: materializes
+// views such as Permute() for kernels that need dense rows.
+template<typename T>
+Tensor<T> Contiguous(const Tensor<T> & other) {
+  return other.IsContiguous() ? other : Copy(other);
 }
 
 // TENSOR FRIENDS
 
+// Elementwise kernels broadcast their operands (numpy rules) and respect the
+// offset and stride of views.  The three argument forms write into an
+// existing tensor c of the broadcast shape; c may be one of the operands.
+
+template<typename T, typename F>
+void UnaryHelper(const Tensor<T> & a, Tensor<T> & c, F f) {
+  if (a.shape != c.shape)
+    throw runtime_error("Elementwise: output has the wrong shape");
+  elementwise::Loop loop;
+  loop.shape = c.shape;
+  loop.strides = {c.stride, a.stride};
+  elementwise::Unary(loop, c.data->data() + c.offset,
+                     a.data->data() + a.offset, f);
+}
+
+// c = f(a) elementwise where c's element type differs from a's.
+template<typename T, typename U, typename F>
+void ConvertHelper(const Tensor<T> & a, Tensor<U> & c, F f) {
+  if (a.shape != c.shape)
+    throw runtime_error("Elementwise: output has the wrong shape");
+  elementwise::Loop loop;
+  loop.shape = c.shape;
+  loop.strides = {c.stride, a.stride};
+  elementwise::Unary(loop, c.data->data() + c.offset,
+                     a.data->data() + a.offset, f);
+}
+
+template<typename U, typename T>
+struct CastFunctor {
+  U operator()(T x) const { return (U) x; }
+};
+
+// Element type conversion, e.g. Float32 to Float16 storage and back.
+template<typename U, typename T>
+Tensor<U> Cast(const Tensor<T> & a) {
+  Tensor<U> c = Empty<U>(a.Shape());
+  ConvertHelper(a, c, CastFunctor<U, T>());
+  return c;
+}
+
+template<typename T, typename F>
+void BinaryHelper(const Tensor<T> & a, const Tensor<T> & b, Tensor<T> & c,
+                  F f) {
+  if (elementwise::BroadcastShape(a.shape, b.shape) != c.shape)
+    throw runtime_error("Elementwise: output has the wrong shape");
+  elementwise::Loop loop;
+  loop.shape = c.shape;
+  loop.strides = {c.stride,
+                  elementwise::BroadcastStrides(a.shape, a.stride, c.shape),
+                  elementwise::BroadcastStrides(b.shape, b.stride, c.shape)};
+  elementwise::Binary(loop, c.data->data() + c.offset,
+                      a.data->data() + a.offset, b.data->data() + b.offset, f);
+}
+
+// Calls f(n, c_row, c_stride, input_rows, input_strides) for every row of
+// the broadcast loop over the inputs.  Building block for fused kernels.
+template<typename T, typename F>
+void NaryHelper(const vector<const Tensor<T> *> & inputs, Tensor<T> & c,
+                F f) {
+  elementwise::Loop loop;
+  loop.shape = c.shape;
+  loop.strides.push_back(c.stride);
+  for (auto input : inputs)
+    loop.strides.push_back(elementwise::BroadcastStrides(
+        input->shape, input->stride, c.shape));
+  elementwise::Collapse(loop);
+  int n = loop.shape.back();
+  int nops = loop.strides.size();
+  vector<long> row_strides(nops);
+  for (int k = 0; k < nops; k++)
+    row_strides[k] = loop.strides[k].back();
+  vector<const T *> rows(inputs.size());
+  elementwise::ForEachRow(loop, [&](const long * offsets) {
+    for (int k = 0; k < inputs.size(); k++)
+      rows[k] = inputs[k]->data->data() + inputs[k]->offset + offsets[k + 1];
+    f(n, c.data->data() + c.offset + offsets[0], row_strides[0], rows.data(),
+      row_strides.data() + 1);
+  });
+}
+
+// Copy a tensor's elements, in row-major order, out to or in from a flat
+// array.
+template<typename T>
+void Export(const Tensor<T> & a, T * out) {
+  strided::Copy(a.shape, out, ShapeToStrides(a.shape),
+                a.data->data() + a.offset, a.stride);
+}
+
+template<typename T>
+void Import(const T * in, Tensor<T> & c) {
+  strided::Copy(c.shape, c.data->data() + c.offset, c.stride, in,
+                ShapeToStrides(c.shape));
+}
+
+template<typename T>
+void Fill(Tensor<T> & c, T value) {
+  UnaryHelper(c, c, elementwise::ConstantFunctor<T>{value});
+}
+
+// Accumulating kernels, the building blocks of gradients.  c's shape must
+// broadcast to the shape of the operands; the dimensions c is broadcast
+// along are summed out (the adjoint of broadcasting).  AccumulateHelper
+// computes c = f(c, a, b) per element.
+
+template<typename T, typename F>
+void AccumulateHelper(const Tensor<T> & a, const Tensor<T> & b, Tensor<T> & c,
+                      F f) {
+  vector<int> shape = elementwise::BroadcastShape(a.shape, b.shape);
+  if (elementwise::BroadcastShape(shape, c.shape) != shape)
+    throw runtime_error("Accumulate: output has the wrong shape");
+  vector<long> c_strides = elementwise::BroadcastStrides(c.shape, c.stride,
+                                                        shape);
+  elementwise::Loop loop;
+  loop.shape = shape;
+  loop.strides = {c_strides, c_strides,
+                  elementwise::BroadcastStrides(a.shape, a.stride, shape),
+                  elementwise::BroadcastStrides(b.shape, b.stride, shape)};
+  T * out = c.data->data() + c.offset;
+  elementwise::Ternary(loop, out, (const T *) out, a.data->data() + a.offset,
+                       b.data->data() + b.offset, f);
+}
+
+// c += a
+template<typename T>
+void Accumulate(const Tensor<T> & a, Tensor<T> & c) {
+  vector<long> c_strides = elementwise::BroadcastStrides(c.shape, c.stride,
+                                                        a.shape);
+  elementwise::Loop loop;
+  loop.shape = a.shape;
+  loop.strides = {c_strides, c_strides, a.stride};
+  T * out = c.data->data() + c.offset;
+  elementwise::Binary(loop, out, (const T *) out, a.data->data() + a.offset,
+                      elementwise::AddFunctor());
+}
+
+// c += a * b
+template<typename T>
+void MultiplyAccumulate(const Tensor<T> & a, const Tensor<T> & b,
+                        Tensor<T> & c) {
+  AccumulateHelper(a, b, c, elementwise::MultiplyAddFunctor());
+}
+
+// Tensors of one shape stacked along a new leading dimension.
+template<typename T>
+Tensor<T> Stack(const vector<Tensor<T>> & tensors) {
+  if (tensors.empty())
+    throw runtime_error("Stack: no tensors");
+  vector<int> shape = tensors[0].Shape();
+  shape.insert(shape.begin(), tensors.size());
+  Tensor<T> c = Empty<T>(shape);
+  long size = tensors[0].Size();
+  for (int i = 0; i < (int) tensors.size(); i++) {
+    if (tensors[i].Shape() != tensors[0].Shape())
+      throw runtime_error("Stack: shapes do not match");
+    Export(tensors[i], c.DataMutable().data() + i * size);
+  }
+  return c;
+}
+
+template<typename T>
+void Add(const Tensor<T> & a, const Tensor<T> & b, Tensor<T> & c) {
+  BinaryHelper(a, b, c, elementwise::AddFunctor());
+}
+
+template<typename T>
+void Multiply(const Tensor<T> & a, const Tensor<T> & b, Tensor<T> & c) {
+  BinaryHelper(a, b, c, elementwise::MultiplyFunctor());
+}
+
+template<typename T>
+void Subtract(const Tensor<T> & a, const Tensor<T> & b, Tensor<T> & c) {
+  BinaryHelper(a, b, c, elementwise::SubtractFunctor());
+}
+
+template<typename T>
+void Negate(const Tensor<T> & a, Tensor<T> & c) {
+  UnaryHelper(a, c, elementwise::NegateFunctor());
+}
+
+// f is any callable taking and returning T.  Functors and lambdas are
+// inlined into the elementwise loop, so cheap ones vectorize; a function
+// pointer costs an indirect call per element.  On large tensors f runs on
+// several threads at once, so it must not modify shared state.
+template<typename T, typename F>
+void Apply(const Tensor<T> & a, F f, Tensor<T> & c) {
+  UnaryHelper(a, c, f);
+}
+
+// The function pointer forms, so overloaded functions (std::abs) resolve.
+template<typename T>
+void Apply(const Tensor<T> & a, T (*f)(T), Tensor<T> & c) {
+  UnaryHelper(a, c, f);
+}
+
 template<typename T>
 Tensor<T> Add(const Tensor<T> & a, const Tensor<T> & b) {
-  Tensor<T> c = Zeros<T>(a.shape);
-  for (int i = 0; i < c.Size(); i++)
-    c.data->at(i) = a.data->at(i) + b.data->at(i);
+  Tensor<T> c = Empty<T>(elementwise::BroadcastShape(a.Shape(), b.Shape()));
+  Add(a, b, c);
   return c;
 }
 
 template<typename T>
 Tensor<T> Multiply(const Tensor<T> & a, const Tensor<T> & b) {
-  Tensor<T> c = Zeros<T>(a.shape);
-  for (int i = 0; i < c.Size(); i++)
-    c.data->at(i) = a.data->at(i) * b.data->at(i);
+  Tensor<T> c = Empty<T>(elementwise::BroadcastShape(a.Shape(), b.Shape()));
+  Multiply(a, b, c);
   return c;
 }
 
 template<typename T>
 Tensor<T> Subtract(const Tensor<T> & a, const Tensor<T> & b) {
-  Tensor<T> c = Zeros<T>(a.shape);
-  for (int i = 0; i < c.Size(); i++)
-    c.data->at(i) = a.data->at(i) - b.data->at(i);
+  Tensor<T> c = Empty<T>(elementwise::BroadcastShape(a.Shape(), b.Shape()));
+  Subtract(a, b, c);
   return c;
 }
 
 template<typename T>
 Tensor<T> Negate(const Tensor<T> & a) {
-  Tensor<T> c = Zeros<T>(a.shape);
-  for (int i = 0; i < c.Size(); i++)
-    c.data->at(i) = -a.data->at(i);
+  Tensor<T> c = Empty<T>(a.Shape());
+  Negate(a, c);
+  return c;
+}
+
+template<typename T, typename F>
+Tensor<T> Apply(const Tensor<T> & a, F f) {
+  Tensor<T> c = Empty<T>(a.Shape());
+  UnaryHelper(a, c, f);
   return c;
 }
 
 template<typename T>
 Tensor<T> Apply(const Tensor<T> & a, T (*f)(T)) {
-  Tensor<T> c = Zeros<T>(a.shape);
-  for (int i = 0; i < c.Size(); i++)
-    c.data->at(i) = f(a.data->at(i));
+  Tensor<T> c = Empty<T>(a.Shape());
+  UnaryHelper(a, c, f);
   return c;
 }
 
+// c += a b, through the operands' strides (so Transpose() views are free).
+// c may be of a wider type than a and b, e.g. Int32 for Int8 operands.
+template<typename T, typename TC>
+void MatrixMultiplyAccumulate(const Tensor<T> & a, const Tensor<T> & b,
+                              Tensor<TC> & c) {
+  if (a.NumDimension() != 2 || b.NumDimension() != 2 ||
+      c.NumDimension() != 2)
+    throw runtime_error("MatrixMultiply: operands are not matrices");
+  if (a.Shape()[1] != b.Shape()[0] || c.Shape()[0] != a.Shape()[0] ||
+      c.Shape()[1] != b.Shape()[1])
+    throw runtime_error("MatrixMultiply: dimensions do not match");
+  gemm::Gemm<T, TC>(c.Shape()[0], c.Shape()[1], a.Shape()[1],
+                    a.data->data() + a.offset, a.stride[0], a.stride[1],
+                    b.data->data() + b.offset, b.stride[0], b.stride[1],
+                    c.data->data() + c.offset, c.stride[0], c.stride[1]);
+}
+
 template<typename T>
 Tensor<T> MatrixMultiply(const Tensor<T> & a, const Tensor<T> & b) {
   if (a.NumDimension() != 2)
@@ -181,17 +519,105 @@ Tensor<T> MatrixMultiply(const Tensor<T> & a, const Tensor<T> & b) {
     throw runtime_error("MatrixMultiply: inner dimensions do not match");
 
   Tensor<T> c = Zeros<T>({a.Shape()[0], b.Shape()[1]});
-  int inner_dim = a.Shape()[1];
-
-  for (int i = 0; i < c.Shape()[0]; i++) {
-    for (int j = 0; j < c.Shape()[1]; j++) {
-      int val = 0;
-      for (int k = 0; k < inner_dim; k++) {
-        val += a.Get({i, k}) * b.Get({k, j});
-      }
-      c.At({i, j}) = val;
+  gemm::Gemm<T>(c.Shape()[0], c.Shape()[1], a.Shape()[1],
+                a.data->data() + a.offset, a.stride[0], a.stride[1],
+                b.data->data() + b.offset, b.stride[0], b.stride[1],
+                c.data->data(), c.stride[0], c.stride[1]);
+  return c;
+}
+
+// 2-D convolution of NCHW images x with filters w (o, c / groups, kh, kw)
+// into c (n, o, oh, ow), see src/conv.h.  Views are made contiguous first.
+template<typename T>
+void Conv2D(const Tensor<T> & x, const Tensor<T> & w, Tensor<T> & c,
+            const conv::Params & p = conv::Params()) {
+  conv::Geometry g = conv::MakeGeometry(x.Shape(), w.Shape(), p);
+  if (c.Shape() != vector<int>({g.n, g.o, g.oh, g.ow}))
+    throw runtime_error("Conv2D: output shape does not match");
+  if (!c.IsContiguous()) {
+    Tensor<T> dense = Empty<T>(c.shape);
+    Conv2D(x, w, dense, p);
+    Move(dense, c);
+    return;
+  }
+  Tensor<T> xc = Contiguous(x);
+  Tensor<T> wc = Contiguous(w);
+  conv::Conv2D(g, p, xc.data->data() + xc.offset,
+               wc.data->data() + wc.offset, c.data->data() + c.offset);
+}
+
+template<typename T>
+Tensor<T> Conv2D(const Tensor<T> & x, const Tensor<T> & w,
+                 const conv::Params & p = conv::Params()) {
+  Tensor<T> c = Empty<T>(conv::OutputShape(x.Shape(), w.Shape(), p));
+  Conv2D(x, w, c, p);
+  return c;
+}
+
+// Reductions over a set of axes (all axes when empty; negative axes count
+// from the end).  The reduced axes are dropped from the output, or kept with
+// size 1 when keep_dims.  Floating point sums are accumulated pairwise and
+// with Kahan compensation, and give the same bits for any thread count.
+
+template<typename T, typename R>
+Tensor<T> ReduceHelper(const Tensor<T> & a, const vector<int> & axes,
+                       bool keep_dims, R reducer) {
+  vector<bool> flags = reduce::AxisFlags(a.NumDimension(), axes);
+  Tensor<T> c = Empty<T>(reduce::ReducedShape(a.shape, axes, keep_dims));
+  vector<long> out_stride = c.stride;
+  if (keep_dims) {
+    out_stride.clear();
+    for (int d = 0; d < a.NumDimension(); d++) {
+      if (!flags[d])
+        out_stride.push_back(c.stride[d]);
     }
   }
+  elementwise::Loop kept, reduced;
+  reduce::SplitLoops(a.shape, a.stride, flags, out_stride, kept, reduced);
+  reduce::Reduce(kept, reduced, c.data->data(), a.data->data() + a.offset,
+                 reducer);
+  return c;
+}
+
+template<typename T>
+Tensor<T> Sum(const Tensor<T> & a, vector<int> axes = {},
+              bool keep_dims = false) {
+  return ReduceHelper(a, axes, keep_dims, reduce::SumReducer<T>{1});
+}
+
+template<typename T>
+Tensor<T> Mean(const Tensor<T> & a, vector<int> axes = {},
+               bool keep_dims = false) {
+  long count = reduce::ReducedCount(a.Shape(), axes);
+  if (count == 0)
+    throw runtime_error("Mean: empty reduction");
+  return ReduceHelper(a, axes, keep_dims,
+                      reduce::SumReducer<T>{(typename reduce::SumReducer<T>::A)
+                                            count});
+}
+
+template<typename T>
+Tensor<T> Max(const Tensor<T> & a, vector<int> axes = {},
+              bool keep_dims = false) {
+  if (reduce::ReducedCount(a.Shape(), axes) == 0)
+    throw runtime_error("Max: empty reduction");
+  return ReduceHelper(a, axes, keep_dims, reduce::MaxReducer<T>());
+}
+
+// Index of the first maximum along one axis.
+template<typename T, typename I = Int64>
+Tensor<I> ArgMax(const Tensor<T> & a, int axis, bool keep_dims = false) {
+  vector<bool> flags = reduce::AxisFlags(a.NumDimension(), {axis});
+  Tensor<I> c = Empty<I>(reduce::ReducedShape(a.shape, {axis},
+                                                      keep_dims));
+  int d = find(flags.begin(), flags.end(), true) - flags.begin();
+  vector<long> out_stride = c.Stride();
+  if (keep_dims)
+    out_stride.erase(out_stride.begin() + d);
+  elementwise::Loop kept, reduced;
+  reduce::SplitLoops(a.shape, a.stride, flags, out_stride, kept, reduced);
+  reduce::ArgMax(kept, a.shape[d], a.stride[d], c.DataMutable().data(),
+                 a.data->data() + a.offset);
   return c;
 }
 
@@ -210,41 +636,76 @@ public:
   };
 
   friend Tensor Zeros<T>(vector<int> shape);
+  friend Tensor Empty<T>(vector<int> shape);
   friend Tensor Ones<T>(vector<int> shape);
   friend Tensor Identity<T>(vector<int> shape);
   friend Tensor RandomNormal<T>(vector<int> shape, T mean, T stdev);
   friend Tensor RandomUniform<T>(vector<int> shape, T min, T max);
   friend Tensor Slice<T>(const Tensor<T> & other, vector<int> start, vector<int>
     stop, vector<int> stride);
+  friend Tensor View<T>(const Tensor<T> & other, vector<int> shape);
+  friend Tensor FromStorage<T>(shared_ptr<storage::Storage<T>> data,
+                               vector<int> shape, vector<long> stride,
+                               long offset);
+  friend Tensor Transpose<T>(const Tensor<T> & other);
+  friend vector<Tensor> Unstack<T>(const Tensor<T> & other);
+  friend void Export<T>(const Tensor<T> & a, T * out);
+  friend void Import<T>(const T * in, Tensor<T> & c);
   friend Tensor Copy<T>(const Tensor<T> & other);
   friend void Move<T>(const Tensor<T> & src, Tensor<T> & dst);
-  friend void MoveHelper<T>(const Tensor<T> & a, Tensor<T> & b, int da, int db,
-                            int dim);
+  friend Tensor Permute<T>(const Tensor<T> & other, const vector<int> & axes);
 
   // Getters
-  const vector<T> & Data() { return (*data); };
-  vector<T> & DataMutable() { return (*data); };
+  const storage::Storage<T> & Data() const { return (*data); };
+  storage::Storage<T> & DataMutable() { return (*data); };
   const vector<int> & Shape() const { return shape; };
-  const vector<int> & Stride() const { return stride; };
+  const vector<long> & Stride() const { return stride; };
   T Get(vector<int> index) const;
   T & At(vector<int> index);
-  int Size();
+  long Size() const;
   int NumDimension() const { return shape.size(); }
-  int DataIndex(vector<int> index) const;
+  bool IsContiguous() const { return stride == ShapeToStrides(shape); }
+  long DataIndex(vector<int> index) const;
 
   friend Tensor Multiply<T>(const Tensor & a, const Tensor & b);
   friend Tensor Add<T>(const Tensor & a, const Tensor & b);
   friend Tensor Subtract<T>(const Tensor & a, const Tensor & b);
   friend Tensor Negate<T>(const Tensor & a);
   friend Tensor Apply<T>(const Tensor & a, T (*f)(T));
+  template<typename U, typename F>
+  friend Tensor<U> Apply(const Tensor<U> & a, F f);
   friend Tensor MatrixMultiply<T>(const Tensor & a, const Tensor & b);
+  friend void Conv2D<T>(const Tensor & x, const Tensor & w, Tensor & c,
+                       const conv::Params & p);
+  template<typename U, typename UC>
+  friend void MatrixMultiplyAccumulate(const Tensor<U> & a,
+                                       const Tensor<U> & b, Tensor<UC> & c);
+  friend void Accumulate<T>(const Tensor & a, Tensor & c);
+  template<typename U, typename R>
+  friend Tensor<U> ReduceHelper(const Tensor<U> & a, const vector<int> & axes,
+                                bool keep_dims, R reducer);
+  template<typename U, typename I>
+  friend Tensor<I> ArgMax(const Tensor<U> & a, int axis, bool keep_dims);
+  template<typename U, typename F>
+  friend void AccumulateHelper(const Tensor<U> & a, const Tensor<U> & b,
+                               Tensor<U> & c, F f);
+  template<typename U, typename F>
+  friend void UnaryHelper(const Tensor<U> & a, Tensor<U> & c, F f);
+  template<typename U, typename V, typename F>
+  friend void ConvertHelper(const Tensor<U> & a, Tensor<V> & c, F f);
+  template<typename U, typename F>
+  friend void NaryHelper(const vector<const Tensor<U> *> & inputs,
+                         Tensor<U> & c, F f);
+  template<typename U, typename F>
+  friend void BinaryHelper(const Tensor<U> & a, const Tensor<U> & b,
+                           Tensor<U> & c, F f);
 
 
 private:
-  shared_ptr<vector<T>> data;
+  shared_ptr<storage::Storage<T>> data;
   vector<int> shape;
-  vector<int> stride;
-  int offset;
+  vector<long> stride;
+  long offset;
 };
 
 // CONSTRUCTORS
@@ -252,8 +713,8 @@ private:
 // TENSOR METHODS
 
 template<typename T>
-int Tensor<T>::DataIndex(vector<int> index) const {
-  int flat_index = offset;
+long Tensor<T>::DataIndex(vector<int> index) const {
+  long flat_index = offset;
   for (int i = 0; i < index.size(); i++)
     flat_index += stride[i] * index[i];
   return flat_index;
@@ -270,8 +731,8 @@ T & Tensor<T>::At(vector<int> index) {
 }
 
 template<typename T>
-int Tensor<T>::Size() {
-  return accumulate(shape.begin(), shape.end(), 1, multiplies<int>());
+long Tensor<T>::Size() const {
+  return accumulate(shape.begin(), shape.end(), 1L, multiplies<long>());
 };
 
 }  // namespace tensor
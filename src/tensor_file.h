@@ -0,0 +1,257 @@
+#ifndef JB_TENSOR_FILE_H
+#define JB_TENSOR_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "src/storage.h"
+#include "src/tensor.h"
+
+using namespace std;
+
+namespace jb {
+
+namespace tensor_file {
+
+// Container of named tensors, laid out so that loading is a single mmap:
+// tensors returned by File::Get point straight into the mapping, so
+// Session::Assign binds model weights without reading or copying them.
+//
+// Layout (little endian, offsets in bytes from the start of the file):
+//
+//   char     magic[8]        "JBTENSOR"
+//   uint32   version         1
+//   uint32   count
+//   count entries of
+//     uint32 name_length, char name[name_length]
+//     uint32 dtype, uint32 ndim
+//     int64  shape[ndim], int64 stride[ndim]   (stride in elements)
+//     uint64 offset, uint64 size                (payload bytes)
+//   payloads, each starting on a kAlignment byte boundary
+
+const char kMagic[8] = {'J', 'B', 'T', 'E', 'N', 'S', 'O', 'R'};
+const uint32_t kVersion = 1;
+const long kAlignment = 64;
+
+enum DType : uint32_t {
+  kFloat32 = 1,
+  kFloat64 = 2,
+  kInt8 = 3,
+  kInt16 = 4,
+  kInt32 = 5,
+  kInt64 = 6,
+  kFloat16 = 7,
+  kBFloat16 = 8,
+};
+
+template<typename T> DType DTypeOf();
+template<> DType DTypeOf<tensor::Float32>() { return kFloat32; }
+template<> DType DTypeOf<tensor::Float64>() { return kFloat64; }
+template<> DType DTypeOf<tensor::Int8>() { return kInt8; }
+template<> DType DTypeOf<tensor::Int16>() { return kInt16; }
+template<> DType DTypeOf<tensor::Int32>() { return kInt32; }
+template<> DType DTypeOf<tensor::Int64>() { return kInt64; }
+template<> DType DTypeOf<tensor::Float16>() { return kFloat16; }
+template<> DType DTypeOf<tensor::BFloat16>() { return kBFloat16; }
+
+// WRITER
+
+// Collects tensors (of any element type) and writes them as one file.
+// Views are written densely in row-major order.
+class Writer {
+public:
+  template<typename T>
+  void Add(const string & name, const tensor::Tensor<T> & value);
+  void Write(const string & path) const;
+private:
+  struct Entry {
+    string name;
+    DType dtype;
+    vector<int> shape;
+    long bytes;
+    function<void(char *)> payload;
+  };
+  vector<Entry> entries;
+};
+
+template<typename T>
+void Writer::Add(const string & name, const tensor::Tensor<T> & value) {
+  for (auto & e : entries) {
+    if (e.name == name)
+      throw runtime_error("Writer: duplicate tensor " + name);
+  }
+  Entry e;
+  e.name = name;
+  e.dtype = DTypeOf<T>();
+  e.shape = value.Shape();
+  e.bytes = (long) value.Size() * sizeof(T);
+  e.payload = [value](char * out) { tensor::Export(value, (T *) out); };
+  entries.push_back(e);
+}
+
+template<typename U>
+void WriteValue(ofstream & out, U value) {
+  out.write((const char *) &value, sizeof(U));
+}
+
+void Writer::Write(const string & path) const {
+  long header = sizeof(kMagic) + 2 * sizeof(uint32_t);
+  for (auto & e : entries)
+    header += 3 * sizeof(uint32_t) + e.name.size() +
+              2 * sizeof(int64_t) * e.shape.size() + 2 * sizeof(uint64_t);
+  vector<long> offsets;
+  long end = header;
+  for (auto & e : entries) {
+    end = (end + kAlignment - 1) / kAlignment * kAlignment;
+    offsets.push_back(end);
+    end += e.bytes;
+  }
+
+  ofstream out(path, ios::binary | ios::trunc);
+  if (!out)
+    throw runtime_error("Writer: cannot open " + path);
+  out.write(kMagic, sizeof(kMagic));
+  WriteValue<uint32_t>(out, kVersion);
+  WriteValue<uint32_t>(out, entries.size());
+  for (int i = 0; i < (int) entries.size(); i++) {
+    const Entry & e = entries[i];
+    WriteValue<uint32_t>(out, e.name.size());
+    out.write(e.name.data(), e.name.size());
+    WriteValue<uint32_t>(out, e.dtype);
+    WriteValue<uint32_t>(out, e.shape.size());
+    for (auto d : e.shape)
+      WriteValue<int64_t>(out, d);
+    for (auto s : tensor::ShapeToStrides(e.shape))
+      WriteValue<int64_t>(out, s);
+    WriteValue<uint64_t>(out, offsets[i]);
+    WriteValue<uint64_t>(out, e.bytes);
+  }
+  vector<char> buffer;
+  for (int i = 0; i < (int) entries.size(); i++) {
+    long pad = offsets[i] - (long) out.tellp();
+    buffer.assign(max(pad, entries[i].bytes), 0);
+    out.write(buffer.data(), pad);
+    entries[i].payload(buffer.data());
+    out.write(buffer.data(), entries[i].bytes);
+  }
+  if (!out)
+    throw runtime_error("Writer: failed writing " + path);
+}
+
+// READER
+
+// A mapped tensor file.  Tensors handed out share the mapping, which stays
+// alive as long as any of them (or the File) does.  Writing to them is
+// allowed but silently copies each touched page into private memory (see
+// storage::MappedFile); the file itself is never modified.
+class File {
+public:
+  File(const string & path);
+  const vector<string> & Names() const { return names; };
+  bool Has(const string & name) const { return entries.count(name) > 0; };
+  DType Type(const string & name) const { return Find(name).dtype; };
+  template<typename T>
+  tensor::Tensor<T> Get(const string & name) const;
+private:
+  struct Entry {
+    DType dtype;
+    vector<int> shape;
+    vector<long> stride;
+    long offset;
+    long bytes;
+  };
+  const Entry & Find(const string & name) const;
+  shared_ptr<storage::MappedFile> file;
+  vector<string> names;
+  map<string, Entry> entries;
+};
+
+// Bounds checked reads from the mapped header.
+class HeaderReader {
+public:
+  HeaderReader(const char * data, long size) : data(data), size(size),
+                                                position(0) {};
+  template<typename U>
+  U Read() {
+    U value;
+    memcpy(&value, Take(sizeof(U)), sizeof(U));
+    return value;
+  }
+  const char * Take(long n) {
+    if (n < 0 || position + n > size)
+      throw runtime_error("File: truncated header");
+    const char * p = data + position;
+    position += n;
+    return p;
+  }
+private:
+  const char * data;
+  long size;
+  long position;
+};
+
+int ToInt(int64_t value) {
+  if (value < INT32_MIN || value > INT32_MAX)
+    throw runtime_error("File: dimension does not fit in an int");
+  return (int) value;
+}
+
+File::File(const string & path)
+    : file(make_shared<storage::MappedFile>(path)) {
+  HeaderReader header(file->Data(), file->Size());
+  if (memcmp(header.Take(sizeof(kMagic)), kMagic, sizeof(kMagic)) != 0)
+    throw runtime_error("File: not a tensor file " + path);
+  if (header.Read<uint32_t>() != kVersion)
+    throw runtime_error("File: unsupported version in " + path);
+  uint32_t count = header.Read<uint32_t>();
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length = header.Read<uint32_t>();
+    string name(header.Take(length), length);
+    Entry e;
+    e.dtype = (DType) header.Read<uint32_t>();
+    uint32_t ndim = header.Read<uint32_t>();
+    for (uint32_t d = 0; d < ndim; d++)
+      e.shape.push_back(ToInt(header.Read<int64_t>()));
+    for (uint32_t d = 0; d < ndim; d++)
+      e.stride.push_back(header.Read<int64_t>());
+    e.offset = header.Read<uint64_t>();
+    e.bytes = header.Read<uint64_t>();
+    if (e.offset < 0 || e.bytes < 0 || e.offset + e.bytes > file->Size())
+      throw runtime_error("File: payload of " + name + " exceeds the file");
+    if (!entries.insert({name, e}).second)
+      throw runtime_error("File: duplicate tensor " + name);
+    names.push_back(name);
+  }
+}
+
+const File::Entry & File::Find(const string & name) const {
+  auto it = entries.find(name);
+  if (it == entries.end())
+    throw runtime_error("File: no tensor named " + name);
+  return it->second;
+}
+
+template<typename T>
+tensor::Tensor<T> File::Get(const string & name) const {
+  const Entry & e = Find(name);
+  if (e.dtype != DTypeOf<T>())
+    throw runtime_error("File: " + name + " has a different type");
+  if (e.bytes % sizeof(T) != 0)
+    throw runtime_error("File: payload of " + name + " is not whole elements");
+  auto data = make_shared<storage::MappedStorage<T>>(
+      file, e.offset, e.bytes / (long) sizeof(T));
+  return tensor::FromStorage<T>(data, e.shape, e.stride, 0);
+}
+
+}  // namespace tensor_file
+
+}  // namespace jb
+
+#endif  // JB_TENSOR_FILE_H
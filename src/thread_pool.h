@@ -0,0 +1,132 @@
+#ifndef JB_THREAD_POOL_H
+#define JB_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace jb {
+
+namespace thread_pool {
+
+// Work-stealing thread pool.  Every worker owns a task deque: tasks
+// submitted from a worker go to the back of its own deque and are popped
+// LIFO (the inputs they need are still in cache), idle workers steal FIFO
+// from the front of the others.  Tasks submitted from outside the pool are
+// spread round robin.
+
+class ThreadPool {
+public:
+  explicit ThreadPool(int num_workers);
+  ~ThreadPool();
+  void Submit(function<void()> task);
+  int NumWorkers() const { return workers.size(); }
+private:
+  struct Worker {
+    mutex lock;
+    deque<function<void()>> tasks;
+  };
+  void Loop(int id);
+  bool Pop(int id, function<void()> & task);
+  static ThreadPool * & CurrentPool();
+  static int & CurrentWorker();
+  vector<unique_ptr<Worker>> workers;
+  vector<thread> threads;
+  mutex wake_lock;
+  condition_variable wake;
+  atomic<long> pending;
+  atomic<unsigned> next;
+  bool stop = false;
+};
+
+ThreadPool::ThreadPool(int num_workers) : pending(0), next(0) {
+  if (num_workers < 1)
+    num_workers = 1;
+  for (int i = 0; i < num_workers; i++)
+    workers.push_back(unique_ptr<Worker>(new Worker()));
+  for (int i = 0; i < num_workers; i++)
+    threads.push_back(thread(&ThreadPool::Loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> guard(wake_lock);
+    stop = true;
+  }
+  wake.notify_all();
+  for (auto & t : threads)
+    t.join();
+}
+
+ThreadPool * & ThreadPool::CurrentPool() {
+  static thread_local ThreadPool * pool = nullptr;
+  return pool;
+}
+
+int & ThreadPool::CurrentWorker() {
+  static thread_local int id = -1;
+  return id;
+}
+
+void ThreadPool::Submit(function<void()> task) {
+  int id = CurrentPool() == this ? CurrentWorker()
+                                 : next++ % workers.size();
+  {
+    lock_guard<mutex> guard(workers[id]->lock);
+    workers[id]->tasks.push_back(move(task));
+  }
+  {
+    lock_guard<mutex> guard(wake_lock);
+    pending++;
+  }
+  wake.notify_one();
+}
+
+bool ThreadPool::Pop(int id, function<void()> & task) {
+  int n = workers.size();
+  for (int i = 0; i < n; i++) {
+    Worker & w = *workers[(id + i) % n];
+    lock_guard<mutex> guard(w.lock);
+    if (w.tasks.empty())
+      continue;
+    if (i == 0) {
+      task = move(w.tasks.back());
+      w.tasks.pop_back();
+    } else {
+      task = move(w.tasks.front());
+      w.tasks.pop_front();
+    }
+    pending--;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::Loop(int id) {
+  CurrentPool() = this;
+  CurrentWorker() = id;
+  while (true) {
+    function<void()> task;
+    if (Pop(id, task)) {
+      task();
+      continue;
+    }
+    unique_lock<mutex> guard(wake_lock);
+    wake.wait(guard, [this] { return stop || pending > 0; });
+    if (stop && pending == 0)
+      return;
+  }
+}
+
+}  // namespace thread_pool
+
+}  // namespace jb
+
+#endif  // JB_THREAD_POOL_H
@@ -1,9 +1,17 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <list>
+#include <memory>
+#include <sstream>
+#include <thread>
 #include "src/tensor.h"
 #include "src/op.h"
 #include "test/test.h"
 #include "src/session.h"
+#include "src/batcher.h"
+#include "src/graph_file.h"
 
 using namespace std;
 using namespace jb;
@@ -89,10 +97,1048 @@ void TestMultiply() {
 }
 
 
+void TestSessionParallelRun() {
+  // independent towers joined at the end, serial and parallel must agree
+  {
+    Variable<Int32> a, b;
+    vector<unique_ptr<Op<Int32>>> ops;
+    vector<Op<Int32> *> towers;
+    for (int t = 0; t < 8; t++) {
+      Op<Int32> * x = &a;
+      for (int d = 0; d < 4; d++) {
+        ops.emplace_back(new op::Add<Int32>({x, &b}));
+        x = ops.back().get();
+        ops.emplace_back(new op::Multiply<Int32>({x, t % 2 ? &a : &b}));
+        x = ops.back().get();
+      }
+      towers.push_back(x);
+    }
+    op::Add<Int32> out(towers);
+
+    Tensor<Int32> a_val = Zeros<Int32>({2, 2});
+    Tensor<Int32> b_val = Zeros<Int32>({2, 2});
+    a_val.DataMutable() = {1, 2, 3, 4};
+    b_val.DataMutable() = {1, -1, 2, -2};
+
+    Session<Int32> serial;
+    serial.Assign(&a, a_val);
+    serial.Assign(&b, b_val);
+    serial.Run({&out});
+    auto expected = serial.Values();
+
+    Session<Int32> parallel(4);
+    AssertTrue(parallel.NumThreads() == 4, "Should configure worker count");
+    parallel.Assign(&a, a_val);
+    parallel.Assign(&b, b_val);
+    for (int r = 0; r < 10; r++) {
+      parallel.Run({&out});
+      auto values = parallel.Values();
+      for (int i = 0; i < 4; i++)
+        AssertTrue(values[&out].Data()[i] == expected[&out].Data()[i],
+                   "Parallel run should match serial run");
+      for (auto & o : ops)
+        AssertTrue(values[o.get()].Data()[0] == expected[o.get()].Data()[0],
+                   "Parallel run should store every intermediate");
+    }
+  }
+  // errors in a task propagate to the caller
+  {
+    Variable<Int32> a, b;
+    op::Add<Int32> add({&a, &b});
+    Session<Int32> s(2);
+    s.Assign(&a, Zeros<Int32>({3}));
+    s.Assign(&b, Zeros<Int32>({2}));
+    bool thrown = false;
+    try {
+      s.Run({&add});
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Parallel run should rethrow op errors");
+  }
+}
+
+void TestSessionCompile() {
+  {
+    Session<Int32> s;
+    Variable<Int32> a, b;
+    op::Add<Int32> add({&a, &b});
+    op::Multiply<Int32> multiply({&add, &a, &add});
+    Plan<Int32> plan = s.Compile({&multiply});
+    AssertTrue(plan.ops.size() == 4, "Plan should hold each op once");
+    AssertTrue(plan.steps.size() == 2, "Plan should compute non-variables");
+    AssertTrue(plan.variables.size() == 2, "Plan should assign variables");
+    AssertTrue(plan.ops[plan.outputs[0]] == &multiply,
+               "Plan output should map to its slot");
+    for (int i = 0; i < plan.ops.size(); i++)
+      for (auto input : plan.inputs[i])
+        AssertTrue(input < i, "Plan should be topologically ordered");
+
+    Tensor<Int32> a_val = Zeros<Int32>({2});
+    Tensor<Int32> b_val = Zeros<Int32>({2});
+    a_val.DataMutable() = {1, 2};
+    b_val.DataMutable() = {3, 4};
+    s.Assign(&a, a_val);
+    s.Assign(&b, b_val);
+    s.Run(plan);
+    AssertTrue(plan.Output(0).Get({0}) == 16, "Invalid plan result");
+    AssertTrue(plan.Output(0).Get({1}) == 72, "Invalid plan result");
+    AssertTrue(s.Values().at(&multiply).Get({1}) == 72,
+               "Plan outputs should be stored in session");
+
+    // plans are reusable after reassignment
+    b_val = Zeros<Int32>({2});
+    s.Assign(&b, b_val);
+    s.Run(plan);
+    AssertTrue(plan.Output(0).Get({0}) == 1, "Invalid plan result on rerun");
+    AssertTrue(plan.Output(0).Get({1}) == 8, "Invalid plan result on rerun");
+  }
+}
+
+void TestSessionPlanMemory() {
+  // a deep chain runs in place in a single buffer
+  {
+    Session<Int32> s;
+    Variable<Int32> a, b;
+    vector<unique_ptr<Op<Int32>>> ops;
+    Op<Int32> * x = &a;
+    for (int d = 0; d < 10; d++) {
+      ops.emplace_back(new op::Add<Int32>({x, &b}));
+      x = ops.back().get();
+    }
+    Tensor<Int32> a_val = Zeros<Int32>({2, 3});
+    a_val.DataMutable() = {1, 2, 3, 4, 5, 6};
+    s.Assign(&a, a_val);
+    s.Assign(&b, Ones<Int32>({3}));
+    Plan<Int32> plan = s.Compile({x});
+    MemoryReport report = s.PlanMemory(plan);
+    AssertTrue(report.buffers == 1, "Chain should share one buffer");
+    AssertTrue(report.in_place == 8, "Chain should run in place");
+    AssertTrue(report.naive_peak_bytes == (11 * 6 + 3) * sizeof(Int32),
+               "Invalid naive peak bytes");
+    AssertTrue(report.planned_peak_bytes == (3 * 6 + 3) * sizeof(Int32),
+               "Invalid planned peak bytes");
+    for (int r = 0; r < 2; r++) {
+      s.Run(plan);
+      for (int i = 0; i < 6; i++)
+        AssertTrue(plan.Output(0).Data()[i] == i + 11,
+                   "Planned run should compute correct values");
+    }
+  }
+  // buffers are recycled once their last consumer ran
+  {
+    Variable<Int32> a;
+    op::Add<Int32> x1({&a, &a});
+    op::Multiply<Int32> x2({&x1, &a});
+    op::Add<Int32> x3({&x2, &x1});  // x1 dies here
+    op::Multiply<Int32> x4({&x3, &x3});
+    op::Add<Int32> out({&x4, &a});
+    Tensor<Int32> a_val = Zeros<Int32>({4});
+    a_val.DataMutable() = {1, 2, 3, 4};
+
+    Session<Int32> naive;
+    naive.Assign(&a, a_val);
+    naive.Run({&out});
+    auto expected = naive.Values();
+
+    Session<Int32> s;
+    s.SetMemoryPlanning(true);
+    s.Assign(&a, a_val);
+    s.Run({&out});
+    s.Run({&out});
+    auto values = s.Values();
+    for (int i = 0; i < 4; i++)
+      AssertTrue(values[&out].Data()[i] == expected[&out].Data()[i],
+                 "Planned run should match unplanned run");
+    AssertTrue(values.count(&x2) == 0,
+               "Planned run should not keep intermediates");
+
+    // reassigning a different shape replans
+    Tensor<Int32> b_val = Zeros<Int32>({2, 2});
+    b_val.DataMutable() = {1, 2, 3, 4};
+    s.Assign(&a, b_val);
+    s.Run({&out});
+    AssertTrue(s.Values().at(&out).Get({1, 1}) == expected[&out].Data()[3],
+               "Planned run should follow new shapes");
+  }
+}
+
+// Once the pool holds a run's buffers, further runs take none from the
+// system, planned or not.
+void TestSessionAllocations() {
+  Variable<Float32> x, w;
+  op::MatrixMultiply<Float32> y(&x, &w);
+  op::Add<Float32> z({&y, &x});
+  op::Gelu<Float32> out(&z);
+  for (int planned = 0; planned < 2; planned++) {
+    Session<Float32> s;
+    s.SetMemoryPlanning(planned);
+    s.Assign(&x, Ones<Float32>({64, 64}));
+    s.Assign(&w, Ones<Float32>({64, 64}));
+    for (int r = 0; r < 2; r++)
+      s.Run({&out});
+    pool::Stats before = pool::GetStats();
+    for (int r = 0; r < 5; r++)
+      s.Run({&out});
+    pool::Stats after = pool::GetStats();
+    AssertTrue(after.system_allocations == before.system_allocations,
+               "Steady state runs should not allocate from the system");
+    AssertTrue(s.Values().at(&out).Get({3, 5}) > 64,
+               "Pooled runs should compute correct values");
+  }
+}
+
+Int32 Relu(Int32 x) { return x > 0 ? x : 0; }
+
+void TestApply() {
+  {
+    Session<Int32> s;
+    Variable<Int32> a;
+    op::Apply<Int32> relu(&a, Relu);
+    Tensor<Int32> val = Zeros<Int32>({3});
+    val.DataMutable() = {-1, 0, 2};
+    s.Assign(&a, val);
+    s.Run({&relu});
+    auto values = s.Values();
+    AssertTrue(values[&relu].Data()[0] == 0, "Invalid apply value");
+    AssertTrue(values[&relu].Data()[1] == 0, "Invalid apply value");
+    AssertTrue(values[&relu].Data()[2] == 2, "Invalid apply value");
+  }
+}
+
+void TestSessionFuse() {
+  {
+    Variable<Int32> x, bias, scale;
+    op::Add<Int32> biased({&x, &bias});
+    op::Multiply<Int32> scaled({&biased, &scale});
+    op::Apply<Int32> relu(&scaled, Relu);
+    op::Multiply<Int32> squared({&relu, &relu});  // relu has two uses
+    op::Add<Int32> shifted({&squared, &bias});
+    op::Add<Int32> out({&shifted, &x, &scale});
+
+    Tensor<Int32> x_val = Zeros<Int32>({2, 3});
+    Tensor<Int32> bias_val = Zeros<Int32>({3});
+    Tensor<Int32> scale_val = Zeros<Int32>({2, 1});
+    x_val.DataMutable() = {-3, -1, 0, 1, 2, 3};
+    bias_val.DataMutable() = {1, 0, -1};
+    scale_val.DataMutable() = {2, -1};
+
+    Session<Int32> reference;
+    reference.Assign(&x, x_val);
+    reference.Assign(&bias, bias_val);
+    reference.Assign(&scale, scale_val);
+    reference.Run({&out});
+    auto expected = reference.Values();
+
+    Session<Int32> s;
+    s.Assign(&x, x_val);
+    s.Assign(&bias, bias_val);
+    s.Assign(&scale, scale_val);
+    Plan<Int32> plan = s.Compile({&out});
+    int removed = s.Fuse(plan);
+    AssertTrue(removed == 4, "Fuse should fold both elementwise chains");
+    AssertTrue(plan.steps.size() == 2, "Fused plan should have two kernels");
+    AssertTrue(plan.ops[plan.outputs[0]] == &out,
+               "Fused plan should keep output identity");
+    s.Run(plan);
+    for (int i = 0; i < 6; i++)
+      AssertTrue(plan.Output(0).Data()[i] == expected[&out].Data()[i],
+                 "Fused plan should match unfused graph");
+
+    // fused kernels run in place under memory planning
+    s.PlanMemory(plan);
+    s.Run(plan);
+    for (int i = 0; i < 6; i++)
+      AssertTrue(plan.Output(0).Data()[i] == expected[&out].Data()[i],
+                 "Fused and planned plan should match unfused graph");
+  }
+  // fused kernels read strided views
+  {
+    Variable<Int32> a, b;
+    op::Add<Int32> add({&a, &b});
+    op::Multiply<Int32> multiply({&add, &a});
+    Tensor<Int32> base = Zeros<Int32>({4, 4});
+    for (int i = 0; i < 16; i++)
+      base.DataMutable()[i] = i;
+    Session<Int32> s;
+    s.SetFusion(true);
+    s.Assign(&a, Slice<Int32>(base, {0, 1}, {4, 4}, {2, 2}));
+    s.Assign(&b, Slice<Int32>(base, {1, 0}, {4, 3}, {2, 2}));
+    s.Run({&multiply});
+    auto values = s.Values();
+    AssertTrue(values.count(&add) == 0, "Fused intermediates are not kept");
+    AssertTrue(values[&multiply].Get({0, 0}) == (1 + 4) * 1,
+               "Invalid fused value on views");
+    AssertTrue(values[&multiply].Get({1, 1}) == (11 + 14) * 11,
+               "Invalid fused value on views");
+  }
+}
+
+void TestSessionProfiler() {
+  {
+    Variable<Int32> a, b;
+    op::Add<Int32> add({&a, &b});
+    op::Multiply<Int32> multiply({&add, &b});
+    op::Apply<Int32> relu(&multiply, Relu);
+    Tensor<Int32> val = Zeros<Int32>({2, 3});
+    val.DataMutable() = {1, -2, 3, -4, 5, -6};
+
+    Profiler profiler;
+    Session<Int32> s(2);
+    s.SetProfiler(&profiler);
+    s.Assign(&a, val);
+    s.Assign(&b, val);
+    s.Run({&relu});
+    s.Assign(&b, val);  // invalidate, so every op runs again
+    s.Run({&relu});
+    vector<OpEvent> events = profiler.Events();
+    AssertTrue(events.size() == 6, "Should record every op run");
+    const OpEvent & e = events[0];
+    AssertTrue(e.shape.size() == 2 && e.shape[1] == 3,
+               "Should record output shape");
+    AssertTrue(e.bytes == 6 * sizeof(Int32), "Should record output bytes");
+    AssertTrue(e.flops == 6, "Should estimate flops");
+
+    auto summary = profiler.Summary();
+    AssertTrue(summary.size() == 3, "Should aggregate per op type");
+    for (auto & op_summary : summary)
+      AssertTrue(op_summary.count == 2, "Should count evaluations per type");
+
+    ostringstream trace;
+    profiler.WriteChromeTrace(trace);
+    AssertTrue(trace.str().find("\"traceEvents\"") != string::npos,
+               "Should export trace events");
+    AssertTrue(trace.str().find("\"name\": \"Multiply\"") != string::npos,
+               "Should name trace events by op type");
+
+    // detached sessions record nothing
+    s.SetProfiler(nullptr);
+    s.Run({&relu});
+    AssertTrue(profiler.Events().size() == 6, "Should stop recording");
+  }
+}
+
+Float64 TanhFunction(Float64 x) { return tanh(x); }
+Float64 TanhGrad(Float64 x) { return 1 - tanh(x) * tanh(x); }
+
+void TestSessionGradients() {
+  // gradients agree with finite differences
+  {
+    Variable<Float64> x, w, b;
+    op::MatrixMultiply<Float64> h(&x, &w);
+    op::Add<Float64> z({&h, &b});
+    op::Apply<Float64> y(&z, TanhFunction, TanhGrad);
+    op::Multiply<Float64> out({&y, &y});
+    Session<Float64> s;
+    Tensor<Float64> x_val = Zeros<Float64>({2, 3});
+    Tensor<Float64> w_val = Zeros<Float64>({3, 4});
+    Tensor<Float64> b_val = Zeros<Float64>({4});
+    for (int i = 0; i < 6; i++)
+      x_val.DataMutable()[i] = 0.1 * i - 0.2;
+    for (int i = 0; i < 12; i++)
+      w_val.DataMutable()[i] = 0.05 * (i % 5) - 0.1;
+    b_val.DataMutable() = {0.1, -0.2, 0.3, 0};
+    s.Assign(&x, x_val);
+    s.Assign(&w, w_val);
+    s.Assign(&b, b_val);
+    Gradients<Float64> g = s.CompileGradients(&out, {&w, &b});
+    for (int run = 0; run < 2; run++)
+      s.RunGradients(g);
+    AssertTrue(g.Gradient(0).Shape() == w_val.Shape(),
+               "Gradient should have the variable's shape");
+    AssertTrue(g.Gradient(1).Shape() == b_val.Shape(),
+               "Broadcast gradient should be summed out");
+
+    auto loss = [&](Variable<Float64> * variable, Tensor<Float64> value) {
+      s.Assign(variable, value);
+      s.Run({&out});
+      Float64 total = 0;
+      for (auto v : s.Values().at(&out).Data())
+        total += v;
+      return total;
+    };
+    const Float64 eps = 1e-6;
+    vector<pair<Variable<Float64> *, Tensor<Float64>>> checks = {{&w, w_val},
+                                                                 {&b, b_val}};
+    for (int c = 0; c < checks.size(); c++) {
+      Tensor<Float64> value = Copy(checks[c].second);
+      for (int i = 0; i < value.Size(); i++) {
+        Float64 saved = value.DataMutable()[i];
+        value.DataMutable()[i] = saved + eps;
+        Float64 up = loss(checks[c].first, Copy(value));
+        value.DataMutable()[i] = saved - eps;
+        Float64 down = loss(checks[c].first, Copy(value));
+        value.DataMutable()[i] = saved;
+        Float64 numeric = (up - down) / (2 * eps);
+        AssertTrue(fabs(g.Gradient(c).Data()[i] - numeric) < 1e-6,
+                   "Gradient does not match finite differences");
+      }
+    }
+  }
+  // checkpointing trades recomputation for activation memory
+  {
+    Variable<Float64> x;
+    vector<unique_ptr<op::Apply<Float64>>> chain;
+    list<Op<Float64> *> checkpoints;
+    Op<Float64> * y = &x;
+    for (int d = 0; d < 16; d++) {
+      chain.emplace_back(new op::Apply<Float64>(y, TanhFunction, TanhGrad));
+      y = chain.back().get();
+      if (d % 4 == 3)
+        checkpoints.push_back(y);
+    }
+    Session<Float64> s;
+    Tensor<Float64> x_val = Zeros<Float64>({256});
+    for (int i = 0; i < 256; i++)
+      x_val.DataMutable()[i] = 0.01 * i - 1;
+    s.Assign(&x, x_val);
+    Gradients<Float64> full = s.CompileGradients(y, {&x});
+    Gradients<Float64> sparse = s.CompileGradients(y, {&x}, checkpoints);
+    s.RunGradients(full);
+    s.RunGradients(sparse);
+    for (int i = 0; i < 256; i++)
+      AssertTrue(full.Gradient(0).Data()[i] == sparse.Gradient(0).Data()[i],
+                 "Checkpointing should not change gradients");
+    AssertTrue(full.report.recomputed == 0, "Nothing should be recomputed");
+    AssertTrue(sparse.report.recomputed == 12,
+               "Released activations should be recomputed once");
+    AssertTrue(sparse.report.peak_activation_bytes * 2 <
+               full.report.peak_activation_bytes,
+               "Checkpointing should lower activation memory");
+  }
+}
+
+void TestSessionIncremental() {
+  {
+    Variable<Int32> weights, input;
+    op::Multiply<Int32> scaled({&weights, &weights});  // weights only
+    op::Add<Int32> shifted({&scaled, &weights});       // weights only
+    op::Multiply<Int32> out({&shifted, &input});
+    Tensor<Int32> w_val = Zeros<Int32>({3});
+    w_val.DataMutable() = {1, 2, 3};
+    Tensor<Int32> x_val = Ones<Int32>({3});
+
+    for (int threads : {1, 3}) {
+      Session<Int32> s(threads);
+      s.Assign(&weights, w_val);
+      s.Assign(&input, x_val);
+      Plan<Int32> plan = s.Compile({&out});
+      s.Run(plan);
+      AssertTrue(s.LastRunStats().misses == 3 && s.LastRunStats().hits == 0,
+                 "First run should evaluate every op");
+      s.Run(plan);
+      AssertTrue(s.LastRunStats().misses == 0 && s.LastRunStats().hits == 3,
+                 "Unchanged inputs should be served from the cache");
+
+      // only the op downstream of the input is evaluated again
+      Tensor<Int32> x2 = Zeros<Int32>({3});
+      x2.DataMutable() = {2, 0, -1};
+      s.Assign(&input, x2);
+      s.Run(plan);
+      AssertTrue(s.LastRunStats().misses == 1 && s.LastRunStats().hits == 2,
+                 "Only invalidated ops should be evaluated");
+      AssertTrue(plan.Output(0).Get({0}) == 4 && plan.Output(0).Get({1}) == 0 &&
+                 plan.Output(0).Get({2}) == -12, "Invalid incremental result");
+
+      s.Assign(&weights, w_val);
+      s.Run(plan);
+      AssertTrue(s.LastRunStats().misses == 3,
+                 "Reassigned weights should invalidate their consumers");
+      AssertTrue(s.TotalStats().hits == 5 && s.TotalStats().misses == 7,
+                 "Total stats should accumulate");
+    }
+  }
+  // caching can be turned off
+  {
+    Variable<Int32> a;
+    op::Add<Int32> out({&a, &a});
+    Session<Int32> s;
+    s.SetIncremental(false);
+    s.Assign(&a, Ones<Int32>({2}));
+    s.Run({&out});
+    s.Run({&out});
+    AssertTrue(s.LastRunStats().misses == 1, "Should evaluate every run");
+  }
+}
+
+void TestSessionOptimize() {
+  Variable<Float32> x, w, b;
+  op::Multiply<Float32> wb({&w, &b});
+  op::Multiply<Float32> wb2({&w, &b});
+  op::Add<Float32> c({&wb, &wb2});
+  op::Add<Float32> y1({&x, &c});
+  op::Add<Float32> y2({&x, &c});
+  op::Multiply<Float32> out({&y1, &y2});
+  op::Apply<Float32> scaled(&c, [](Float32 v) { return v / 3; });
+  Tensor<Float32> w_val = Zeros<Float32>({4});
+  w_val.DataMutable() = {0.1, 0.2, 0.3, 0.4};
+  Tensor<Float32> b_val = Zeros<Float32>({4});
+  b_val.DataMutable() = {3, -1, 7, 0.5};
+  Tensor<Float32> x_val = Ones<Float32>({2, 4});
+  Session<Float32> s;
+  s.Assign(&w, w_val);
+  s.Assign(&b, b_val);
+  s.Assign(&x, x_val);
+  Plan<Float32> reference = s.Compile({&out, &scaled});
+  s.Run(reference);
+  for (bool planned : {false, true}) {
+    Plan<Float32> plan = s.Compile({&out, &scaled});
+    OptimizationReport report = s.Optimize(plan, {&w, &b});
+    AssertTrue(report.merged == 2, "Optimize: Should merge duplicates");
+    AssertTrue(report.folded == 3, "Optimize: Should fold constants");
+    AssertTrue(report.removed == 5, "Optimize: Should report removed ops");
+    AssertTrue(plan.ops.size() == 5, "Optimize: Invalid plan size");
+    if (planned)
+      s.PlanMemory(plan);
+    for (int run = 0; run < 2; run++) {
+      s.Run(plan);
+      s.Run(reference);
+      for (int k = 0; k < 2; k++) {
+        const Tensor<Float32> & got = plan.Output(k);
+        const Tensor<Float32> & want = reference.Output(k);
+        AssertTrue(got.Shape() == want.Shape(), "Optimize: Invalid shape");
+        for (int i = 0; i < want.Size(); i++)
+          AssertTrue(got.Data()[i] == want.Data()[i],
+                     "Optimize: Should match the unoptimized plan");
+      }
+      Tensor<Float32> x2_val = Ones<Float32>({2, 4});
+      x2_val.DataMutable()[5] = -2;
+      s.Assign(&x, x2_val);
+    }
+    s.Assign(&x, x_val);
+  }
+  bool thrown = false;
+  try {
+    Variable<Float32> unset;
+    op::Add<Float32> bad({&unset, &x});
+    Plan<Float32> plan = s.Compile({&bad});
+    s.Optimize(plan, {&unset});
+  } catch (runtime_error &) {
+    thrown = true;
+  }
+  AssertTrue(thrown, "Optimize: Should reject unassigned fixed variables");
+  {
+    // an output merged into a constant duplicate stays in the plan
+    op::Add<Float32> d({&wb, &w});
+    Plan<Float32> plan = s.Compile({&d, &wb2});
+    s.Optimize(plan, {&w, &b});
+    s.Run(plan);
+    for (int i = 0; i < 4; i++) {
+      Float32 product = w_val.Data()[i] * b_val.Data()[i];
+      AssertTrue(plan.Output(1).Data()[i] == product &&
+                 plan.Output(0).Data()[i] == product + w_val.Data()[i],
+                 "Optimize: Should keep merged outputs");
+    }
+  }
+}
+
+void TestReduce() {
+  {
+    Variable<Float64> x;
+    op::Sum<Float64> rows(&x, {1});
+    op::Mean<Float64> mean(&rows);
+    op::ArgMax<Float64> arg(&x, 1);
+    Tensor<Float64> val = Zeros<Float64>({2, 3});
+    val.DataMutable() = {1, 2, 3, 6, 5, 4};
+    Session<Float64> s;
+    s.Assign(&x, val);
+    s.Run({&mean, &arg});
+    auto values = s.Values();
+    AssertTrue(values[&rows].Get({1}) == 15, "Invalid sum op value");
+    AssertTrue(values[&mean].Get({}) == 10.5, "Invalid mean op value");
+    AssertTrue(values[&arg].Get({0}) == 2 && values[&arg].Get({1}) == 0,
+               "Invalid argmax op value");
+
+    // d mean / dx = 1 / 2 for every element
+    Gradients<Float64> g = s.CompileGradients(&mean, {&x});
+    s.RunGradients(g);
+    for (int i = 0; i < 6; i++)
+      AssertTrue(g.Gradient(0).Data()[i] == 0.5, "Invalid reduce gradient");
+  }
+}
+
+void TestSessionRunBatch() {
+  Variable<Float32> x, w, bias;
+  op::MatrixMultiply<Float32> h(&x, &w);
+  op::Add<Float32> out({&h, &bias});
+  Tensor<Float32> w_val = Zeros<Float32>({3, 2});
+  w_val.DataMutable() = {1, 0, 0, 1, 1, 1};
+  Tensor<Float32> b_val = Zeros<Float32>({2});
+  b_val.DataMutable() = {10, 20};
+  vector<Feed<Float32>> feeds;
+  for (int r = 0; r < 5; r++) {
+    Tensor<Float32> sample = Zeros<Float32>({3});
+    sample.DataMutable() = {(Float32) r, 1, 2};
+    feeds.push_back({{&x, sample}});
+  }
+  {
+    Session<Float32> s;
+    s.Assign(&w, w_val);
+    s.Assign(&bias, b_val);
+    auto results = s.RunBatch({&out}, feeds);
+    AssertTrue(results.size() == 5, "Should return one result per request");
+    for (int r = 0; r < 5; r++) {
+      const Tensor<Float32> & y = results[r][0];
+      AssertTrue(y.Shape() == vector<int>({2}), "Should drop batch dimension");
+      AssertTrue(y.Get({0}) == r + 2 + 10 && y.Get({1}) == 3 + 20,
+                 "Invalid batched result");
+      AssertTrue(&y.Data() == &results[0][0].Data(),
+                 "Results should be views of the batch output");
+    }
+    Tensor<Float32> removed = feeds[2][&x];
+    feeds[2].erase(&x);
+    bool threw = false;
+    try {
+      s.RunBatch({&out}, feeds);
+    } catch (runtime_error &) {
+      threw = true;
+    }
+    AssertTrue(threw, "Should reject requests feeding different variables");
+    feeds[2][&x] = removed;
+    // batches leave the session's values alone, also when they fail
+    Tensor<Float32> single = Zeros<Float32>({1, 3});
+    s.Assign(&x, single);
+    s.RunBatch({&out}, feeds);
+    threw = false;
+    try {
+      s.RunBatch({&bias}, feeds);
+    } catch (runtime_error &) {
+      threw = true;
+    }
+    AssertTrue(threw, "Should reject outputs without the batch dimension");
+    s.Run({&out});
+    AssertTrue(s.Values().at(&out).Shape() == vector<int>({1, 2}),
+               "RunBatch should not change the assigned values");
+  }
+  // concurrent callers are coalesced: the delay is long enough that the
+  // batch only closes once all five requests are queued
+  {
+    Session<Float32> s;
+    s.Assign(&w, w_val);
+    s.Assign(&bias, b_val);
+    batcher::Batcher<Float32> b(&s, {&out}, 5, chrono::hours(1));
+    vector<vector<Tensor<Float32>>> results(5);
+    vector<thread> callers;
+    for (int r = 0; r < 5; r++)
+      callers.emplace_back([&, r] { results[r] = b.Run(feeds[r]); });
+    for (auto & c : callers)
+      c.join();
+    for (int r = 0; r < 5; r++)
+      AssertTrue(results[r][0].Get({0}) == r + 2 + 10,
+                 "Invalid micro-batched result");
+    AssertTrue(b.Requests() == 5, "Should count requests");
+    AssertTrue(b.Batches() == 1, "Should coalesce concurrent requests");
+  }
+}
+
+void TestSessionRunAsync() {
+  Variable<Float32> x, w, bias;
+  op::MatrixMultiply<Float32> h(&x, &w);
+  op::Add<Float32> out({&h, &bias});
+  Tensor<Float32> w_val = Zeros<Float32>({3, 2});
+  w_val.DataMutable() = {1, 0, 0, 1, 1, 1};
+  Tensor<Float32> b_val = Zeros<Float32>({1, 2});
+  b_val.DataMutable() = {10, 20};
+  for (int threads : {1, 4}) {
+    Session<Float32> s(threads);
+    s.Assign(&w, w_val);
+    s.Assign(&bias, b_val);
+    // clients share the weights and feed their own inputs
+    const int clients = 4, requests = 50;
+    vector<int> wrong(clients, 0);
+    vector<thread> callers;
+    for (int c = 0; c < clients; c++) {
+      callers.emplace_back([&, c] {
+        for (int r = 0; r < requests; r++) {
+          Tensor<Float32> sample = Zeros<Float32>({1, 3});
+          sample.DataMutable() = {(Float32) c, (Float32) r, 2};
+          auto y = s.RunAsync({&out}, {{&x, sample}}).get()[0];
+          if (y.Get({0, 0}) != c + 2 + 10 || y.Get({0, 1}) != r + 2 + 20)
+            wrong[c]++;
+        }
+      });
+    }
+    for (auto & c : callers)
+      c.join();
+    for (int c = 0; c < clients; c++)
+      AssertTrue(wrong[c] == 0, "Invalid concurrent result");
+    // requests keep the weights they started with
+    Tensor<Float32> sample = Zeros<Float32>({1, 3});
+    sample.DataMutable() = {1, 1, 1};
+    auto before = s.RunAsync({&out}, {{&x, sample}});
+    Tensor<Float32> b2_val = Zeros<Float32>({1, 2});
+    s.Assign(&bias, b2_val);
+    auto after = s.RunAsync({&out}, {{&x, sample}});
+    AssertTrue(before.get()[0].Get({0, 0}) == 12, "Should see old weights");
+    AssertTrue(after.get()[0].Get({0, 0}) == 2, "Should see new weights");
+    // errors reach the caller through the future
+    Variable<Float32> unset;
+    op::Add<Float32> bad({&out, &unset});
+    auto failed = s.RunAsync({&bad}, {{&x, sample}});
+    bool thrown = false;
+    try {
+      failed.get();
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Should report a variable neither fed nor assigned");
+  }
+}
+
+Float32 Square(Float32 x) { return x * x; }
+Float32 Twice(Float32 x) { return 2 * x; }
+
+// Writes a graph file of an input "x" (op 0) and one more op, the output.
+void WriteGraph(const string & path, const graph_file::Record & r) {
+  using tensor_file::WriteValue;
+  ofstream out(path, ios::binary | ios::trunc);
+  out.write(graph_file::kMagic, sizeof(graph_file::kMagic));
+  WriteValue<uint32_t>(out, graph_file::kVersion);
+  WriteValue<uint32_t>(out, tensor_file::DTypeOf<Float32>());
+  WriteValue<uint32_t>(out, 2);
+  graph_file::Record x;
+  x.code = graph_file::kVariable;
+  x.attributes = {graph_file::kInput};
+  x.strings = {"x"};
+  for (auto & op : {x, r}) {
+    WriteValue<uint32_t>(out, op.code);
+    WriteValue<uint32_t>(out, op.inputs.size());
+    for (auto input : op.inputs)
+      WriteValue<uint32_t>(out, input);
+    WriteValue<uint32_t>(out, op.attributes.size());
+    for (auto a : op.attributes)
+      WriteValue<int64_t>(out, a);
+    WriteValue<uint32_t>(out, op.strings.size());
+    for (auto & s : op.strings)
+      graph_file::WriteString(out, s);
+  }
+  WriteValue<uint32_t>(out, 1);
+  WriteValue<uint32_t>(out, 1);
+}
+
+void TestGraphFile() {
+  string path = "test_graph_file.jbg";
+  string constants_path = "test_graph_file.jbt";
+  graph_file::RegisterFunction<Float32>("square", Square);
+  graph_file::RegisterFunction<Float32>("twice", Twice);
+  Variable<Float32> x, w, bias;
+  op::MatrixMultiply<Float32> h(&x, &w);
+  op::Add<Float32> z({&h, &bias});
+  op::Apply<Float32> a(&z, Square, Twice);
+  op::Tanh<Float32> t(&z);
+  op::Fused<Float32> f({&a, &t}, {{Fused<Float32>::kApply, 1, 1, Square},
+                                  {Fused<Float32>::kAdd, 0, 2, nullptr}});
+  op::Sum<Float32> s({&f}, {1}, true);
+  Tensor<Float32> w_val = Zeros<Float32>({3, 4});
+  for (int i = 0; i < 12; i++)
+    w_val.DataMutable()[i] = 0.1 * i - 0.5;
+  op::QuantizedMatrixMultiply<Float32> q(&x, w_val);
+  op::ArgMax<Float32> m(&q, 1);
+  Tensor<Float32> b_val = Ones<Float32>({1, 4});
+  Tensor<Float32> x_val = Zeros<Float32>({2, 3});
+  x_val.DataMutable() = {1, -2, 3, 0.5, 0.25, -1};
+  Session<Float32> reference;
+  reference.Assign(&x, x_val);
+  reference.Assign(&w, w_val);
+  reference.Assign(&bias, b_val);
+  reference.Run({&s, &q, &m});
+  {
+    graph_file::Writer<Float32> writer;
+    writer.Input(&x, "x");
+    writer.Constant(&w, "w", w_val);
+    writer.Constant(&bias, "bias", b_val);
+    writer.Write(path, constants_path, {&s, &q, &m});
+  }
+  {
+    Session<Float32> session;
+    graph_file::Graph<Float32> graph(path, constants_path, session);
+    AssertTrue(graph.NumOps() == 11, "GraphFile: Should load every op");
+    session.Assign(graph.Input("x"), x_val);
+    session.Run(graph.Outputs());
+    vector<Op<Float32> *> expected = {&s, &q, &m};
+    int k = 0;
+    for (auto o : graph.Outputs()) {
+      const Tensor<Float32> & value = session.Values().at(o);
+      const Tensor<Float32> & want = reference.Values().at(expected[k++]);
+      AssertTrue(value.Shape() == want.Shape(), "GraphFile: Invalid shape");
+      for (int i = 0; i < want.Size(); i++)
+        AssertTrue(value.Data()[i] == want.Data()[i],
+                   "GraphFile: Loaded graph should compute the same values");
+    }
+    AssertTrue(session.Values().at(graph.Outputs().front()).Size() == 2,
+               "GraphFile: Should keep reduction attributes");
+  }
+  // functions must be registered to be saved
+  {
+    op::Apply<Float32> unregistered(&x, [](Float32 v) { return v + 1; });
+    graph_file::Writer<Float32> writer;
+    writer.Input(&x, "x");
+    bool thrown = false;
+    try {
+      writer.Write(path, constants_path, {&unregistered});
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "GraphFile: Should reject unregistered functions");
+  }
+  // malformed ops are rejected when loading
+  {
+    graph_file::Record fused;
+    fused.code = graph_file::kFused;
+    fused.inputs = {0};
+    graph_file::Record apply;
+    apply.code = graph_file::kApply;
+    apply.inputs = {0};
+    apply.strings = {"", ""};
+    graph_file::Record conv2d;
+    conv2d.code = graph_file::kConv2D;
+    conv2d.inputs = {0, 0};
+    conv2d.attributes = {1, 1, 0, 0, 1, 1, 1, 9};  // no such algorithm
+    vector<graph_file::Record> malformed(7, fused);
+    malformed[0].attributes = {7, 0, 0};  // no such instruction
+    malformed[1].attributes = {Fused<Float32>::kApply, 0, 0};
+    malformed[1].strings = {""};  // no function
+    malformed[2].inputs.clear();  // nothing to compute
+    malformed[3] = apply;
+    malformed[4].attributes = {Fused<Float32>::kAdd, 1L << 32, 0};
+    malformed[5].attributes = {Fused<Float32>::kAdd, 0, 0};
+    malformed[5].strings = {"square"};  // not read by any instruction
+    malformed[6] = conv2d;
+    for (auto & r : malformed) {
+      WriteGraph(path, r);
+      Session<Float32> session;
+      bool thrown = false;
+      try {
+        graph_file::Graph<Float32> graph(path, constants_path, session);
+      } catch (runtime_error &) {
+        thrown = true;
+      }
+      AssertTrue(thrown, "GraphFile: Should reject malformed ops");
+    }
+  }
+  {
+    ofstream out(path);
+    out << "not a graph file";
+  }
+  {
+    Session<Float32> session;
+    bool thrown = false;
+    try {
+      graph_file::Graph<Float32> graph(path, constants_path, session);
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "GraphFile: Should reject bad magic");
+  }
+  remove(path.c_str());
+  remove(constants_path.c_str());
+}
+
+Float64 GeluFunction(Float64 x) {
+  return 0.5 * x * (1 + tanh(0.797884560802865355880 *
+                             (x + 0.044715 * x * x * x)));
+}
+Float64 SigmoidFunction(Float64 x) { return 1 / (1 + exp(-x)); }
+
+// values and gradients of an activation op against a reference function
+template<typename A>
+void CheckActivation(Float64 (*reference)(Float64), Float64 lo, Float64 hi) {
+  Variable<Float64> x;
+  A y(&x);
+  Session<Float64> s;
+  Tensor<Float64> x_val = Zeros<Float64>({4, 8});
+  for (int i = 0; i < 32; i++)
+    x_val.DataMutable()[i] = lo + (hi - lo) * i / 31;
+  s.Assign(&x, x_val);
+  Gradients<Float64> g = s.CompileGradients(&y, {&x});
+  s.RunGradients(g);
+  const Float64 eps = 1e-6;
+  for (int i = 0; i < 32; i++) {
+    Float64 v = x_val.Data()[i];
+    Float64 expected = reference(v);
+    AssertTrue(fabs(g.Value().Data()[i] - expected) <=
+                   1e-14 * max(1.0, fabs(expected)),
+               string(y.Type()) + ": wrong value");
+    Float64 numeric = (reference(v + eps) - reference(v - eps)) / (2 * eps);
+    AssertTrue(fabs(g.Gradient(0).Data()[i] - numeric) <
+                   1e-6 * max(1.0, fabs(numeric)),
+               string(y.Type()) + ": gradient does not match finite differences");
+  }
+  // Backward accumulates in one pass, without temporaries
+  Tensor<Float64> ones = Ones<Float64>({4, 8});
+  Tensor<Float64> grad = Zeros<Float64>({4, 8});
+  long allocations = pool::GetStats().allocations;
+  y.Backward({&x_val}, g.Value(), ones, {&grad});
+  AssertTrue(pool::GetStats().allocations == allocations,
+             string(y.Type()) + ": Backward should not allocate");
+  for (int i = 0; i < 32; i++)
+    AssertTrue(grad.Data()[i] == g.Gradient(0).Data()[i],
+               string(y.Type()) + ": Backward should accumulate");
+}
+
+void TestActivation() {
+  CheckActivation<op::Exp<Float64>>(exp, -5, 5);
+  CheckActivation<op::Log<Float64>>(log, 0.01, 10);
+  CheckActivation<op::Tanh<Float64>>(tanh, -4, 4);
+  CheckActivation<op::Sigmoid<Float64>>(SigmoidFunction, -8, 8);
+  CheckActivation<op::Gelu<Float64>>(GeluFunction, -4, 4);
+  // single precision through the planned, in place path
+  {
+    Variable<Float32> x;
+    op::Gelu<Float32> y(&x);
+    op::Sigmoid<Float32> z(&y);
+    Session<Float32> s;
+    Tensor<Float32> x_val = Zeros<Float32>({100});
+    for (int i = 0; i < 100; i++)
+      x_val.DataMutable()[i] = 0.1f * i - 5;
+    s.Assign(&x, x_val);
+    auto plan = s.Compile({&z});
+    s.PlanMemory(plan);
+    s.Run(plan);
+    for (int i = 0; i < 100; i++) {
+      Float64 expected = SigmoidFunction(GeluFunction(x_val.Data()[i]));
+      AssertTrue(fabs(plan.Output(0).Data()[i] - expected) < 1e-6,
+                 "Wrong Float32 activation chain");
+    }
+  }
+}
+
+void TestConv2D() {
+  // conv, bias and relu, planned
+  Variable<Float32> x, w, bias;
+  conv::Params params;
+  params.pad_h = params.pad_w = 1;
+  op::Conv2D<Float32> y(&x, &w, params);
+  op::Add<Float32> z({&y, &bias});
+  op::Apply<Float32> out(&z, [](Float32 v) { return v > 0 ? v : 0; });
+  Tensor<Float32> x_val = Zeros<Float32>({2, 3, 8, 8});
+  Tensor<Float32> w_val = Zeros<Float32>({4, 3, 3, 3});
+  Tensor<Float32> bias_val = Zeros<Float32>({4, 1, 1});
+  for (int i = 0; i < x_val.Size(); i++)
+    x_val.DataMutable()[i] = ((i * 37) % 101) / 50.0f - 1;
+  for (int i = 0; i < w_val.Size(); i++)
+    w_val.DataMutable()[i] = ((i * 53) % 89) / 44.0f - 1;
+  bias_val.DataMutable() = {0.5f, -0.5f, 0, 1};
+  Session<Float32> s;
+  s.Assign(&x, x_val);
+  s.Assign(&w, w_val);
+  s.Assign(&bias, bias_val);
+  auto plan = s.Compile({&out});
+  s.PlanMemory(plan);
+  s.Run(plan);
+  Tensor<Float32> expected =
+      tensor::Add(tensor::Conv2D(x_val, w_val, params), bias_val);
+  AssertTrue(plan.Output(0).Shape() == expected.Shape(),
+             "Conv2D: Wrong output shape");
+  bool close = true;
+  for (int i = 0; i < expected.Size(); i++) {
+    float e = max(expected.Data()[i], 0.0f);
+    close = close && fabs(plan.Output(0).Data()[i] - e) < 1e-5;
+  }
+  AssertTrue(close, "Conv2D: Planned run should match tensor::Conv2D");
+}
+
+void TestSparseOps() {
+  // sparse operands held by the ops against the same graph on dense ones
+  auto random = [](int rows, int cols, int every) {
+    Tensor<Float64> a = Zeros<Float64>({rows, cols});
+    for (int i = 0; i < a.Size(); i++)
+      a.DataMutable()[i] = i % every == 0 ? i % 5 - 2 : 0;
+    return a;
+  };
+  Tensor<Float64> s_val = random(12, 9, 7);
+  Tensor<Float64> b_val = random(12, 4, 3);
+  Tensor<Float64> m_val = random(12, 4, 2);
+  Tensor<Float64> w_val = random(4, 6, 5);
+  Tensor<Float64> x_val = random(9, 4, 1);
+  Variable<Float64> x;
+  op::SparseMatrixMultiply<Float64> h(sparse::FromDense(s_val), &x);
+  op::SparseAdd<Float64> a(&h, sparse::FromDense(b_val));
+  op::SparseMultiply<Float64> m(&a, sparse::FromDense(m_val));
+  op::SparseMatrixMultiply<Float64> out(&m, sparse::FromDense(w_val));
+  Variable<Float64> s, b, mask, w;
+  op::MatrixMultiply<Float64> dense_h(&s, &x);
+  op::Add<Float64> dense_a({&dense_h, &b});
+  op::Multiply<Float64> dense_m({&dense_a, &mask});
+  op::MatrixMultiply<Float64> dense_out(&dense_m, &w);
+  Session<Float64> session;
+  session.Assign(&x, x_val);
+  session.Assign(&s, s_val);
+  session.Assign(&b, b_val);
+  session.Assign(&mask, m_val);
+  session.Assign(&w, w_val);
+  Plan<Float64> reference = session.Compile({&dense_out});
+  session.Run(reference);
+  const Tensor<Float64> & want = reference.Output(0);
+  for (bool planned : {false, true}) {
+    Plan<Float64> plan = session.Compile({&out});
+    if (planned)
+      session.PlanMemory(plan);
+    session.Run(plan);
+    const Tensor<Float64> & got = plan.Output(0);
+    AssertTrue(got.Shape() == vector<int>({12, 6}), "Sparse ops: Invalid shape");
+    for (int i = 0; i < want.Size(); i++)
+      AssertTrue(got.Data()[i] == want.Data()[i],
+                 "Sparse ops: Should match the dense graph");
+  }
+  Gradients<Float64> g = session.CompileGradients(&out, {&x});
+  session.RunGradients(g);
+  Gradients<Float64> dense_g = session.CompileGradients(&dense_out, {&x});
+  session.RunGradients(dense_g);
+  for (int i = 0; i < x_val.Size(); i++)
+    AssertTrue(g.Gradient(0).Data()[i] == dense_g.Gradient(0).Data()[i],
+               "Sparse ops: Gradients should match the dense graph");
+}
+
+void TestQuantizedMatrixMultiply() {
+  Tensor<Float32> x_val = Zeros<Float32>({8, 32});
+  Tensor<Float32> w = Zeros<Float32>({32, 16});
+  for (int i = 0; i < x_val.Size(); i++)
+    x_val.DataMutable()[i] = ((i * 37) % 101) / 50.0f - 1;
+  for (int i = 0; i < w.Size(); i++)
+    w.DataMutable()[i] = (((i * 53) % 89) / 44.0f - 1) * (1 + i % 16);
+  Variable<Float32> x;
+  op::QuantizedMatrixMultiply<Float32> y(&x, w);
+  AssertTrue(y.Weights().Shape() == w.Shape(),
+             "QuantizedMatrixMultiply: Should store Int8 weights");
+  Session<Float32> s;
+  s.Assign(&x, x_val);
+  auto plan = s.Compile({&y});
+  s.PlanMemory(plan);
+  s.Run(plan);
+  Tensor<Float32> exact = tensor::MatrixMultiply(x_val, w);
+  double error = 0, norm = 0;
+  for (int i = 0; i < exact.Size(); i++) {
+    double e = plan.Output(0).Data()[i] - exact.Data()[i];
+    error += e * e;
+    norm += exact.Data()[i] * exact.Data()[i];
+  }
+  AssertTrue(sqrt(error / norm) < 0.01,
+             "QuantizedMatrixMultiply: Should match MatrixMultiply");
+}
+
 int main() {
   TestVariable();
   TestSessionRun();
   TestAdd();
   TestMultiply();
+  TestSessionParallelRun();
+  TestSessionCompile();
+  TestSessionPlanMemory();
+  TestSessionAllocations();
+  TestApply();
+  TestSessionFuse();
+  TestSessionProfiler();
+  TestSessionGradients();
+  TestSessionIncremental();
+  TestSessionOptimize();
+  TestReduce();
+  TestSessionRunBatch();
+  TestSessionRunAsync();
+  TestGraphFile();
+  TestActivation();
+  TestQuantizedMatrixMultiply();
+  TestSparseOps();
+  TestConv2D();
   return 0;
 }
\ No newline at end of file
@@ -1,8 +1,16 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <functional>
+#include <thread>
 
 
+#include "src/activation.h"
+#include "src/quantize.h"
+#include "src/sparse.h"
 #include "src/tensor.h"
+#include "src/static_tensor.h"
+#include "src/tensor_file.h"
 #include "test/test.h"
 
 using namespace std;
@@ -13,7 +21,7 @@ using namespace jb::test;
 void TestTensorShapeToStride() {
   {
     vector<int> shape = {4, 2, 3, 5};
-    vector<int> strides = tensor::ShapeToStrides(shape);
+    vector<long> strides = tensor::ShapeToStrides(shape);
     AssertTrue(strides[0] == 2 * 3 * 5, "Incorrect stride from shape");
     AssertTrue(strides[1] == 3 * 5, "Incorrect stride from shape");
     AssertTrue(strides[2] == 5, "Incorrect stride from shape");
@@ -21,7 +29,7 @@ void TestTensorShapeToStride() {
   }
   {
     vector<int> shape = {5};
-    vector<int> strides = tensor::ShapeToStrides(shape);
+    vector<long> strides = tensor::ShapeToStrides(shape);
     AssertTrue(strides[0] == 1, "Incorrect stride from shape");
   }
 }
@@ -79,6 +87,82 @@ void TestTensorMultiply() {
   }
 }
 
+void TestTensorAddSlice() {
+  // respects view offset and stride
+  {
+    Tensor<Int32> t = Zeros<Int32>({3, 3});
+    t.DataMutable() = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+    auto a = Slice<Int32>(t, {1, 0}, {3, 3}, {1, 2});
+    auto b = Slice<Int32>(t, {0, 1}, {2, 3}, {1, 1});
+    auto out = Add(a, b);
+    AssertTrue(out.Shape()[0] == 2, "Invalid add shape");
+    AssertTrue(out.Shape()[1] == 2, "Invalid add shape");
+    AssertTrue(out.Data()[0] == 4 + 2, "Invalid add result on slice");
+    AssertTrue(out.Data()[1] == 6 + 3, "Invalid add result on slice");
+    AssertTrue(out.Data()[2] == 7 + 5, "Invalid add result on slice");
+    AssertTrue(out.Data()[3] == 9 + 6, "Invalid add result on slice");
+  }
+}
+
+void TestTensorBroadcast() {
+  // bias add over rows
+  {
+    Tensor<Int32> a = Zeros<Int32>({2, 3});
+    Tensor<Int32> bias = Zeros<Int32>({3});
+    a.DataMutable() = {1, 2, 3, 4, 5, 6};
+    bias.DataMutable() = {10, 20, 30};
+    auto out = Add(a, bias);
+    AssertTrue(out.Shape().size() == 2, "Invalid broadcast shape");
+    AssertTrue(out.Data()[0] == 11, "Invalid broadcast add result");
+    AssertTrue(out.Data()[2] == 33, "Invalid broadcast add result");
+    AssertTrue(out.Data()[3] == 14, "Invalid broadcast add result");
+    AssertTrue(out.Data()[5] == 36, "Invalid broadcast add result");
+  }
+  // outer product style broadcast of both operands
+  {
+    Tensor<Int32> a = Zeros<Int32>({3, 1});
+    Tensor<Int32> b = Zeros<Int32>({1, 2});
+    a.DataMutable() = {1, 2, 3};
+    b.DataMutable() = {10, 100};
+    auto out = Multiply(a, b);
+    AssertTrue(out.Shape()[0] == 3, "Invalid broadcast shape");
+    AssertTrue(out.Shape()[1] == 2, "Invalid broadcast shape");
+    AssertTrue(out.Get({0, 1}) == 100, "Invalid broadcast multiply result");
+    AssertTrue(out.Get({2, 0}) == 30, "Invalid broadcast multiply result");
+    AssertTrue(out.Get({2, 1}) == 300, "Invalid broadcast multiply result");
+  }
+  // empty operands broadcast to an empty result without calling f
+  {
+    Tensor<Int32> a = Zeros<Int32>({0, 5});
+    Tensor<Int32> bias = Ones<Int32>({5});
+    auto out = Add(a, bias);
+    AssertTrue(out.Shape() == vector<int>({0, 5}) && out.Size() == 0,
+               "Invalid empty broadcast shape");
+    int calls = 0;
+    elementwise::Loop loop;
+    loop.shape = {2, 0, 5};
+    loop.strides = {{0, 5, 1}, {0, 5, 1}, {0, 0, 1}};
+    elementwise::Binary(loop, out.DataMutable().data(), a.Data().data(),
+                        bias.Data().data(), [&](Int32 x, Int32 y) {
+      calls++;
+      return x + y;
+    });
+    AssertTrue(calls == 0, "Empty broadcast should not call the functor");
+  }
+  // incompatible shapes
+  {
+    Tensor<Int32> a = Zeros<Int32>({2, 3});
+    Tensor<Int32> b = Zeros<Int32>({2});
+    bool thrown = false;
+    try {
+      Subtract(a, b);
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Should reject incompatible shapes");
+  }
+}
+
 void TestTensorSubtract() {
   {
     Tensor<Int32> a = Zeros<Int32>({3});
@@ -112,6 +196,17 @@ void TestTensorApply() {
     AssertTrue(c.Data()[1] == 2, "Invalid apply result");
     AssertTrue(c.Data()[2] == 3, "Invalid apply result");
   }
+  // lambdas and functors, into an existing tensor
+  {
+    Tensor<Int32> a = Zeros<Int32>({3});
+    a.DataMutable() = {-1, 2, -3};
+    auto c = Apply(a, [](Int32 x) { return x > 0 ? x : 0; });
+    AssertTrue(c.Data()[0] == 0 && c.Data()[1] == 2 && c.Data()[2] == 0,
+               "Invalid lambda apply result");
+    Apply(a, elementwise::NegateFunctor(), c);
+    AssertTrue(c.Data()[0] == 1 && c.Data()[1] == -2 && c.Data()[2] == 3,
+               "Invalid functor apply result");
+  }
 }
 
 void TestTensorDataIndex() {
@@ -180,6 +275,67 @@ void TestTensorMatrixMultply() {
   }
 }
 
+void TestTensorMatrixMultiplyFloat() {
+  {
+    Tensor<Float32> a = Zeros<Float32>({1, 2});
+    Tensor<Float32> b = Zeros<Float32>({2, 1});
+    a.DataMutable() = {0.5, 0.25};
+    b.DataMutable() = {0.5, 0.5};
+    auto c = MatrixMultiply(a, b);
+    AssertTrue(c.Get({0, 0}) == 0.375f,
+               "MatrixMultiply: Should accumulate in floating point");
+  }
+}
+
+void TestTensorMatrixMultiplyBlocked() {
+  // large enough to go through the packed path, with ragged edge tiles
+  {
+    int m = 70, k = 300, n = 53;
+    auto a = Zeros<Float64>({m, k});
+    auto b = Zeros<Float64>({k, n});
+    for (int i = 0; i < a.Size(); i++)
+      a.DataMutable()[i] = ((i * 7) % 13 - 6) * 0.25;
+    for (int i = 0; i < b.Size(); i++)
+      b.DataMutable()[i] = ((i * 5) % 11 - 5) * 0.5;
+    auto c = MatrixMultiply(a, b);
+    for (int i = 0; i < m; i++) {
+      for (int j = 0; j < n; j++) {
+        double val = 0;
+        for (int p = 0; p < k; p++)
+          val += a.Get({i, p}) * b.Get({p, j});
+        AssertTrue(c.Get({i, j}) == val,
+                   "MatrixMultiply: Blocked result should match reference");
+      }
+    }
+  }
+}
+
+void TestTensorMatrixMultiplySlice() {
+  // strided views are consumed without a copy
+  {
+    auto a = Zeros<Int32>({80, 90});
+    auto b = Zeros<Int32>({90, 60});
+    for (int i = 0; i < a.Size(); i++)
+      a.DataMutable()[i] = (i % 7) - 3;
+    for (int i = 0; i < b.Size(); i++)
+      b.DataMutable()[i] = (i % 5) - 2;
+    auto as = Slice<Int32>(a, {1, 0}, {80, 90}, {2, 3});
+    auto bs = Slice<Int32>(b, {0, 2}, {90, 60}, {3, 1});
+    auto c = MatrixMultiply(as, bs);
+    AssertTrue(c.Shape()[0] == 40, "MatrixMultiply: Should have correct shape");
+    AssertTrue(c.Shape()[1] == 58, "MatrixMultiply: Should have correct shape");
+    for (int i = 0; i < c.Shape()[0]; i++) {
+      for (int j = 0; j < c.Shape()[1]; j++) {
+        int val = 0;
+        for (int p = 0; p < as.Shape()[1]; p++)
+          val += as.Get({i, p}) * bs.Get({p, j});
+        AssertTrue(c.Get({i, j}) == val,
+                   "MatrixMultiply: Should respect view strides and offset");
+      }
+    }
+  }
+}
+
 void TestTensorZeros() {
   auto t = Zeros<Int32>({3, 3});
   AssertTrue(t.Shape()[0] == 3, "Zeros: Incorrect shape");
@@ -257,6 +413,101 @@ void TestTensorMove() {
   }
 }
 
+// Every element of a against b, through index arithmetic.
+template<typename T>
+bool SameElements(const Tensor<T> & a, const Tensor<T> & b) {
+  if (a.Shape() != b.Shape())
+    return false;
+  vector<int> index(a.NumDimension(), 0);
+  for (int i = 0; i < a.Size(); i++) {
+    if (a.Get(index) != b.Get(index))
+      return false;
+    for (int d = a.NumDimension() - 1; d >= 0; d--) {
+      if (++index[d] < a.Shape()[d])
+        break;
+      index[d] = 0;
+    }
+  }
+  return true;
+}
+
+void TestTensorPermute() {
+  // views, no data moved
+  {
+    Tensor<Int32> a = Zeros<Int32>({2, 3, 4});
+    for (int i = 0; i < a.Size(); i++)
+      a.DataMutable()[i] = i;
+    Tensor<Int32> p = Permute(a, {2, 0, 1});
+    AssertTrue(p.Shape() == vector<int>({4, 2, 3}), "Wrong permuted shape");
+    AssertTrue(p.Get({3, 1, 2}) == a.Get({1, 2, 3}), "Wrong permuted element");
+    AssertTrue(&p.Data()[0] == &a.Data()[0], "Permute should be a view");
+    Tensor<Int32> t = Transpose(a, 0, 2);
+    AssertTrue(t.Shape() == vector<int>({4, 3, 2}), "Wrong transposed shape");
+    AssertTrue(t.Get({3, 1, 0}) == a.Get({0, 1, 3}), "Wrong transposed element");
+    bool thrown = false;
+    try {
+      Permute(a, {0, 0, 1});
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Should reject repeated axes");
+    AssertTrue(&Contiguous(a).Data()[0] == &a.Data()[0],
+               "Contiguous tensors should not be copied");
+    Tensor<Int32> c = Contiguous(p);
+    AssertTrue(c.IsContiguous() && SameElements(c, p),
+               "Contiguous should materialize the view");
+  }
+  // every copy kernel: memcpy rows, tiled transposes (with partial tiles),
+  // strided rows, and sizes that are split across threads
+  {
+    parallel::SetNumThreads(3);
+    vector<vector<int>> shapes = {{37, 45}, {5, 67, 33}, {3, 4, 5, 6},
+                                  {600, 700}};
+    for (auto & shape : shapes) {
+      Tensor<Float32> a = Zeros<Float32>(shape);
+      for (int i = 0; i < a.Size(); i++)
+        a.DataMutable()[i] = (Float32) i;
+      int ndim = shape.size();
+      vector<int> reversed(ndim);
+      for (int d = 0; d < ndim; d++)
+        reversed[d] = ndim - 1 - d;
+      vector<int> rotated(ndim);
+      for (int d = 0; d < ndim; d++)
+        rotated[d] = (d + 1) % ndim;
+      vector<int> start(ndim, 0), step(ndim, 1);
+      step[0] = 2;
+      vector<Tensor<Float32>> views = {
+          a, Permute(a, reversed), Permute(a, rotated),
+          Slice<Float32>(a, start, shape, step),
+          Permute(Slice<Float32>(a, start, shape, step), reversed)};
+      for (auto & view : views) {
+        Tensor<Float32> c = Copy(view);
+        AssertTrue(c.IsContiguous() && SameElements(c, view),
+                   "Copy does not match its source");
+        // into a permuted destination
+        Tensor<Float32> back = Zeros<Float32>(
+            Permute(c, reversed).Shape());
+        Tensor<Float32> into = Permute(back, reversed);
+        Move(view, into);
+        AssertTrue(SameElements(into, view), "Move does not match its source");
+      }
+    }
+    parallel::SetNumThreads(0);
+  }
+  // shapes must agree
+  {
+    auto a = Zeros<Int32>({2, 3});
+    auto b = Zeros<Int32>({3, 2});
+    bool thrown = false;
+    try {
+      Move(a, b);
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Should reject moving between shapes");
+  }
+}
+
 void TestTensorSlice() {
   {
     auto t1 = Identity<Int32>({3, 3});
@@ -294,12 +545,884 @@ void TestTensorSlice() {
   }
 }
 
+void TestStaticTensor() {
+  {
+    static_assert(StaticTensor<Float32, 2, 3, 4>::kSize == 24,
+                  "StaticTensor: size should be computed at compile time");
+    static_assert(StaticShape<2, 3, 4>::Stride(0) == 12,
+                  "StaticTensor: strides should be computed at compile time");
+    static_assert(StaticTensor<Float32, 2, 3, 4>::DataIndex(1, 2, 3) == 23,
+                  "StaticTensor: indices should be computed at compile time");
+    StaticTensor<Int32, 2, 2> a;
+    AssertTrue(a.Get(1, 1) == 0, "StaticTensor: Should be zero initialized");
+    a.At(0, 1) = 5;
+    AssertTrue(a[1] == 5, "StaticTensor: Should store row major");
+  }
+  {
+    StaticTensor<Int32, 2, 3> a, b;
+    for (int i = 0; i < 6; i++) {
+      a[i] = i;
+      b[i] = 2 * i;
+    }
+    auto add = Add(a, b);
+    auto multiply = Multiply(a, b);
+    auto subtract = Subtract(a, b);
+    auto negate = Negate(a);
+    auto square = Apply(a, [](Int32 x) { return x * x; });
+    AssertTrue(add.Get(1, 2) == 15, "StaticTensor: Invalid add result");
+    AssertTrue(multiply.Get(1, 2) == 50, "StaticTensor: Invalid multiply");
+    AssertTrue(subtract.Get(1, 2) == -5, "StaticTensor: Invalid subtract");
+    AssertTrue(negate.Get(1, 2) == -5, "StaticTensor: Invalid negate");
+    AssertTrue(square.Get(1, 2) == 25, "StaticTensor: Invalid apply");
+  }
+  {
+    StaticTensor<Float64, 3, 2> a;
+    StaticTensor<Float64, 2, 3> b;
+    for (int i = 0; i < 6; i++) {
+      a[i] = 1 + i % 2;
+      b[i] = 1 + i % 3;
+    }
+    auto c = MatrixMultiply(a, b);
+    auto expected = MatrixMultiply(ToTensor(a), ToTensor(b));
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++)
+        AssertTrue(c.Get(i, j) == expected.Get({i, j}),
+                   "StaticTensor: MatrixMultiply should match Tensor");
+  }
+  // conversions respect views
+  {
+    auto t = Zeros<Int32>({4, 4});
+    for (int i = 0; i < 16; i++)
+      t.DataMutable()[i] = i;
+    auto view = Slice<Int32>(t, {1, 0}, {4, 4}, {2, 3});
+    auto s = FromTensor<StaticTensor<Int32, 2, 2>>(view);
+    AssertTrue(s.Get(0, 0) == 4 && s.Get(0, 1) == 7, "Invalid FromTensor");
+    AssertTrue(s.Get(1, 0) == 12 && s.Get(1, 1) == 15, "Invalid FromTensor");
+    auto back = ToTensor(s);
+    AssertTrue(back.Shape() == vector<int>({2, 2}), "Invalid ToTensor shape");
+    AssertTrue(back.Get({1, 1}) == 15, "Invalid ToTensor value");
+    bool thrown = false;
+    try {
+      FromTensor<StaticTensor<Int32, 3, 2>>(view);
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "FromTensor should reject mismatched shapes");
+  }
+}
+
+void TestTensorFile() {
+  string path = "test_tensor_file.jbt";
+  {
+    Tensor<Float32> w = Zeros<Float32>({2, 3});
+    w.DataMutable() = {1, 2, 3, 4, 5, 6};
+    Tensor<Int32> b = Zeros<Int32>({4, 4});
+    for (int i = 0; i < 16; i++)
+      b.DataMutable()[i] = i;
+    tensor_file::Writer writer;
+    writer.Add("w", w);
+    writer.Add("b_strided", Slice<Int32>(b, {0, 1}, {4, 4}, {2, 2}));
+    writer.Write(path);
+  }
+  {
+    tensor_file::File file(path);
+    AssertTrue(file.Names().size() == 2, "TensorFile: Should list tensors");
+    AssertTrue(file.Type("w") == tensor_file::kFloat32,
+               "TensorFile: Should record dtype");
+    Tensor<Float32> w = file.Get<Float32>("w");
+    AssertTrue(w.Data().IsMapped(), "TensorFile: Should not copy payload");
+    AssertTrue((long) w.Data().data() % tensor_file::kAlignment == 0,
+               "TensorFile: Payload should be aligned");
+    AssertTrue(w.Shape() == vector<int>({2, 3}), "TensorFile: Invalid shape");
+    AssertTrue(w.Get({1, 2}) == 6, "TensorFile: Invalid value");
+    Tensor<Int32> b = file.Get<Int32>("b_strided");
+    AssertTrue(b.Shape() == vector<int>({2, 2}), "TensorFile: Invalid shape");
+    AssertTrue(b.Get({0, 0}) == 1 && b.Get({0, 1}) == 3 &&
+               b.Get({1, 0}) == 9 && b.Get({1, 1}) == 11,
+               "TensorFile: Views should be written densely");
+    // writes stay private to the process
+    w.At({0, 0}) = 100;
+    AssertTrue(tensor_file::File(path).Get<Float32>("w").Get({0, 0}) == 1,
+               "TensorFile: Writes should not reach the file");
+    AssertTrue(Add(w, w).Get({1, 2}) == 12, "TensorFile: Should compute");
+    bool threw = false;
+    try {
+      file.Get<Float64>("w");
+    } catch (runtime_error &) {
+      threw = true;
+    }
+    AssertTrue(threw, "TensorFile: Should reject wrong type");
+  }
+  {
+    ofstream out(path);
+    out << "not a tensor file";
+  }
+  {
+    bool threw = false;
+    try {
+      tensor_file::File file(path);
+    } catch (runtime_error &) {
+      threw = true;
+    }
+    AssertTrue(threw, "TensorFile: Should reject bad magic");
+  }
+  remove(path.c_str());
+}
+
+void TestTensorReduce() {
+  // every axis set, on a strided view, against a naive loop
+  {
+    Tensor<Int32> base = Zeros<Int32>({4, 6, 10});
+    for (int i = 0; i < base.Size(); i++)
+      base.DataMutable()[i] = (i * 7) % 23 - 11;
+    Tensor<Int32> a = Slice<Int32>(base, {1, 0, 1}, {4, 6, 10}, {1, 2, 3});
+    vector<vector<int>> axis_sets = {{}, {0}, {1}, {2}, {0, 1}, {0, 2},
+                                     {1, 2}, {-1}};
+    for (auto & axes : axis_sets) {
+      Tensor<Int32> sum = Sum(a, axes, true);
+      Tensor<Int32> max = Max(a, axes, true);
+      Tensor<Int32> expected_sum = Zeros<Int32>(sum.Shape());
+      Tensor<Int32> expected_max = Zeros<Int32>(max.Shape());
+      Fill(expected_max, -1000);
+      for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+          for (int k = 0; k < 3; k++) {
+            vector<int> o = {sum.Shape()[0] == 1 ? 0 : i,
+                             sum.Shape()[1] == 1 ? 0 : j,
+                             sum.Shape()[2] == 1 ? 0 : k};
+            expected_sum.At(o) += a.Get({i, j, k});
+            expected_max.At(o) = std::max(expected_max.Get(o), a.Get({i, j, k}));
+          }
+      for (int i = 0; i < sum.Size(); i++) {
+        AssertTrue(sum.Data()[i] == expected_sum.Data()[i],
+                   "Invalid reduce sum");
+        AssertTrue(max.Data()[i] == expected_max.Data()[i],
+                   "Invalid reduce max");
+      }
+    }
+    AssertTrue(Sum(a, {0, 2}).Shape() == vector<int>({3}),
+               "Reduced axes should be dropped");
+    AssertTrue(Sum(a).NumDimension() == 0, "Full reduction is a scalar");
+  }
+  {
+    Tensor<Float32> a = Zeros<Float32>({2, 3});
+    a.DataMutable() = {1, 5, 5, 7, -2, 7};
+    Tensor<Int64> index = ArgMax(a, 1);
+    AssertTrue(index.Get({0}) == 1 && index.Get({1}) == 0,
+               "ArgMax should return the first maximum");
+    AssertTrue(ArgMax(a, 0).Get({2}) == 1, "Invalid ArgMax over rows");
+    AssertTrue(Mean(a, {0}).Get({1}) == 1.5f, "Invalid mean");
+  }
+  // accurate and reproducible: 2^22 float32 values, summed along both the
+  // inner and the outer axis, with one and four threads
+  {
+    const int n = 1 << 22;
+    Tensor<Float32> a = Zeros<Float32>({n});
+    for (int i = 0; i < n; i++)
+      a.DataMutable()[i] = 0.1f + (i % 3) * 1e-3f;
+    double exact = 0;
+    for (int i = 0; i < n; i++)
+      exact += a.Data()[i];
+    Tensor<Float32> column = View(a, {n, 1});
+    Tensor<Float32> rows = View(a, {n / 64, 64});
+    parallel::SetNumThreads(1);
+    Float32 serial = Sum(a).Get({});
+    Tensor<Float32> serial_rows = Sum(rows, {0});
+    parallel::SetNumThreads(4);
+    Float32 parallel = Sum(a).Get({});
+    Tensor<Float32> parallel_rows = Sum(rows, {0});
+    parallel::SetNumThreads(0);
+    AssertTrue(fabs(serial - exact) / exact < 1e-6,
+               "Pairwise sum should be accurate");
+    AssertTrue(fabs(Sum(column, {0}).Get({0}) - exact) / exact < 1e-6,
+               "Strided sum should be accurate");
+    AssertTrue(serial == parallel, "Sum should not depend on threads");
+    double total = 0;
+    for (int j = 0; j < 64; j++) {
+      AssertTrue(serial_rows.Data()[j] == parallel_rows.Data()[j],
+                 "Column sums should not depend on threads");
+      total += serial_rows.Data()[j];
+    }
+    AssertTrue(fabs(total - exact) / exact < 1e-6,
+               "Compensated column sums should be accurate");
+  }
+}
+
+// Largest error of f over [lo, hi] against the long double reference, in
+// units of T's epsilon; relative error when relative is set, otherwise
+// absolute error divided by max(1, |x|).
+template<typename T, typename F>
+double ActivationError(F f, long double (*reference)(long double), double lo,
+                       double hi, bool relative) {
+  const int n = 1 << 14;
+  Tensor<T> x = Zeros<T>({n});
+  for (int i = 0; i < n; i++)
+    x.DataMutable()[i] = (T) (lo + (hi - lo) * i / (n - 1));
+  Tensor<T> y = Apply(x, f);
+  double error = 0;
+  for (int i = 0; i < n; i++) {
+    long double expected = reference(x.Data()[i]);
+    long double scale = relative ? fabsl(expected)
+                                 : max(1.0L, fabsl((long double) x.Data()[i]));
+    error = max(error, (double) (fabsl(y.Data()[i] - expected) / scale));
+  }
+  return error / numeric_limits<T>::epsilon();
+}
+
+long double ReferenceSigmoid(long double x) { return 1 / (1 + expl(-x)); }
+long double ReferenceGelu(long double x) {
+  return 0.5L * x * (1 + tanhl(0.797884560802865355880L *
+                               (x + 0.044715L * x * x * x)));
+}
+long double ReferenceLog(long double x) { return logl(x); }
+
+// the accuracy bounds documented in src/activation.h
+template<typename T>
+void CheckActivationAccuracy() {
+  using namespace activation;
+  AssertTrue(ActivationError<T>(ExpFunctor(), expl, -80, 80, true) <= 2,
+             "Exp exceeds its error bound");
+  AssertTrue(ActivationError<T>(LogFunctor(), ReferenceLog, 1e-3, 1e3, true) <= 3,
+             "Log exceeds its error bound");
+  AssertTrue(ActivationError<T>(TanhFunctor(), tanhl, -20, 20, false) <= 2,
+             "Tanh exceeds its error bound");
+  AssertTrue(ActivationError<T>(SigmoidFunctor(), ReferenceSigmoid, -40, 40,
+                                false) <= 2,
+             "Sigmoid exceeds its error bound");
+  AssertTrue(ActivationError<T>(GeluFunctor(), ReferenceGelu, -10, 10,
+                                false) <= 2,
+             "Gelu exceeds its error bound");
+  // subnormals, and the special values
+  T tiny = numeric_limits<T>::denorm_min() * 3;
+  T inf = numeric_limits<T>::infinity();
+  AssertTrue(fabsl(Log(tiny) - logl(tiny)) <=
+                 3 * numeric_limits<T>::epsilon() * fabsl(logl(tiny)),
+             "Log of a subnormal is inaccurate");
+  AssertTrue(Exp((T) 1000) == inf, "Exp should overflow to inf");
+  AssertTrue(Exp((T) -1000) == 0, "Exp should underflow to 0");
+  AssertTrue(Exp(-inf) == 0 && Exp(inf) == inf, "Exp of inf");
+  AssertTrue(Log((T) 0) == -inf && Log(inf) == inf, "Log of 0 and inf");
+  AssertTrue(std::isnan(Log((T) -1)), "Log of a negative should be NaN");
+  T nan = numeric_limits<T>::quiet_NaN();
+  AssertTrue(std::isnan(Exp(nan)) && std::isnan(Log(nan)) &&
+                 std::isnan(Tanh(nan)) && std::isnan(Sigmoid(nan)),
+             "NaN should propagate");
+  AssertTrue(Tanh((T) 50) == 1 && Tanh((T) -50) == -1 &&
+                 Sigmoid((T) -1000) == 0 && Sigmoid((T) 1000) == 1,
+             "Activations should saturate");
+}
+
+void TestActivationAccuracy() {
+  CheckActivationAccuracy<Float32>();
+  CheckActivationAccuracy<Float64>();
+}
+
+void TestTensorHalf() {
+  {
+    Tensor<Float32> a = Zeros<Float32>({4, 5});
+    a.DataMutable() = {0, -0.0f, 1, -2, 0.1f, 65504, 70000, -1e-7f, 3.14159f,
+                       1e-3f, 2048, 2049, 2051, -0.5f, 1.0f / 3, 6e-8f, 100,
+                       1e30f, -1e30f, 7};
+    Tensor<Float16> h = Cast<Float16>(a);
+    Tensor<Float32> back = Cast<Float32>(h);
+    for (int i = 0; i < a.Size(); i++) {
+      float x = a.Data()[i], y = back.Data()[i];
+      if (fabs(x) > 65504) {
+        AssertTrue(isinf(y) && (y > 0) == (x > 0),
+                   "Float16: Should overflow to infinity");
+      } else if (fabs(x) >= 6.103515625e-5f) {
+        AssertTrue(fabs(y - x) <= ldexp(fabs(x), -11),
+                   "Float16: Should round to nearest");
+      } else {
+        AssertTrue(fabs(y - x) <= ldexp(1.0f, -25),
+                   "Float16: Should round subnormals to nearest");
+      }
+    }
+    AssertTrue(back.Get({2, 1}) == 2048 && back.Get({2, 2}) == 2052,
+               "Float16: Should round ties to even");
+    Tensor<BFloat16> b = Cast<BFloat16>(a);
+    AssertTrue(sizeof(b.Data()[0]) == 2, "BFloat16: Should take 2 bytes");
+    back = Cast<Float32>(b);
+    for (int i = 0; i < a.Size(); i++) {
+      float x = a.Data()[i], y = back.Data()[i];
+      AssertTrue(fabs(y - x) <= ldexp(fabs(x), -8),
+                 "BFloat16: Should round to nearest");
+    }
+    // strided views convert element by element
+    Tensor<Float16> view = Slice<Float16>(h, {0, 1}, {4, 5}, {2, 2});
+    Tensor<Float64> d = Cast<Float64>(view);
+    AssertTrue(d.Shape() == vector<int>({2, 2}) && d.Get({1, 0}) == 2048,
+               "Cast: Should read views");
+  }
+  {
+    string path = "test_tensor_half.jbt";
+    Tensor<Float16> h = Cast<Float16>(Ones<Float32>({3, 2}));
+    tensor_file::Writer writer;
+    writer.Add("h", h);
+    writer.Write(path);
+    tensor_file::File file(path);
+    AssertTrue(file.Type("h") == tensor_file::kFloat16,
+               "TensorFile: Should record Float16");
+    AssertTrue((float) file.Get<Float16>("h").Get({2, 1}) == 1,
+               "TensorFile: Should read Float16");
+    remove(path.c_str());
+  }
+}
+
+// Deterministic pseudo random values in [-range, range].
+Tensor<Float32> Uniform(const vector<int> & shape, float range,
+                        unsigned seed) {
+  Tensor<Float32> a = Zeros<Float32>(shape);
+  for (int i = 0; i < a.Size(); i++) {
+    seed = seed * 1664525u + 1013904223u;
+    a.DataMutable()[i] = range * ((seed >> 8) / 8388608.0f - 1);
+  }
+  return a;
+}
+
+void TestQuantize() {
+  // round trip error is at most half a step
+  {
+    Tensor<Float32> a = Uniform({6, 7}, 3, 1);
+    for (int axis = -1; axis < 2; axis++) {
+      for (int symmetric = 0; symmetric < 2; symmetric++) {
+        quantize::Params p = quantize::ChooseParams(a, axis, symmetric);
+        Tensor<Float32> back =
+            quantize::Dequantize(quantize::Quantize(a, p), p);
+        for (int i = 0; i < 6; i++) {
+          for (int j = 0; j < 7; j++) {
+            int c = axis == -1 ? 0 : (axis == 0 ? i : j);
+            AssertTrue(fabs(back.Get({i, j}) - a.Get({i, j})) <=
+                           p.scale[c] * 0.5001f,
+                       "Quantize: Round trip error should be half a step");
+          }
+        }
+      }
+    }
+    Tensor<Float32> r = Apply(a, [](Float32 x) { return x > 0 ? x : 0; });
+    quantize::Params p = quantize::ChooseParams(r);
+    AssertTrue(p.zero_point[0] == quantize::kMin,
+               "Quantize: Non negative data should use the whole range");
+    Tensor<Float32> back = quantize::Dequantize(quantize::Quantize(r, p), p);
+    AssertTrue(back.Get({0, 1}) == 0 || r.Get({0, 1}) != 0,
+               "Quantize: Zero should be exact");
+    bool thrown = false;
+    try {
+      quantize::Quantize(Zeros<Float32>({3, 3}), quantize::ChooseParams(a, 1));
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Quantize: Should reject params of another shape");
+  }
+  // Int8 x Int8 accumulates exactly into Int32, here with an odd depth
+  {
+    int m = 37, k = 301, n = 45;
+    Tensor<Int8> a = Zeros<Int8>({m, k});
+    Tensor<Int8> b = Zeros<Int8>({k, n});
+    for (int i = 0; i < a.Size(); i++)
+      a.DataMutable()[i] = (Int8) ((i * 37) % 256 - 128);
+    for (int i = 0; i < b.Size(); i++)
+      b.DataMutable()[i] = (Int8) ((i * 91) % 255 - 127);
+    Tensor<Int32> c = Zeros<Int32>({m, n});
+    MatrixMultiplyAccumulate(a, b, c);
+    bool exact = true;
+    for (int i = 0; i < m; i++) {
+      for (int j = 0; j < n; j++) {
+        Int32 val = 0;
+        for (int p = 0; p < k; p++)
+          val += (Int32) a.Get({i, p}) * b.Get({p, j});
+        exact = exact && c.Get({i, j}) == val;
+      }
+    }
+    AssertTrue(exact, "MatrixMultiply: Int8 products should not overflow");
+  }
+  // quantized products stay within the bound implied by the rounding
+  {
+    int m = 20, k = 64, n = 24;
+    Tensor<Float32> x = Add(Uniform({m, k}, 2, 2), Ones<Float32>({m, k}));
+    Tensor<Float32> w = Uniform({k, n}, 0.5, 3);
+    for (int j = 0; j < n; j++) {
+      for (int p = 0; p < k; p++)
+        w.At({p, j}) *= 0.1f + j;  // columns of very different ranges
+    }
+    Tensor<Float32> exact = MatrixMultiply(x, w);
+    for (int axis = -1; axis < 2; axis += 2) {
+      for (int symmetric = 0; symmetric < 2; symmetric++) {
+        quantize::Params px = quantize::ChooseParams(x, -1, symmetric);
+        quantize::Params pw = quantize::ChooseParams(w, axis, symmetric);
+        Tensor<Float32> y = quantize::MatrixMultiply(
+            quantize::Quantize(x, px), px, quantize::Quantize(w, pw), pw);
+        double error = 0, norm = 0;
+        for (int i = 0; i < m; i++) {
+          for (int j = 0; j < n; j++) {
+            float sx = px.scale[0], sw = pw.scale[axis == -1 ? 0 : j];
+            double bound = 0;
+            for (int p = 0; p < k; p++)
+              bound += sx / 2 * fabs(w.Get({p, j})) +
+                       sw / 2 * fabs(x.Get({i, p})) + sx * sw / 4;
+            double e = y.Get({i, j}) - exact.Get({i, j});
+            double tolerance = bound * 1.001 + 1e-5 * fabs(exact.Get({i, j}));
+            AssertTrue(fabs(e) <= tolerance,
+                       "Quantize: MatrixMultiply error should be bounded");
+            error += e * e;
+            norm += exact.Get({i, j}) * exact.Get({i, j});
+          }
+        }
+        // measured: 0.4-0.6% per column, 0.7% per tensor
+        AssertTrue(sqrt(error / norm) < (axis == 1 ? 0.01 : 0.015),
+                   "Quantize: MatrixMultiply should be accurate");
+      }
+    }
+    // requantized output: one more rounding of the dequantized product
+    quantize::Params px = quantize::ChooseParams(x);
+    quantize::Params pw = quantize::ChooseParams(w, 1, true);
+    quantize::Params py = quantize::ChooseParams(exact);
+    Tensor<Int8> qx = quantize::Quantize(x, px);
+    Tensor<Int8> qw = quantize::Quantize(w, pw);
+    Tensor<Float32> y = quantize::MatrixMultiply(qx, px, qw, pw);
+    Tensor<Float32> yq =
+        quantize::Dequantize(quantize::MatrixMultiply(qx, px, qw, pw, py), py);
+    for (int i = 0; i < y.Size(); i++) {
+      AssertTrue(fabs(yq.Data()[i] - exact.Data()[i]) <=
+                     py.scale[0] * 0.5001 +
+                         fabs(y.Data()[i] - exact.Data()[i]),
+                 "Quantize: Requantized output should be close");
+    }
+  }
+}
+
+// The definition, for checking both convolution kernels.
+Tensor<Int32> NaiveConv2D(const Tensor<Int32> & x, const Tensor<Int32> & w,
+                          const conv::Params & p) {
+  Tensor<Int32> c = Zeros<Int32>(conv::OutputShape(x.Shape(), w.Shape(), p));
+  int cg = w.Shape()[1], og = w.Shape()[0] / p.groups;
+  for (int b = 0; b < c.Shape()[0]; b++)
+    for (int f = 0; f < c.Shape()[1]; f++)
+      for (int y = 0; y < c.Shape()[2]; y++)
+        for (int z = 0; z < c.Shape()[3]; z++)
+          for (int ch = 0; ch < cg; ch++)
+            for (int i = 0; i < w.Shape()[2]; i++)
+              for (int j = 0; j < w.Shape()[3]; j++) {
+                int iy = y * p.stride_h - p.pad_h + i * p.dilation_h;
+                int ix = z * p.stride_w - p.pad_w + j * p.dilation_w;
+                if (iy >= 0 && iy < x.Shape()[2] && ix >= 0 &&
+                    ix < x.Shape()[3])
+                  c.At({b, f, y, z}) += w.Get({f, ch, i, j}) *
+                      x.Get({b, f / og * cg + ch, iy, ix});
+              }
+  return c;
+}
+
+void TestConv2D() {
+  // {n, c, h, w, o, kh, kw, stride, pad, dilation, groups}
+  vector<vector<int>> cases = {
+      {1, 1, 5, 5, 1, 3, 3, 1, 0, 1, 1},      // plain
+      {2, 3, 9, 40, 5, 3, 3, 1, 1, 1, 1},     // padded, rows past a block
+      {1, 4, 11, 13, 6, 3, 5, 2, 2, 1, 1},    // strided, rectangular
+      {1, 2, 12, 12, 3, 3, 3, 1, 2, 2, 1},    // dilated
+      {2, 6, 7, 7, 4, 3, 3, 1, 1, 1, 2},      // grouped
+      {1, 8, 10, 37, 8, 3, 3, 1, 1, 1, 8},    // depthwise
+      {1, 4, 9, 9, 8, 3, 3, 2, 1, 1, 4},      // depthwise, multiplier 2
+      {2, 16, 6, 7, 12, 1, 1, 1, 0, 1, 1},    // pointwise, in place
+      {1, 3, 4, 4, 2, 1, 1, 2, 0, 1, 1},      // strided 1 x 1
+      {1, 2, 3, 3, 2, 3, 3, 1, 3, 1, 1},      // padding past the filter
+  };
+  for (auto & k : cases) {
+    conv::Params p;
+    p.stride_h = p.stride_w = k[7];
+    p.pad_h = p.pad_w = k[8];
+    p.dilation_h = p.dilation_w = k[9];
+    p.groups = k[10];
+    Tensor<Int32> x = Zeros<Int32>({k[0], k[1], k[2], k[3]});
+    Tensor<Int32> w = Zeros<Int32>({k[4], k[1] / k[10], k[5], k[6]});
+    for (int i = 0; i < x.Size(); i++)
+      x.DataMutable()[i] = (i * 7) % 11 - 5;
+    for (int i = 0; i < w.Size(); i++)
+      w.DataMutable()[i] = (i * 5) % 7 - 3;
+    Tensor<Int32> expected = NaiveConv2D(x, w, p);
+    for (auto algorithm : {conv::kAuto, conv::kIm2col, conv::kDirect}) {
+      p.algorithm = algorithm;
+      Tensor<Int32> c = Conv2D(x, w, p);
+      bool same = c.Shape() == expected.Shape();
+      for (int i = 0; same && i < c.Size(); i++)
+        same = c.Data()[i] == expected.Data()[i];
+      AssertTrue(same, "Conv2D: Should match the definition");
+    }
+  }
+  // views are read through, and c may be a view
+  {
+    Tensor<Float32> x = Zeros<Float32>({1, 5, 6, 2});
+    for (int i = 0; i < x.Size(); i++)
+      x.DataMutable()[i] = 0.25f * (i % 9);
+    Tensor<Float32> nchw = Permute(x, {0, 3, 1, 2});  // (1, 2, 5, 6)
+    Tensor<Float32> w = Ones<Float32>({3, 2, 2, 2});
+    Tensor<Float32> c = Conv2D(nchw, w);
+    Tensor<Float32> d_view = Permute(Zeros<Float32>({5, 4, 3, 1}),
+                                     {3, 2, 1, 0});
+    Conv2D(nchw, w, d_view);
+    float sum = 0;
+    for (int i = 0; i < 2; i++)
+      for (int j = 0; j < 2; j++)
+        for (int ch = 0; ch < 2; ch++)
+          sum += nchw.Get({0, ch, 2 + i, 3 + j});
+    AssertTrue(c.Get({0, 1, 2, 3}) == sum && d_view.Get({0, 1, 2, 3}) == sum,
+               "Conv2D: Should read and write views");
+  }
+  bool thrown = false;
+  try {
+    Conv2D(Zeros<Float32>({1, 4, 5, 5}), Zeros<Float32>({2, 3, 3, 3}));
+  } catch (runtime_error &) {
+    thrown = true;
+  }
+  AssertTrue(thrown, "Conv2D: Should reject filters of other channels");
+}
+
+// A rows x cols matrix of small integers, nonzero with probability
+// `density` and denser in the first rows, so row ranges are skewed.
+Tensor<Float64> RandomSparse(int rows, int cols, double density) {
+  Tensor<Float64> a = Zeros<Float64>({rows, cols});
+  for (int i = 0; i < rows; i++) {
+    double p = i < rows / 8 ? min(1.0, 8 * density) : density;
+    for (int j = 0; j < cols; j++) {
+      if (rand() < p * RAND_MAX)
+        a.At({i, j}) = rand() % 7 - 3;
+    }
+  }
+  return a;
+}
+
+bool Equal(const Tensor<Float64> & a, const Tensor<Float64> & b) {
+  if (a.Shape() != b.Shape())
+    return false;
+  for (int i = 0; i < a.Shape()[0]; i++) {
+    for (int j = 0; j < a.Shape()[1]; j++) {
+      if (a.Get({i, j}) != b.Get({i, j}))
+        return false;
+    }
+  }
+  return true;
+}
+
+void TestSparse() {
+  srand(7);
+  Tensor<Float64> d = RandomSparse(37, 29, 0.1);
+  sparse::Csr<Float64> a = sparse::FromDense(d);
+  sparse::Check(a);
+  AssertTrue(Equal(sparse::ToDense(a), d), "Sparse: Dense round trip");
+  AssertTrue(Equal(sparse::ToDense(sparse::FromDense(Transpose(d))),
+                   sparse::ToDense(sparse::Transpose(a))),
+             "Sparse: Invalid transpose");
+  // coordinates in any order, duplicates summed
+  {
+    sparse::Coo<Float64> coo = sparse::ToCoo(a);
+    AssertTrue(coo.value.size() == a.NonZeros(), "Sparse: Invalid COO");
+    sparse::Coo<Float64> shuffled;
+    shuffled.rows = coo.rows;
+    shuffled.cols = coo.cols;
+    for (long k = coo.value.size() - 1; k >= 0; k--) {
+      shuffled.row.insert(shuffled.row.end(), {coo.row[k], coo.row[k]});
+      shuffled.column.insert(shuffled.column.end(),
+                             {coo.column[k], coo.column[k]});
+      shuffled.value.insert(shuffled.value.end(), {coo.value[k], 1});
+    }
+    sparse::Csr<Float64> b = sparse::FromCoo(shuffled);
+    sparse::Check(b);
+    AssertTrue(b.NonZeros() == a.NonZeros(), "Sparse: Should merge duplicates");
+    for (long k = 0; k < b.NonZeros(); k++)
+      AssertTrue(b.values[k] == a.values[k] + 1 &&
+                 b.columns[k] == a.columns[k],
+                 "Sparse: Should sum duplicates in order");
+    bool thrown = false;
+    try {
+      shuffled.column[0] = 29;
+      sparse::FromCoo(shuffled);
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Sparse: Should reject coordinates out of range");
+  }
+  // products against the dense product, on one thread and several
+  for (int threads : {1, 4}) {
+    parallel::SetNumThreads(threads);
+    Tensor<Float64> big = RandomSparse(512, 700, 0.05);
+    sparse::Csr<Float64> s = sparse::FromDense(big);
+    Tensor<Float64> x = Zeros<Float64>({700, 96});
+    for (long i = 0; i < x.Size(); i++)
+      x.DataMutable()[i] = i % 5 - 2;
+    AssertTrue(Equal(sparse::MatrixMultiply(s, x), MatrixMultiply(big, x)),
+               "Sparse: Invalid sparse x dense product");
+    Tensor<Float64> xt = Transpose(Copy(Transpose(x)));
+    AssertTrue(Equal(sparse::MatrixMultiply(s, xt), MatrixMultiply(big, x)),
+               "Sparse: Invalid product with a strided operand");
+    Tensor<Float64> y = Transpose(x);
+    AssertTrue(Equal(sparse::MatrixMultiply(y, sparse::Transpose(s)),
+                     MatrixMultiply(y, Transpose(big))),
+               "Sparse: Invalid dense x sparse product");
+  }
+  parallel::SetNumThreads(0);
+  // elementwise
+  Tensor<Float64> e = RandomSparse(37, 29, 0.2);
+  sparse::Csr<Float64> b = sparse::FromDense(e);
+  AssertTrue(Equal(sparse::ToDense(sparse::Add(a, b)), Add(d, e)),
+             "Sparse: Invalid sparse + sparse");
+  AssertTrue(Equal(sparse::ToDense(sparse::Multiply(a, b)), Multiply(d, e)),
+             "Sparse: Invalid sparse * sparse");
+  AssertTrue(Equal(sparse::Add(a, e), Add(d, e)),
+             "Sparse: Invalid sparse + dense");
+  AssertTrue(Equal(sparse::ToDense(sparse::Multiply(e, a)), Multiply(d, e)),
+             "Sparse: Invalid sparse * dense");
+  bool thrown = false;
+  try {
+    sparse::Add(a, sparse::Transpose(b));
+  } catch (runtime_error &) {
+    thrown = true;
+  }
+  AssertTrue(thrown, "Sparse: Should reject mismatched shapes");
+}
+
+void TestParallel() {
+  parallel::SetNumThreads(4);
+  {
+    // every index exactly once, nested loops included
+    const long n = 1000;
+    vector<int> hits(n * n, 0);
+    parallel::ParallelFor(n, n * n, [&](long begin, long end) {
+      for (long i = begin; i < end; i++) {
+        parallel::ParallelFor(n, n, [&](long b, long e) {
+          for (long j = b; j < e; j++)
+            hits[i * n + j]++;
+        }, 1);
+      }
+    }, 1);
+    AssertTrue(count(hits.begin(), hits.end(), 1) == n * n,
+               "Parallel: ParallelFor should cover each index once");
+    thread::id caller = this_thread::get_id();
+    bool same = true;
+    parallel::ParallelFor(n, n, [&](long, long) {
+      same = same && this_thread::get_id() == caller;
+    });
+    AssertTrue(same, "Parallel: Small loops should run on the caller");
+    bool thrown = false;
+    try {
+      parallel::ParallelFor(n, n, [&](long begin, long) {
+        if (begin > 0)
+          throw runtime_error("chunk");
+      }, 1);
+    } catch (runtime_error &) {
+      thrown = true;
+    }
+    AssertTrue(thrown, "Parallel: Should propagate exceptions");
+  }
+  // large kernels match a single thread bit for bit
+  auto fill = [](Tensor<Float32> & t) {
+    for (long i = 0; i < t.Size(); i++)
+      t.DataMutable()[i] = (i % 1013) * 0.01f - 5;
+  };
+  auto same = [](const Tensor<Float32> & a, const Tensor<Float32> & b) {
+    if (a.Shape() != b.Shape())
+      return false;
+    for (long i = 0; i < a.Size(); i++) {
+      if (a.Data()[i] != b.Data()[i])
+        return false;
+    }
+    return true;
+  };
+  Tensor<Float32> a = Empty<Float32>({1 << 20});
+  Tensor<Float32> rows = Empty<Float32>({512, 1031});
+  Tensor<Float32> row = Empty<Float32>({1031});
+  Tensor<Float32> x = Empty<Float32>({300, 200});
+  Tensor<Float32> w = Empty<Float32>({200, 700});
+  Tensor<Float32> wide = Empty<Float32>({200, 2000});
+  for (Tensor<Float32> * t : {&a, &rows, &row, &x, &w, &wide})
+    fill(*t);
+  auto square = [](Float32 v) { return v * v; };
+  vector<Tensor<Float32>> results[2];
+  for (int threads : {1, 4}) {
+    parallel::SetNumThreads(threads);
+    vector<Tensor<Float32>> & r = results[threads > 1];
+    r.push_back(Add(a, a));
+    r.push_back(Multiply(rows, row));
+    r.push_back(Apply(Transpose(rows), square));
+    r.push_back(Cast<Float32>(Cast<Float16>(a)));
+    r.push_back(Copy(Transpose(rows)));
+    r.push_back(MatrixMultiply(x, w));
+    r.push_back(MatrixMultiply(Transpose(w), Transpose(x)));
+    r.push_back(MatrixMultiply(Slice(x, {0, 0}, {40, 200}, {1, 1}), wide));
+  }
+  // accumulating into broadcast outputs (gradients of broadcast operands)
+  {
+    parallel::SetNumThreads(8);
+    Tensor<Float32> total = Zeros<Float32>({1});
+    Accumulate(Ones<Float32>({1 << 20}), total);
+    AssertTrue(total.Get({0}) == 1 << 20,
+               "Parallel: Accumulate into a scalar should not lose updates");
+    Tensor<Float32> grad = Ones<Float32>({4096, 512});
+    Tensor<Float32> bias = Zeros<Float32>({512});
+    Tensor<Float32> column = Zeros<Float32>({4096, 1});
+    Accumulate(grad, bias);
+    MultiplyAccumulate(grad, grad, column);
+    for (int i = 0; i < 512; i++)
+      AssertTrue(bias.Get({i}) == 4096,
+                 "Parallel: Bias gradient should not lose updates");
+    for (int i = 0; i < 4096; i++)
+      AssertTrue(column.Get({i, 0}) == 512,
+                 "Parallel: Row accumulate should not lose updates");
+  }
+  parallel::SetNumThreads(0);
+  for (int i = 0; i < (int) results[0].size(); i++)
+    AssertTrue(same(results[0][i], results[1][i]),
+               "Parallel: Results should not depend on threads");
+  AssertTrue(results[1][0].Get({12345}) == 2 * a.Get({12345}),
+             "Parallel: Invalid Add");
+  AssertTrue(results[1][1].Get({511, 1030}) ==
+             rows.Get({511, 1030}) * row.Get({1030}),
+             "Parallel: Invalid broadcast Multiply");
+  AssertTrue(results[1][2].Get({1030, 7}) == square(rows.Get({7, 1030})),
+             "Parallel: Invalid strided Apply");
+  double val = 0;
+  for (int p = 0; p < 200; p++)
+    val += x.Get({299, p}) * w.Get({p, 699});
+  AssertTrue(fabs(results[1][5].Get({299, 699}) - val) < 1e-3 * fabs(val),
+             "Parallel: Invalid MatrixMultiply");
+}
+
+void TestAllocator() {
+  // buffers are aligned, and a freed buffer serves the next request
+  {
+    long address;
+    {
+      Tensor<Float32> a = Empty<Float32>({17, 3});
+      address = (long) a.Data().data();
+      AssertTrue(address % pool::kAlignment == 0,
+                 "Pool: Buffers should be aligned");
+      Fill(a, 7.0f);
+    }
+    pool::Stats before = pool::GetStats();
+    Tensor<Float32> b = Zeros<Float32>({51});
+    pool::Stats after = pool::GetStats();
+    AssertTrue((long) b.Data().data() == address,
+               "Pool: Should reuse a freed buffer of the same class");
+    AssertTrue(after.system_allocations == before.system_allocations &&
+                   after.pool_hits == before.pool_hits + 1,
+               "Pool: Reuse should not reach the system");
+    AssertTrue(b.Get({50}) == 0,
+               "Pool: Zeros should clear a reused buffer");
+  }
+  // size classes: at most a quarter wasted
+  {
+    long size;
+    AssertTrue(pool::SizeClass(1, size) == 0 && size == 64,
+               "Pool: Smallest class should be a cache line");
+    for (long bytes = 100; bytes < (1L << 40); bytes = bytes * 3 + 1) {
+      int c = pool::SizeClass(bytes, size);
+      AssertTrue(size >= bytes && size <= bytes * 5 / 4 + 64 &&
+                     pool::ClassSize(c) == size,
+                 "Pool: Size class should fit the request closely");
+    }
+  }
+  // buffers freed by another thread reach this one through the shared pool
+  {
+    pool::Trim();
+    Tensor<Int32> a;
+    thread t([&a]() { a = Ones<Int32>({1 << 20}); });
+    t.join();
+    AssertTrue(a.Get({12345}) == 1, "Pool: Should allocate in threads");
+    void * p = a.DataMutable().data();
+    a = Tensor<Int32>();
+    AssertTrue(pool::GetStats().bytes_cached == 4 << 20,
+               "Pool: Large buffers should go to the shared pool");
+    thread u([p]() {
+      Tensor<Int32> b = Empty<Int32>({1 << 20});
+      AssertTrue(b.DataMutable().data() == p,
+                 "Pool: Other threads should reuse shared buffers");
+    });
+    u.join();
+  }
+  // a zero limit frees everything; huge pages align large buffers
+  {
+    // larger than the thread cache takes, so it goes to the shared pool
+    const int n = 2 * pool::kThreadCacheBytes / sizeof(Float64);
+    pool::Trim();
+    Empty<Float64>({n});
+    AssertTrue(pool::GetStats().bytes_cached >= n * (long) sizeof(Float64),
+               "Pool: Should cache below the limit");
+    pool::SetCacheLimit(0);
+    long frees = pool::GetStats().system_frees;
+    Empty<Float64>({n});
+    AssertTrue(pool::GetStats().bytes_cached == 0 &&
+                   pool::GetStats().system_frees == frees + 1,
+               "Pool: Should not cache past the limit");
+    pool::SetCacheLimit(1L << 30);
+    pool::SetHugePages(true);
+    long huge = pool::GetStats().huge_page_allocations;
+    Tensor<Float32> h = Empty<Float32>({1 << 20});
+    AssertTrue((long) h.Data().data() % pool::kHugePage == 0 &&
+                   pool::GetStats().huge_page_allocations == huge + 1,
+               "Pool: Large buffers should use huge pages");
+    pool::SetHugePages(false);
+  }
+  // products take their packing panels from the pool too
+  {
+    Tensor<Float32> a = Ones<Float32>({200, 300});
+    Tensor<Float32> b = Ones<Float32>({300, 100});
+    Tensor<Float32> c = Zeros<Float32>({200, 100});
+    MatrixMultiplyAccumulate(a, b, c);
+    pool::Stats before = pool::GetStats();
+    MatrixMultiplyAccumulate(a, b, c);
+    pool::Stats after = pool::GetStats();
+    AssertTrue(after.allocations > before.allocations &&
+                   after.system_allocations == before.system_allocations,
+               "Pool: Repeated products should reuse packing panels");
+    AssertTrue(c.Get({199, 99}) == 600, "Pool: Invalid product");
+  }
+}
+
+// A tensor past 2^31 elements: offsets, strides and sizes are 64-bit.
+void TestTensorLarge() {
+  const int kRows = 2049, kColumns = 1 << 20;
+  Tensor<Int8> a;
+  try {
+    a = Zeros<Int8>({kRows, kColumns});
+  } catch (bad_alloc &) {
+    cout << "TestTensorLarge: skipped, cannot allocate 2 GB" << endl;
+    return;
+  }
+  AssertTrue(a.Size() == 2049L << 20, "Large: Size should not overflow");
+  AssertTrue(a.Stride()[0] == kColumns, "Large: Stride should be a row");
+  a.At({kRows - 1, kColumns - 1}) = 5;
+  AssertTrue(a.Data()[a.Size() - 1] == 5, "Large: At should reach the end");
+
+  // the last row starts at element 2^31
+  Tensor<Int8> row = Slice(a, {kRows - 1, 0}, {kRows, 16}, {1, 1});
+  Fill(row, (Int8) 3);
+  AssertTrue(a.Get({kRows - 1, 15}) == 3 && a.Get({kRows - 2, 15}) == 0,
+             "Large: Fill should write past 2^31");
+  AssertTrue(Max(a).Data()[0] == 5, "Large: Max should see every element");
+  Tensor<Int8> column =
+      Slice(a, {0, kColumns - 1}, {kRows, kColumns}, {1, 1});
+  AssertTrue(ArgMax<Int8, Int32>(column, 0).Data()[0] == kRows - 1,
+             "Large: ArgMax should index past 2^31");
+
+  Tensor<Int8> doubled = Add(row, row);
+  AssertTrue(doubled.Get({0, 7}) == 6, "Large: Add should read past 2^31");
+  Tensor<Int8> tail = Slice(a, {kRows - 2, 0}, {kRows, 8}, {1, 1});
+  Tensor<Int8> t = Copy(Transpose(tail));
+  AssertTrue(t.Get({7, 1}) == 3 && t.Get({7, 0}) == 0,
+             "Large: Copy should read past 2^31");
+
+  Tensor<Int32> c = Zeros<Int32>({1, 1});
+  MatrixMultiplyAccumulate(row, Ones<Int8>({16, 1}), c);
+  AssertTrue(c.Data()[0] == 48, "Large: MatrixMultiply should read past 2^31");
+}
+
 int main() {
   TestTensorShapeToStride();
   TestTensorConstructorShapeStride();
   TestTensorSize();
   TestTensorAdd();
   TestTensorMultiply();
+  TestTensorAddSlice();
+  TestTensorBroadcast();
   TestTensorSubtract();
   TestTensorNegate();
   TestTensorApply();
@@ -307,6 +1430,9 @@ int main() {
   TestTensorGet();
   TestTensorAt();
   TestTensorMatrixMultply();
+  TestTensorMatrixMultiplyFloat();
+  TestTensorMatrixMultiplyBlocked();
+  TestTensorMatrixMultiplySlice();
   TestTensorZeros();
   TestTensorOnes();
   TestIdentity();
@@ -314,5 +1440,17 @@ int main() {
   TestTensorCopy();
   TestTensorReferenceConstructor();
   TestTensorMove();
+  TestStaticTensor();
+  TestTensorFile();
+  TestTensorReduce();
+  TestActivationAccuracy();
+  TestTensorPermute();
+  TestTensorHalf();
+  TestQuantize();
+  TestConv2D();
+  TestSparse();
+  TestParallel();
+  TestAllocator();
+  TestTensorLarge();
   return 0;
 }
\ No newline at end of file